@@ -251,10 +251,6 @@ __init_db_file(dbp, dbi, err_msgs)
 		dbp->next_sig = dbp->aDb[dbi].schema_sig;
 		__sm_get_format_version(dbp->aDb[dbi].pBt,
 					&dbp->format_version);
-		if (dbp->format_version == 0) {
-			/* New, empty database. */
-			dbp->format_version = DBSQL_FORMAT_VERSION;
-		}
 	}
 
 	/*
@@ -282,7 +278,22 @@ __init_db_file(dbp, dbi, err_msgs)
 		parser.rc = DBSQL_NOMEM;
 		__reset_internal_schema(dbp, 0);
 	}
+	if (parser.rc == DBSQL_SUCCESS && dbi == 0 &&
+	    dbp->format_version == 0) {
+		/*
+		 * Databases made before the format version was stamped
+		 * into them have none.  If they hold anything but the
+		 * schema table their rows are in the version 1 layout.
+		 */
+		if (__hash_count(&dbp->aDb[dbi].tblHash) > 1)
+			dbp->format_version = 1;
+		else
+			dbp->format_version = DBSQL_FORMAT_VERSION;
+	}
 	if (parser.rc == DBSQL_SUCCESS) {
+		__analyze_load(dbp, dbi);
+		if (dbi == 0)
+			__analyze_load(dbp, 1);
 		DB_PROPERTY_SET(dbp, dbi, DBSQL_SCHEMA_LOADED);
 		if (dbi == 0)
 			DB_PROPERTY_SET(dbp, 1, DBSQL_SCHEMA_LOADED);
@@ -406,6 +417,9 @@ __api_open(dbp, filename, mode, err_msgs)
 
 	dbp->onError = OE_Default;
 	dbp->priorNewRowid = 0;
+	dbp->sort_memory = DBSQL_SORT_MEMORY;
+	dbp->agg_memory = DBSQL_AGG_MEMORY;
+	dbp->hash_memory = DBSQL_HASH_MEMORY;
 	dbp->magic = DBSQL_STATUS_BUSY;
 	dbp->nDb = 2;
 
@@ -846,7 +860,9 @@ __api_set_busy_callback(dbp, busy, arg)
  * __api_set_progress_callback --
  *	This routine sets the progress callback for a database to the
  *	given callback function with the given argument. The progress
- *	callback will be invoked every num_ops opcodes have been executed.
+ *	callback will be invoked at the end of the first loop iteration,
+ *	or at the end of the statement, after which num_ops opcodes have
+ *	been executed.
  *
  * STATIC: static void __api_set_progress_callback __P((DBSQL *, int,
  * STATIC:                                 int (*)(void*), void *));
@@ -1171,6 +1187,32 @@ __api_func_return_type(dbp, name, data_type)
 	return DBSQL_SUCCESS;
 }
 
+/*
+ * __api_func_deterministic --
+ *	Mark all functions with a given name as deterministic, or not.  A
+ *	deterministic function returns the same result whenever it is given
+ *	the same arguments during one execution of a statement.  A call of
+ *	one on constant arguments is made once per execution, not once per
+ *	row.
+ *
+ * STATIC: static int __api_func_deterministic __P((DBSQL *, const char *,
+ * STATIC:                                     int));
+ */
+int
+__api_func_deterministic(dbp, name, deterministic)
+	DBSQL *dbp;
+	const char *name;
+	int deterministic;
+{
+	func_def_t *p = (func_def_t*)__hash_find((hash_t*)dbp->fns, name,
+						 strlen(name));
+	while(p) {
+		p->isDeterministic = deterministic ? 1 : 0;
+		p = p->pNext;
+	}
+	return DBSQL_SUCCESS;
+}
+
 /*
  * __api_set_trace_callback --
  *	Register a trace function.  The 'arg' from the previously
@@ -1486,12 +1528,19 @@ dbsql_create(dbpp, dbenv, flags)
 	dbp->exec = __api_exec;
 	dbp->create_function = __api_create_function;
 	dbp->func_return_type = __api_func_return_type;
+	dbp->func_deterministic = __api_func_deterministic;
 	dbp->set_authorizer = __api_set_authorizer;
 	dbp->prepare = __api_prepare;
 	dbp->step = __api_step;
 	dbp->finalize = __api_finalize;
 	dbp->reset = __api_reset;
 	dbp->bind = __api_bind;
+	dbp->bind_int64 = __api_bind_int64;
+	dbp->bind_double = __api_bind_double;
+	dbp->bind_text = __api_bind_text;
+	dbp->bind_blob = __api_bind_blob;
+	dbp->bind_null = __api_bind_null;
+	dbp->bind_parameter_index = __api_bind_parameter_index;
 	*dbpp = dbp;
 	return DBSQL_SUCCESS;
 }
@@ -0,0 +1,759 @@
+/*-
+ * DBSQL - A SQL database engine.
+ *
+ * Copyright (C) 2007-2008  The DBSQL Group, Inc. - All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * There are special exceptions to the terms and conditions of the GPL as it
+ * is applied to this software. View the full text of the exception in file
+ * LICENSE_EXCEPTIONS in the directory of this software distribution.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+ * This file contains code used to implement the ANALYZE command and the
+ * estimates the query planner makes from the statistics it gathers.
+ *
+ * The statistics of a table or index are kept in the meta database of
+ * the storage manager that holds it, see __sm_set_stat().  They are a
+ * line of text giving the number of entries followed, for an index, by
+ * the average number of entries that share the values of the first one,
+ * two, ... columns, and last by what __sm_estimate_entries() made of the
+ * number of entries at the time.  Comparing that with what it says now
+ * shows how far the table has grown or shrunk since it was analyzed.
+ * For an index the line is terminated by a 0x00 and
+ * followed by DBSQL_STAT_SAMPLES samples of the first column taken at
+ * evenly spaced entries, each in index key format (see OP_MakeKey).  A
+ * table is only given statistics of its own if it has no index, any of
+ * its indices counts its rows as well.
+ */
+
+#include "dbsql_config.h"
+
+#ifndef NO_SYSTEM_INCLUDES
+#include <ctype.h>
+#endif
+
+#include "dbsql_int.h"
+
+/*
+ * __analyze_table --
+ *	Generate code that gathers statistics on the table 'table' and
+ *	each of its indices.
+ *
+ * STATIC: static void __analyze_table __P((parser_t *, table_t *));
+ */
+static void
+__analyze_table(parser, table)
+	parser_t *parser;
+	table_t *table;
+{
+	vdbe_t *v;
+	index_t *idx;
+	int cur;
+
+	if (table->pSelect || table->readOnly)
+		return;
+	v = __parser_get_vdbe(parser);
+	if (v == 0)
+		return;
+	__vdbe_prepare_write(parser, 0, table->iDb);
+	cur = parser->nTab++;
+	if (table->pIndex == 0) {
+		__vdbe_add_op(v, OP_Integer, table->iDb, 0);
+		__vdbe_add_op(v, OP_OpenRead, cur, table->tnum);
+		__vdbe_change_p3(v, -1, table->zName, P3_STATIC);
+		__vdbe_add_op(v, OP_Analyze, cur, 0);
+		__vdbe_change_p3(v, -1, table->zName, P3_STATIC);
+		__vdbe_add_op(v, OP_Close, cur, 0);
+	}
+	for (idx = table->pIndex; idx; idx = idx->pNext) {
+		if (idx->iDb != table->iDb)
+			__vdbe_prepare_write(parser, 0, idx->iDb);
+		__vdbe_add_op(v, OP_Integer, idx->iDb, 0);
+		__vdbe_add_op(v, OP_OpenRead, cur, idx->tnum);
+		__vdbe_change_p3(v, -1, idx->zName, P3_STATIC);
+		__vdbe_add_op(v, OP_Analyze, cur, idx->nColumn);
+		__vdbe_change_p3(v, -1, idx->zName, P3_STATIC);
+		__vdbe_add_op(v, OP_Close, cur, 0);
+	}
+}
+
+/*
+ * __analyze_db --
+ *	Generate code that gathers statistics on every table of database
+ *	'dbi'.
+ *
+ * STATIC: static void __analyze_db __P((parser_t *, int));
+ */
+static void
+__analyze_db(parser, dbi)
+	parser_t *parser;
+	int dbi;
+{
+	hash_ele_t *ele;
+
+	for (ele = __hash_first(&parser->db->aDb[dbi].tblHash); ele;
+	     ele = __hash_next(ele)) {
+		__analyze_table(parser, (table_t *)__hash_data(ele));
+	}
+}
+
+/*
+ * __analyze --
+ *	The ANALYZE command counts the rows of tables and measures how
+ *	selective their indices are so that the query planner can choose
+ *	between plans on something better than guesses.  Without an
+ *	argument every database is analyzed.  The argument may name a
+ *	database, a table or an index, in which case the table of that
+ *	index is analyzed.
+ *
+ * PUBLIC: void __analyze __P((parser_t *, token_t *, token_t *));
+ */
+void
+__analyze(parser, name1, name2)
+	parser_t *parser;
+	token_t *name1;
+	token_t *name2;
+{
+	DBSQL *dbp = parser->db;
+	table_t *table;
+	index_t *idx;
+	char *name, *db_name;
+	int i;
+
+	if (parser->nErr || parser->rc == ENOMEM)
+		return;
+	if (__parser_get_vdbe(parser) == 0)
+		return;
+	if (name1 == 0) {
+		for (i = 0; i < dbp->nDb; i++) {
+			if (dbp->aDb[i].pBt)
+				__analyze_db(parser, i);
+		}
+		__vdbe_conclude_write(parser);
+		return;
+	}
+
+	db_name = 0;
+	if (name2 && name2->z) {
+		db_name = __table_name_from_token(name1);
+		name = __table_name_from_token(name2);
+	} else {
+		name = __table_name_from_token(name1);
+		for (i = 0; name && i < dbp->nDb; i++) {
+			if (dbp->aDb[i].pBt && dbp->aDb[i].zName &&
+			    strcasecmp(dbp->aDb[i].zName, name) == 0)
+				break;
+		}
+		if (name && i < dbp->nDb) {
+			__analyze_db(parser, i);
+			__vdbe_conclude_write(parser);
+			__dbsql_free(dbp, name);
+			return;
+		}
+	}
+	if (name == 0) {
+		parser->rc = ENOMEM;
+	} else if ((table = __find_table(dbp, name, db_name)) != 0) {
+		__analyze_table(parser, table);
+		__vdbe_conclude_write(parser);
+	} else if ((idx = __find_index(dbp, name, db_name)) != 0) {
+		__analyze_table(parser, idx->pTable);
+		__vdbe_conclude_write(parser);
+	} else {
+		__error_msg(parser, "no such table or index: %s", name);
+	}
+	if (db_name)
+		__dbsql_free(dbp, db_name);
+	if (name)
+		__dbsql_free(dbp, name);
+}
+
+/*
+ * __analyze_prefix --
+ *	Return how many of the first 'ncol' fields of the index keys 'a'
+ *	and 'b' are the same.
+ *
+ * STATIC: static int __analyze_prefix __P((const char *, int,
+ * STATIC:                             const char *, int, int));
+ */
+static int
+__analyze_prefix(a, na, b, nb, ncol)
+	const char *a;
+	int na;
+	const char *b;
+	int nb;
+	int ncol;
+{
+	int i, k;
+
+	for (i = 0, k = 0; k < ncol; k++) {
+		while (i < na && i < nb && a[i] == b[i] && a[i] != 0)
+			i++;
+		if (i >= na || i >= nb || a[i] != b[i])
+			return k;
+		i++;
+	}
+	return ncol;
+}
+
+/*
+ * __analyze_apply --
+ *	Attach the statistics 'stat', 'len' bytes in the format described
+ *	at the top of this file, to the table or index 'name' of database
+ *	'dbi'.  Statistics that do not fit the table or index are ignored.
+ *
+ * STATIC: static void __analyze_apply __P((DBSQL *, int, const char *,
+ * STATIC:                             const char *, int));
+ */
+static void
+__analyze_apply(dbp, dbi, name, stat, len)
+	DBSQL *dbp;
+	int dbi;
+	const char *name;
+	const char *stat;
+	int len;
+{
+	table_t *table;
+	index_t *idx;
+	int i, n, ncol, nrow[2], *val;
+	const char *z, *end;
+
+	idx = __hash_find(&dbp->aDb[dbi].idxHash, name, strlen(name) + 1);
+	if (idx == 0) {
+		table = __hash_find(&dbp->aDb[dbi].tblHash, name,
+				    strlen(name) + 1);
+		ncol = 0;
+		val = nrow;
+	} else {
+		table = idx->pTable;
+		ncol = idx->nColumn;
+		if (__dbsql_malloc(dbp, (sizeof(int) * (ncol + 2)) + len,
+				   &val) == ENOMEM)
+			return;
+	}
+	if (table == 0)
+		return;
+
+	/* Decode the counts. */
+	z = stat;
+	end = stat + len;
+	for (n = 0; n <= ncol + 1 && z < end && *z; n++) {
+		while (z < end && *z == ' ')
+			z++;
+		if (z == end || !isdigit(*z))
+			break;
+		for (val[n] = 0; z < end && isdigit(*z); z++)
+			val[n] = (val[n] * 10) + (*z - '0');
+	}
+	if (n != ncol + 2 || (z < end && *z != 0)) {
+		if (idx)
+			__dbsql_free(dbp, val);
+		return;
+	}
+	table->nRowEst = val[0];
+	table->hasStat = 1;
+	if (idx == 0) {
+		table->nRowSm = val[ncol + 1];
+		return;
+	}
+	idx->nRowSm = val[ncol + 1];
+
+	/* The samples follow the 0x00 that ends the counts. */
+	if (z < end)
+		z++;
+	if (idx->aiRowEst)
+		__dbsql_free(dbp, idx->aiRowEst);
+	idx->aiRowEst = val;
+	idx->aSample = (char *)&val[ncol + 2];
+	memcpy(idx->aSample, z, end - z);
+	idx->nSample = 0;
+	for (i = 0; i < end - z; i++) {
+		if (idx->aSample[i] == 0)
+			idx->nSample++;
+	}
+}
+
+/*
+ * __analyze_load --
+ *	Read the statistics that ANALYZE left for the tables and indices
+ *	of database 'dbi'.  This is done when the schema is loaded.
+ *
+ * PUBLIC: void __analyze_load __P((DBSQL *, int));
+ */
+void
+__analyze_load(dbp, dbi)
+	DBSQL *dbp;
+	int dbi;
+{
+	sm_t *sm;
+	hash_ele_t *ele;
+	table_t *table;
+	index_t *idx;
+	char *stat;
+	int len;
+
+	if ((sm = dbp->aDb[dbi].pBt) == 0)
+		return;
+	for (ele = __hash_first(&dbp->aDb[dbi].tblHash); ele;
+	     ele = __hash_next(ele)) {
+		table = __hash_data(ele);
+		if (table->pSelect || table->pIndex)
+			continue;
+		if (__sm_get_stat(sm, table->zName, &stat, &len) ==
+		    DBSQL_SUCCESS && stat) {
+			__analyze_apply(dbp, dbi, table->zName, stat, len);
+			__dbsql_ufree(dbp, stat);
+		}
+	}
+	for (ele = __hash_first(&dbp->aDb[dbi].idxHash); ele;
+	     ele = __hash_next(ele)) {
+		idx = __hash_data(ele);
+		if (__sm_get_stat(sm, idx->zName, &stat, &len) ==
+		    DBSQL_SUCCESS && stat) {
+			__analyze_apply(dbp, dbi, idx->zName, stat, len);
+			__dbsql_ufree(dbp, stat);
+		}
+	}
+}
+
+/*
+ * __execute_analyze --
+ *	This routine implements the OP_Analyze opcode of the VDBE.  It
+ *	reads every entry the cursor 'smc' can reach and stores the
+ *	statistics of the table or index 'name', whose keys have 'ncol'
+ *	fields (0 for a table).  The statistics take effect for statements
+ *	prepared from then on.
+ *
+ * PUBLIC: int __execute_analyze __P((char **, DBSQL *, sm_cursor_t *, int,
+ * PUBLIC:                       const char *));
+ */
+int
+__execute_analyze(err_msgs, dbp, smc, ncol, name)
+	char **err_msgs;
+	DBSQL *dbp;
+	sm_cursor_t *smc;
+	int ncol;
+	const char *name;
+{
+	int rc, res, i, k, n, len, nrow, dbi;
+	int prev_len, prev_size, samp_len, samp_size, samp_next;
+	int *dist;
+	double est;
+	const char *key;
+	char *prev, *samp, *stat;
+
+	dist = 0;
+	prev = samp = stat = 0;
+	prev_len = prev_size = samp_len = samp_size = 0;
+	if (__dbsql_calloc(dbp, ncol + 1, sizeof(int), &dist) == ENOMEM)
+		goto no_mem;
+
+	/*
+	 * Count the entries and, for each number of leading fields, how
+	 * many distinct values those fields take.
+	 */
+	nrow = 0;
+	for (rc = __sm_first(smc, &res); rc == DBSQL_SUCCESS && res == 0;
+	     rc = __sm_next(smc, &res)) {
+		nrow++;
+		if (ncol == 0)
+			continue;
+		if ((rc = __sm_key_ptr(smc, &key, &len)) != DBSQL_SUCCESS)
+			break;
+		k = (nrow == 1) ? 0 :
+			__analyze_prefix(prev, prev_len, key, len, ncol);
+		for (i = k; i < ncol; i++)
+			dist[i + 1]++;
+		if (len > prev_size) {
+			if (__dbsql_realloc(dbp, len, &prev) == ENOMEM)
+				goto no_mem;
+			prev_size = len;
+		}
+		memcpy(prev, key, len);
+		prev_len = len;
+	}
+	if (rc != DBSQL_SUCCESS)
+		goto err;
+
+	/*
+	 * Take the first field of evenly spaced entries as samples.  An
+	 * index with fewer entries than samples has some sampled twice,
+	 * keeping the weight of every sample the same.
+	 */
+	if (ncol > 0 && nrow > 0) {
+		i = 0;
+		k = 0;
+		samp_next = nrow / (2 * DBSQL_STAT_SAMPLES);
+		for (rc = __sm_first(smc, &res);
+		     rc == DBSQL_SUCCESS && res == 0 &&
+			     k < DBSQL_STAT_SAMPLES;
+		     rc = __sm_next(smc, &res), i++) {
+			if (i < samp_next)
+				continue;
+			if ((rc = __sm_key_ptr(smc, &key, &len)) !=
+			    DBSQL_SUCCESS)
+				break;
+			for (n = 0; n < len && key[n]; n++)
+				;
+			n++;
+			for (; k < DBSQL_STAT_SAMPLES && i >= samp_next; k++) {
+				if (samp_len + n > samp_size) {
+					samp_size = (samp_len + n) * 2;
+					if (__dbsql_realloc(dbp, samp_size,
+							    &samp) == ENOMEM)
+						goto no_mem;
+				}
+				memcpy(&samp[samp_len], key, n - 1);
+				samp[samp_len + n - 1] = 0;
+				samp_len += n;
+				samp_next = (int)((((double)(2 * (k + 1) + 1)) *
+						   nrow) /
+						  (2 * DBSQL_STAT_SAMPLES));
+			}
+		}
+		if (rc != DBSQL_SUCCESS)
+			goto err;
+	}
+
+	/* Encode and store the statistics. */
+	if (__sm_estimate_entries(smc->sm, smc->id, &est) != DBSQL_SUCCESS ||
+	    est > 2000000000)
+		est = 0;
+	if (__dbsql_malloc(dbp, (12 * (ncol + 2)) + 1 + samp_len,
+			   &stat) == ENOMEM)
+		goto no_mem;
+	len = sprintf(stat, "%d", nrow);
+	for (i = 1; i <= ncol; i++) {
+		len += sprintf(&stat[len], " %d",
+			       dist[i] ? (nrow + dist[i] - 1) / dist[i] : 0);
+	}
+	len += sprintf(&stat[len], " %d", (int)est);
+	if (ncol > 0) {
+		stat[len++] = 0;
+		if (samp_len > 0)
+			memcpy(&stat[len], samp, samp_len);
+		len += samp_len;
+	}
+	rc = __sm_set_stat(smc->sm, name, stat, len);
+	if (rc == DBSQL_SUCCESS) {
+		for (dbi = 0; dbi < dbp->nDb; dbi++) {
+			if (dbp->aDb[dbi].pBt == smc->sm) {
+				__analyze_apply(dbp, dbi, name, stat, len);
+				break;
+			}
+		}
+	}
+	goto done;
+
+  no_mem:
+	rc = DBSQL_NOMEM;
+  err:
+	__str_append(err_msgs, "unable to analyze ", name, (char*)0);
+  done:
+	if (dist)
+		__dbsql_free(dbp, dist);
+	if (prev)
+		__dbsql_free(dbp, prev);
+	if (samp)
+		__dbsql_free(dbp, samp);
+	if (stat)
+		__dbsql_free(dbp, stat);
+	return rc;
+}
+
+/*
+ * __analyze_value_key --
+ *	If 'value' is a literal, write it into 'buf' the way it appears as
+ *	the first field of a key of index 'idx' and return the length of
+ *	that field including its terminating 0x00.  Otherwise, or if 'buf'
+ *	is too small, return 0.
+ *
+ * STATIC: static int __analyze_value_key __P((index_t *, expr_t *, char *,
+ * STATIC:                                int));
+ */
+static int
+__analyze_value_key(idx, value, buf, size)
+	index_t *idx;
+	expr_t *value;
+	char *buf;
+	int size;
+{
+	int neg, n, text;
+	char *z;
+	double r;
+
+	if (value == 0)
+		return 0;
+	neg = 0;
+	if (value->op == TK_UMINUS && value->pLeft &&
+	    (value->pLeft->op == TK_INTEGER || value->pLeft->op == TK_FLOAT)) {
+		neg = 1;
+		value = value->pLeft;
+	}
+	switch(value->op) {
+	case TK_INTEGER: /* FALLTHROUGH */
+	case TK_FLOAT:   /* FALLTHROUGH */
+	case TK_STRING:
+		break;
+	default:
+		return 0;
+	}
+	if (value->token.z == 0 ||
+	    (z = __table_name_from_token(&value->token)) == 0)
+		return 0;
+	text = (idx->pTable->aCol[idx->aiColumn[0]].sortOrder &
+		DBSQL_SO_TYPEMASK) == DBSQL_SO_TEXT;
+	n = 0;
+	if (!text && __str_is_numeric(z)) {
+		if (size >= 64) {
+			r = __dbsql_atof(z);
+			buf[0] = 'b';
+			__str_real_as_sortable(neg ? -r : r, &buf[1]);
+			n = strlen(buf) + 1;
+		}
+	} else if (!neg && (int)strlen(z) + 2 <= size) {
+		buf[0] = 'c';
+		strcpy(&buf[1], z);
+		n = strlen(buf) + 1;
+	}
+	__dbsql_free(NULL, z);
+	return n;
+}
+
+/*
+ * __analyze_scale --
+ *	Scale 'count', which was counted by ANALYZE when the storage
+ *	manager estimated the table or index 'id' of database 'dbi' held
+ *	'then' entries, by how much that estimate has changed since.
+ *
+ * STATIC: static double __analyze_scale __P((DBSQL *, int, int, double,
+ * STATIC:                               int));
+ */
+static double
+__analyze_scale(dbp, dbi, id, count, then)
+	DBSQL *dbp;
+	int dbi;
+	int id;
+	double count;
+	int then;
+{
+	double now;
+
+	if (then <= 0 || dbp->aDb[dbi].pBt == 0 ||
+	    __sm_estimate_entries(dbp->aDb[dbi].pBt, id, &now) !=
+	    DBSQL_SUCCESS)
+		return count;
+	return count * now / then;
+}
+
+/*
+ * __analyze_table_rows --
+ *	Return the number of rows the table 'table' is thought to hold.
+ *	The count made by ANALYZE is preferred, adjusted for how much the
+ *	table has grown or shrunk since.  A table that was never analyzed
+ *	is sized from the storage manager's estimate, and failing that
+ *	assumed to hold DBSQL_EST_ROWS rows.
+ *
+ * PUBLIC: double __analyze_table_rows __P((DBSQL *, table_t *));
+ */
+double
+__analyze_table_rows(dbp, table)
+	DBSQL *dbp;
+	table_t *table;
+{
+	index_t *idx;
+	double rows;
+
+	if (table->pSelect || table->isTransient)
+		return DBSQL_EST_ROWS;
+	for (idx = table->pIndex; idx && idx->aiRowEst == 0;
+	     idx = idx->pNext)
+		;
+	if (idx)
+		rows = __analyze_scale(dbp, idx->iDb, idx->tnum,
+				       idx->aiRowEst[0], idx->nRowSm);
+	else if (table->hasStat)
+		rows = __analyze_scale(dbp, table->iDb, table->tnum,
+				       table->nRowEst, table->nRowSm);
+	else if (dbp->aDb[table->iDb].pBt == 0 ||
+		 __sm_estimate_entries(dbp->aDb[table->iDb].pBt, table->tnum,
+				       &rows) != DBSQL_SUCCESS)
+		rows = DBSQL_EST_ROWS;
+	return (rows < 1) ? 1 : rows;
+}
+
+/*
+ * __analyze_key_frac --
+ *	Estimate the fraction of the entries of index 'idx' whose first
+ *	field sorts before the 'len' byte field 'key', or before or the
+ *	same as it if 'inclusive' is set.  Returns a negative number if
+ *	there is no way to tell.
+ *
+ *	The samples are used if 'idx' has been analyzed, otherwise the
+ *	storage manager is asked where the key would fall in the index.
+ *	Every entry whose first field is 'key' sorts after 'key' itself,
+ *	terminator included, and before 'key' with its terminator made
+ *	0x01.
+ *
+ * STATIC: static double __analyze_key_frac __P((DBSQL *, index_t *,
+ * STATIC:                                  char *, int, int));
+ */
+static double
+__analyze_key_frac(dbp, idx, key, len, inclusive)
+	DBSQL *dbp;
+	index_t *idx;
+	char *key;
+	int len;
+	int inclusive;
+{
+	char *s;
+	int i, c, hits;
+	double less;
+
+	if (idx->nSample > 0) {
+		hits = 0;
+		for (s = idx->aSample, i = 0; i < idx->nSample;
+		     s += strlen(s) + 1, i++) {
+			c = strcmp(s, key);
+			hits += inclusive ? (c <= 0) : (c < 0);
+		}
+		return (hits + 0.5) / (idx->nSample + 1);
+	}
+	if (dbp->aDb[idx->iDb].pBt == 0)
+		return -1;
+	key[len - 1] = inclusive ? 1 : 0;
+	c = __sm_estimate_range(dbp->aDb[idx->iDb].pBt, idx->tnum, key, len,
+				&less, 0);
+	key[len - 1] = 0;
+	return (c == DBSQL_SUCCESS) ? less : -1;
+}
+
+/*
+ * __analyze_eq_rows --
+ *	Estimate how many entries of index 'idx', on a table now thought to
+ *	hold 'rows' rows, match == constraints on its first 'num_eq'
+ *	columns, the first of them against 'value'.  Returns a negative
+ *	number if there is no way to tell.
+ *
+ *	When 'value' is a literal the samples are consulted.  A value found
+ *	among them is common and matches about as many entries as the
+ *	samples it was found in stand for.  Any other value is rarer than
+ *	that, whatever the average says.  For an index that has not been
+ *	analyzed the storage manager is asked how much of it lies between
+ *	'value' and the next value, and each further column is assumed to
+ *	keep one entry in ten.
+ *
+ * PUBLIC: double __analyze_eq_rows __P((DBSQL *, index_t *, int, expr_t *,
+ * PUBLIC:                          double));
+ */
+double
+__analyze_eq_rows(dbp, idx, num_eq, value, rows)
+	DBSQL *dbp;
+	index_t *idx;
+	int num_eq;
+	expr_t *value;
+	double rows;
+{
+	char buf[256], *s;
+	double out, per_sample, first, lo, hi;
+	int i, n, hits;
+
+	if (num_eq < 1)
+		return -1;
+	if (num_eq > idx->nColumn)
+		num_eq = idx->nColumn;
+	n = __analyze_value_key(idx, value, buf, sizeof(buf));
+	if (idx->aiRowEst == 0) {
+		if (n == 0 ||
+		    (lo = __analyze_key_frac(dbp, idx, buf, n, 0)) < 0 ||
+		    (hi = __analyze_key_frac(dbp, idx, buf, n, 1)) < 0)
+			return -1;
+		for (out = (hi - lo) * rows, i = 1; i < num_eq; i++)
+			out /= 10;
+		return (out < 1) ? 1 : out;
+	}
+
+	out = idx->aiRowEst[num_eq];
+	if (idx->nSample > 0 && idx->aiRowEst[1] > 0 && n > 0) {
+		per_sample = (double)idx->aiRowEst[0] / idx->nSample;
+		hits = 0;
+		for (s = idx->aSample, i = 0; i < idx->nSample;
+		     s += strlen(s) + 1, i++) {
+			if (strcmp(s, buf) == 0)
+				hits++;
+		}
+		if (hits > 0)
+			first = hits * per_sample;
+		else if (per_sample < idx->aiRowEst[1])
+			first = per_sample;
+		else
+			first = idx->aiRowEst[1];
+		out = first * idx->aiRowEst[num_eq] / idx->aiRowEst[1];
+	}
+
+	/* The table may have grown or shrunk since it was analyzed. */
+	if (idx->aiRowEst[0] > 0)
+		out = out * rows / idx->aiRowEst[0];
+	return (out < 1) ? 1 : out;
+}
+
+/*
+ * __analyze_range_frac --
+ *	Estimate the fraction of the entries of index 'idx' whose first
+ *	column is within the bounds "<column> lt_op lt_val" and "<column>
+ *	gt_op gt_val".  Either bound may be missing.  Returns a negative
+ *	number if there is no way to tell.
+ *
+ * PUBLIC: double __analyze_range_frac __P((DBSQL *, index_t *, int,
+ * PUBLIC:                             expr_t *, int, expr_t *));
+ */
+double
+__analyze_range_frac(dbp, idx, lt_op, lt_val, gt_op, gt_val)
+	DBSQL *dbp;
+	index_t *idx;
+	int lt_op;
+	expr_t *lt_val;
+	int gt_op;
+	expr_t *gt_val;
+{
+	char buf[256];
+	double lt_f, gt_f, f;
+	int n;
+
+	lt_f = gt_f = 1;
+	if (lt_val) {
+		if ((n = __analyze_value_key(idx, lt_val, buf,
+					     sizeof(buf))) == 0 ||
+		    (lt_f = __analyze_key_frac(dbp, idx, buf, n,
+					       lt_op == TK_LE)) < 0)
+			return -1;
+	}
+	if (gt_val) {
+		if ((n = __analyze_value_key(idx, gt_val, buf,
+					     sizeof(buf))) == 0 ||
+		    (gt_f = __analyze_key_frac(dbp, idx, buf, n,
+					       gt_op == TK_GT)) < 0)
+			return -1;
+		gt_f = 1 - gt_f;
+	}
+
+	/*
+	 * With both bounds the fraction is what lies below the upper bound
+	 * less what lies below the lower one.  Two bounds between the same
+	 * pair of samples still cover something.
+	 */
+	f = lt_f + gt_f - 1;
+	if (idx->nSample > 0 && f < 0.5 / (idx->nSample + 1))
+		f = 0.5 / (idx->nSample + 1);
+	return (f < 0) ? 0 : f;
+}
@@ -131,8 +131,12 @@ __parse_exec(parser)
 			trace = 0;
 		}
 		__vdbe_trace(v, trace);
+		__expr_code_prologue(parser);
 		__vdbe_make_ready(v, parser->nVar, callback, parser->pArg,
 				  parser->explain);
+		__vdbe_set_var_names(v, parser->azVarName);
+		parser->azVarName = 0;
+		parser->nVarName = 0;
 		if (parser->useCallback) {
 			if (parser->explain) {
 				rc = __vdbe_list(v);
@@ -154,9 +158,13 @@ __parse_exec(parser)
 	} else if (parser->useCallback == 0) {
 		parser->rc = DBSQL_ERROR;
 	}
+	__expr_list_delete(parser->pConst);
+	parser->pConst = 0;
+	__expr_var_names_clear(parser);
 	parser->nTab = 0;
 	parser->nMem = 0;
 	parser->nSet = 0;
+	parser->nHash = 0;
 	parser->nAgg = 0;
 	parser->nVar = 0;
 }
@@ -293,6 +301,8 @@ __delete_index(dbp, index)
 		__hash_insert(&dbp->aDb[index->iDb].idxHash, old->zName,
 			      strlen(old->zName) + 1, old);
 	}
+	if (index->aiRowEst)
+		__dbsql_free(dbp, index->aiRowEst);
 	__dbsql_free(dbp, index);
 }
 
@@ -720,8 +730,7 @@ void __start_table(parser, start, name, temp, view)
 		__vdbe_prepare_write(parser, 0, temp);
 		if (!temp) {
 			__vdbe_add_op(v, OP_Integer, dbp->format_version, 0);
-			__vdbe_add_op(v, OP_SetFormatVersion,
-				      DBSQL_FORMAT_VERSION, 0);
+			__vdbe_add_op(v, OP_SetFormatVersion, idb, 0);
 		}
 		__open_master_table(v, temp);
 		__vdbe_add_op(v, OP_NewRecno, 0, 0);
@@ -1706,9 +1715,13 @@ __drop_table(parser, name, view)
 		__vdbe_add_op(v, OP_Close, 0, 0);
 		if (!view) {
 			__vdbe_add_op(v, OP_Destroy, table->tnum, table->iDb);
+			__vdbe_add_op(v, OP_DropStat, table->iDb, 0);
+			__vdbe_change_p3(v, -1, table->zName, 0);
 			for (idx = table->pIndex; idx; idx = idx->pNext) {
 				__vdbe_add_op(v, OP_Destroy, idx->tnum,
 					      idx->iDb);
+				__vdbe_add_op(v, OP_DropStat, idx->iDb, 0);
+				__vdbe_change_p3(v, -1, idx->zName, 0);
 			}
 		}
 		__vdbe_conclude_write(parser);
@@ -2233,6 +2246,7 @@ void __create_index(parser, token, sltable, list, on_error, start, end)
 		__vdbe_add_op(v, OP_MakeRecord, 5, 0);
 		__vdbe_add_op(v, OP_PutIntKey, 0, 0);
 		if (sltable) {
+			__vdbe_add_op(v, OP_BulkInsert, 1, 0);
 			__vdbe_add_op(v, OP_Integer, table->iDb, 0);
 			__vdbe_add_op(v, OP_OpenRead, 2, table->tnum);
 			__vdbe_change_p3(v, -1, table->zName, P3_STATIC);
@@ -2357,6 +2371,8 @@ __drop_index(parser, name)
 		}
 		__vdbe_add_op(v, OP_Close, 0, 0);
 		__vdbe_add_op(v, OP_Destroy, index->tnum, index->iDb);
+		__vdbe_add_op(v, OP_DropStat, index->iDb, 0);
+		__vdbe_change_p3(v, -1, index->zName, 0);
 		__vdbe_conclude_write(parser);
 	}
 
@@ -87,12 +87,14 @@ void __copy(parser, table_name, filename, delimiter, on_error)
 		__vdbe_add_op(v, OP_Integer, table->iDb, 0);
 		__vdbe_add_op(v, OP_OpenWrite, 0, table->tnum);
 		__vdbe_change_p3(v, -1, table->zName, P3_STATIC);
+		__vdbe_add_op(v, OP_BulkInsert, 0, 0);
 		for(i = 1, index = table->pIndex; index;
 		    index=index->pNext, i++) {
 			DBSQL_ASSERT(index->iDb == 1 || index->iDb == table->iDb);
 			__vdbe_add_op(v, OP_Integer, index->iDb, 0);
 			__vdbe_add_op(v, OP_OpenWrite, i, index->tnum);
 			__vdbe_change_p3(v, -1, index->zName, P3_STATIC);
+			__vdbe_add_op(v, OP_BulkInsert, i, 0);
 		}
 		if (db->flags & DBSQL_CountRows) {
                         /* Initialize the row count */
@@ -135,6 +137,11 @@ void __copy(parser, table_name, filename, delimiter, on_error)
 		__vdbe_add_op(v, OP_Goto, 0, addr);
 		__vdbe_resolve_label(v, end);
 		__vdbe_add_op(v, OP_Noop, 0, 0);
+		__vdbe_add_op(v, OP_Close, 0, 0);
+		for(i = 1, index = table->pIndex; index;
+		    index=index->pNext, i++) {
+			__vdbe_add_op(v, OP_Close, i, 0);
+		}
 		__vdbe_conclude_write(parser);
 		if (db->flags & DBSQL_CountRows) {
 			__vdbe_add_op(v, OP_ColumnName, 0, 0);
@@ -1024,14 +1024,15 @@ __register_datetime_funcs(dbp)
 		char *name;
 		int args;
 		int type;
+		int deterministic;
 		void (*func)(dbsql_func_t*, int, const char**);
 	} funcs[] = {
 #ifndef DBSQL_OMIT_DATETIME_FUNCS
-		{ "julianday", -1, DBSQL_NUMERIC, __julianday_sql_func   },
-		{ "date",      -1, DBSQL_TEXT,    __date_sql_func        },
-		{ "time",      -1, DBSQL_TEXT,    __time_sql_func        },
-		{ "datetime",  -1, DBSQL_TEXT,    __datetime_sql_func    },
-		{ "strftime",  -1, DBSQL_TEXT,    __strftime_sql_func    },
+		{ "julianday", -1, DBSQL_NUMERIC, 1, __julianday_sql_func   },
+		{ "date",      -1, DBSQL_TEXT,    1, __date_sql_func        },
+		{ "time",      -1, DBSQL_TEXT,    1, __time_sql_func        },
+		{ "datetime",  -1, DBSQL_TEXT,    1, __datetime_sql_func    },
+		{ "strftime",  -1, DBSQL_TEXT,    1, __strftime_sql_func    },
 #endif
 	};
 	int i;
@@ -1043,6 +1044,8 @@ __register_datetime_funcs(dbp)
 		if (funcs[i].func) {
 			dbp->func_return_type(dbp, funcs[i].name,
 					      funcs[i].type);
+			dbp->func_deterministic(dbp, funcs[i].name,
+						funcs[i].deterministic);
 		}
 	}
 }
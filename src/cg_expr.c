@@ -131,6 +131,79 @@ __expr_function(list, token)
 	return new;
 }
 
+/*
+ * __expr_assign_var --
+ *	Number the variable 'expr'.  Each '?' gets the next number.  A
+ *	':name' gets the number it was given the first time it was seen in
+ *	the statement, so every use of the name takes the same value, and
+ *	its name is remembered for DBSQL->bind_parameter_index().
+ *
+ * PUBLIC: void __expr_assign_var __P((parser_t *, expr_t *));
+ */
+void
+__expr_assign_var(parser, expr)
+	parser_t *parser;
+	expr_t *expr;
+{
+	token_t *t = &expr->token;
+	char **az;
+	int i, n;
+
+	if (t->n < 2 || t->z[0] != ':') {
+		expr->iTable = ++parser->nVar;
+		return;
+	}
+	for (i = 0; i < parser->nVarName; i++) {
+		if (parser->azVarName[i] &&
+		    strncmp(parser->azVarName[i], t->z, t->n) == 0 &&
+		    parser->azVarName[i][t->n] == 0) {
+			expr->iTable = i + 1;
+			return;
+		}
+	}
+	expr->iTable = ++parser->nVar;
+	if (parser->nVar > parser->nVarName) {
+		n = parser->nVar + 8;
+		az = parser->azVarName;
+		if (__dbsql_realloc(NULL, n * sizeof(char *), &az) == ENOMEM) {
+			parser->rc = ENOMEM;
+			return;
+		}
+		memset(&az[parser->nVarName], 0,
+		       (n - parser->nVarName) * sizeof(char *));
+		parser->azVarName = az;
+		parser->nVarName = n;
+	}
+	i = expr->iTable - 1;
+	if (__dbsql_strndup(parser->db, t->z, &parser->azVarName[i],
+			    t->n) == ENOMEM)
+		parser->rc = ENOMEM;
+}
+
+/*
+ * __expr_var_names_clear --
+ *	Free the names of the ':name' variables of a statement that were
+ *	not handed over to its VDBE.
+ *
+ * PUBLIC: void __expr_var_names_clear __P((parser_t *));
+ */
+void
+__expr_var_names_clear(parser)
+	parser_t *parser;
+{
+	int i;
+
+	if (parser->azVarName == 0)
+		return;
+	for (i = 0; i < parser->nVarName; i++) {
+		if (parser->azVarName[i])
+			__dbsql_free(NULL, parser->azVarName[i]);
+	}
+	__dbsql_free(NULL, parser->azVarName);
+	parser->azVarName = 0;
+	parser->nVarName = 0;
+}
+
 /*
  * __expr_delete --
  *	Recursively delete an expression tree.
@@ -686,6 +759,10 @@ __lookup_name(parser, db_token, table_token, col_token, slist,
 				expr->iColumn = ((j == table->iPKey) ? -1 : j);
 				expr->dataType = column->sortOrder &
 					DBSQL_SO_TYPEMASK;
+				if (j != table->iPKey)
+					item->colUsed |= (j < 31) ?
+						((u_int32_t)1 << j) :
+						(u_int32_t)1 << 31;
 				break;
 			}
 		}
@@ -1296,6 +1373,309 @@ __expr_type(p)
 	return DBSQL_SO_NUM;
 }
 
+/*
+ * __expr_fold --
+ *	If the given expression is integer arithmetic on integer literals
+ *	and its value fits in 32 bits, return 1 and put the value in
+ *	'value'.  Otherwise return 0 and leave 'value' unchanged.  A
+ *	division by zero is not folded; the VDBE makes it NULL.
+ *
+ * STATIC: static int __expr_fold __P((expr_t *, int *));
+ */
+static int
+__expr_fold(p, value)
+	expr_t *p;
+	int *value;
+{
+	int a, b;
+	double r;
+
+	switch (p->op) {
+	case TK_INTEGER:
+		return __expr_is_integer(p, value);
+	case TK_UPLUS:
+		return __expr_fold(p->pLeft, value);
+	case TK_UMINUS:
+		if (!__expr_fold(p->pLeft, &a))
+			return 0;
+		r = -(double)a;
+		break;
+	case TK_PLUS:   /* FALLTHROUGH */
+	case TK_MINUS:  /* FALLTHROUGH */
+	case TK_STAR:   /* FALLTHROUGH */
+	case TK_SLASH:  /* FALLTHROUGH */
+	case TK_REM:    /* FALLTHROUGH */
+	case TK_BITAND: /* FALLTHROUGH */
+	case TK_BITOR:
+		if (!__expr_fold(p->pLeft, &a) || !__expr_fold(p->pRight, &b))
+			return 0;
+		switch (p->op) {
+		case TK_PLUS:   r = (double)a + b; break;
+		case TK_MINUS:  r = (double)a - b; break;
+		case TK_STAR:   r = (double)a * b; break;
+		case TK_BITAND: r = a & b;         break;
+		case TK_BITOR:  r = a | b;         break;
+		case TK_SLASH:
+			if (b == 0)
+				return 0;
+			r = (b == -1) ? -(double)a : a / b;
+			break;
+		default:
+			if (b == 0)
+				return 0;
+			r = (b == -1) ? 0 : a % b;
+			break;
+		}
+		break;
+	default:
+		return 0;
+	}
+	if (r < -2147483648.0 || r > 2147483647.0)
+		return 0;
+	*value = (int)r;
+	return 1;
+}
+
+/*
+ * __expr_hoistable --
+ *	Return 1 if the value of the given expression cannot change while
+ *	a statement runs: it is made only of literals, variables, operators
+ *	and calls of deterministic functions.  Subqueries and IN lists are
+ *	not, since the code that fills them in runs after the prologue.
+ *
+ * STATIC: static int __expr_hoistable __P((parser_t *, expr_t *));
+ */
+static int
+__expr_hoistable(parser, p)
+	parser_t *parser;
+	expr_t *p;
+{
+	func_def_t *def;
+	const char *id;
+	int i, nid;
+
+	switch (p->op) {
+	case TK_NULL:     /* FALLTHROUGH */
+	case TK_STRING:   /* FALLTHROUGH */
+	case TK_INTEGER:  /* FALLTHROUGH */
+	case TK_FLOAT:    /* FALLTHROUGH */
+	case TK_VARIABLE:
+		return 1;
+	case TK_GLOB:     /* FALLTHROUGH */
+	case TK_LIKE:     /* FALLTHROUGH */
+	case TK_FUNCTION:
+		__get_function_name(p, &id, &nid);
+		def = __find_function(parser->db, id, nid,
+				      p->pList ? p->pList->nExpr : 0, 0);
+		if (def == 0 || def->xFunc == 0 || !def->isDeterministic)
+			return 0;
+		break;
+	case TK_PLUS:     /* FALLTHROUGH */
+	case TK_MINUS:    /* FALLTHROUGH */
+	case TK_STAR:     /* FALLTHROUGH */
+	case TK_SLASH:    /* FALLTHROUGH */
+	case TK_REM:      /* FALLTHROUGH */
+	case TK_CONCAT:   /* FALLTHROUGH */
+	case TK_BITAND:   /* FALLTHROUGH */
+	case TK_BITOR:    /* FALLTHROUGH */
+	case TK_BITNOT:   /* FALLTHROUGH */
+	case TK_LSHIFT:   /* FALLTHROUGH */
+	case TK_RSHIFT:   /* FALLTHROUGH */
+	case TK_UMINUS:   /* FALLTHROUGH */
+	case TK_UPLUS:    /* FALLTHROUGH */
+	case TK_LT:       /* FALLTHROUGH */
+	case TK_LE:       /* FALLTHROUGH */
+	case TK_GT:       /* FALLTHROUGH */
+	case TK_GE:       /* FALLTHROUGH */
+	case TK_NE:       /* FALLTHROUGH */
+	case TK_EQ:       /* FALLTHROUGH */
+	case TK_AND:      /* FALLTHROUGH */
+	case TK_OR:       /* FALLTHROUGH */
+	case TK_NOT:      /* FALLTHROUGH */
+	case TK_ISNULL:   /* FALLTHROUGH */
+	case TK_NOTNULL:  /* FALLTHROUGH */
+	case TK_BETWEEN:  /* FALLTHROUGH */
+	case TK_CASE:
+		break;
+	default:
+		return 0;
+	}
+	if (p->pLeft && !__expr_hoistable(parser, p->pLeft))
+		return 0;
+	if (p->pRight && !__expr_hoistable(parser, p->pRight))
+		return 0;
+	for (i = 0; p->pList && i < p->pList->nExpr; i++) {
+		if (!__expr_hoistable(parser, p->pList->a[i].pExpr))
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * __expr_hoist --
+ *	If the given expression is worth computing only once per execution
+ *	of the statement, queue a copy of it for the prologue, code an
+ *	OP_MemLoad of the memory cell the prologue leaves its value in and
+ *	return 1.  Otherwise code nothing and return 0.
+ *
+ *	Literals and unary operators on literals are already one or two
+ *	instructions and are left where they are.  Nor is anything hoisted
+ *	out of an operand that is not always evaluated: the branches of a
+ *	CASE, the right side of a short-circuit AND or OR and the upper
+ *	bound of a BETWEEN.  The prologue would compute those for a row that
+ *	never reaches them.  A hoisted expression still runs once per
+ *	execution even when no row is visited, so a deterministic user
+ *	function that fails on its constant arguments fails the statement
+ *	even over an empty table.
+ *
+ * STATIC: static int __expr_hoist __P((parser_t *, expr_t *));
+ */
+static int
+__expr_hoist(parser, expr)
+	parser_t *parser;
+	expr_t *expr;
+{
+	expr_t *copy;
+	expr_list_t *list;
+
+	if (parser->inPrologue || parser->initFlag || parser->nCond > 0)
+		return 0;
+	switch (expr->op) {
+	case TK_GLOB:     /* FALLTHROUGH */
+	case TK_LIKE:     /* FALLTHROUGH */
+	case TK_FUNCTION: /* FALLTHROUGH */
+	case TK_BETWEEN:  /* FALLTHROUGH */
+	case TK_CASE:
+		break;
+	default:
+		if (expr->pLeft == 0 || expr->pRight == 0)
+			return 0;
+		break;
+	}
+	if (!__expr_hoistable(parser, expr))
+		return 0;
+
+	/*
+	 * Like a subquery, the copy keeps its memory cell in iColumn.
+	 */
+	if ((copy = __expr_dup(expr)) == 0)
+		return 0;
+	copy->iColumn = parser->nMem++;
+	list = __expr_list_append(parser->pConst, copy, 0);
+	if (list == 0 || list->nExpr == 0 ||
+	    list->a[list->nExpr - 1].pExpr != copy) {
+		__expr_delete(copy);
+		parser->pConst = list;
+		parser->rc = ENOMEM;
+		return 0;
+	}
+	parser->pConst = list;
+	__vdbe_add_op(parser->pVdbe, OP_MemLoad, copy->iColumn, 0);
+	return 1;
+}
+
+/*
+ * __expr_code_prologue --
+ *	Code the expressions __expr_code() hoisted out of the statement.
+ *	The code goes after the end of the program.  __parser_get_vdbe()
+ *	started the program with an OP_Goto to address 1; that OP_Goto is
+ *	pointed here, so every execution stores the hoisted values in
+ *	their memory cells first, then jumps back to address 1.
+ *
+ * PUBLIC: void __expr_code_prologue __P((parser_t *));
+ */
+void
+__expr_code_prologue(parser)
+	parser_t *parser;
+{
+	vdbe_t *v = parser->pVdbe;
+	expr_list_t *list = parser->pConst;
+	int i;
+
+	if (v == 0 || list == 0)
+		return;
+	DBSQL_ASSERT(__vdbe_get_op(v, 0)->opcode == OP_Goto);
+	__vdbe_add_op(v, OP_Halt, 0, 0);
+	__vdbe_change_p2(v, 0, __vdbe_current_addr(v));
+	parser->inPrologue = 1;
+	for (i = 0; i < list->nExpr; i++) {
+		__expr_code(parser, list->a[i].pExpr);
+		__vdbe_add_op(v, OP_MemStore, list->a[i].pExpr->iColumn, 1);
+	}
+	parser->inPrologue = 0;
+	__vdbe_add_op(v, OP_Goto, 0, 1);
+	__expr_list_delete(list);
+	parser->pConst = 0;
+}
+
+/*
+ * __expr_is_number --
+ *	Return true if 'p' is a number literal, possibly signed.
+ *
+ * STATIC: static int __expr_is_number __P((expr_t *));
+ */
+static int
+__expr_is_number(p)
+	expr_t *p;
+{
+	if (p && (p->op == TK_UMINUS || p->op == TK_UPLUS))
+		p = p->pLeft;
+	return (p != 0 && (p->op == TK_INTEGER || p->op == TK_FLOAT));
+}
+
+/*
+ * __expr_code_num --
+ *	Generate code for 'expr' with __expr_code() when only its numeric
+ *	value is used.  A column read straight from a table is marked so
+ *	that OP_Column may take it from an index key, which holds the value
+ *	of a number but not the text it was written as.
+ *
+ * STATIC: static void __expr_code_num __P((parser_t *, expr_t *));
+ */
+static void
+__expr_code_num(parser, expr)
+	parser_t *parser;
+	expr_t *expr;
+{
+	vdbe_t *v = parser->pVdbe;
+	int addr;
+
+	if (v == 0 || expr == 0)
+		return;
+	addr = __vdbe_current_addr(v);
+	__expr_code(parser, expr);
+	if (expr->op == TK_COLUMN && __vdbe_current_addr(v) == addr + 1 &&
+	    __vdbe_get_op(v, addr)->opcode == OP_Column)
+		__vdbe_change_p3(v, addr, "n", P3_STATIC);
+}
+
+/*
+ * __expr_code_compared --
+ *	Generate code for the two operands of the comparison 'expr'.  When
+ *	a numeric comparison is made with a number literal only the numeric
+ *	value of the other operand matters, see __expr_code_num().  Against
+ *	anything else the text of a number can change the outcome.
+ *
+ * STATIC: static void __expr_code_compared __P((parser_t *, expr_t *));
+ */
+static void
+__expr_code_compared(parser, expr)
+	parser_t *parser;
+	expr_t *expr;
+{
+	int num;
+
+	num = (__expr_type(expr) != DBSQL_SO_TEXT);
+	if (num && __expr_is_number(expr->pRight))
+		__expr_code_num(parser, expr->pLeft);
+	else
+		__expr_code(parser, expr->pLeft);
+	if (num && __expr_is_number(expr->pLeft))
+		__expr_code_num(parser, expr->pRight);
+	else
+		__expr_code(parser, expr->pRight);
+}
+
 /*
  * __expr_code --
  *	Generate code into the current Vdbe to evaluate the given
@@ -1319,6 +1699,17 @@ __expr_code(parser, expr)
 	if (v == 0 || expr == 0)
 		return;
 
+	/*
+	 * Integer arithmetic on literals is done now, and other constant
+	 * expressions are computed once, by the prologue.
+	 */
+	if (expr->pLeft && expr->pRight && __expr_fold(expr, &i)) {
+		__vdbe_add_op(v, OP_Integer, i, 0);
+		return;
+	}
+	if (__expr_hoist(parser, expr))
+		return;
+
 	switch(expr->op) {
 	case TK_PLUS:     op = OP_Add;      break;
 	case TK_MINUS:    op = OP_Subtract; break;
@@ -1384,9 +1775,15 @@ __expr_code(parser, expr)
 		if (__expr_type(expr) == DBSQL_SO_TEXT) {
 			op += 6;  /* Convert numeric opcodes to text opcodes */
 		}
-		/* FALLTHROUGH */
+		__expr_code_compared(parser, expr);
+		__vdbe_add_op(v, op, 0, 0);
+		break;
 	case TK_AND: /* FALLTHROUGH */
-	case TK_OR: /* FALLTHROUGH */
+	case TK_OR:
+		__expr_code(parser, expr->pLeft);
+		__expr_code(parser, expr->pRight);
+		__vdbe_add_op(v, op, 0, 0);
+		break;
 	case TK_PLUS: /* FALLTHROUGH */
 	case TK_STAR: /* FALLTHROUGH */
 	case TK_MINUS: /* FALLTHROUGH */
@@ -1394,14 +1791,14 @@ __expr_code(parser, expr)
 	case TK_BITAND: /* FALLTHROUGH */
 	case TK_BITOR: /* FALLTHROUGH */
 	case TK_SLASH:
-		__expr_code(parser, expr->pLeft);
-		__expr_code(parser, expr->pRight);
+		__expr_code_num(parser, expr->pLeft);
+		__expr_code_num(parser, expr->pRight);
 		__vdbe_add_op(v, op, 0, 0);
 		break;
 	case TK_LSHIFT: /* FALLTHROUGH */
 	case TK_RSHIFT:
-		__expr_code(parser, expr->pRight);
-		__expr_code(parser, expr->pLeft);
+		__expr_code_num(parser, expr->pRight);
+		__expr_code_num(parser, expr->pLeft);
 		__vdbe_add_op(v, op, 0, 0);
 		break;
 	case TK_CONCAT:
@@ -1429,7 +1826,10 @@ __expr_code(parser, expr)
 		/* FALLTHROUGH */
 	case TK_BITNOT: /* FALLTHROUGH */
 	case TK_NOT:
-		__expr_code(parser, expr->pLeft);
+		if (expr->op == TK_NOT)
+			__expr_code(parser, expr->pLeft);
+		else
+			__expr_code_num(parser, expr->pLeft);
 		__vdbe_add_op(v, op, 0, 0);
 		break;
 	case TK_ISNULL:
@@ -1498,6 +1898,7 @@ __expr_code(parser, expr)
 		if (expr->pLeft) {
 			__expr_code(parser, expr->pLeft);
 		}
+		parser->nCond++;
 		for (i = 0; i < nexpr; i += 2) {
 			__expr_code(parser, expr->pList->a[i].pExpr);
 			if (expr->pLeft) {
@@ -1520,6 +1921,7 @@ __expr_code(parser, expr)
 		} else {
 			__vdbe_add_op(v, OP_String, 0, 0);
 		}
+		parser->nCond--;
 		__vdbe_resolve_label(v, expr_end_label);
 		break;
 	case TK_RAISE:
@@ -1588,12 +1990,16 @@ __expr_if_true(parser, expr, dest, jump_if_null)
 	case TK_AND:
 		d2 = __vdbe_make_label(v);
 		__expr_if_false(parser, expr->pLeft, d2, !jump_if_null);
+		parser->nCond++;
 		__expr_if_true(parser, expr->pRight, dest, jump_if_null);
+		parser->nCond--;
 		__vdbe_resolve_label(v, d2);
 		break;
 	case TK_OR:
 		__expr_if_true(parser, expr->pLeft, dest, jump_if_null);
+		parser->nCond++;
 		__expr_if_true(parser, expr->pRight, dest, jump_if_null);
+		parser->nCond--;
 		break;
 	case TK_NOT:
 		__expr_if_false(parser, expr->pLeft, dest, jump_if_null);
@@ -1604,8 +2010,7 @@ __expr_if_true(parser, expr, dest, jump_if_null)
 	case TK_GE: /* FALLTHROUGH */
 	case TK_NE: /* FALLTHROUGH */
 	case TK_EQ:
-		__expr_code(parser, expr->pLeft);
-		__expr_code(parser, expr->pRight);
+		__expr_code_compared(parser, expr);
 		if (__expr_type(expr) == DBSQL_SO_TEXT) {
 			op += 6; /* Convert numeric opcodes to text opcodes */
 		}
@@ -1633,7 +2038,9 @@ __expr_if_true(parser, expr, dest, jump_if_null)
 		__vdbe_add_op(v, OP_Dup, 0, 0);
 		__expr_code(parser, expr->pList->a[0].pExpr);
 		addr = __vdbe_add_op(v, OP_Lt, !jump_if_null, 0);
+		parser->nCond++;
 		__expr_code(parser, expr->pList->a[1].pExpr);
+		parser->nCond--;
 		__vdbe_add_op(v, OP_Le, jump_if_null, dest);
 		__vdbe_add_op(v, OP_Integer, 0, 0);
 		__vdbe_change_p2(v, addr, __vdbe_current_addr(v));
@@ -1684,12 +2091,16 @@ __expr_if_false(parser, expr, dest, jump_if_null)
 	switch(expr->op) {
 	case TK_AND:
 		__expr_if_false(parser, expr->pLeft, dest, jump_if_null);
+		parser->nCond++;
 		__expr_if_false(parser, expr->pRight, dest, jump_if_null);
+		parser->nCond--;
 		break;
 	case TK_OR:
 		d2 = __vdbe_make_label(v);
 		__expr_if_true(parser, expr->pLeft, d2, !jump_if_null);
+		parser->nCond++;
 		__expr_if_false(parser, expr->pRight, dest, jump_if_null);
+		parser->nCond--;
 		__vdbe_resolve_label(v, d2);
 		break;
 	case TK_NOT:
@@ -1712,8 +2123,7 @@ __expr_if_false(parser, expr, dest, jump_if_null)
 			DBSQL_ASSERT(OP_Eq + 6 == OP_StrEq);
 			op += 6;
 		}
-		__expr_code(parser, expr->pLeft);
-		__expr_code(parser, expr->pRight);
+		__expr_code_compared(parser, expr);
 		__vdbe_add_op(v, op, jump_if_null, dest);
 		break;
 	case TK_ISNULL: /* FALLTHROUGH */
@@ -1741,7 +2151,9 @@ __expr_if_false(parser, expr, dest, jump_if_null)
 		__vdbe_add_op(v, OP_Ge, !jump_if_null, addr + 3);
 		__vdbe_add_op(v, OP_Pop, 1, 0);
 		__vdbe_add_op(v, OP_Goto, 0, dest);
+		parser->nCond++;
 		__expr_code(parser, expr->pList->a[1].pExpr);
+		parser->nCond--;
 		__vdbe_add_op(v, OP_Gt, jump_if_null, dest);
 		break;
 	default:
@@ -391,10 +391,23 @@ void __insert(parser, tlist, vlist, select, column, on_error)
 		__vdbe_add_op(v, OP_Integer, table->iDb, 0);
 		__vdbe_add_op(v, OP_OpenWrite, base, table->tnum);
 		__vdbe_change_p3(v, -1, table->zName, P3_STATIC);
+		if (select) {
+			/*
+			 * Rows are streamed in from the SELECT, which
+			 * does not read this table (otherwise they would
+			 * be staged in a temp table first), so the
+			 * inserts can be batched.
+			 */
+			__vdbe_add_op(v, OP_BulkInsert, base, 0);
+		}
 		for (dx = 1, idx = table->pIndex; idx; idx = idx->pNext, dx++){
 			__vdbe_add_op(v, OP_Integer, idx->iDb, 0);
 			__vdbe_add_op(v, OP_OpenWrite, (dx + base), idx->tnum);
 			__vdbe_change_p3(v, -1, idx->zName, P3_STATIC);
+			if (select) {
+				__vdbe_add_op(v, OP_BulkInsert, (dx + base),
+					      0);
+			}
 		}
 		parser->nTab += dx;
 	}
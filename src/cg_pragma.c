@@ -96,6 +96,34 @@ __get_safety_level(z)
 	return 1;
 }
 
+/*
+ * __pragma_stat --
+ *	Generate code that returns one row of PRAGMA runtime_stats.  A
+ *	NULL 'db_name' means the value applies to the whole connection.
+ *
+ * STATIC: static void __pragma_stat __P((vdbe_t *, const char *,
+ * STATIC:                           const char *, u_int64_t));
+ */
+static void
+__pragma_stat(v, db_name, name, value)
+	vdbe_t *v;
+	const char *db_name;
+	const char *name;
+	u_int64_t value;
+{
+	char buf[24];
+
+	__vdbe_add_op(v, OP_String, 0, 0);
+	if (db_name)
+		__vdbe_change_p3(v, -1, db_name, P3_STATIC);
+	__vdbe_add_op(v, OP_String, 0, 0);
+	__vdbe_change_p3(v, -1, name, P3_STATIC);
+	snprintf(buf, sizeof(buf), "%llu", (unsigned long long)value);
+	__vdbe_add_op(v, OP_String, 0, 0);
+	__vdbe_change_p3(v, -1, buf, strlen(buf));
+	__vdbe_add_op(v, OP_Callback, 3, 0);
+}
+
 /*
  * __pragma --
  *	Process a pragma statement.  
@@ -159,6 +187,19 @@ if (strcasecmp(left_name, "vdbe_trace") == 0) {
 		dbp->flags &= ~DBSQL_VdbeTrace;
 	}
 } else
+/*
+ *   PRAGMA peephole
+ *
+ * When off, programs skip the peephole pass of __vdbe_make_ready() and
+ * EXPLAIN lists them exactly as the code generators emitted them.
+ */
+if (strcasecmp(left_name, "peephole") == 0) {
+	if (__get_boolean(right_name)) {
+		dbp->flags &= ~DBSQL_NoPeephole;
+	} else {
+		dbp->flags |= DBSQL_NoPeephole;
+	}
+} else
 /*
  *   PRAGMA full_column_names
  */
@@ -199,6 +240,101 @@ if (strcasecmp(left_name, "empty_result_callbacks") == 0) {
 		dbp->flags &= ~DBSQL_NullCallback;
 	}
 } else
+/*
+ *   PRAGMA isolation
+ *   PRAGMA isolation = snapshot | serializable
+ *
+ * With snapshot isolation a read-only statement run outside of a
+ * transaction reads a snapshot of each database taken when it opens its
+ * first cursor on it, and kept until the statement finishes, rather than
+ * locking the pages it reads.  Statements that write, and everything
+ * inside BEGIN ... COMMIT, are serializable.
+ */
+if (strcasecmp(left_name, "isolation") == 0) {
+	if (left == right) {
+		static vdbe_op_t isolation_preface[] = {
+			{ OP_ColumnName,  0, 0,       "isolation"},
+		};
+		__vdbe_add_op_list(v, ARRAY_SIZE(isolation_preface),
+				   isolation_preface);
+		__vdbe_add_op(v, OP_String, 0, 0);
+		__vdbe_change_p3(v, -1,
+				 (dbp->flags & DBSQL_SnapshotRead) ?
+				   "snapshot" : "serializable", P3_STATIC);
+		__vdbe_add_op(v, OP_Callback, 1, 0);
+	} else if (strcasecmp(right_name, "snapshot") == 0) {
+		dbp->flags |= DBSQL_SnapshotRead;
+	} else {
+		dbp->flags &= ~DBSQL_SnapshotRead;
+	}
+} else
+/*
+ *   PRAGMA sort_memory
+ *   PRAGMA sort_memory = N
+ *
+ * The number of kilobytes an ORDER BY may sort in memory.  Beyond that
+ * sorted runs are written to temporary files and merged.  Zero means
+ * sorts are always done in memory.
+ */
+if (strcasecmp(left_name, "sort_memory") == 0) {
+	if (left == right) {
+		static vdbe_op_t sort_memory_preface[] = {
+			{ OP_ColumnName,  0, 0,       "sort_memory"},
+		};
+		__vdbe_add_op_list(v, ARRAY_SIZE(sort_memory_preface),
+				   sort_memory_preface);
+		__vdbe_add_op(v, OP_Integer, dbp->sort_memory, 0);
+		__vdbe_add_op(v, OP_Callback, 1, 0);
+	} else {
+		int n = atoi(right_name);
+		dbp->sort_memory = (n < 0) ? 0 : n;
+	}
+} else
+/*
+ *   PRAGMA agg_memory
+ *   PRAGMA agg_memory = N
+ *
+ * The number of kilobytes the groups of a GROUP BY may use.  Beyond that
+ * the rows of any other group are spilled to temporary files, divided
+ * into partitions that are aggregated one after the other.  Zero means
+ * no limit.
+ */
+if (strcasecmp(left_name, "agg_memory") == 0) {
+	if (left == right) {
+		static vdbe_op_t agg_memory_preface[] = {
+			{ OP_ColumnName,  0, 0,       "agg_memory"},
+		};
+		__vdbe_add_op_list(v, ARRAY_SIZE(agg_memory_preface),
+				   agg_memory_preface);
+		__vdbe_add_op(v, OP_Integer, dbp->agg_memory, 0);
+		__vdbe_add_op(v, OP_Callback, 1, 0);
+	} else {
+		int n = atoi(right_name);
+		dbp->agg_memory = (n < 0) ? 0 : n;
+	}
+} else
+/*
+ *   PRAGMA hash_memory
+ *   PRAGMA hash_memory = N
+ *
+ * The number of kilobytes the hash table of a hash join may use.  A join
+ * whose inner table needs more spills the table to a transient index that
+ * each outer row seeks.  Zero means no limit.
+ */
+if (strcasecmp(left_name, "hash_memory") == 0) {
+	if (left == right) {
+		static vdbe_op_t hash_memory_preface[] = {
+			{ OP_ColumnName,  0, 0,       "hash_memory"},
+		};
+		__vdbe_add_op_list(v, ARRAY_SIZE(hash_memory_preface),
+				   hash_memory_preface);
+		__vdbe_add_op(v, OP_Integer, dbp->hash_memory, 0);
+		__vdbe_add_op(v, OP_Callback, 1, 0);
+	} else {
+		int n = atoi(right_name);
+		dbp->hash_memory = (n < 0) ? 0 : n;
+	}
+} else
 /*
  *   PRAGMA table_info
  */
@@ -374,6 +510,51 @@ if (strcasecmp(left_name, "database_list") == 0) {
 		__vdbe_add_op(v, OP_Callback, 3, 0);
 	}
 } else
+/*
+ *   PRAGMA runtime_stats
+ */
+if (strcasecmp(left_name, "runtime_stats") == 0) {
+	int i;
+	sm_stat_t st;
+	static vdbe_op_t runtime_stats_preface[] = {
+		{ OP_ColumnName,  0, 0,       "database"},
+		{ OP_ColumnName,  1, 0,       "name"},
+		{ OP_ColumnName,  2, 0,       "value"},
+	};
+
+	__vdbe_add_op_list(v, ARRAY_SIZE(runtime_stats_preface),
+			   runtime_stats_preface);
+	for (i = 0; i < dbp->nDb; i++) {
+		if (dbp->aDb[i].pBt == 0)
+			continue;
+		__sm_stat(dbp->aDb[i].pBt, &st);
+		__pragma_stat(v, dbp->aDb[i].zName, "cursor_pool_hits",
+			      st.pool_hits);
+		__pragma_stat(v, dbp->aDb[i].zName, "cursor_pool_misses",
+			      st.pool_misses);
+		__pragma_stat(v, dbp->aDb[i].zName, "snapshots",
+			      st.snapshots);
+		__pragma_stat(v, dbp->aDb[i].zName, "deadlocks",
+			      st.deadlocks);
+	}
+	if (dbp->aDb[0].pBt) {
+		/* These are shared by every database in the environment. */
+		__sm_stat(dbp->aDb[0].pBt, &st);
+		__pragma_stat(v, NULL, "lock_waits", st.lock_waits);
+		__pragma_stat(v, NULL, "lock_deadlocks", st.lock_deadlocks);
+	}
+	__pragma_stat(v, NULL, "sort_spills", dbp->sort_spills);
+	__pragma_stat(v, NULL, "sort_spill_bytes", dbp->sort_spill_bytes);
+	__pragma_stat(v, NULL, "sort_merges", dbp->sort_merges);
+	__pragma_stat(v, NULL, "agg_groups", dbp->agg_groups);
+	__pragma_stat(v, NULL, "agg_spills", dbp->agg_spills);
+	__pragma_stat(v, NULL, "agg_passes", dbp->agg_passes);
+	__pragma_stat(v, NULL, "agg_lookups", dbp->agg_lookups);
+	__pragma_stat(v, NULL, "agg_probes", dbp->agg_probes);
+	__pragma_stat(v, NULL, "hash_builds", dbp->hash_builds);
+	__pragma_stat(v, NULL, "hash_spills", dbp->hash_spills);
+	__pragma_stat(v, NULL, "arena_high_water", dbp->arena_high);
+} else
 #ifndef NDEBUG
  /*
   * PRAGMA parser_trace
@@ -417,18 +417,27 @@ __aggregate_info_reset(parser)
  *	Insert code into "v" that will push the record on the top of the
  *	stack into the sorter.
  *
+ *	When the SELECT has a LIMIT, only the first LIMIT+OFFSET sorted
+ *	rows are ever output.  If that is a small enough number, tell the
+ *	sorter so that it keeps just those rows in a heap.
+ *
  * STATIC: static void __push_onto_sorter __P((parser_t *, vdbe_t *,
- * STATIC:                                expr_list_t *));
+ * STATIC:                                select_t *, expr_list_t *));
  */
 static void
-__push_onto_sorter(parser, v, orderby_clause)
+__push_onto_sorter(parser, v, select, orderby_clause)
 	parser_t *parser;
 	vdbe_t *v;
+	select_t *select;
 	expr_list_t *orderby_clause;
 {
-	int i, order, type, c;
+	int i, order, type, c, bound;
 	char *sort_order;
 
+	bound = 0;
+	if (select->nLimit >= 0 && select->nOffset >= 0 &&
+	    select->nLimit + select->nOffset <= DBSQL_SORT_HEAP_MAX)
+		bound = select->nLimit + select->nOffset;
 	if (__dbsql_calloc(parser->db, 1, orderby_clause->nExpr + 1,
 			&sort_order) == ENOMEM)
 		return;
@@ -453,7 +462,7 @@ __push_onto_sorter(parser, v, orderby_clause)
 	__vdbe_add_op(v, OP_SortMakeKey, orderby_clause->nExpr, 0);
 	__vdbe_change_p3(v, -1, sort_order, strlen(sort_order));
 	__dbsql_free(parser->db, sort_order);
-	__vdbe_add_op(v, OP_SortPut, 0, 0);
+	__vdbe_add_op(v, OP_SortPut, bound, 0);
 }
 
 /*
@@ -593,7 +602,7 @@ __select_inner_loop(parser, select, elist, src_table, num_cols, orderby_clause,
 		 * temporary table param.
 		 */
 	case SRT_Union:
-		__vdbe_add_op(v, OP_MakeRecord, num_cols,
+		__vdbe_add_op(v, OP_MakeTextRecord, num_cols,
 			      NULL_ALWAYS_DISTINCT);
 		__vdbe_add_op(v, OP_String, 0, 0);
 		__vdbe_add_op(v, OP_PutStrKey, param, 0);
@@ -605,7 +614,7 @@ __select_inner_loop(parser, select, elist, src_table, num_cols, orderby_clause,
 	case SRT_TempTable:
 		__vdbe_add_op(v, OP_MakeRecord, num_cols, 0);
 		if (orderby_clause) {
-			__push_onto_sorter(parser, v, orderby_clause);
+			__push_onto_sorter(parser, v, select, orderby_clause);
 		} else {
 			__vdbe_add_op(v, OP_NewRecno, param, 0);
 			__vdbe_add_op(v, OP_Pull, 1, 0);
@@ -619,7 +628,7 @@ __select_inner_loop(parser, select, elist, src_table, num_cols, orderby_clause,
 		 * the temporary table param.
 		 */
 	case SRT_Except:
-		addr = __vdbe_add_op(v, OP_MakeRecord, num_cols,
+		addr = __vdbe_add_op(v, OP_MakeTextRecord, num_cols,
 				     NULL_ALWAYS_DISTINCT);
 		__vdbe_add_op(v, OP_NotFound, param, (addr + 3));
 		__vdbe_add_op(v, OP_Delete, param, 0);
@@ -637,7 +646,7 @@ __select_inner_loop(parser, select, elist, src_table, num_cols, orderby_clause,
 		__vdbe_add_op(v, OP_Pop, 1, 0);
 		addr2 = __vdbe_add_op(v, OP_Goto, 0, 0);
 		if (orderby_clause) {
-			__push_onto_sorter(parser, v, orderby_clause);
+			__push_onto_sorter(parser, v, select, orderby_clause);
 		} else {
 			__vdbe_add_op(v, OP_String, 0, 0);
 			__vdbe_add_op(v, OP_PutStrKey, param, 0);
@@ -653,7 +662,7 @@ __select_inner_loop(parser, select, elist, src_table, num_cols, orderby_clause,
 	case SRT_Mem:
 		DBSQL_ASSERT(num_cols == 1);
 		if (orderby_clause) {
-			__push_onto_sorter(parser, v, orderby_clause);
+			__push_onto_sorter(parser, v, select, orderby_clause);
 		} else {
 			__vdbe_add_op(v, OP_MemStore, param, 1);
 			__vdbe_add_op(v, OP_Goto, 0, brk);
@@ -667,7 +676,7 @@ __select_inner_loop(parser, select, elist, src_table, num_cols, orderby_clause,
 	case SRT_Sorter:
 		if (orderby_clause) {
 			__vdbe_add_op(v, OP_SortMakeRec, num_cols, 0);
-			__push_onto_sorter(parser, v, orderby_clause);
+			__push_onto_sorter(parser, v, select, orderby_clause);
 		} else {
 			DBSQL_ASSERT(dest == SRT_Callback);
 			__vdbe_add_op(v, OP_Callback, num_cols, 0);
@@ -682,7 +691,7 @@ __select_inner_loop(parser, select, elist, src_table, num_cols, orderby_clause,
 	case SRT_Subroutine:
 		if (orderby_clause) {
 			__vdbe_add_op(v, OP_MakeRecord, num_cols, 0);
-			__push_onto_sorter(parser, v, orderby_clause);
+			__push_onto_sorter(parser, v, select, orderby_clause);
 		} else {
 			__vdbe_add_op(v, OP_Gosub, 0, param);
 		}
@@ -1385,6 +1394,10 @@ __match_orderby_to_column(parser, select, orderby_clause, table_idx,
  *	necessary.  If an error occurs, return NULL and leave a message
  *	in parser.
  *
+ *	A new program starts with an OP_Goto to address 1.  It stays that
+ *	way, and the peephole pass drops it, unless __expr_code_prologue()
+ *	points it at a prologue.
+ *
  * PUBLIC: vdbe_t *__parser_get_vdbe __P((parser_t *));
  */
 vdbe_t *
@@ -1394,6 +1407,8 @@ __parser_get_vdbe(parser)
 	vdbe_t *v = parser->pVdbe;
 	if (v == 0) {
 		v = parser->pVdbe = __vdbe_create(parser->db);
+		if (v != 0)
+			__vdbe_add_op(v, OP_Goto, 0, 1);
 	}
 	return v;
 }
@@ -2349,6 +2364,45 @@ __min_max_query(parser, select, dest, param)
 	return 1;
 }
 
+/*
+ * __select_agg_step --
+ *	Generate code that runs the step function of each aggregate
+ *	function of a SELECT on the current aggregator.  If 'args_p' is
+ *	true the code computes the arguments of the functions, otherwise
+ *	they must be on the stack already, with the first function's on
+ *	top.
+ *
+ * STATIC: static void __select_agg_step __P((parser_t *, vdbe_t *, int));
+ */
+static void
+__select_agg_step(parser, v, args_p)
+	parser_t *parser;
+	vdbe_t *v;
+	int args_p;
+{
+	expr_t *e;
+	int i, j;
+
+	for (i = 0; i < parser->nAgg; i++) {
+		if (!parser->aAgg[i].isAgg)
+			continue;
+		e = parser->aAgg[i].pExpr;
+		DBSQL_ASSERT(e->op == TK_AGG_FUNCTION);
+		if (args_p && e->pList) {
+			for(j = 0; j < e->pList->nExpr; j++) {
+				__expr_code(parser, e->pList->a[j].pExpr);
+			}
+		}
+		__vdbe_add_op(v, OP_Integer, i, 0);
+		__vdbe_add_op(v, OP_AggFunc, 0,
+			      (e->pList ? e->pList->nExpr : 0));
+		DBSQL_ASSERT(parser->aAgg[i].pFunc != 0);
+		DBSQL_ASSERT(parser->aAgg[i].pFunc->xStep != 0);
+		__vdbe_change_p3(v, -1, (char*)parser->aAgg[i].pFunc,
+				 P3_POINTER);
+	}
+}
+
 /*
  * __select --
  *	Generate code for the given SELECT statement.
@@ -2440,8 +2494,8 @@ int __select(parser, select, dest, param, parent, parent_tab, parent_agg_p)
 	const char *saveauth_context;
 	int need_restore_context_p;
 	func_def_t *func;
-	int lbl1;
-	int endagg, startagg;
+	int lbl1, lbl2, lbl3, lbl4;
+	int endagg, startagg, aggdone, aggrow, nval, nset;
 
 	if (parser->rc == ENOMEM || parser->nErr || select == 0)
 		return 1;
@@ -2802,40 +2856,42 @@ int __select(parser, select, dest, param, parent, parent_tab, parent_agg_p)
 		 * aggregate processing.  
 		 */
 		if (groupby_clause) {
-			for (i = 0; i < groupby_clause->nExpr; i++) {
-				__expr_code(parser,
-					    groupby_clause->a[i].pExpr);
+			/*
+			 * Push all the aggregator needs of the row: the
+			 * arguments of the aggregate functions, the last
+			 * function's first, then the other expressions and
+			 * the key on top.  The subroutine at 'aggrow' takes
+			 * it from there, for these rows and for those that
+			 * AggFocus spills and AggReplay reads back.
+			 */
+			nval = nset = 0;
+			for (i = parser->nAgg - 1; i >= 0; i--) {
+				e = parser->aAgg[i].pExpr;
+				if (!parser->aAgg[i].isAgg || e->pList == 0)
+					continue;
+				for(j = 0; j < e->pList->nExpr; j++) {
+					__expr_code(parser,
+						    e->pList->a[j].pExpr);
+				}
+				nval += e->pList->nExpr;
 			}
-			__vdbe_add_op(v, OP_MakeKey, groupby_clause->nExpr, 0);
-			__add_key_type(v, groupby_clause);
-			lbl1 = __vdbe_make_label(v);
-			__vdbe_add_op(v, OP_AggFocus, 0, lbl1);
 			for (i = 0; i < parser->nAgg; i++) {
 				if (parser->aAgg[i].isAgg)
 					continue;
 				__expr_code(parser, parser->aAgg[i].pExpr);
-				__vdbe_add_op(v, OP_AggSet, 0, i);
+				nset++;
 			}
-			__vdbe_resolve_label(v, lbl1);
-		}
-		for (i = 0; i < parser->nAgg; i++) {
-			if (!parser->aAgg[i].isAgg)
-				continue;
-			e = parser->aAgg[i].pExpr;
-			DBSQL_ASSERT(e->op == TK_AGG_FUNCTION);
-			if (e->pList) {
-				for(j = 0; j < e->pList->nExpr; j++) {
-					__expr_code(parser,
-						    e->pList->a[j].pExpr);
-				}
+			nval += nset;
+			for (i = 0; i < groupby_clause->nExpr; i++) {
+				__expr_code(parser,
+					    groupby_clause->a[i].pExpr);
 			}
-			__vdbe_add_op(v, OP_Integer, i, 0);
-			__vdbe_add_op(v, OP_AggFunc, 0,
-				      (e->pList ? e->pList->nExpr : 0));
-			DBSQL_ASSERT(parser->aAgg[i].pFunc != 0);
-			DBSQL_ASSERT(parser->aAgg[i].pFunc->xStep != 0);
-			__vdbe_change_p3(v, -1, (char*)parser->aAgg[i].pFunc,
-					 P3_POINTER);
+			__vdbe_add_op(v, OP_MakeKey, groupby_clause->nExpr, 0);
+			__add_key_type(v, groupby_clause);
+			aggrow = __vdbe_make_label(v);
+			__vdbe_add_op(v, OP_Gosub, 0, aggrow);
+		} else {
+			__select_agg_step(parser, v, 1);
 		}
 	}
 
@@ -2850,7 +2906,36 @@ int __select(parser, select, dest, param, parent, parent_tab, parent_agg_p)
 	 */
 	if (agg_p) {
 		endagg = __vdbe_make_label(v);
-		startagg = __vdbe_add_op(v, OP_AggNext, 0, endagg);
+		aggdone = groupby_clause ? __vdbe_make_label(v) : endagg;
+		if (groupby_clause) {
+			/*
+			 * The subroutine that aggregates one row.  A row
+			 * whose group is new makes the group take its other
+			 * expressions, otherwise they are popped.
+			 */
+			lbl1 = __vdbe_make_label(v);
+			lbl2 = __vdbe_make_label(v);
+			lbl3 = __vdbe_make_label(v);
+			__vdbe_add_op(v, OP_Goto, 0, lbl3);
+			__vdbe_resolve_label(v, aggrow);
+			__vdbe_add_op(v, OP_AggFocus, nval + 1, lbl1);
+			for (i = parser->nAgg - 1; i >= 0; i--) {
+				if (!parser->aAgg[i].isAgg)
+					__vdbe_add_op(v, OP_AggSet, 0, i);
+			}
+			__vdbe_add_op(v, OP_Goto, 0, lbl2);
+			__vdbe_resolve_label(v, lbl1);
+			lbl4 = __vdbe_make_label(v);
+			__vdbe_add_op(v, OP_AggSkip, 0, lbl4);
+			if (nset > 0)
+				__vdbe_add_op(v, OP_Pop, nset, 0);
+			__vdbe_resolve_label(v, lbl2);
+			__select_agg_step(parser, v, 0);
+			__vdbe_resolve_label(v, lbl4);
+			__vdbe_add_op(v, OP_Return, 0, 0);
+			__vdbe_resolve_label(v, lbl3);
+		}
+		startagg = __vdbe_add_op(v, OP_AggNext, 0, aggdone);
 		parser->useAgg = 1;
 		if (having_clause) {
 			__expr_if_false(parser, having_clause, startagg, 1);
@@ -2861,6 +2946,18 @@ int __select(parser, select, dest, param, parent, parent_tab, parent_agg_p)
 			goto select_end;
 		}
 		__vdbe_add_op(v, OP_Goto, 0, startagg);
+		if (groupby_clause) {
+			/*
+			 * Aggregate the rows spilled for a later pass, one
+			 * partition at a time.
+			 */
+			__vdbe_resolve_label(v, aggdone);
+			__vdbe_add_op(v, OP_AggRescan, 0, endagg);
+			lbl1 = __vdbe_add_op(v, OP_AggReplay, nval + 1,
+					     startagg);
+			__vdbe_add_op(v, OP_Gosub, 0, aggrow);
+			__vdbe_add_op(v, OP_Goto, 0, lbl1);
+		}
 		__vdbe_resolve_label(v, endagg);
 		__vdbe_add_op(v, OP_Noop, 0, 0);
 		parser->useAgg = 0;
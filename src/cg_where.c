@@ -25,6 +25,21 @@
 #include "dbsql_config.h"
 #include "dbsql_int.h"
 
+/*
+ * A set of tables is a bitmask made of where_mask_t words in which bit i
+ * stands for the i-th entry of the FROM clause.  A join of no more than
+ * WHERE_MASK_BITS tables, by far the common case, needs a single word and
+ * the tests on masks below are then a single integer operation.
+ */
+typedef u_int32_t where_mask_t;
+#define WHERE_MASK_BITS 32
+
+/*
+ * A WHERE clause with no more than this many AND terms is analyzed
+ * without allocating any memory.
+ */
+#define WHERE_INLINE_TERMS 32
+
 /*
  * The query generator uses an array of instances of this structure to
  * help it analyze the subexpressions of the WHERE clause.  Each WHERE
@@ -40,25 +55,89 @@ typedef struct expr_info {
 	short int idxRight;     /* p->pRight is a column in this table
 				   number. -1 if p->pRight is not the
 				   column of any table */
-	unsigned prereqLeft;    /* Bitmask of tables referenced by p->pLeft */
-	unsigned prereqRight;   /* Bitmask of tables referenced by p->pRight */
-	unsigned prereqAll;     /* Bitmask of tables referenced by p */
+	where_mask_t *prereqLeft;  /* Tables referenced by p->pLeft */
+	where_mask_t *prereqRight; /* Tables referenced by p->pRight */
+	where_mask_t *prereqAll;   /* Tables referenced by p */
+	where_mask_t aPrereq[3];   /* The three masks when they fit in a
+				      single word */
 } expr_info_t;
 
 /*
- * An instance of the following structure keeps track of a mapping
- * between VDBE cursor numbers and bitmasks.  The VDBE cursor numbers
- * are small integers contained in src_list_item.iCursor and Expr.iTable
- * fields.  For any given WHERE clause, we want to track which cursors
- * are being used, so we assign a single bit in a 32-bit word to track
- * that cursor.  Then a 32-bit integer is able to show the set of all
- * cursors being used.
+ * An instance of the following structure keeps track of the mapping
+ * between VDBE cursor numbers and bits of a mask.  The VDBE cursor
+ * numbers are small integers contained in src_list_item.iCursor and
+ * Expr.iTable fields.  The cursor of the i-th FROM clause entry is
+ * given bit i.
  */
 typedef struct expr_mask_set {
-	int n;          /* Number of assigned cursor values */
-	int ix[32];     /* Cursor assigned to each bit */
+	src_list_t *pTabList;   /* The FROM clause */
+	int nWord;              /* Number of words in each mask */
 } expr_mask_set_t;
 
+/*
+ * __mask_bit_set --
+ *	Add bit B to the mask M.
+ */
+#define __mask_bit_set(M, B)						\
+	((M)[(B) / WHERE_MASK_BITS] |=					\
+	    (where_mask_t)1 << ((B) % WHERE_MASK_BITS))
+
+/*
+ * __mask_within --
+ *	True if every table in mask A is also in mask B.
+ */
+#define __mask_within(S, A, B) ((S)->nWord == 1 ?			\
+	((A)[0] & ~(B)[0]) == 0 : __mask_test((S), (A), (B), 0))
+
+/*
+ * __mask_disjoint --
+ *	True if masks A and B have no table in common.
+ */
+#define __mask_disjoint(S, A, B) ((S)->nWord == 1 ?			\
+	((A)[0] & (B)[0]) == 0 : __mask_test((S), (A), (B), 1))
+
+/*
+ * __mask_test --
+ *	The test behind __mask_within() and __mask_disjoint() for masks
+ *	of more than one word.
+ *
+ * STATIC: static int __mask_test __P((expr_mask_set_t *, where_mask_t *,
+ * STATIC:                        where_mask_t *, int));
+ */
+static int
+__mask_test(mask_set, a, b, disjoint)
+	expr_mask_set_t *mask_set;
+	where_mask_t *a;
+	where_mask_t *b;
+	int disjoint;
+{
+	int i;
+	for (i = 0; i < mask_set->nWord; i++) {
+		if ((a[i] & (disjoint ? b[i] : ~b[i])) != 0)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * __expr_count_terms --
+ *	Return the number of subexpressions separated by AND operators
+ *	in 'expr'.
+ *
+ * STATIC: static int __expr_count_terms __P((expr_t *));
+ */
+static int
+__expr_count_terms(expr)
+	expr_t *expr;
+{
+	if (expr == 0)
+		return 0;
+	if (expr->op != TK_AND)
+		return 1;
+	return __expr_count_terms(expr->pLeft) +
+		__expr_count_terms(expr->pRight);
+}
+
 /* __expr_split --
  *	This routine is used to divide the WHERE expression into subexpressions
  *	separated by the AND operator.
@@ -94,41 +173,31 @@ __expr_split(num_slot, slot, expr)
 }
 
 /*
- * __get_cursor_bitmask --
- *	Return the bitmask for the given cursor.  Assign a new bitmask
- *	if this is the first time the cursor has been seen.
+ * __get_cursor_bit --
+ *	Return the bit of the mask that stands for the given cursor.
+ *	Cursors outside of the FROM clause, such as the new.* and old.*
+ *	tables of a trigger, do not change while the loops run and -1 is
+ *	returned for them.
  *
- * STATIC: static int __get_cursor_bitmask __P((expr_mask_set_t *, int));
+ * STATIC: static int __get_cursor_bit __P((expr_mask_set_t *, int));
  */
 static int
-__get_cursor_bitmask(mask_set, cursor)
+__get_cursor_bit(mask_set, cursor)
 	expr_mask_set_t *mask_set;
 	int cursor;
 {
 	int i;
-	for (i = 0; i < mask_set->n; i++) {
-		if (mask_set->ix[i] == cursor)
-			return (1 << i);
+	for (i = 0; i < mask_set->pTabList->nSrc; i++) {
+		if (mask_set->pTabList->a[i].iCursor == cursor)
+			return i;
 	}
-	if (i == mask_set->n && i < ARRAY_SIZE(mask_set->ix)) {
-		mask_set->n++;
-		mask_set->ix[i] = cursor;
-		return (1 << i);
-	}
-	return 0;
+	return -1;
 }
 
-/*
- * __free_mask_set --
- *	Destroy an expression mask set.  This is a no-op.
- */
-#define __free_mask_set(P)
-
 /*
  * __expr_table_usage --
- *	This routine walks (recursively) an expression tree and generates
- *	a bitmask indicating which tables are used in that expression
- *	tree.
+ *	This routine walks (recursively) an expression tree and adds the
+ *	tables used in that expression tree to the mask 'mask'.
  *
  *	In order for this routine to work, the calling function must have
  *	previously invoked __expr_resolve_ids() on the expression.  See
@@ -137,33 +206,35 @@ __get_cursor_bitmask(mask_set, cursor)
  *	sets their opcodes to TK_COLUMN and their expr_t.iTable fields to
  *	the VDBE cursor number of the table.
  *
- * STATIC: static int __expr_table_usage __P((expr_mask_set_t *, expr_t *));
+ * STATIC: static void __expr_table_usage __P((expr_mask_set_t *, expr_t *,
+ * STATIC:                                where_mask_t *));
  */
-static int
-__expr_table_usage(mask_set, p)
+static void
+__expr_table_usage(mask_set, p, mask)
 	expr_mask_set_t *mask_set;
 	expr_t *p;
+	where_mask_t *mask;
 {
 	int i;
-	unsigned int mask = 0;
 	if(p == 0)
-		return 0;
+		return;
 	if (p->op == TK_COLUMN) {
-		return __get_cursor_bitmask(mask_set, p->iTable);
+		if ((i = __get_cursor_bit(mask_set, p->iTable)) >= 0)
+			__mask_bit_set(mask, i);
+		return;
 	}
 	if (p->pRight) {
-		mask = __expr_table_usage(mask_set, p->pRight);
+		__expr_table_usage(mask_set, p->pRight, mask);
 	}
 	if (p->pLeft) {
-		mask |= __expr_table_usage(mask_set, p->pLeft);
+		__expr_table_usage(mask_set, p->pLeft, mask);
 	}
 	if (p->pList) {
 		for(i = 0; i < p->pList->nExpr; i++) {
-			mask |= __expr_table_usage(mask_set,
-						   p->pList->a[i].pExpr);
+			__expr_table_usage(mask_set, p->pList->a[i].pExpr,
+					   mask);
 		}
 	}
-	return mask;
 }
 
 /*
@@ -194,9 +265,9 @@ __allowed_op(op)
 /*
  * __expr_analyze --
  *	The input to this routine is an expr_info_t structure with only the
- *	"p" field filled in.  The job of this routine is to analyze the
- *	subexpression and populate all the other fields of the expr_info_t
- *	structure.
+ *	"p" field filled in and its three masks pointing at cleared words.
+ *	The job of this routine is to analyze the subexpression and
+ *	populate all the other fields of the expr_info_t structure.
  *
  * STATIC: static void expr_analyze __P((expr_mask_set_t *, expr_info_t *));
  */
@@ -206,14 +277,14 @@ __expr_analyze(mask_set, info)
 	expr_info_t *info;
 {
 	expr_t *expr = info->p;
-	info->prereqLeft = __expr_table_usage(mask_set, expr->pLeft);
-	info->prereqRight = __expr_table_usage(mask_set, expr->pRight);
-	info->prereqAll = __expr_table_usage(mask_set, expr);
+	__expr_table_usage(mask_set, expr->pLeft, info->prereqLeft);
+	__expr_table_usage(mask_set, expr->pRight, info->prereqRight);
+	__expr_table_usage(mask_set, expr, info->prereqAll);
 	info->indexable = 0;
 	info->idxLeft = -1;
 	info->idxRight = -1;
 	if (__allowed_op(expr->op) &&
-	    (info->prereqRight & info->prereqLeft) == 0) {
+	    __mask_disjoint(mask_set, info->prereqRight, info->prereqLeft)) {
 		if (expr->pRight && expr->pRight->op == TK_COLUMN) {
 			info->idxRight = expr->pRight->iTable;
 			info->indexable = 1;
@@ -343,6 +414,1015 @@ static index_t *__find_sorting_index(table, base, orderby_clause,
 	return match;
 }
 
+/*
+ * __where_term_op --
+ *	If the WHERE clause term 'info' constrains a column of the table
+ *	with cursor 'cur' using only tables in 'loop_mask' on the other
+ *	side, return the operator as if that column were on the left and
+ *	store the column number in *col_p.  If 'val_p' is not NULL the
+ *	other side is stored in *val_p.  Otherwise return 0.
+ *
+ * STATIC: static int __where_term_op __P((expr_mask_set_t *, expr_info_t *,
+ * STATIC:                            int, where_mask_t *, int *, expr_t **));
+ */
+static int
+__where_term_op(mask_set, info, cur, loop_mask, col_p, val_p)
+	expr_mask_set_t *mask_set;
+	expr_info_t *info;
+	int cur;
+	where_mask_t *loop_mask;
+	int *col_p;
+	expr_t **val_p;
+{
+	if (info->idxLeft == cur &&
+	    __mask_within(mask_set, info->prereqRight, loop_mask)) {
+		*col_p = info->p->pLeft->iColumn;
+		if (val_p)
+			*val_p = info->p->pRight;
+		return info->p->op;
+	}
+	if (info->idxRight == cur &&
+	    __mask_within(mask_set, info->prereqLeft, loop_mask)) {
+		*col_p = info->p->pRight->iColumn;
+		if (val_p)
+			*val_p = info->p->pLeft;
+		switch(info->p->op) {
+		case TK_LE: return TK_GE;
+		case TK_LT: return TK_GT;
+		case TK_GE: return TK_LE;
+		case TK_GT: return TK_LT;
+		case TK_EQ: return TK_EQ;
+		}
+	}
+	return 0;
+}
+
+/*
+ * __where_index_rows --
+ *	Estimate how many of the 'rows' rows of the table with cursor 'cur'
+ *	a lookup in its index 'idx' delivers when the tables in 'loop_mask'
+ *	are positioned by outer loops.  Returns a negative number if no
+ *	term of the WHERE clause can use 'idx'.
+ *
+ *	The statistics gathered by ANALYZE, or the storage manager's
+ *	estimates for literal values, are used when there are any.
+ *	Otherwise each column of the index fixed by an == constraint is
+ *	assumed to keep one row in ten and a range bound one row in four.
+ *	A unique index fixed on every column delivers a single row.
+ *
+ * STATIC: static double __where_index_rows __P((DBSQL *, expr_mask_set_t *,
+ * STATIC:      expr_info_t *, int, int, where_mask_t *, index_t *, double));
+ */
+static double
+__where_index_rows(dbp, mask_set, wc_exprs, num_expr, cur, loop_mask, idx,
+		   rows)
+	DBSQL *dbp;
+	expr_mask_set_t *mask_set;
+	expr_info_t *wc_exprs;
+	int num_expr;
+	int cur;
+	where_mask_t *loop_mask;
+	index_t *idx;
+	double rows;
+{
+	int j, k, col, op, num_eq, eq_mask, lt_p, gt_p, in_p, lt_op, gt_op;
+	double out, f, r;
+	expr_t *val, *eq_val, *lt_val, *gt_val;
+
+	if (idx->nColumn > 32)
+		return -1;
+	eq_mask = lt_p = gt_p = in_p = lt_op = gt_op = 0;
+	eq_val = lt_val = gt_val = 0;
+	for (j = 0; j < num_expr; j++) {
+		op = __where_term_op(mask_set, &wc_exprs[j], cur, loop_mask,
+				     &col, &val);
+		if (op == 0 || col < 0)
+			continue;
+		for (k = 0; k < idx->nColumn; k++) {
+			if (idx->aiColumn[k] == col)
+				break;
+		}
+		if (k == idx->nColumn)
+			continue;
+		switch(op) {
+		case TK_IN:
+			if (k == 0)
+				in_p = 1;
+			break;
+		case TK_EQ:
+			eq_mask |= 1 << k;
+			if (k == 0)
+				eq_val = val;
+			break;
+		case TK_LE: /* FALLTHROUGH */
+		case TK_LT:
+			lt_p |= 1 << k;
+			if (k == 0) {
+				lt_op = op;
+				lt_val = val;
+			}
+			break;
+		default:
+			gt_p |= 1 << k;
+			if (k == 0) {
+				gt_op = op;
+				gt_val = val;
+			}
+			break;
+		}
+	}
+	for (num_eq = 0; num_eq < idx->nColumn; num_eq++) {
+		if ((eq_mask & (1 << num_eq)) == 0)
+			break;
+	}
+	if (num_eq == 0 && (lt_p & 1) == 0 && (gt_p & 1) == 0) {
+		if (!in_p)
+			return -1;
+		return idx->aiRowEst ? idx->aiRowEst[1] : rows / 10;
+	}
+
+	out = (num_eq > 0) ?
+		__analyze_eq_rows(dbp, idx, num_eq, eq_val, rows) : rows;
+	if (out < 0) {
+		for (out = rows, k = 0; k < num_eq; k++)
+			out /= 10;
+	}
+	if (num_eq == idx->nColumn && idx->onError != OE_None)
+		out = 1;
+
+	f = 1;
+	if (lt_p & (1 << num_eq))
+		f /= 4;
+	if (gt_p & (1 << num_eq))
+		f /= 4;
+	if (num_eq == 0 && (lt_val || gt_val) &&
+	    (r = __analyze_range_frac(dbp, idx, lt_op, lt_val, gt_op,
+				      gt_val)) >= 0)
+		f = r;
+	out *= f;
+	return (out < 1) ? 1 : out;
+}
+
+/*
+ * __where_skip_cost --
+ *	Return the estimated cost of a skip-scan of index 'idx' of the table
+ *	with cursor 'cur', or a negative number if it cannot be skip-scanned.
+ *	A skip-scan is for an index whose left-most column no term of the
+ *	WHERE clause constrains.  For each distinct value of that column it
+ *	seeks to the range that the terms on the following columns select
+ *	and then skips past the value.  It only pays when ANALYZE has found
+ *	few distinct values, at least DBSQL_SKIP_SCAN_MIN entries for each.
+ *	The rows it delivers are stored in *rows_p and the score of the
+ *	index, as __where_begin() computes it but counting columns from the
+ *	second one, in *score_p.
+ *
+ * STATIC: static double __where_skip_cost __P((expr_mask_set_t *,
+ * STATIC:      expr_info_t *, int, int, where_mask_t *, index_t *, double,
+ * STATIC:      double *, int *));
+ */
+static double
+__where_skip_cost(mask_set, wc_exprs, num_expr, cur, loop_mask, idx, rows,
+		  rows_p, score_p)
+	expr_mask_set_t *mask_set;
+	expr_info_t *wc_exprs;
+	int num_expr;
+	int cur;
+	where_mask_t *loop_mask;
+	index_t *idx;
+	double rows;
+	double *rows_p;
+	int *score_p;
+{
+	int j, k, op, col, num_eq, score, eq_mask, lt_mask, gt_mask;
+	double groups, out;
+
+	if (idx->aiRowEst == 0 || idx->nColumn < 2 || idx->nColumn > 32 ||
+	    idx->aiRowEst[1] < DBSQL_SKIP_SCAN_MIN)
+		return -1;
+	eq_mask = lt_mask = gt_mask = 0;
+	for (j = 0; j < num_expr; j++) {
+		op = __where_term_op(mask_set, &wc_exprs[j], cur, loop_mask,
+				     &col, 0);
+		if (op == 0 || col < 0)
+			continue;
+		for (k = 0; k < idx->nColumn; k++) {
+			if (idx->aiColumn[k] == col)
+				break;
+		}
+		if (k == 0)
+			return -1;
+		if (k == idx->nColumn)
+			continue;
+		switch(op) {
+		case TK_IN:
+			break;
+		case TK_EQ:
+			eq_mask |= 1 << k;
+			break;
+		case TK_LE: /* FALLTHROUGH */
+		case TK_LT:
+			lt_mask |= 1 << k;
+			break;
+		default:
+			gt_mask |= 1 << k;
+			break;
+		}
+	}
+	for (num_eq = 1; num_eq < idx->nColumn; num_eq++) {
+		if ((eq_mask & (1 << num_eq)) == 0)
+			break;
+	}
+	score = (num_eq - 1) * 8;
+	if (lt_mask & (1 << num_eq))
+		score++;
+	if (gt_mask & (1 << num_eq))
+		score += 2;
+	if (score == 0)
+		return -1;
+
+	/*
+	 * Each distinct value of the left-most column keeps the entries
+	 * that share the values of the == columns with one of them.
+	 */
+	groups = (double)idx->aiRowEst[0] / idx->aiRowEst[1];
+	out = rows * idx->aiRowEst[num_eq] / idx->aiRowEst[1];
+	if (score & 1)
+		out /= 4;
+	if (score & 2)
+		out /= 4;
+	*rows_p = (out < 1) ? 1 : out;
+	*score_p = score;
+	return *rows_p * 2 + groups * 2;
+}
+
+/*
+ * __where_uses_cursor --
+ *	Return TRUE if the expression 'p' refers to a column of the table
+ *	with cursor 'cur'.
+ *
+ * STATIC: static int __where_uses_cursor __P((expr_t *, int));
+ */
+static int
+__where_uses_cursor(p, cur)
+	expr_t *p;
+	int cur;
+{
+	int i;
+	if (p == 0)
+		return 0;
+	if (p->op == TK_COLUMN)
+		return (p->iTable == cur);
+	if (__where_uses_cursor(p->pLeft, cur) ||
+	    __where_uses_cursor(p->pRight, cur))
+		return 1;
+	if (p->pList) {
+		for (i = 0; i < p->pList->nExpr; i++) {
+			if (__where_uses_cursor(p->pList->a[i].pExpr, cur))
+				return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * __where_or_term --
+ *	Return TRUE if 'expr', a branch of an OR, has the form
+ *	"column = value" where the column is the ROWID or the left-most
+ *	column of an index of 'table', the table with cursor 'cur', and
+ *	the value does not depend on that table.  The index, NULL for the
+ *	ROWID, is stored in *idx_p and the value in *val_p.
+ *
+ * STATIC: static int __where_or_term __P((expr_t *, int, table_t *,
+ * STATIC:                            index_t **, expr_t **));
+ */
+static int
+__where_or_term(expr, cur, table, idx_p, val_p)
+	expr_t *expr;
+	int cur;
+	table_t *table;
+	index_t **idx_p;
+	expr_t **val_p;
+{
+	expr_t *col, *val;
+	index_t *idx;
+
+	if (expr->op != TK_EQ)
+		return 0;
+	if (expr->pLeft->op == TK_COLUMN && expr->pLeft->iTable == cur) {
+		col = expr->pLeft;
+		val = expr->pRight;
+	} else if (expr->pRight->op == TK_COLUMN &&
+		   expr->pRight->iTable == cur) {
+		col = expr->pRight;
+		val = expr->pLeft;
+	} else {
+		return 0;
+	}
+	if (__where_uses_cursor(val, cur))
+		return 0;
+	*val_p = val;
+	*idx_p = 0;
+	if (col->iColumn < 0)
+		return 1;
+	for (idx = table->pIndex; idx; idx = idx->pNext) {
+		if (idx->aiColumn[0] == col->iColumn) {
+			*idx_p = idx;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * __where_or_usable --
+ *	Return TRUE if the WHERE clause term 'info' is an OR that refers to
+ *	no table other than the one with bit 'bit' and those in 'loop_mask'
+ *	and that may limit the rows the loop over that table visits.
+ *
+ * STATIC: static int __where_or_usable __P((expr_mask_set_t *,
+ * STATIC:                          expr_info_t *, int, where_mask_t *));
+ */
+static int
+__where_or_usable(mask_set, info, bit, loop_mask)
+	expr_mask_set_t *mask_set;
+	expr_info_t *info;
+	int bit;
+	where_mask_t *loop_mask;
+{
+	where_mask_t m;
+	int i;
+
+	if (info->p->op != TK_OR)
+		return 0;
+
+	/*
+	 * The rows of the right table of a LEFT JOIN that fail the WHERE
+	 * clause still count as matches, only its ON clause may be used.
+	 */
+	if (bit > 0 &&
+	    (mask_set->pTabList->a[bit - 1].jointype & JT_LEFT) != 0 &&
+	    !ExprHasProperty(info->p, EP_FromJoin))
+		return 0;
+	for (i = 0; i < mask_set->nWord; i++) {
+		m = info->prereqAll[i] & ~loop_mask[i];
+		if (i == bit / WHERE_MASK_BITS)
+			m &= ~((where_mask_t)1 << (bit % WHERE_MASK_BITS));
+		if (m != 0)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * __where_or_rows --
+ *	Estimate how many of the 'rows' rows of 'table', the table with
+ *	cursor 'cur', are found by looking up each branch of the OR 'expr'.
+ *	A row found by two branches counts twice.  The number of branches
+ *	that are looked up in an index is added to *nidx_p.  Returns a
+ *	negative number if some branch cannot be looked up.
+ *
+ * STATIC: static double __where_or_rows __P((DBSQL *, expr_t *, int,
+ * STATIC:                               table_t *, double, int *));
+ */
+static double
+__where_or_rows(dbp, expr, cur, table, rows, nidx_p)
+	DBSQL *dbp;
+	expr_t *expr;
+	int cur;
+	table_t *table;
+	double rows;
+	int *nidx_p;
+{
+	index_t *idx;
+	expr_t *val;
+	double l, r;
+
+	if (expr->op == TK_OR) {
+		if ((l = __where_or_rows(dbp, expr->pLeft, cur, table, rows,
+					 nidx_p)) < 0 ||
+		    (r = __where_or_rows(dbp, expr->pRight, cur, table, rows,
+					 nidx_p)) < 0)
+			return -1;
+		return l + r;
+	}
+	if (!__where_or_term(expr, cur, table, &idx, &val))
+		return -1;
+	if (idx == 0)
+		return 1;
+	(*nidx_p)++;
+	if (idx->nColumn == 1 && idx->onError != OE_None)
+		return 1;
+	r = __analyze_eq_rows(dbp, idx, 1, val, rows);
+	return (r < 0) ? rows / 10 : r;
+}
+
+/*
+ * __where_loop_cost --
+ *	Estimate what it costs to run the loop over the FROM clause entry
+ *	'item' once, when the tables in 'loop_mask' are already positioned
+ *	by outer loops.  The cost is in rows visited.  The number of rows
+ *	the loop is expected to produce is written into *rows_p.
+ *
+ *	The table is assumed to hold 'rows' rows.  A range bound on the
+ *	ROWID keeps one row in four and the rows an index delivers are
+ *	estimated by __where_index_rows().  Reaching a row through an index
+ *	costs twice as much as reaching it by its ROWID.  So does reaching
+ *	the rows found by the branches of an OR, see __where_or_code().  A
+ *	skip-scan also pays a seek for each value it skips over, see
+ *	__where_skip_cost().
+ *
+ * STATIC: static double __where_loop_cost __P((DBSQL *, expr_mask_set_t *,
+ * STATIC:                   expr_info_t *, int, struct src_list_item *,
+ * STATIC:                   double, where_mask_t *, double *));
+ */
+static double
+__where_loop_cost(dbp, mask_set, wc_exprs, num_expr, item, rows, loop_mask,
+		  rows_p)
+	DBSQL *dbp;
+	expr_mask_set_t *mask_set;
+	expr_info_t *wc_exprs;
+	int num_expr;
+	struct src_list_item *item;
+	double rows;
+	where_mask_t *loop_mask;
+	double *rows_p;
+{
+	int cur = item->iCursor;
+	int j, n, bit, col, op, lt_p, gt_p;
+	double out, cost, best_out, best_cost;
+	index_t *idx;
+
+	best_out = rows;
+	best_cost = rows;
+
+	/* Lookups and ranges on the ROWID. */
+	lt_p = gt_p = 0;
+	for (j = 0; j < num_expr; j++) {
+		op = __where_term_op(mask_set, &wc_exprs[j], cur, loop_mask,
+				     &col, 0);
+		if (op == 0 || col >= 0)
+			continue;
+		if (op == TK_EQ || op == TK_IN) {
+			*rows_p = 1;
+			return 1;
+		}
+		if (op == TK_LT || op == TK_LE)
+			lt_p = 1;
+		else
+			gt_p = 1;
+	}
+	if (lt_p || gt_p) {
+		out = rows / ((lt_p + gt_p) * 4);
+		if (out < best_cost) {
+			best_out = out;
+			best_cost = out;
+		}
+	}
+
+	/* Each usable index. */
+	for (idx = item->pTab->pIndex; idx; idx = idx->pNext) {
+		out = __where_index_rows(dbp, mask_set, wc_exprs, num_expr,
+					 cur, loop_mask, idx, rows);
+		if (out >= 0)
+			cost = out * 2;
+		else if ((cost = __where_skip_cost(mask_set, wc_exprs,
+				    num_expr, cur, loop_mask, idx, rows, &out,
+				    &n)) < 0)
+			continue;
+		if (cost < best_cost) {
+			best_out = out;
+			best_cost = cost;
+		}
+	}
+
+	/* An OR of lookups on the ROWID or on indices. */
+	bit = __get_cursor_bit(mask_set, cur);
+	for (j = 0; j < num_expr; j++) {
+		if (!__where_or_usable(mask_set, &wc_exprs[j], bit, loop_mask))
+			continue;
+		n = 0;
+		out = __where_or_rows(dbp, wc_exprs[j].p, cur, item->pTab,
+				      rows, &n);
+		if (out >= 0 && out * 2 < best_cost) {
+			best_out = out;
+			best_cost = out * 2;
+		}
+	}
+
+	/*
+	 * Without an index, an == term joining an inner table to the outer
+	 * loops is answered from a hash table and a range term from an
+	 * automatic index, both built only once.
+	 */
+	if (best_out == rows) {
+		for (j = 0; j < num_expr; j++) {
+			if (__mask_disjoint(mask_set, wc_exprs[j].prereqAll,
+					    loop_mask))
+				continue;
+			op = __where_term_op(mask_set, &wc_exprs[j], cur,
+					     loop_mask, &col, 0);
+			if (op == 0 || op == TK_IN || col < 0)
+				continue;
+			out = rows / ((op == TK_EQ) ? 10 : 4);
+			if (out < best_out) {
+				best_out = out;
+				best_cost = out * 2;
+			}
+		}
+	}
+	*rows_p = best_out;
+	return best_cost;
+}
+
+/*
+ * __where_order --
+ *	Choose the order in which the loops over the FROM clause entries
+ *	are nested and record it in where_info->a[].iFrom.  The estimated
+ *	cost of an order is the sum over every loop of the cost of one run
+ *	of that loop times the number of rows produced by the loops outside
+ *	of it.  All orders are considered for small joins, larger ones are
+ *	built by repeatedly adding the loop that is cheapest to add.
+ *
+ *	A table on the right of a LEFT JOIN cannot move, nothing before it
+ *	in the FROM clause may move after it and nothing after it may move
+ *	before it.  If the first table can deliver rows in ORDER BY order
+ *	it stays the outer loop.  The FROM clause order is kept unless the
+ *	best order is estimated to be at least twice as cheap, the cost
+ *	model is much too crude to trust a smaller difference.
+ *	from_rows[i] is the number of rows in the i-th FROM clause entry.
+ *
+ * STATIC: static void __where_order __P((where_info_t *, expr_mask_set_t *,
+ * STATIC:                  expr_info_t *, int, double *, expr_list_t *));
+ */
+static void
+__where_order(where_info, mask_set, wc_exprs, num_expr, from_rows,
+	      orderby_clause)
+	where_info_t *where_info;
+	expr_mask_set_t *mask_set;
+	expr_info_t *wc_exprs;
+	int num_expr;
+	double *from_rows;
+	expr_list_t *orderby_clause;
+{
+	src_list_t *tab_list = where_info->pTabList;
+	DBSQL *dbp = where_info->pParse->db;
+	int n = tab_list->nSrc;
+	int i, t, best, barrier, sorted, lead;
+	unsigned int s, all, placed;
+	where_mask_t loop_base[1];
+	int req_base[WHERE_MASK_BITS];
+	int order_base[WHERE_MASK_BITS];
+	char done_base[WHERE_MASK_BITS];
+	where_mask_t *loop_mask;
+	int *req, *order;
+	char *done, *buf;
+	double dp_cost[1 << DBSQL_JOIN_DP_MAX];
+	double dp_rows[1 << DBSQL_JOIN_DP_MAX];
+	signed char dp_last[1 << DBSQL_JOIN_DP_MAX];
+	double cost, rows, out, c, from_cost, best_cost, best_rows;
+
+	for (i = 0; i < n; i++)
+		where_info->a[i].iFrom = i;
+	if (n < 2)
+		return;
+	buf = 0;
+	loop_mask = loop_base;
+	req = req_base;
+	order = order_base;
+	done = done_base;
+	if (n > WHERE_MASK_BITS) {
+		if (__dbsql_malloc(dbp, mask_set->nWord * sizeof(where_mask_t)
+			    + n * (2 * sizeof(int) + 1), &buf) == ENOMEM)
+			return;
+		loop_mask = (where_mask_t *)buf;
+		req = (int *)&loop_mask[mask_set->nWord];
+		order = &req[n];
+		done = (char *)&order[n];
+	}
+
+	/*
+	 * Work out how many of the leading FROM clause entries must come
+	 * before each table.
+	 */
+	sorted = (orderby_clause != 0 &&
+	    __find_sorting_index(tab_list->a[0].pTab, tab_list->a[0].iCursor,
+				 orderby_clause, 0, 0, 0) != 0);
+	barrier = -1;
+	for (i = 0; i < n; i++) {
+		if (i > 0 && (tab_list->a[i - 1].jointype & JT_LEFT) != 0)
+			barrier = i;
+		req[i] = 0;
+		if (barrier >= 0)
+			req[i] = (i != barrier) ? barrier + 1 : barrier;
+		if (i > 0 && sorted && req[i] == 0)
+			req[i] = 1;
+	}
+
+	/* The cost of the order written in the FROM clause. */
+	from_cost = 0;
+	rows = 1;
+	memset(loop_mask, 0, mask_set->nWord * sizeof(where_mask_t));
+	for (i = 0; i < n; i++) {
+		c = __where_loop_cost(dbp, mask_set, wc_exprs, num_expr,
+				      &tab_list->a[i], from_rows[i], loop_mask,
+				      &out);
+		from_cost += rows * c;
+		rows *= out;
+		__mask_bit_set(loop_mask, i);
+	}
+
+	if (n <= DBSQL_JOIN_DP_MAX) {
+		/*
+		 * dp_cost[s] is the cheapest way to nest the set of tables
+		 * 's' as the outer loops, dp_last[s] is the innermost table
+		 * of that nesting.  A set of tables this small is its own
+		 * single word mask.
+		 */
+		all = (1U << n) - 1;
+		for (s = 0; s <= all; s++)
+			dp_cost[s] = -1;
+		dp_cost[0] = 0;
+		dp_rows[0] = 1;
+		for (s = 0; s < all; s++) {
+			if (dp_cost[s] < 0)
+				continue;
+			loop_mask[0] = s;
+			for (t = 0; t < n; t++) {
+				if ((s & (1U << t)) ||
+				    (((1U << req[t]) - 1) & ~s) != 0)
+					continue;
+				c = __where_loop_cost(dbp, mask_set, wc_exprs,
+					      num_expr, &tab_list->a[t],
+					      from_rows[t], loop_mask, &out);
+				cost = dp_cost[s] + dp_rows[s] * c;
+				placed = s | (1U << t);
+				if (dp_cost[placed] < 0 ||
+				    cost < dp_cost[placed]) {
+					dp_cost[placed] = cost;
+					dp_rows[placed] = dp_rows[s] * out;
+					dp_last[placed] = t;
+				}
+			}
+		}
+		best_cost = dp_cost[all];
+		for (s = all, i = n - 1; i >= 0; i--) {
+			order[i] = dp_last[s];
+			s &= ~(1U << dp_last[s]);
+		}
+	} else {
+		/*
+		 * 'lead' is the number of leading FROM clause entries that
+		 * have all been placed.
+		 */
+		best_cost = 0;
+		rows = 1;
+		lead = 0;
+		memset(done, 0, n);
+		memset(loop_mask, 0, mask_set->nWord * sizeof(where_mask_t));
+		for (i = 0; i < n; i++) {
+			best = -1;
+			best_rows = 0;
+			c = 0;
+			for (t = 0; t < n; t++) {
+				if (done[t] || req[t] > lead)
+					continue;
+				cost = __where_loop_cost(dbp, mask_set,
+					      wc_exprs, num_expr,
+					      &tab_list->a[t], from_rows[t],
+					      loop_mask, &out);
+				if (best < 0 || cost + out < c + best_rows) {
+					best = t;
+					c = cost;
+					best_rows = out;
+				}
+			}
+			order[i] = best;
+			best_cost += rows * c;
+			rows *= best_rows;
+			done[best] = 1;
+			while (lead < n && done[lead])
+				lead++;
+			__mask_bit_set(loop_mask, best);
+		}
+	}
+
+	if (best_cost * 2 < from_cost) {
+		for (i = 0; i < n; i++)
+			where_info->a[i].iFrom = order[i];
+	}
+	__dbsql_free(dbp, buf);
+}
+
+/*
+ * __where_is_ordered --
+ *	Return TRUE if 'expr' is a column of a table scanned by one of the
+ *	first 'num_level' loops and that loop visits its rows in ascending
+ *	order of that column, either through an index that sorts on it or
+ *	by ROWID.  The loops inside of it then see the values of 'expr'
+ *	ascend, which lets OP_MergeTo walk an inner index forward.
+ *
+ * STATIC: static int __where_is_ordered __P((where_info_t *, int, expr_t *));
+ */
+static int
+__where_is_ordered(where_info, num_level, expr)
+	where_info_t *where_info;
+	int num_level;
+	expr_t *expr;
+{
+	struct src_list_item *item;
+	where_level_t *level;
+	expr_list_t list;
+	struct expr_list_item term;
+	int i;
+
+	if (expr == 0 || expr->op != TK_COLUMN)
+		return 0;
+	for (i = 0; i < num_level; i++) {
+		level = &where_info->a[i];
+		item = &where_info->pTabList->a[level->iFrom];
+		if (item->iCursor != expr->iTable)
+			continue;
+		if (level->bRev || level->iHash >= 0 || level->bSkip ||
+		    level->inOp != OP_Noop)
+			return 0;
+		if (level->pIdx == 0) {
+			return (expr->iColumn < 0 ||
+				expr->iColumn == item->pTab->iPKey);
+		}
+		memset(&term, 0, sizeof(term));
+		term.pExpr = expr;
+		term.sortOrder = DBSQL_SO_ASC;
+		list.nExpr = list.nAlloc = 1;
+		list.a = &term;
+		return (__find_sorting_index(item->pTab, item->iCursor, &list,
+				level->pIdx, (level->score + 4) / 8, 0) ==
+			level->pIdx);
+	}
+	return 0;
+}
+
+/*
+ * __where_auto_index --
+ *	Make the description of an automatic index on column 'col' of
+ *	'table'.  The index is built in a temporary table when the loops
+ *	begin and is freed by __where_end().  Return NULL if memory is
+ *	exhausted.
+ *
+ * STATIC: static index_t *__where_auto_index __P((parser_t *, table_t *,
+ * STATIC:                                    int));
+ */
+static index_t *
+__where_auto_index(parser, table, col)
+	parser_t *parser;
+	table_t *table;
+	int col;
+{
+	index_t *idx;
+
+	if (__dbsql_calloc(parser->db, 1, sizeof(index_t) + sizeof(int),
+			   &idx) == ENOMEM)
+		return 0;
+	idx->aiColumn = (int *)&idx[1];
+	idx->aiColumn[0] = col;
+	idx->nColumn = 1;
+	idx->pTable = table;
+	idx->onError = OE_None;
+	idx->iDb = table->iDb;
+	return idx;
+}
+
+/*
+ * __where_or_code --
+ *	Generate the code that looks up each branch of the OR 'expr' on the
+ *	table 'table' with cursor 'cur' and adds the ROWIDs found to the
+ *	temporary table of 'level'.  The temporary table is keyed by ROWID,
+ *	so a row found by several branches is kept once and the rows come
+ *	out of it in ROWID order.  If 'open' is TRUE, only generate the code
+ *	that opens the cursors on the indices of the branches instead.
+ *	*cur_p is the last cursor handed out to a branch.
+ *
+ * STATIC: static void __where_or_code __P((parser_t *, expr_t *, int,
+ * STATIC:                      table_t *, where_level_t *, int, int *));
+ */
+static void
+__where_or_code(parser, expr, cur, table, level, open, cur_p)
+	parser_t *parser;
+	expr_t *expr;
+	int cur;
+	table_t *table;
+	where_level_t *level;
+	int open;
+	int *cur_p;
+{
+	vdbe_t *v = parser->pVdbe;
+	index_t *idx;
+	expr_t *val;
+	int skip, start, test_op;
+
+	if (expr->op == TK_OR) {
+		__where_or_code(parser, expr->pLeft, cur, table, level, open,
+				cur_p);
+		__where_or_code(parser, expr->pRight, cur, table, level, open,
+				cur_p);
+		return;
+	}
+	if (!__where_or_term(expr, cur, table, &idx, &val)) {
+		DBSQL_ASSERT(0);
+		return;
+	}
+	if (open) {
+		if (idx) {
+			__vdbe_add_op(v, OP_Integer, idx->iDb, 0);
+			__vdbe_add_op(v, OP_OpenRead, ++(*cur_p), idx->tnum);
+			__vdbe_change_p3(v, -1, idx->zName, P3_STATIC);
+		}
+		return;
+	}
+	skip = __vdbe_make_label(v);
+	__expr_code(parser, val);
+	if (idx == 0) {
+		__vdbe_add_op(v, OP_MustBeInt, 1, skip);
+		__vdbe_add_op(v, OP_String, 0, 0);
+		__vdbe_add_op(v, OP_PutIntKey, level->iCur, 0);
+		__vdbe_resolve_label(v, skip);
+		return;
+	}
+	++(*cur_p);
+	__vdbe_add_op(v, OP_NotNull, -1, (__vdbe_current_addr(v) + 3));
+	__vdbe_add_op(v, OP_Pop, 1, 0);
+	__vdbe_add_op(v, OP_Goto, 0, skip);
+	__vdbe_add_op(v, OP_MakeKey, 1, 0);
+	__add_idx_key_type(v, idx);
+	if (idx->nColumn == 1) {
+		__vdbe_add_op(v, OP_MemStore, level->iMem, 0);
+		test_op = OP_IdxGT;
+	} else {
+		__vdbe_add_op(v, OP_Dup, 0, 0);
+		__vdbe_add_op(v, OP_IncrKey, 0, 0);
+		__vdbe_add_op(v, OP_MemStore, level->iMem, 1);
+		test_op = OP_IdxGE;
+	}
+	__vdbe_add_op(v, OP_MoveTo, *cur_p, skip);
+	start = __vdbe_add_op(v, OP_MemLoad, level->iMem, 0);
+	__vdbe_add_op(v, test_op, *cur_p, skip);
+	__vdbe_add_op(v, OP_IdxRecno, *cur_p, 0);
+	__vdbe_add_op(v, OP_String, 0, 0);
+	__vdbe_add_op(v, OP_PutIntKey, level->iCur, 0);
+	__vdbe_add_op(v, OP_Next, *cur_p, start);
+	__vdbe_resolve_label(v, skip);
+}
+
+/*
+ * __where_idx_covers --
+ *	Return true if the index 'idx' holds every column in 'used', a
+ *	mask of the columns of its table as in src_list_t.colUsed, so a
+ *	loop over it need not read the table.
+ *
+ * STATIC: static int __where_idx_covers __P((index_t *, u_int32_t));
+ */
+static int
+__where_idx_covers(idx, used)
+	index_t *idx;
+	u_int32_t used;
+{
+	int k;
+
+	for (k = 0; k < idx->nColumn; k++) {
+		if (idx->aiColumn[k] < 31)
+			used &= ~((u_int32_t)1 << idx->aiColumn[k]);
+	}
+	return (used == 0);
+}
+
+/*
+ * __where_idx_move --
+ *	Generate the code that moves the table cursor 'cur' to the row of
+ *	the current entry of the index cursor of 'level'.  The move is left
+ *	deferred and the columns the index holds are read from its key until
+ *	one is needed that the key cannot give back, see OP_IdxMoveTo.
+ *
+ * STATIC: static void __where_idx_move __P((vdbe_t *, int, where_level_t *));
+ */
+static void
+__where_idx_move(v, cur, level)
+	vdbe_t *v;
+	int cur;
+	where_level_t *level;
+{
+	index_t *idx;
+	char *map, buf[20];
+	int k;
+
+	idx = level->pIdx;
+	__vdbe_add_op(v, OP_IdxMoveTo, cur, level->iCur);
+	map = 0;
+	for (k = 0; k < idx->nColumn; k++) {
+		snprintf(buf, sizeof(buf), "%d", idx->aiColumn[k]);
+		__str_append(&map, k ? "," : "", buf, (char*)0);
+	}
+	__vdbe_change_p3(v, -1, map, P3_DYNAMIC);
+}
+
+/*
+ * __where_code_term --
+ *	Generate code that pushes the value that an unused term of the
+ *	WHERE clause compares column 'col' of the table with cursor 'cur'
+ *	to, and mark the term used.  'op' is TK_EQ for a "col=..." term,
+ *	TK_LT for "col<..." or "col<=..." and TK_GT for "col>..." or
+ *	"col>=...".  Return the operator of the term written with 'col' on
+ *	its left.
+ *
+ * STATIC: static int __where_code_term __P((parser_t *, expr_mask_set_t *,
+ * STATIC:              expr_info_t *, int, int, where_mask_t *, int, int));
+ */
+static int
+__where_code_term(parser, mask_set, wc_exprs, num_expr, cur, loop_mask, col,
+		  op)
+	parser_t *parser;
+	expr_mask_set_t *mask_set;
+	expr_info_t *wc_exprs;
+	int num_expr;
+	int cur;
+	where_mask_t *loop_mask;
+	int col;
+	int op;
+{
+	expr_t *val;
+	int j, c, term_op;
+
+	for (j = 0; j < num_expr; j++) {
+		if (wc_exprs[j].p == 0)
+			continue;
+		term_op = __where_term_op(mask_set, &wc_exprs[j], cur,
+					  loop_mask, &c, &val);
+		if (term_op == 0 || c != col)
+			continue;
+		if (term_op == op || (op == TK_LT && term_op == TK_LE) ||
+		    (op == TK_GT && term_op == TK_GE)) {
+			__expr_code(parser, val);
+			wc_exprs[j].p = 0;
+			return term_op;
+		}
+	}
+	DBSQL_ASSERT(0);
+	return 0;
+}
+
+/*
+ * __where_skip_key --
+ *	Generate code that makes the top 'n' values on the stack into a key
+ *	on the columns of index 'idx' that follow the first one, and stores
+ *	it in memory cell 'mem'.  No row can match a NULL value, so if there
+ *	is one the code jumps to 'brk'.  If 'null_p' is true a NULL is added
+ *	after the values and the key made to sort after it, to leave out
+ *	the entries whose next column is NULL.  If 'incr' is true the key is
+ *	made to sort after all of the entries that begin with it.
+ *
+ * STATIC: static void __where_skip_key __P((vdbe_t *, index_t *, int, int,
+ * STATIC:                             int, int, int));
+ */
+static void
+__where_skip_key(v, idx, n, null_p, incr, mem, brk)
+	vdbe_t *v;
+	index_t *idx;
+	int n;
+	int null_p;
+	int incr;
+	int mem;
+	int brk;
+{
+	table_t *table;
+	char *type;
+	int k;
+
+	if (n > 0) {
+		__vdbe_add_op(v, OP_NotNull, -n, (__vdbe_current_addr(v) + 3));
+		__vdbe_add_op(v, OP_Pop, n, 0);
+		__vdbe_add_op(v, OP_Goto, 0, brk);
+	}
+	if (null_p) {
+		__vdbe_add_op(v, OP_String, 0, 0);
+		n++;
+		incr = 1;
+	}
+	__vdbe_add_op(v, OP_MakeKey, n, 0);
+	table = idx->pTable;
+	if (n > 0 && __dbsql_malloc(NULL, n + 1, &type) != ENOMEM) {
+		for (k = 0; k < n; k++) {
+			if ((table->aCol[idx->aiColumn[k + 1]].sortOrder &
+			     DBSQL_SO_TYPEMASK) == DBSQL_SO_TEXT)
+				type[k] = 't';
+			else
+				type[k] = 'n';
+		}
+		type[n] = 0;
+		__vdbe_change_p3(v, -1, type, P3_DYNAMIC);
+	}
+	if (incr)
+		__vdbe_add_op(v, OP_IncrKey, 0, 0);
+	__vdbe_add_op(v, OP_MemStore, mem, 1);
+}
+
 /*
  * __where_begin --
  *	Generate the beginning of the loop used for WHERE clause processing.
@@ -384,6 +1464,12 @@ static index_t *__find_sorting_index(table, base, orderby_clause,
  *	checking to see if there are indices that can be used to speed up
  *	the loop.
  *
+ *	The loops need not be nested in FROM clause order.  __where_order()
+ *	picks the order that its cost estimate likes best, so that a table
+ *	which can be reached through an index on a column of an outer table
+ *	ends up inside that table's loop.  where_info->a[i].iFrom is the
+ *	FROM clause entry scanned by the i-th loop.
+ *
  *	Terms of the WHERE clause are also used to limit which rows actually
  *	make it to the "..." in the middle of the loop.  After each "foreach",
  *	terms of the WHERE clause that use only terms in that loop and outer
@@ -448,17 +1534,32 @@ where_info_t *__where_begin(parser, tab_list, where_clause, push_key_p,
 	int brk, cont = 0;        /* Addresses used during code generation */
 	int num_expr;             /* Number of subexpressions in the WHERE
 				     clause */
-	int loop_mask;            /* One bit set for each outer loop */
+	where_mask_t *loop_mask;  /* One bit set for each outer loop */
 	int have_key_p;           /* True if KEY is on the stack */
 	expr_mask_set_t mask_set; /* The expression mask set */
-	int direct_eq[32];        /* Term of the form ROWID==X for the
+	int *direct_eq;           /* Term of the form ROWID==X for the
 				     N-th table */
-	int direct_lt[32];        /* Term of the form ROWID<X or ROWID<=X */
-	int direct_gt[32];        /* Term of the form ROWID>X or ROWID>=X */
-	expr_info_t wc_exprs[101];/* The WHERE clause is divided into these
+	int *direct_lt;           /* Term of the form ROWID<X or ROWID<=X */
+	int *direct_gt;           /* Term of the form ROWID>X or ROWID>=X */
+	int *hash_eq;             /* Term of the form X==Y answered by a
+				     hash join */
+	int *or_term;             /* Term of the form X OR Y answered by
+				     a union of lookups */
+	double *from_rows;        /* Estimated rows in each FROM clause
+				     entry */
+	expr_info_t *wc_exprs;    /* The WHERE clause is divided into these
 				     expressions */
-	char buf[50];
-	int x, mask, j, cur, best_score;
+	int direct_base[5 * WHERE_MASK_BITS];
+	double rows_base[WHERE_MASK_BITS];
+	where_mask_t loop_base[1];
+	expr_info_t wc_base[WHERE_INLINE_TERMS];
+	char *scratch;            /* Space for all of the above when it
+				     does not fit in the local arrays */
+	where_mask_t *pool;
+	int n, j, cur, best_score, cover, best_cover;
+	int auto_col, auto_score;
+	double outer_rows, out, est, best_est;
+	char *auto_name;
 	table_t *table;
 	index_t *idx, *best_idx;
 	int eq_mask;  /* Index columns covered by an x=... term */
@@ -472,7 +1573,10 @@ where_info_t *__where_begin(parser, tab_list, where_clause, push_key_p,
 	int num_col_eq;
 	where_level_t *level;
 	expr_t *ex, *expr;
+	expr_t *merge_key;        /* Outer side of the first == term of an
+				     index loop */
 	int start, test_op, col_num;
+	int skip, end_mem;        /* Skip-scan jump target and end key */
 	int eqcols;
 	int le_flag, ge_flag;
 
@@ -482,24 +1586,6 @@ where_info_t *__where_begin(parser, tab_list, where_clause, push_key_p,
 	 */
 	DBSQL_ASSERT(push_key_p == 0 || tab_list->nSrc == 1);
 
-	/*
-	 * Split the WHERE clause into separate subexpressions where each
-	 * subexpression is separated by an AND operator.  If the wc_exprs[]
-	 * array fills up, the last entry might point to an expression which
-	 * contains additional unfactored AND operators.
-	 */
-	memset(&mask_set, 0, sizeof(mask_set));
-	memset(wc_exprs, 0, sizeof(wc_exprs));
-	num_expr = __expr_split(ARRAY_SIZE(wc_exprs), wc_exprs, where_clause);
-	if (num_expr == ARRAY_SIZE(wc_exprs)) {
-		sprintf(buf, "%d", (int)(ARRAY_SIZE(wc_exprs) - 1));
-		__str_append(&parser->zErrMsg,
-			     "WHERE clause too complex - no more "
-			     "than ", buf, " terms allowed", (char*)0);
-		parser->nErr++;
-		return 0;
-	}
-  
 	/*
 	 * Allocate and initialize the where_info_t structure that will
 	 * become the return value.
@@ -510,10 +1596,76 @@ where_info_t *__where_begin(parser, tab_list, where_clause, push_key_p,
 		__dbsql_free(parser->db, where_info);
 		return 0;
 	}
+
+	/*
+	 * Size the masks and the per table and per term arrays for this
+	 * statement.  Small joins and short WHERE clauses use the local
+	 * arrays, anything larger gets its space from the heap.
+	 */
+	n = tab_list->nSrc;
+	num_expr = __expr_count_terms(where_clause);
+	mask_set.pTabList = tab_list;
+	mask_set.nWord = (n + WHERE_MASK_BITS - 1) / WHERE_MASK_BITS;
+	if (mask_set.nWord == 0)
+		mask_set.nWord = 1;
+	scratch = 0;
+	from_rows = rows_base;
+	direct_eq = direct_base;
+	loop_mask = loop_base;
+	pool = 0;
+	wc_exprs = wc_base;
+	if (n > WHERE_MASK_BITS &&
+	    __dbsql_calloc(parser->db, 1, n * (sizeof(double) +
+		5 * sizeof(int)) + (3 * num_expr + 1) * mask_set.nWord *
+		sizeof(where_mask_t), &scratch) == ENOMEM) {
+		__dbsql_free(parser->db, where_info);
+		return 0;
+	}
+	if (scratch) {
+		from_rows = (double *)scratch;
+		direct_eq = (int *)&from_rows[n];
+		loop_mask = (where_mask_t *)&direct_eq[5 * n];
+		pool = &loop_mask[mask_set.nWord];
+	}
+	direct_lt = &direct_eq[n];
+	direct_gt = &direct_lt[n];
+	hash_eq = &direct_gt[n];
+	or_term = &hash_eq[n];
+	if (num_expr > ARRAY_SIZE(wc_base) &&
+	    __dbsql_calloc(parser->db, num_expr, sizeof(expr_info_t),
+			   &wc_exprs) == ENOMEM) {
+		__dbsql_free(parser->db, scratch);
+		__dbsql_free(parser->db, where_info);
+		return 0;
+	}
+
+	/*
+	 * Split the WHERE clause into separate subexpressions where each
+	 * subexpression is separated by an AND operator.
+	 */
+	if (wc_exprs == wc_base)
+		memset(wc_base, 0, num_expr * sizeof(expr_info_t));
+	__expr_split(num_expr, wc_exprs, where_clause);
+	for (i = 0; i < num_expr; i++) {
+		if (pool) {
+			wc_exprs[i].prereqLeft = &pool[(3 * i) *
+						       mask_set.nWord];
+			wc_exprs[i].prereqRight = &pool[(3 * i + 1) *
+							mask_set.nWord];
+			wc_exprs[i].prereqAll = &pool[(3 * i + 2) *
+						      mask_set.nWord];
+		} else {
+			wc_exprs[i].prereqLeft = &wc_exprs[i].aPrereq[0];
+			wc_exprs[i].prereqRight = &wc_exprs[i].aPrereq[1];
+			wc_exprs[i].prereqAll = &wc_exprs[i].aPrereq[2];
+		}
+	}
 	where_info->pParse = parser;
 	where_info->pTabList = tab_list;
 	where_info->peakNTab = where_info->savedNTab = parser->nTab;
 	where_info->iBreak = __vdbe_make_label(v);
+	for (i = 0; i < tab_list->nSrc; i++)
+		where_info->a[i].iHash = -1;
 
 	/*
 	 * Special case: a WHERE clause that is constant.  Evaluate the
@@ -526,30 +1678,24 @@ where_info_t *__where_begin(parser, tab_list, where_clause, push_key_p,
 	}
 
 	/*
-	 * Analyze all of the subexpressions.
+	 * Analyze all of the subexpressions.  The new.* and old.* tables
+	 * of a trigger body are not in the FROM clause and so never show
+	 * up in the prerequisite masks.
 	 */
-	for(i = 0; i < num_expr; i++) {
+	for(i = 0; i < num_expr; i++)
 		__expr_analyze(&mask_set, &wc_exprs[i]);
 
-		/*
-		 * If we are executing a trigger body, remove all references
-		 * to new.* and old.* tables from the prerequisite masks.
-		 */
-		if (parser->trigStack) {
-			if ((x = parser->trigStack->newIdx) >= 0 ) {
-				mask = ~__get_cursor_bitmask(&mask_set, x);
-				wc_exprs[i].prereqRight &= mask;
-				wc_exprs[i].prereqLeft &= mask;
-				wc_exprs[i].prereqAll &= mask;
-			}
-			if ((x = parser->trigStack->oldIdx) >= 0) {
-				mask = ~__get_cursor_bitmask(&mask_set, x);
-				wc_exprs[i].prereqRight &= mask;
-				wc_exprs[i].prereqLeft &= mask;
-				wc_exprs[i].prereqAll &= mask;
-			}
-		}
+	/*
+	 * Estimate the size of each table once, then decide which FROM
+	 * clause entry each nested loop scans.
+	 */
+	for (i = 0; i < tab_list->nSrc; i++) {
+		from_rows[i] = tab_list->a[i].pTab ?
+			__analyze_table_rows(parser->db, tab_list->a[i].pTab) :
+			DBSQL_EST_ROWS;
 	}
+	__where_order(where_info, &mask_set, wc_exprs, num_expr, from_rows,
+		      orderby_clause ? *orderby_clause : 0);
 
 	/*
 	 * Figure out what index to use (if any) for each nested loop.
@@ -563,18 +1709,16 @@ where_info_t *__where_begin(parser, tab_list, where_clause, push_key_p,
 	 * to use a ROWID which can directly access a table rather than an
 	 * index which requires reading an index first to get the rowid then
 	 * doing a second read of the actual database table.
-	 *
-	 * Actually, if there are more than 32 tables in the join, only the
-	 * first 32 tables are candidates for indices.  This is (again) due
-	 * to the limit of 32 bits in an integer bitmask.
 	 */
-	loop_mask = 0;
-	for(i = 0; i < tab_list->nSrc && i < ARRAY_SIZE(direct_eq); i++) {
-		cur = tab_list->a[i].iCursor; /* The cursor for this table */
-		mask = __get_cursor_bitmask(&mask_set, cur);
-		table = tab_list->a[i].pTab;
+	memset(loop_mask, 0, mask_set.nWord * sizeof(where_mask_t));
+	outer_rows = 1;
+	for(i = 0; i < tab_list->nSrc; i++) {
+		/* The cursor for this table */
+		cur = tab_list->a[where_info->a[i].iFrom].iCursor;
+		table = tab_list->a[where_info->a[i].iFrom].pTab;
 		best_idx = 0;
 		best_score = 0;
+		best_cover = 0;
 
 		/*
 		 * Check to see if there is an expression that uses only the
@@ -590,11 +1734,13 @@ where_info_t *__where_begin(parser, tab_list, where_clause, push_key_p,
 		 direct_eq[i] = -1;
 		 direct_lt[i] = -1;
 		 direct_gt[i] = -1;
+		 hash_eq[i] = -1;
+		 or_term[i] = -1;
 		 for (j = 0; j < num_expr; j++) {
 			 if (wc_exprs[j].idxLeft == cur &&
 			     wc_exprs[j].p->pLeft->iColumn < 0 &&
-			     ((wc_exprs[j].prereqRight & loop_mask) ==
-			      wc_exprs[j].prereqRight)) {
+			     __mask_within(&mask_set,
+			      wc_exprs[j].prereqRight, loop_mask)) {
 				 switch(wc_exprs[j].p->op) {
 				 case TK_IN: /* FALLTHROUGH */
 				 case TK_EQ:
@@ -612,8 +1758,8 @@ where_info_t *__where_begin(parser, tab_list, where_clause, push_key_p,
 			 }
 			 if (wc_exprs[j].idxRight == cur &&
 			     wc_exprs[j].p->pRight->iColumn < 0 &&
-			     ((wc_exprs[j].prereqLeft & loop_mask) ==
-			      wc_exprs[j].prereqLeft)) {
+			     __mask_within(&mask_set,
+			      wc_exprs[j].prereqLeft, loop_mask)) {
 				 switch(wc_exprs[j].p->op) {
 				 case TK_EQ:
 					 direct_eq[i] = j;
@@ -630,7 +1776,7 @@ where_info_t *__where_begin(parser, tab_list, where_clause, push_key_p,
 			 }
 		 }
 		 if (direct_eq[i] >= 0) {
-			 loop_mask |= mask;
+			 __mask_bit_set(loop_mask, where_info->a[i].iFrom);
 			 where_info->a[i].pIdx = 0;
 			 continue;
 		 }
@@ -671,8 +1817,8 @@ where_info_t *__where_begin(parser, tab_list, where_clause, push_key_p,
 				 continue;/* Ignore indices too many columns */
 			 for (j = 0; j < num_expr; j++) {
 				 if (wc_exprs[j].idxLeft == cur &&
-				     ((wc_exprs[j].prereqRight & loop_mask) ==
-				      wc_exprs[j].prereqRight)) {
+				     __mask_within(&mask_set,
+				      wc_exprs[j].prereqRight, loop_mask)) {
 					 col = wc_exprs[j].p->pLeft->iColumn;
 					 for (k = 0; k < idx->nColumn; k++) {
 					 if (idx->aiColumn[k] == col) {
@@ -701,8 +1847,8 @@ where_info_t *__where_begin(parser, tab_list, where_clause, push_key_p,
 					 }
 				 }
 				 if (wc_exprs[j].idxRight == cur && 
-				     ((wc_exprs[j].prereqLeft & loop_mask) ==
-				      wc_exprs[j].prereqLeft)) {
+				     __mask_within(&mask_set,
+				      wc_exprs[j].prereqLeft, loop_mask)) {
 					 col = wc_exprs[j].p->pRight->iColumn;
 					 for (k = 0; k < idx->nColumn; k++) {
 					 if (idx->aiColumn[k] == col) {
@@ -750,18 +1896,160 @@ where_info_t *__where_begin(parser, tab_list, where_clause, push_key_p,
 			 if (score == 0 && in_mask)
 				 score = 4;     /* Default score for IN
 						   constraint. */
-			 if (score > best_score ) {
+			 if (score == 0)
+				 continue;
+
+			 /*
+			  * Between two indices ANALYZE has measured, the one
+			  * expected to deliver fewer rows wins.  On a tie an
+			  * index that holds every column the statement uses
+			  * wins, as the table need not be read.
+			  */
+			 est = __where_index_rows(parser->db, &mask_set,
+					  wc_exprs, num_expr, cur, loop_mask,
+					  idx,
+					  from_rows[where_info->a[i].iFrom]);
+			 cover = __where_idx_covers(idx,
+				 tab_list->a[where_info->a[i].iFrom].colUsed);
+			 if (best_idx == 0 ||
+			     ((idx->aiRowEst && best_idx->aiRowEst) ?
+			      (est < best_est ||
+			       (est == best_est && cover > best_cover)) :
+			      (score > best_score ||
+			       (score == best_score && cover > best_cover)))) {
 				 best_idx = idx;
 				 best_score = score;
+				 best_est = est;
+				 best_cover = cover;
 			 }
 		 }
 		 where_info->a[i].pIdx = best_idx;
 		 where_info->a[i].score = best_score;
 		 where_info->a[i].bRev = 0;
-		 loop_mask |= mask;
+
+		 /*
+		  * With no usable index or ROWID range, an OR whose every
+		  * branch can be looked up is answered by visiting the
+		  * union of the rows those lookups find, if that is
+		  * expected to be cheaper than scanning the table.
+		  */
+		 if (best_idx == 0 && direct_lt[i] < 0 && direct_gt[i] < 0) {
+			 best_est = from_rows[where_info->a[i].iFrom] / 2;
+			 for (j = 0; j < num_expr; j++) {
+				 if (!__where_or_usable(&mask_set,
+					    &wc_exprs[j],
+					    where_info->a[i].iFrom, loop_mask))
+					 continue;
+				 k = 0;
+				 est = __where_or_rows(parser->db,
+					    wc_exprs[j].p, cur, table,
+					    from_rows[where_info->a[i].iFrom],
+					    &k);
+				 if (est >= 0 && est < best_est) {
+					 or_term[i] = j;
+					 best_est = est;
+					 where_info->a[i].nOrIdx = k;
+				 }
+			 }
+			 if (or_term[i] >= 0)
+				 where_info->a[i].bOr = 1;
+		 }
+
+		 /*
+		  * Failing all of that, an index whose left-most column
+		  * has few distinct values may be skip-scanned by terms on
+		  * its other columns.
+		  */
+		 if (best_idx == 0 && direct_lt[i] < 0 && direct_gt[i] < 0 &&
+		     or_term[i] < 0) {
+			 best_est = from_rows[where_info->a[i].iFrom] / 2;
+			 for(idx = table->pIndex; idx; idx = idx->pNext) {
+				 est = __where_skip_cost(&mask_set, wc_exprs,
+					    num_expr, cur, loop_mask, idx,
+					    from_rows[where_info->a[i].iFrom],
+					    &out, &score);
+				 if (est >= 0 && est < best_est) {
+					 best_idx = idx;
+					 best_score = score;
+					 best_est = est;
+				 }
+			 }
+			 if (best_idx) {
+				 where_info->a[i].pIdx = best_idx;
+				 where_info->a[i].score = best_score;
+				 where_info->a[i].bSkip = 1;
+			 }
+		 }
+
+		 /*
+		  * An inner table with no usable index or ROWID constraint,
+		  * that the outer loops are expected to scan several times,
+		  * gets a structure built for it before the loops start.
+		  * An == term relating one of its columns to the outer
+		  * loops is answered with a hash join.  Failing that, range
+		  * terms on one such column are answered with an automatic
+		  * index on that column.
+		  */
+		 if (i > 0 && best_idx == 0 && direct_lt[i] < 0 &&
+		     direct_gt[i] < 0 && or_term[i] < 0 &&
+		     outer_rows >= DBSQL_JOIN_BUILD_MIN) {
+			 auto_col = -1;
+			 auto_score = 0;
+			 for (j = 0; j < num_expr; j++) {
+				 if (__mask_disjoint(&mask_set,
+						     wc_exprs[j].prereqAll,
+						     loop_mask))
+					 continue;
+				 switch(__where_term_op(&mask_set,
+							&wc_exprs[j], cur,
+							loop_mask, &col, 0)) {
+				 case TK_EQ:
+					 if (col >= 0 && hash_eq[i] < 0)
+						 hash_eq[i] = j;
+					 break;
+				 case TK_LE: /* FALLTHROUGH */
+				 case TK_LT:
+					 if (col >= 0 && (auto_col < 0 ||
+							  auto_col == col)) {
+						 auto_col = col;
+						 auto_score |= 1;
+					 }
+					 break;
+				 case TK_GE: /* FALLTHROUGH */
+				 case TK_GT:
+					 if (col >= 0 && (auto_col < 0 ||
+							  auto_col == col)) {
+						 auto_col = col;
+						 auto_score |= 2;
+					 }
+					 break;
+				 }
+			 }
+			 if (hash_eq[i] >= 0) {
+				 where_info->a[i].iHash = parser->nHash++;
+				 where_info->a[i].iSpill = parser->nTab++;
+				 where_info->peakNTab = parser->nTab;
+			 } else if (auto_col >= 0 &&
+				    (best_idx = __where_auto_index(parser,
+						      table, auto_col)) != 0) {
+				 where_info->a[i].pIdx = best_idx;
+				 where_info->a[i].score = auto_score;
+				 where_info->a[i].bAuto = 1;
+			 }
+		 }
+		 __where_loop_cost(parser->db, &mask_set, wc_exprs, num_expr,
+				   &tab_list->a[where_info->a[i].iFrom],
+				   from_rows[where_info->a[i].iFrom],
+				   loop_mask, &out);
+		 outer_rows *= out;
+		 __mask_bit_set(loop_mask, where_info->a[i].iFrom);
 		 if (best_idx) {
 			 where_info->a[i].iCur = parser->nTab++;
 			 where_info->peakNTab = parser->nTab;
+		 } else if (where_info->a[i].bOr) {
+			 where_info->a[i].iCur = parser->nTab;
+			 parser->nTab += 1 + where_info->a[i].nOrIdx;
+			 where_info->peakNTab = parser->nTab;
 		 }
 	}
 
@@ -771,7 +2059,7 @@ where_info_t *__where_begin(parser, tab_list, where_clause, push_key_p,
 	 */
 	if (orderby_clause && *orderby_clause && tab_list->nSrc > 0) {
 		rev = 0;
-		table = tab_list->a[0].pTab;
+		table = tab_list->a[where_info->a[0].iFrom].pTab;
 		idx = where_info->a[0].pIdx;
 		if (idx && where_info->a[0].score == 4) {
 			/*
@@ -781,16 +2069,18 @@ where_info_t *__where_begin(parser, tab_list, where_clause, push_key_p,
 			 */
 			sort_idx = 0;
 		} else if (direct_eq[0] >= 0 || direct_lt[0] >= 0 ||
-			   direct_gt[0] >= 0) {
+			   direct_gt[0] >= 0 || where_info->a[0].bOr ||
+			   where_info->a[0].bSkip) {
 			/*
 			 * If the left-most column is accessed using its
-			 * ROWID, then donot try to sort by index.
+			 * ROWID, or its index is skip-scanned, then donot
+			 * try to sort by index.
 			 */
 			sort_idx = 0;
 		} else {
 			num_col_eq = (where_info->a[0].score + 4) / 8;
 			sort_idx = __find_sorting_index(table,
-						tab_list->a[0].iCursor, 
+				      tab_list->a[where_info->a[0].iFrom].iCursor,
 							*orderby_clause, idx,
 							num_col_eq, &rev);
 		}
@@ -810,15 +2100,16 @@ where_info_t *__where_begin(parser, tab_list, where_clause, push_key_p,
 	 * tables.
 	 */
 	for (i = 0; i < tab_list->nSrc; i++) {
-		table = tab_list->a[i].pTab;
+		table = tab_list->a[where_info->a[i].iFrom].pTab;
 		if (table->isTransient || table->pSelect )
 			continue;
 		__vdbe_add_op(v, OP_Integer, table->iDb, 0);
-		__vdbe_add_op(v, OP_OpenRead, tab_list->a[i].iCursor,
+		__vdbe_add_op(v, OP_OpenRead,
+			      tab_list->a[where_info->a[i].iFrom].iCursor,
 			      table->tnum);
 		__vdbe_change_p3(v, -1, table->zName, P3_STATIC);
 		__code_verify_schema(parser, table->iDb);
-		if (where_info->a[i].pIdx != 0) {
+		if (where_info->a[i].pIdx != 0 && !where_info->a[i].bAuto) {
 			__vdbe_add_op(v, OP_Integer,
 				      where_info->a[i].pIdx->iDb, 0);
 			__vdbe_add_op(v, OP_OpenRead, where_info->a[i].iCur,
@@ -826,22 +2117,85 @@ where_info_t *__where_begin(parser, tab_list, where_clause, push_key_p,
 			__vdbe_change_p3(v, -1, where_info->a[i].pIdx->zName,
 					 P3_STATIC);
 		}
+		if (where_info->a[i].bOr) {
+			k = where_info->a[i].iCur;
+			__where_or_code(parser, wc_exprs[or_term[i]].p,
+				      tab_list->a[where_info->a[i].iFrom].iCursor,
+				      table, &where_info->a[i], 1, &k);
+		}
+	}
+
+	/*
+	 * Load the hash table of every hash join.  The inner table is read
+	 * backwards so that the rows for each key come out of the table in
+	 * ROWID order, the order a scan of the table would visit them.
+	 */
+	for (i = 0; i < tab_list->nSrc; i++) {
+		level = &where_info->a[i];
+		if (level->iHash < 0)
+			continue;
+		cur = tab_list->a[level->iFrom].iCursor;
+		k = hash_eq[i];
+		expr = wc_exprs[k].p;
+		brk = __vdbe_make_label(v);
+		__vdbe_add_op(v, OP_HashReset, level->iHash, cur);
+		if (__expr_type(expr) == DBSQL_SO_TEXT)
+			__vdbe_change_p3(v, -1, "text", P3_STATIC);
+		__vdbe_add_op(v, OP_Last, cur, brk);
+		start = __vdbe_current_addr(v);
+		__expr_code(parser, (wc_exprs[k].idxLeft == cur) ?
+			    expr->pLeft : expr->pRight);
+		__vdbe_add_op(v, OP_Recno, cur, 0);
+		__vdbe_add_op(v, OP_HashPut, level->iHash, level->iSpill);
+		__vdbe_add_op(v, OP_Prev, cur, start);
+		__vdbe_resolve_label(v, brk);
+	}
+
+	/*
+	 * Build every automatic index in a temporary table holding an entry
+	 * for each row of the inner table.  EXPLAIN shows which table and
+	 * column each one indexes.
+	 */
+	for (i = 0; i < tab_list->nSrc; i++) {
+		level = &where_info->a[i];
+		if (!level->bAuto)
+			continue;
+		idx = level->pIdx;
+		table = idx->pTable;
+		cur = tab_list->a[level->iFrom].iCursor;
+		auto_name = 0;
+		__vdbe_add_op(v, OP_OpenTemp, level->iCur, 1);
+		__str_append(&auto_name, "auto-index on ",
+			     table->zName ? table->zName : "subquery", "(",
+			     table->aCol[idx->aiColumn[0]].zName, ")",
+			     (char*)0);
+		__vdbe_change_p3(v, -1, auto_name, P3_DYNAMIC);
+		brk = __vdbe_make_label(v);
+		__vdbe_add_op(v, OP_Rewind, cur, brk);
+		start = __vdbe_add_op(v, OP_Column, cur, idx->aiColumn[0]);
+		__vdbe_add_op(v, OP_Recno, cur, 0);
+		__vdbe_add_op(v, OP_MakeIdxKey, 1, 0);
+		__add_idx_key_type(v, idx);
+		__vdbe_add_op(v, OP_IdxPut, level->iCur, 0);
+		__vdbe_add_op(v, OP_Next, cur, start);
+		__vdbe_resolve_label(v, brk);
 	}
 
 	/*
 	 * Generate the code to do the search.
 	 */
-	loop_mask = 0;
+	memset(loop_mask, 0, mask_set.nWord * sizeof(where_mask_t));
 	for (i = 0; i < tab_list->nSrc; i++) {
-		cur = tab_list->a[i].iCursor;
 		level = &where_info->a[i];
+		cur = tab_list->a[level->iFrom].iCursor;
 
 		/*
 		 * If this is the right table of a LEFT OUTER JOIN, allocate
 		 * and initialize a memory cell that records if this table
 		 * matches any row of the left table of the join.
 		 */
-		if (i > 0 && (tab_list->a[(i - 1)].jointype & JT_LEFT) != 0) {
+		if (level->iFrom > 0 &&
+		    (tab_list->a[(level->iFrom - 1)].jointype & JT_LEFT) != 0) {
 			if (!parser->nMem)
 				parser->nMem++;
 			level->iLeftJoin = parser->nMem++;
@@ -851,7 +2205,7 @@ where_info_t *__where_begin(parser, tab_list, where_clause, push_key_p,
 
 		idx = level->pIdx;
 		level->inOp = OP_Noop;
-		if (i < ARRAY_SIZE(direct_eq) && direct_eq[i] >= 0) {
+		if (direct_eq[i] >= 0) {
 			/*
 			 * Case 1:  We can directly reference a single row
 			 * using an equality comparison against the ROWID
@@ -896,6 +2250,100 @@ where_info_t *__where_begin(parser, tab_list, where_clause, push_key_p,
 			have_key_p = 0;
 			__vdbe_add_op(v, OP_NotExists, cur, brk);
 			level->op = OP_Noop;
+		} else if (level->bSkip) {
+			/*
+			 * Case 6:  The left-most column of the index is not
+			 * constrained but the columns that follow are.  For
+			 * each distinct value of the left-most column, seek
+			 * to the range of entries with that value which the
+			 * terms on the other columns select, then skip past
+			 * the value.  The keys made here leave out the left-
+			 * most field, OP_IdxPrefix copies it from the current
+			 * index entry.  Memory cells iMem+1 to iMem+3 hold
+			 * the key that skips past the current value and the
+			 * start and end of the range within any value.
+			 */
+			score = level->score;
+			eqcols = score / 8;
+			brk = level->brk = __vdbe_make_label(v);
+			cont = level->cont = __vdbe_make_label(v);
+			level->iMem = parser->nMem;
+			parser->nMem += 4;
+			for (j = 1; j <= eqcols; j++) {
+				__where_code_term(parser, &mask_set, wc_exprs,
+						  num_expr, cur, loop_mask,
+						  idx->aiColumn[j], TK_EQ);
+			}
+			for (j = 0; j < eqcols; j++) {
+				__vdbe_add_op(v, OP_Dup, eqcols - 1, 0);
+			}
+			if ((score & 1) != 0) {
+				le_flag = __where_code_term(parser, &mask_set,
+					      wc_exprs, num_expr, cur,
+					      loop_mask,
+					      idx->aiColumn[eqcols + 1],
+					      TK_LT) == TK_LE;
+				__where_skip_key(v, idx, eqcols + 1, 0,
+						 le_flag, level->iMem + 3, brk);
+			} else if (eqcols > 0) {
+				__where_skip_key(v, idx, eqcols, 0, 1,
+						 level->iMem + 3, brk);
+			}
+			if ((score & 2) != 0) {
+				ge_flag = __where_code_term(parser, &mask_set,
+					      wc_exprs, num_expr, cur,
+					      loop_mask,
+					      idx->aiColumn[eqcols + 1],
+					      TK_GT) == TK_GE;
+				__where_skip_key(v, idx, eqcols + 1, 0,
+						 !ge_flag, level->iMem + 2,
+						 brk);
+			} else {
+				__where_skip_key(v, idx, eqcols,
+						 (score & 1) != 0, 0,
+						 level->iMem + 2, brk);
+			}
+
+			/*
+			 * Skip past the current value, then make the keys
+			 * for the value the index cursor lands on.  With no
+			 * end of range within a value the range ends where
+			 * the value does.
+			 */
+			k = __vdbe_make_label(v);
+			__vdbe_add_op(v, OP_Rewind, level->iCur, brk);
+			__vdbe_add_op(v, OP_Goto, 0, k);
+			skip = __vdbe_add_op(v, OP_MemLoad, level->iMem + 1,
+					     0);
+			__vdbe_add_op(v, OP_MoveTo, level->iCur, brk);
+			__vdbe_resolve_label(v, k);
+			__vdbe_add_op(v, OP_MakeKey, 0, 0);
+			__vdbe_add_op(v, OP_IdxPrefix, level->iCur, 1);
+			__vdbe_add_op(v, OP_IncrKey, 0, 0);
+			__vdbe_add_op(v, OP_MemStore, level->iMem + 1, 1);
+			end_mem = level->iMem + 1;
+			if (eqcols > 0 || (score & 1) != 0) {
+				end_mem = level->iMem;
+				__vdbe_add_op(v, OP_MemLoad, level->iMem + 3,
+					      0);
+				__vdbe_add_op(v, OP_IdxPrefix, level->iCur, 1);
+				__vdbe_add_op(v, OP_MemStore, level->iMem, 1);
+			}
+			__vdbe_add_op(v, OP_MemLoad, level->iMem + 2, 0);
+			__vdbe_add_op(v, OP_IdxPrefix, level->iCur, 1);
+			__vdbe_add_op(v, OP_MoveTo, level->iCur, brk);
+			start = __vdbe_add_op(v, OP_MemLoad, end_mem, 0);
+			__vdbe_add_op(v, OP_IdxGE, level->iCur, skip);
+			if (i == (tab_list->nSrc - 1) && push_key_p) {
+				__vdbe_add_op(v, OP_IdxRecno, level->iCur, 0);
+				have_key_p = 1;
+			} else {
+				__where_idx_move(v, cur, level);
+				have_key_p = 0;
+			}
+			level->op = OP_Next;
+			level->p1 = level->iCur;
+			level->p2 = start;
 		} else if (idx != 0 && level->score > 0 &&
 			   ((level->score % 4) == 0)) {
 			/*
@@ -905,20 +2353,24 @@ where_info_t *__where_begin(parser, tab_list, where_clause, push_key_p,
 			 */
 			col_num = (level->score+4)/8;
 			brk = level->brk = __vdbe_make_label(v);
+			merge_key = 0;
 			for (j = 0; j < col_num; j++) {
 				for (k = 0; k < num_expr; k++) {
 					ex = wc_exprs[k].p;
 					if (ex == 0)
 						continue;
 					if (wc_exprs[k].idxLeft == cur &&
-					    ((wc_exprs[k].prereqRight &
-					      loop_mask) ==
-					     wc_exprs[k].prereqRight) &&
+					    __mask_within(&mask_set,
+					     wc_exprs[k].prereqRight,
+					     loop_mask) &&
 					    (ex->pLeft->iColumn == 
 					     idx->aiColumn[j])) {
 						if (ex->op == TK_EQ) {
 							__expr_code(parser,
 								   ex->pRight);
+							if (j == 0)
+								merge_key =
+								    ex->pRight;
 							wc_exprs[k].p = 0;
 							break;
 						}
@@ -943,12 +2395,14 @@ where_info_t *__where_begin(parser, tab_list, where_clause, push_key_p,
 					}
 					if (wc_exprs[k].idxRight ==cur &&
 					    wc_exprs[k].p->op == TK_EQ &&
-					    ((wc_exprs[k].prereqLeft &
-					      loop_mask) ==
-					     wc_exprs[k].prereqLeft) &&
+					    __mask_within(&mask_set,
+					     wc_exprs[k].prereqLeft,
+					     loop_mask) &&
 					    (wc_exprs[k].p->pRight->iColumn ==
 					     idx->aiColumn[j])) {
 						__expr_code(parser, wc_exprs[k].p->pLeft);
+						if (j == 0)
+							merge_key = ex->pLeft;
 						wc_exprs[k].p = 0;
 						break;
 					}
@@ -980,8 +2434,17 @@ where_info_t *__where_begin(parser, tab_list, where_clause, push_key_p,
 				__vdbe_add_op(v, OP_IdxLT, level->iCur, brk);
 				level->op = OP_Prev;
 			} else {
-				/* Scan in the forward order */
-				__vdbe_add_op(v, OP_MoveTo, level->iCur, brk);
+				/*
+				 * Scan in the forward order.  When the outer
+				 * loops produce the keys in ascending order
+				 * this is a merge join, the index is read in
+				 * one pass rather than searched for every
+				 * outer row.
+				 */
+				__vdbe_add_op(v, (i > 0 &&
+				    __where_is_ordered(where_info, i,
+					merge_key)) ? OP_MergeTo : OP_MoveTo,
+				    level->iCur, brk);
 				start = __vdbe_add_op(v, OP_MemLoad,
 						      level->iMem, 0);
 				__vdbe_add_op(v, test_op, level->iCur, brk);
@@ -989,17 +2452,16 @@ where_info_t *__where_begin(parser, tab_list, where_clause, push_key_p,
 			}
 			__vdbe_add_op(v, OP_RowKey, level->iCur, 0);
 			__vdbe_add_op(v, OP_IdxIsNull, col_num, cont);
-			__vdbe_add_op(v, OP_IdxRecno, level->iCur, 0);
 			if (i == tab_list->nSrc-1 && push_key_p) {
+				__vdbe_add_op(v, OP_IdxRecno, level->iCur, 0);
 				have_key_p = 1;
 			} else {
-				__vdbe_add_op(v, OP_MoveTo, cur, 0);
+				__where_idx_move(v, cur, level);
 				have_key_p = 0;
 			}
 			level->p1 = level->iCur;
 			level->p2 = start;
-		} else if (i < ARRAY_SIZE(direct_lt) &&
-			   (direct_lt[i] >= 0 || direct_gt[i] >= 0)) {
+		} else if (direct_lt[i] >= 0 || direct_gt[i] >= 0) {
 			/*
 			 * Case 3:  We have an inequality comparison against
 			 * the ROWID field.
@@ -1063,6 +2525,53 @@ where_info_t *__where_begin(parser, tab_list, where_clause, push_key_p,
 				__vdbe_add_op(v, test_op, 0, brk);
 			}
 			have_key_p = 0;
+		} else if (level->bOr) {
+			/*
+			 * Case 3a:  There is no usable index but the
+			 * branches of an OR can each be looked up.  Gather
+			 * the ROWIDs they find in a temporary table, which
+			 * is emptied each time this loop starts, then visit
+			 * those rows.  The OR itself is still tested below.
+			 */
+			brk = level->brk = __vdbe_make_label(v);
+			cont = level->cont = __vdbe_make_label(v);
+			level->iMem = parser->nMem++;
+			__vdbe_add_op(v, OP_OpenTemp, level->iCur, 0);
+			k = level->iCur;
+			table = tab_list->a[level->iFrom].pTab;
+			__where_or_code(parser, wc_exprs[or_term[i]].p, cur,
+					table, level, 0, &k);
+			__vdbe_add_op(v, OP_Rewind, level->iCur, brk);
+			start = __vdbe_add_op(v, OP_Recno, level->iCur, 0);
+			__vdbe_add_op(v, OP_NotExists, cur, cont);
+			level->op = OP_Next;
+			level->p1 = level->iCur;
+			level->p2 = start;
+			have_key_p = 0;
+		} else if (level->iHash >= 0) {
+			/*
+			 * Case 4a:  There is no usable index but an == term
+			 * relates this table to the outer loops.  Visit the
+			 * rows found in the join hash table under the value
+			 * of the outer side of the term.  The term itself is
+			 * still tested below, equal keys only make a row a
+			 * candidate.
+			 */
+			k = hash_eq[i];
+			DBSQL_ASSERT(wc_exprs[k].p != 0);
+			brk = level->brk = __vdbe_make_label(v);
+			cont = level->cont = __vdbe_make_label(v);
+			if (wc_exprs[k].idxLeft == cur) {
+				__expr_code(parser, wc_exprs[k].p->pRight);
+			} else {
+				__expr_code(parser, wc_exprs[k].p->pLeft);
+			}
+			__vdbe_add_op(v, OP_HashFirst, level->iHash, brk);
+			start = __vdbe_add_op(v, OP_HashMove, level->iHash, 0);
+			level->op = OP_HashNext;
+			level->p1 = level->iHash;
+			level->p2 = start;
+			have_key_p = 0;
 		} else if (idx == 0) {
 			/*
 			 * Case 4:  There is no usable index.  We must do a
@@ -1104,9 +2613,9 @@ where_info_t *__where_begin(parser, tab_list, where_clause, push_key_p,
 						continue;
 					if (wc_exprs[k].idxLeft == cur &&
 					    wc_exprs[k].p->op == TK_EQ &&
-					    ((wc_exprs[k].prereqRight &
-					      loop_mask) ==
-					     wc_exprs[k].prereqRight) &&
+					    __mask_within(&mask_set,
+					     wc_exprs[k].prereqRight,
+					     loop_mask) &&
 					    (wc_exprs[k].p->pLeft->iColumn ==
 					     idx->aiColumn[j])) {
 						__expr_code(parser,
@@ -1116,9 +2625,9 @@ where_info_t *__where_begin(parser, tab_list, where_clause, push_key_p,
 					}
 					if (wc_exprs[k].idxRight == cur &&
 					    wc_exprs[k].p->op == TK_EQ &&
-					    ((wc_exprs[k].prereqLeft &
-					      loop_mask) ==
-					     wc_exprs[k].prereqLeft) &&
+					    __mask_within(&mask_set,
+					     wc_exprs[k].prereqLeft,
+					     loop_mask) &&
 					    (wc_exprs[k].p->pRight->iColumn ==
 					     idx->aiColumn[j])) {
 						__expr_code(parser,
@@ -1162,9 +2671,9 @@ where_info_t *__where_begin(parser, tab_list, where_clause, push_key_p,
 					if (wc_exprs[k].idxLeft == cur &&
 					    (expr->op == TK_LT ||
 					     expr->op == TK_LE) &&
-					    ((wc_exprs[k].prereqRight &
-					      loop_mask) ==
-					     wc_exprs[k].prereqRight) &&
+					    __mask_within(&mask_set,
+					     wc_exprs[k].prereqRight,
+					     loop_mask) &&
 					    (expr->pLeft->iColumn ==
 					     idx->aiColumn[j])) {
 						__expr_code(parser,
@@ -1176,9 +2685,9 @@ where_info_t *__where_begin(parser, tab_list, where_clause, push_key_p,
 					if (wc_exprs[k].idxRight == cur &&
 					    ((expr->op == TK_GT ||
 					      expr->op == TK_GE)) &&
-					    ((wc_exprs[k].prereqLeft &
-					      loop_mask) ==
-					     wc_exprs[k].prereqLeft) &&
+					    __mask_within(&mask_set,
+					     wc_exprs[k].prereqLeft,
+					     loop_mask) &&
 					    (expr->pRight->iColumn ==
 					     idx->aiColumn[j])) {
 						__expr_code(parser,
@@ -1236,9 +2745,9 @@ where_info_t *__where_begin(parser, tab_list, where_clause, push_key_p,
 					if (wc_exprs[k].idxLeft == cur &&
 					    ((expr->op == TK_GT ||
 					      expr->op == TK_GE)) &&
-					    ((wc_exprs[k].prereqRight &
-					      loop_mask) ==
-					     wc_exprs[k].prereqRight) &&
+					    __mask_within(&mask_set,
+					     wc_exprs[k].prereqRight,
+					     loop_mask) &&
 					    (expr->pLeft->iColumn ==
 					     idx->aiColumn[j])) {
 						__expr_code(parser,
@@ -1250,9 +2759,9 @@ where_info_t *__where_begin(parser, tab_list, where_clause, push_key_p,
 					if (wc_exprs[k].idxRight == cur &&
 					    ((expr->op == TK_LT ||
 					      expr->op == TK_LE)) &&
-					    ((wc_exprs[k].prereqLeft &
-					      loop_mask) ==
-					     wc_exprs[k].prereqLeft) &&
+					    __mask_within(&mask_set,
+					     wc_exprs[k].prereqLeft,
+					     loop_mask) &&
 					    (expr->pRight->iColumn ==
 					     idx->aiColumn[j])) {
 						__expr_code(parser,
@@ -1304,11 +2813,11 @@ where_info_t *__where_begin(parser, tab_list, where_clause, push_key_p,
 			__vdbe_add_op(v, OP_RowKey, level->iCur, 0);
 			__vdbe_add_op(v, OP_IdxIsNull, (eqcols + (score & 1)),
 				      cont);
-			__vdbe_add_op(v, OP_IdxRecno, level->iCur, 0);
 			if (i == (tab_list->nSrc - 1) && push_key_p) {
+				__vdbe_add_op(v, OP_IdxRecno, level->iCur, 0);
 				have_key_p = 1;
 			} else {
-				__vdbe_add_op(v, OP_MoveTo, cur, 0);
+				__where_idx_move(v, cur, level);
 				have_key_p = 0;
 			}
 
@@ -1319,7 +2828,7 @@ where_info_t *__where_begin(parser, tab_list, where_clause, push_key_p,
 			level->p1 = level->iCur;
 			level->p2 = start;
 		}
-		loop_mask |= __get_cursor_bitmask(&mask_set, cur);
+		__mask_bit_set(loop_mask, level->iFrom);
 
 		/*
 		 * Insert code to test every subexpression that can be
@@ -1328,8 +2837,8 @@ where_info_t *__where_begin(parser, tab_list, where_clause, push_key_p,
 		for (j = 0; j < num_expr; j++) {
 			if (wc_exprs[j].p == 0)
 				continue;
-			if ((wc_exprs[j].prereqAll & loop_mask) !=
-			    wc_exprs[j].prereqAll)
+			if (!__mask_within(&mask_set, wc_exprs[j].prereqAll,
+			    loop_mask))
 				continue;
 			if (level->iLeftJoin &&
 			    !ExprHasProperty(wc_exprs[j].p, EP_FromJoin)) {
@@ -1356,8 +2865,9 @@ where_info_t *__where_begin(parser, tab_list, where_clause, push_key_p,
 			for (j = 0; j < num_expr; j++) {
 				if (wc_exprs[j].p == 0)
 					continue;
-				if ((wc_exprs[j].prereqAll & loop_mask) !=
-				    wc_exprs[j].prereqAll )
+				if (!__mask_within(&mask_set,
+				    wc_exprs[j].prereqAll,
+				    loop_mask))
 					continue;
 				if (have_key_p) {
 					/*
@@ -1379,7 +2889,9 @@ where_info_t *__where_begin(parser, tab_list, where_clause, push_key_p,
 	if (push_key_p && !have_key_p) {
 		__vdbe_add_op(v, OP_Recno, tab_list->a[0].iCursor, 0);
 	}
-	__free_mask_set(&mask_set);
+	if (wc_exprs != wc_base)
+		__dbsql_free(parser->db, wc_exprs);
+	__dbsql_free(parser->db, scratch);
 	return where_info;
 }
 
@@ -1394,7 +2906,7 @@ void
 __where_end(winfo)
 	where_info_t *winfo;
 {
-	int i, addr;
+	int i, k, addr;
 	where_level_t *level;
 	table_t *table;
 	vdbe_t *v = winfo->pParse->pVdbe;
@@ -1416,8 +2928,8 @@ __where_end(winfo)
 					     level->iLeftJoin, 0);
 			__vdbe_add_op(v, OP_NotNull, 1,
 				      (addr + 4 + (level->iCur >= 0)));
-			__vdbe_add_op(v, OP_NullRow, tab_list->a[i].iCursor,
-				      0);
+			__vdbe_add_op(v, OP_NullRow,
+				      tab_list->a[level->iFrom].iCursor, 0);
 			if (level->iCur >= 0) {
 				__vdbe_add_op(v, OP_NullRow, level->iCur, 0);
 			}
@@ -1426,12 +2938,19 @@ __where_end(winfo)
 	}
 	__vdbe_resolve_label(v, winfo->iBreak);
 	for (i = 0; i < tab_list->nSrc; i++) {
-		table = tab_list->a[i].pTab;
+		level = &winfo->a[i];
+		table = tab_list->a[level->iFrom].pTab;
 		DBSQL_ASSERT(table != 0);
+		if (level->bOr) {
+			for (k = 0; k <= level->nOrIdx; k++)
+				__vdbe_add_op(v, OP_Close, level->iCur + k, 0);
+		}
+		if (level->iHash >= 0)
+			__vdbe_add_op(v, OP_Close, level->iSpill, 0);
 		if (table->isTransient || table->pSelect)
 			continue;
-		level = &winfo->a[i];
-		__vdbe_add_op(v, OP_Close, tab_list->a[i].iCursor, 0);
+		__vdbe_add_op(v, OP_Close, tab_list->a[level->iFrom].iCursor,
+			      0);
 		if (level->pIdx != 0) {
 			__vdbe_add_op(v, OP_Close, level->iCur, 0);
 		}
@@ -1441,6 +2960,10 @@ __where_end(winfo)
 		winfo->pParse->nTab = winfo->savedNTab;
 	}
 #endif
+	for (i = 0; i < tab_list->nSrc; i++) {
+		if (winfo->a[i].bAuto)
+			__dbsql_free(winfo->pParse->db, winfo->a[i].pIdx);
+	}
 	__dbsql_free(winfo->pParse->db, winfo);
 	return;
 }
@@ -782,6 +782,73 @@ __str_real_as_sortable(r, z)
 	*z = 0;
 }
 
+/*
+ * __str_sortable_as_real --
+ *	Undo __str_real_as_sortable(): store in '*r' the number whose
+ *	sortable form is the null-terminated string 'z'.  Returns 0 if 'z'
+ *	is not such a form or stands for a number too large to hold.
+ *
+ *	The sortable form keeps 47 to 53 bits of the number, depending on
+ *	its size, so '*r' can differ from the number in the last few bits.
+ *	Whole numbers below 2^46 in size come back exactly.
+ *
+ * PUBLIC: int __str_sortable_as_real __P((const char *, double *));
+ */
+int
+__str_sortable_as_real(z, r)
+	const char *z;
+	double *r;
+{
+	int neg, exp, d, i;
+	double m, f;
+	char buf[20];
+	const char *c;
+
+	if (*z != '-' && *z != '0')
+		return 0;
+	neg = (*z == '-');
+	exp = 0;
+	m = 0.0;
+	f = 1.0;
+	for (i = 0, c = z + 1; *c; i++, c++) {
+		if (*c >= '0' && *c <= '9')
+			d = *c - '0';
+		else if (*c >= 'A' && *c <= 'Z')
+			d = *c - 'A' + 10;
+		else if (*c >= 'a' && *c <= 'z')
+			d = *c - 'a' + 36;
+		else if (*c == '|')
+			d = 62;
+		else if (*c == '~')
+			d = 63;
+		else
+			return 0;
+		if (i < 2) {
+			exp = (exp << 6) | d;
+		} else {
+			f /= 64.0;
+			m += d * f;
+		}
+	}
+	if (i < 3 || i > 12 || exp >= 2048)
+		return 0;
+	exp -= 1024;
+	if (neg)
+		exp = -exp;
+	m -= 0.5;
+	for (; exp > 0; exp--)
+		m *= 64.0;
+	for (; exp < 0; exp++)
+		m /= 64.0;
+
+	/* Only a number that gives back 'z' itself is the one it stands for. */
+	__str_real_as_sortable(m, buf);
+	if (strcmp(buf, z) != 0)
+		return 0;
+	*r = m;
+	return 1;
+}
+
 /*
  * __str_cmp --
  *	This routine is used for sorting.  Each key is a list of one or more
@@ -41,6 +41,7 @@ int __str_like_cmp __P((const unsigned char *, const unsigned char *));
 int __str_numeric_cmp __P((const char *, const char *));
 int __str_int_in32b __P((const char *));
 void __str_real_as_sortable __P((double, char *));
+int __str_sortable_as_real __P((const char *, double *));
 int __str_cmp __P((const char *, const char *));
 
 #if defined(__cplusplus)
@@ -11,6 +11,12 @@ int __sqldb_init __P((dbsql_db_t *, DBSQL *, const char *, int, int, int));
 void __api_interrupt __P((DBSQL *));
 int __api_get_table __P((DBSQL *, const char *, char ***, int *, int *, char **));
 void __api_free_table __P((char **));
+void __analyze __P((parser_t *, token_t *, token_t *));
+void __analyze_load __P((DBSQL *, int));
+int __execute_analyze __P((char **, DBSQL *, sm_cursor_t *, int, const char *));
+double __analyze_table_rows __P((DBSQL *, table_t *));
+double __analyze_eq_rows __P((DBSQL *, index_t *, int, expr_t *, double));
+double __analyze_range_frac __P((DBSQL *, index_t *, int, expr_t *, int, expr_t *));
 void __attach __P((parser_t *, token_t *, token_t *));
 void __detach __P((parser_t *, token_t *));
 int __ref_normalizer_ctx_init __P((ref_normalizer_ctx_t *, parser_t *, int, const char *, const token_t *));
@@ -76,6 +82,8 @@ void __generate_row_index_delete __P((DBSQL *, vdbe_t *, table_t *, int, char *)
 expr_t *__expr __P((int, expr_t *, expr_t *, token_t *));
 void __expr_span __P((expr_t *, token_t *, token_t *));
 expr_t *__expr_function __P((expr_list_t *, token_t *));
+void __expr_assign_var __P((parser_t *, expr_t *));
+void __expr_var_names_clear __P((parser_t *));
 void __expr_delete __P((expr_t *));
 expr_t *__expr_dup __P((expr_t *));
 void __token_copy __P((token_t *, token_t *));
@@ -92,6 +100,7 @@ int __expr_resolve_ids __P((parser_t *, src_list_t *, expr_list_t *, expr_t *));
 int __expr_check __P((parser_t *, expr_t *, int, int *));
 int __expr_type __P((expr_t *));
 void __expr_code __P((parser_t *, expr_t *));
+void __expr_code_prologue __P((parser_t *));
 void __expr_if_false __P((parser_t *, expr_t *, int, int));
 int __expr_compare __P((expr_t *, expr_t *));
 int __expr_analyze_aggregates __P((parser_t *, expr_t *));
@@ -136,8 +145,13 @@ char *__sm_get_database_name __P((sm_t *));
 int __sm_begin_txn __P((sm_t *));
 int __sm_commit_txn __P((sm_t *));
 int __sm_abort_txn __P((sm_t *));
-int __sm_cursor __P((sm_t *, int, int, sm_cursor_t **));
+int __sm_cursor __P((sm_t *, int, int, DB_TXN *, sm_cursor_t **));
+int __sm_snapshot_begin __P((sm_t *, DB_TXN **));
+void __sm_snapshot_end __P((DB_TXN *));
 int __sm_close_cursor __P((sm_cursor_t *));
+int __sm_stat __P((sm_t *, sm_stat_t *));
+int __sm_estimate_entries __P((sm_t *, int, double *));
+int __sm_estimate_range __P((sm_t *, int, const void *, int, double *, double *));
 int __sm_moveto __P((sm_cursor_t *, const void *, int, int *));
 int __sm_next __P((sm_cursor_t *, int *));
 int __sm_prev __P((sm_cursor_t *, int *));
@@ -146,9 +160,14 @@ int __sm_data_size __P((sm_cursor_t *, int *));
 int __sm_key_compare __P((sm_cursor_t *, const void *, int, int, int *));
 size_t __sm_key __P((sm_cursor_t *, size_t, size_t, const void *));
 size_t __sm_data __P((sm_cursor_t *, size_t, size_t, char *));
+u_int32_t __sm_row_gen __P((sm_cursor_t *));
+int __sm_key_ptr __P((sm_cursor_t *, const char **, int *));
+int __sm_data_ptr __P((sm_cursor_t *, const char **, int *));
 int __sm_first __P((sm_cursor_t *, int *));
 int __sm_last __P((sm_cursor_t *, int *));
 int __sm_insert __P((sm_cursor_t *, const void *, int, const void *, int));
+int __sm_bulk_insert __P((sm_cursor_t *));
+int __sm_flush __P((sm_cursor_t *));
 int __sm_delete __P((sm_cursor_t *));
 int __sm_drop_table __P((sm_t *, int));
 int __sm_clear_table __P((sm_t *, int));
@@ -159,6 +178,8 @@ int __sm_set_format_version __P((sm_t *, int, u_int32_t));
 int __sm_get_format_version __P((sm_t *, u_int32_t *));
 int __sm_set_schema_sig __P((sm_t *, u_int32_t));
 int __sm_get_schema_sig __P((sm_t *, u_int32_t *));
+int __sm_set_stat __P((sm_t *, const char *, const void *, int));
+int __sm_get_stat __P((sm_t *, const char *, void *, int *));
 void __register_builtin_funcs __P((DBSQL *));
 int get_keyword_code __P((const char *, int));
 int __run_sql_parser __P((parser_t *, const char *, char **));
@@ -181,13 +202,26 @@ vdbe_op_t *__vdbe_get_op __P((vdbe_t *, int));
 void __vdbe_print_op __P((FILE *, int, vdbe_op_t *));
 int __vdbe_list __P((vdbe_t *));
 void __vdbe_make_ready __P((vdbe_t *, int, dbsql_callback, void *, int));
+int __vdbe_arena_alloc __P((arena_block_t **, int, void *));
+void __vdbe_arena_free __P((arena_block_t **));
+int __vdbe_str_alloc __P((vdbe_t *, int, char **));
+void __vdbe_str_reset __P((vdbe_t *));
 void __vdbe_sorter_reset __P((vdbe_t *));
+void __vdbe_agg_clear __P((agg_t *));
 void __vdbe_agg_reset __P((agg_t *));
+void __vdbe_hjoin_clear __P((hjoin_t *));
 void __vdbe_keylist_free __P((keylist_t *));
 void __vdbe_cleanup_cursor __P((cursor_t *));
 int __vdbe_reset __P((vdbe_t *, char **));
 int __vdbe_finalize __P((vdbe_t *, char **));
+void __vdbe_set_var_names __P((vdbe_t *, char **));
 int __api_bind __P((dbsql_stmt_t *, int, const char *, int, int));
+int __api_bind_int64 __P((dbsql_stmt_t *, int, int64_t));
+int __api_bind_double __P((dbsql_stmt_t *, int, double));
+int __api_bind_text __P((dbsql_stmt_t *, int, const char *, int, int));
+int __api_bind_blob __P((dbsql_stmt_t *, int, const void *, int));
+int __api_bind_null __P((dbsql_stmt_t *, int));
+int __api_bind_parameter_index __P((dbsql_stmt_t *, const char *));
 void __vdbe_delete __P((vdbe_t *));
 int __vdbe_byte_swap __P((int));
 int __vdbe_cursor_moveto __P((cursor_t *));
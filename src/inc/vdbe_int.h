@@ -53,6 +53,14 @@ extern char *__opcode_names[];
  */
 typedef unsigned char bool_t;
 
+/*
+ * One field of a typed record as decoded by OP_Column, see REC_TEXT below.
+ */
+typedef struct rec_field {
+	u_int32_t type;       /* REC_NULL, REC_INT8, ... */
+	int offset;           /* Offset of the field's data in the record */
+} rec_field_t;
+
 /*
  * The cursor can seek to a btree entry with a particular key, or
  * loop over all entries of the btree.  You can also insert new
@@ -66,6 +74,16 @@ typedef unsigned char bool_t;
  * really a single row that represents the NEW or OLD pseudo-table of
  * a row trigger.  The data for the row is stored in cursor_t.pData and
  * the rowid is in cursor_t.iKey.
+ *
+ * When OP_Column reads a typed record through a cursor, the types and
+ * offsets of the fields it walks past are kept in cursor_t.aField.  They
+ * stay valid for as long as __sm_row_gen() reports the same value, so
+ * reading more columns of the same row does not decode the header again.
+ *
+ * After OP_IdxMoveTo the move to the table row is deferred and zAltMap
+ * lists the table columns held in the key of index cursor iAltCsr.
+ * OP_Column reads those from the index key for as long as the move stays
+ * deferred, so the table row is only read when some other column is.
  */
 struct cursor {
 	sm_cursor_t *pCursor; /* The cursor structure of the backend */
@@ -82,15 +100,37 @@ struct cursor {
 				 trigger */
 	bool_t deferredMoveto;/* A call to __sm_moveto() is needed */
 	int movetoTarget;     /* Argument to the deferred __sm_moveto() */
+	int iAltCsr;          /* Index cursor the deferred move came from */
+	const char *zAltMap;  /* Columns held in iAltCsr's key, or NULL */
 	sm_t *pBt;            /* Separate database holding temporary tables */
 	int nData;            /* Number of bytes in pData */
 	char *pData;          /* Data for a NEW or OLD pseudo-table */
 	int iKey;             /* Key for the NEW or OLD pseudo-table row */
+	bool_t hdrValid;      /* True if aField describes the current row */
+	u_int32_t rowGen;     /* __sm_row_gen() of the row aField describes */
+	int nField;           /* Number of fields decoded into aField */
+	int nFieldAlloc;      /* Number of slots allocated in aField */
+	int hdrPos;           /* Offset of the next type in the header */
+	int hdrEnd;           /* Offset of the first byte of data */
+	int dataPos;          /* Offset of the data of field nField */
+	rec_field_t *aField;  /* Decoded header of a typed record */
+	char *zMerge;         /* Key of the last OP_MergeTo, or NULL */
+	int nMerge;           /* Number of bytes in zMerge */
 };
 
+/*
+ * OP_MergeTo steps an index cursor at most this many entries looking for
+ * its key before it gives up and searches for it.  A step usually stays
+ * on the current leaf page while a search descends the whole B-tree, so
+ * a step costs a fraction of a search.
+ */
+#define MERGE_STEPS 16
+
 /*
  * A sorter builds a list of elements to be sorted.  Each element of
- * the list is an instance of the following structure.
+ * the list is an instance of the following structure.  Elements are
+ * carved out of an arena with their key and data stored immediately
+ * after the structure.
  */
 typedef struct sorter sorter_t;
 struct sorter {
@@ -98,9 +138,45 @@ struct sorter {
   char *zKey;         /* The key by which we will sort */
   int nData;          /* Number of bytes in the data */
   char *pData;        /* The data associated with this key */
+  u_int32_t iSeq;     /* Order of arrival, used by a bounded sorter */
   sorter_t *pNext;    /* Next in the list */
 };
 
+/*
+ * A block of memory in an arena.  Sorters and aggregators carve their
+ * elements out of a list of these blocks and release the whole list at
+ * once, and the string values made while a program runs come out of one
+ * too.  Blocks are at least ARENA_BLOCK bytes.
+ */
+struct arena_block {
+  arena_block_t *pNext; /* Next block in the arena */
+  int nUsed;            /* Bytes of zBuf handed out so far */
+  int nAlloc;           /* Size of zBuf */
+  char *zBuf;           /* Element storage, follows this structure */
+};
+#define ARENA_BLOCK 65536
+
+/*
+ * When the elements given to a sorter exceed its memory budget, the
+ * elements collected so far are sorted and written to a temporary file
+ * as a run.  Each element in the file is its key length and data length
+ * followed by the key and data bytes.  OP_SortNext merges the runs, and
+ * the elements still in memory, through a heap of the heads of the runs.
+ */
+typedef struct sort_run sort_run_t;
+struct sort_run {
+  FILE *fp;             /* Temporary file holding the run */
+  sorter_t head;        /* Next element of the run, head.zKey==0 at EOF */
+  char *zBuf;           /* Holds the key and data of head */
+  int nBuf;             /* Bytes allocated at zBuf */
+};
+
+/*
+ * A sorter keeps at most this many runs, each an open temporary file.
+ * When it has written this many they are merged into a single run.
+ */
+#define SORT_RUN_MAX 16
+
 /* 
  * Number of buckets used for merge-sort.  
  */
@@ -113,6 +189,38 @@ struct sorter {
  */
 #define NBFS 32
 
+/*
+ * Starting with format version 2 OP_MakeRecord builds typed records.
+ * A typed record looks like this:
+ *
+ *  -------------------------------------------------------------------
+ *  | magic | hdr-size | type0 | ... | type(N-1) | data0 | ... | data(N-1) |
+ *  -------------------------------------------------------------------
+ *
+ * The magic is a single 0x00 byte in records shorter than 256 bytes and
+ * the three bytes 0x00 0x00 0x02 in longer ones.  Neither can begin a
+ * format version 1 record, so both kinds of record can live in the same
+ * table.  hdr-size is the number of bytes taken up by the types.  It
+ * and each type are variable length integers holding seven bits per
+ * byte, most significant first, with the high bit set on every byte but
+ * the last.  The type of a field gives its size and how to decode it:
+ *
+ *	REC_NULL		NULL, no data
+ *	REC_INT8 .. REC_INT64	big-endian two's complement integer
+ *	REC_REAL		big-endian IEEE double
+ *	REC_TEXT + n		n bytes of text including the null terminator
+ */
+#define REC_NULL	0
+#define REC_INT8	1
+#define REC_INT16	2
+#define REC_INT32	3
+#define REC_INT64	4
+#define REC_REAL	5
+#define REC_TEXT	6
+
+#define REC_IS_TYPED(z, n)						\
+	((z)[0] == 0 && ((n) < 256 || ((z)[1] == 0 && (z)[2] == 2)))
+
 /*
  * A single level of the stack or a single memory cell
  * is an instance of the following structure. 
@@ -138,6 +246,13 @@ struct mem {
  * aggregate function context that needs to be finalized.
  */
 #define MEM_AggCtx    0x0100   /* mem_t.z points to an agg function context */
+/*
+ * A string whose mem_t.z was carved out of vdbe_t.pStrArena.  It is never
+ * freed on its own and stays valid only until the arena is emptied, which
+ * happens whenever the stack is empty at the bottom of a loop.  Anything
+ * that keeps a string beyond that, a memory cell for instance, copies it.
+ */
+#define MEM_Arena     0x0200   /* mem_t.z points into vdbe_t.pStrArena */
 	double r;           /* Real value */
 	char *z;            /* String value */
 	char zShort[NBFS];  /* Space for short strings */
@@ -167,26 +282,72 @@ struct __dbsql_func {
 	u_int8_t isStep;      /* Current in the step function */
 	int cnt;              /* Number of times that the step function
 				 has been called */
+	vdbe_t *pVm;          /* Make string results in this VM's string
+				 arena, or 0 to allocate them */
 };
 
+/*
+ * An aggregator over its memory budget spills rows to this many files,
+ * picked by AGG_PART_BITS bits of the key hash.
+ */
+#define AGG_PART_BITS   3
+#define AGG_PART_FANOUT (1 << AGG_PART_BITS)
+
 /*
  * An agg_t structure describes an Aggregator.  Each agg_t consists of
  * zero or more Aggregator elements (agg_elem_t).  Each agg_elem_t contains
  * a key and one or more values.  The values are used in processing
  * aggregate functions in a SELECT.  The key is used to implement
  * the GROUP BY clause of a select.
+ *
+ * Elements are allocated from an arena and found through a chained hash
+ * table on their keys.  Once the elements outgrow the memory budget set
+ * by "PRAGMA agg_memory" no new element is made in the current pass.
+ * The groups already made go on aggregating, while the rows of any other
+ * group are written, as the evaluated key and values OP_AggFocus finds
+ * on the stack, to one of AGG_PART_FANOUT temporary files chosen by the
+ * next AGG_PART_BITS bits of the key hash, counting from the top.  When
+ * the pass is over the files are queued in aPart[] and OP_AggRescan and
+ * OP_AggReplay feed them back, one partition per pass, through the same
+ * code.  A group is thus either made before the budget runs out and
+ * sees all of its rows, or sees none of them and is left entirely to a
+ * single partition.
  */
+typedef struct agg_part agg_part_t;
+struct agg_part {
+	FILE *fp;             /* Temporary file holding the spilled rows */
+	int level;            /* Number of partitioning steps of its keys */
+};
 struct agg {
 	int nMem;             /* Number of values stored in each AggElem */
 	agg_elem_t *pCurrent; /* The AggElem currently in focus */
-	hash_ele_t *pSearch;  /* The hash element for pCurrent */
-	hash_t hash;          /* Hash table of all aggregate elements */
+	agg_elem_t *pSearch;  /* The AggElem last visited by AggNext */
+	agg_elem_t *pFirst;   /* All elements in the order they were made */
+	agg_elem_t *pLast;    /* The most recently made element */
+	agg_elem_t *pFree;    /* Dropped elements available for reuse */
+	agg_elem_t **aHash;   /* Hash table of all aggregate elements */
+	int nHash;            /* Number of slots in aHash[], a power of 2 */
+	int nElem;            /* Number of elements in the hash table */
+	arena_block_t *pArena; /* Memory holding the elements */
+	u_int32_t nUsed;      /* Bytes held by the elements in the table */
+	u_int8_t full;        /* True once this pass makes no more elements */
+	u_int8_t skip;        /* True if AggFocus spilled the current row */
+	int level;            /* Partitioning steps of the keys this pass */
+	FILE *apOut[AGG_PART_FANOUT]; /* Files taking this pass' spilled rows */
+	FILE *pIn;            /* Partition being replayed, or NULL */
+	int nPart;            /* Number of partitions in aPart[] */
+	agg_part_t *aPart;    /* Partitions waiting for a later pass */
 	func_def_t **apFunc;  /* Information about aggregate functions */
 };
 struct agg_elem {
 	char *zKey;           /* The key to this AggElem */
 	int nKey;             /* Number of bytes in the key, including '\0'
 				 at end */
+	u_int32_t hash;       /* Hash of the key */
+	agg_elem_t *pHash;    /* Next element in the same hash chain */
+	agg_elem_t *pNext;    /* Next element in the order made, or in the
+				 free list */
+	char zShort[NBFS];    /* Space for short keys */
 	mem_t aMem[1];        /* The values for this AggElem */
 };
 
@@ -202,6 +363,53 @@ struct set {
 	hash_ele_t *prev;        /* Previously accessed hash elemen */
 };
 
+/*
+ * A join hash table holds the ROWIDs of the rows of the inner table of a
+ * hash join keyed by the value of the join column, see OP_HashReset.
+ * Elements with the same key are chained in ROWID order.  A table that
+ * grows past "PRAGMA hash_memory" spills: its elements move to a transient
+ * index on cursor iSpill, keyed by the hash and length of the key, the key
+ * and the ROWID.  The entries of one key are then next to each other in
+ * ROWID order and a probe seeks to them.
+ */
+typedef struct hjoin_elem hjoin_elem_t;
+struct hjoin_elem {
+	hjoin_elem_t *pHash;  /* Next element in the same hash chain */
+	u_int32_t hash;       /* Hash of the key */
+	int iRecno;           /* ROWID of the row */
+	int nKey;             /* Number of bytes in zKey[] */
+	char zKey[1];         /* The key, see __hjoin_key() */
+};
+struct hjoin {
+	int iCsr;             /* Cursor of the inner table */
+	u_int8_t text;        /* True if keys compare as text */
+	u_int8_t overflow;    /* True if the rows were spilled to iSpill */
+	int iSpill;           /* Cursor of the transient index */
+	hjoin_elem_t **aHash; /* Hash table of all elements */
+	int nHash;            /* Number of slots in aHash[], a power of 2 */
+	int nElem;            /* Number of elements in the hash table */
+	arena_block_t *pArena; /* Memory holding the elements */
+	u_int32_t nUsed;      /* Bytes held by the elements */
+	hjoin_elem_t *pMatch; /* Element the probe is positioned on */
+	char *zProbe;         /* Prefix of the entries of the probed key in
+				 iSpill, see __hjoin_prefix() */
+	int nProbe;           /* Number of bytes in zProbe */
+	int nProbeAlloc;      /* Number of bytes allocated for zProbe */
+};
+
+/*
+ * The P3 of an OP_ColumnCmp, made by __vdbe_optimize() with its operands
+ * already decoded.  The text comes first so that the structure reads as
+ * that string, for EXPLAIN, and is freed like any P3_DYNAMIC string.
+ */
+typedef struct column_cmp column_cmp_t;
+struct column_cmp {
+	char zText[60];       /* "C1,A1,C2,A2,K" as EXPLAIN shows it */
+	int iCsr1, iCol1;     /* Cursor and column of the left operand */
+	int iCsr2, iCol2;     /* Cursor and column of the right operand */
+	int iCmp;             /* The comparison, its opcode less OP_Eq */
+};
+
 /*
  * A keylist_t is a bunch of keys into a table.  The keylist can
  * grow without bound.  The keylist stores the ROWIDs of database
@@ -242,14 +450,27 @@ struct vdbe {
 	cursor_t *aCsr;       /* One element of this array for each open
 				 cursor */
 	sorter_t *pSort;      /* A linked list of objects to be sorted */
+	arena_block_t *pSortArena; /* Memory holding the elements of pSort */
+	u_int32_t nSortMem;   /* Bytes of pSortArena in use */
+	int nRun;             /* Number of runs written to temporary files */
+	sort_run_t *aRun;     /* The runs, in the order they were written */
+	int nRunHeap;         /* Number of runs in aRunHeap[] */
+	sort_run_t **aRunHeap; /* Min-heap of the runs that are not at EOF */
+	int nSortLimit;       /* Rows kept by a bounded sorter, or 0 */
+	int nHeap;            /* Number of elements in aHeap[] */
+	sorter_t **aHeap;     /* Max-heap of the best nSortLimit elements */
+	char *zHeapMax;       /* Largest key of the elements the heap spilled,
+				 larger keys are not kept */
+	u_int32_t iSortSeq;   /* Next sorter_t.iSeq */
+	arena_block_t *pStrArena; /* Memory holding MEM_Arena strings */
+	u_int32_t nStrArena;  /* Bytes of pStrArena in use */
+	u_int32_t nStrArenaHigh; /* Most bytes of pStrArena ever in use */
 	FILE *pFile;          /* At most one open file handler */
 	int nField;           /* Number of file fields */
 	char **azField;       /* Data for each file field */
-	int nVar;             /* Number of entries in azVariable[] */
-	char **azVar;         /* Values for the OP_Variable opcode */
-	int *anVar;           /* Length of each value in azVariable[] */
-	u_int8_t *abVar;      /* TRUE if azVariable[i] needs to be
-				 __os_free()ed */
+	int nVar;             /* Number of entries in aVar[] */
+	mem_t *aVar;          /* Values for the OP_Variable opcode */
+	char **azVarName;     /* Name of each ':name' variable, or 0 */
 	char *zLine;          /* A single line from the input file */
 	int nLineAlloc;       /* Number of spaces allocated for zLine */
 	int magic;            /* Magic number for sanity checking */
@@ -259,6 +480,8 @@ struct vdbe {
 	agg_t agg;            /* Aggregate information */
 	int nSet;             /* Number of sets allocated */
 	set_t *aSet;          /* An array of sets */
+	int nHJoin;           /* Number of join hash tables allocated */
+	hjoin_t *aHJoin;      /* An array of join hash tables */
 	int nCallback;        /* Number of callbacks invoked so far */
 	keylist_t *pList;     /* A list of ROWIDs */
 	int keylistStackDepth;  /* The size of the "keylist" stack */
@@ -270,6 +493,9 @@ struct vdbe {
 	int errorAction;      /* Recovery action to do in case of an error */
 	int undoTransOnError; /* If error, either ROLLBACK or COMMIT */
 	int inTempTrans;      /* True if temp database is transactioned */
+	u_int8_t readOnly;    /* True if the program writes no database */
+	int nSnap;            /* Number of entries in aSnap[] */
+	DB_TXN **aSnap;       /* Snapshot each database is read in, or 0 */
 	int returnStack[100]; /* Return address stack for OP_Gosub &
 				 OP_Return */
 	int returnDepth;      /* Next unused element in returnStack[] */
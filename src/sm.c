@@ -32,6 +32,55 @@ typedef struct {
 #define SM_SCHEMA_SIG "__DBSQL_schema_sig__"
 #define SM_FORMAT_VER "__DBSQL_format_sig__"
 #define SM_META_NAME  "__DBSQL_meta__"
+#define SM_STAT_PREFIX "__DBSQL_stat__"
+
+/*
+ * Size of the buffer used by read-only cursors to fetch many entries at
+ * once with DB_MULTIPLE_KEY during a sequential scan.  It must be a
+ * multiple of 1024 and at least as large as the database page size.
+ */
+#define SM_BULK_BUFSIZE (64 * 1024)
+
+/*
+ * Maximum number of closed cursors each sm_t keeps for reuse.  A pooled
+ * cursor keeps no bulk buffers, only its DBC and its key and data.
+ */
+#define SM_POOL_MAX 16
+
+/*
+ * Berkeley DB accepts DB_MULTIPLE_KEY buffers in DB->put starting with
+ * release 4.8.  With older releases batched inserts are not used.
+ */
+#if DB_VERSION_MAJOR > 4 || (DB_VERSION_MAJOR == 4 && DB_VERSION_MINOR >= 8)
+#define HAVE_SM_BULK_PUT 1
+#endif
+
+/*
+ * Berkeley DB reports the number of pages in a Btree in DB_FAST_STAT
+ * statistics starting with release 4.6.  When it has not counted the keys
+ * the number of entries is estimated from that, assuming each entry with
+ * its share of page overhead takes SM_EST_ENTRY_SIZE bytes.
+ */
+#if DB_VERSION_MAJOR > 4 || (DB_VERSION_MAJOR == 4 && DB_VERSION_MINOR >= 6)
+#define HAVE_SM_PAGECNT 1
+#endif
+#define SM_EST_ENTRY_SIZE 64
+
+/*
+ * Tables and indices of databases that read-only statements may read in a
+ * snapshot are opened with multiversion concurrency control when Berkeley
+ * DB supports it (release 4.5 and later), so that readers running under
+ * DB_TXN_SNAPSHOT neither wait for nor block writers.  Temporary and in
+ * memory databases belong to a single connection and are never read in a
+ * snapshot, so they are spared the cost of keeping page versions.
+ */
+#ifdef DB_MULTIVERSION
+#define SM_DB_MVCC(sm)							\
+	(F_ISSET((sm), SM_TEMP_DB | SM_INMEM_DB) ? 0 : DB_MULTIVERSION)
+#define SM_TXN_SNAPSHOT DB_TXN_SNAPSHOT
+#else
+#define SM_DB_MVCC(sm)  0
+#endif
 
 /*
  * __sm_cmp_values --
@@ -373,6 +422,150 @@ __sm_create(dbp, name, is_temp, in_memory, smp)
 	return DBSQL_SUCCESS;
 }
 
+/*
+ * __sm_cursor_release --
+ *	Close the DBC of a cursor and resolve the child transaction it ran
+ *	in.  The transaction is aborted if 'abort' is set or if closing the
+ *	DBC reports a deadlock, otherwise it is committed into its parent.
+ *	A cursor reading in a snapshot has no transaction of its own; the
+ *	snapshot is resolved by __sm_snapshot_end().
+ *	Returns DBSQL_INTERNAL if the transaction was aborted.
+ *
+ * STATIC: static int __sm_cursor_release __P((sm_cursor_t *, int));
+ */
+static int
+__sm_cursor_release(smc, abort)
+	sm_cursor_t *smc;
+	int abort;
+{
+	sm_t *sm;
+
+	sm = smc->sm;
+	if (smc->dbc && smc->dbc->c_close(smc->dbc) == DB_LOCK_DEADLOCK) {
+		sm->stat.deadlocks++;
+		abort = 1;
+	}
+	F_CLR(smc, SMC_SNAPSHOT);
+	if (smc->txn) {
+		if (abort)
+			smc->txn->abort(smc->txn);
+		else
+			smc->txn->commit(smc->txn, 0);
+	}
+	smc->dbc = 0;
+	smc->txn = 0;
+	smc->parent = 0;
+	return (abort ? DBSQL_INTERNAL : DBSQL_SUCCESS);
+}
+
+/*
+ * __sm_cursor_trim --
+ *	Free the buffers of a cursor that is out of bulk mode, the bulk
+ *	read buffer and the bulk put buffer.
+ *
+ * STATIC: static void __sm_cursor_trim __P((sm_cursor_t *));
+ */
+static void
+__sm_cursor_trim(smc)
+	sm_cursor_t *smc;
+{
+	DBSQL *dbp;
+
+	DBSQL_ASSERT(!F_ISSET(smc, SMC_BULK_SCAN | SMC_BULK_PUT));
+	dbp = smc->sm->dbp;
+	if (smc->bulk.data)
+		__dbsql_free(dbp, smc->bulk.data);
+	if (smc->bput.data)
+		__dbsql_free(dbp, smc->bput.data);
+	smc->bulk.data = 0;
+	smc->bput.data = 0;
+}
+
+/*
+ * __sm_cursor_free --
+ *	Release a cursor and everything it holds.
+ *
+ * STATIC: static int __sm_cursor_free __P((sm_cursor_t *, int));
+ */
+static int
+__sm_cursor_free(smc, abort)
+	sm_cursor_t *smc;
+	int abort;
+{
+	int rc;
+	DBSQL *dbp;
+
+	dbp = smc->sm->dbp;
+	rc = __sm_cursor_release(smc, abort);
+	if (!F_ISSET(smc, SMC_BULK_SCAN)) {
+		if (smc->key.data)
+			__dbsql_ufree(dbp, smc->key.data);
+		if (smc->data.data)
+			__dbsql_ufree(dbp, smc->data.data);
+	}
+	if (smc->bulk.data)
+		__dbsql_free(dbp, smc->bulk.data);
+	if (smc->bput.data)
+		__dbsql_free(dbp, smc->bput.data);
+	__dbsql_free(dbp, smc);
+	return rc;
+}
+
+/*
+ * __sm_pool_drain --
+ *	Free the pooled cursors on database 'id', or all pooled cursors if
+ *	'id' is negative.  This must be done before the transaction the
+ *	child transactions of pooled readers belong to is resolved and
+ *	before the database they refer to is closed, truncated or removed.
+ *
+ * STATIC: static void __sm_pool_drain __P((sm_t *, int));
+ */
+static void
+__sm_pool_drain(sm, id)
+	sm_t *sm;
+	int id;
+{
+	sm_cursor_t *smc, **pp;
+
+	for (pp = &sm->pool; (smc = *pp) != 0;) {
+		if (id < 0 || smc->id == id) {
+			*pp = smc->next;
+			sm->npool--;
+			__sm_cursor_free(smc, 0);
+		} else {
+			pp = &smc->next;
+		}
+	}
+}
+
+/*
+ * __sm_pool_release --
+ *	Close the DBCs of the pooled readers on database 'id' and commit
+ *	their child transactions, so that their read locks do not block a
+ *	writer on that database.  The cursors stay in the pool.
+ *
+ * STATIC: static void __sm_pool_release __P((sm_t *, int));
+ */
+static void
+__sm_pool_release(sm, id)
+	sm_t *sm;
+	int id;
+{
+	sm_cursor_t *smc, **pp;
+
+	for (pp = &sm->pool; (smc = *pp) != 0;) {
+		if (smc->id == id && F_ISSET(smc, SMC_RO_CURSOR) &&
+		    smc->txn != 0 &&
+		    __sm_cursor_release(smc, 0) != DBSQL_SUCCESS) {
+			*pp = smc->next;
+			sm->npool--;
+			__sm_cursor_free(smc, 0);
+		} else {
+			pp = &smc->next;
+		}
+	}
+}
+
 /*
  * __sm_close_db --
  *	Close all managed resources and free all memory used in sm_t.  If
@@ -392,6 +585,7 @@ __sm_close_db(sm)
 	DBSQL_ASSERT(sm != 0);
 
 /*	MUTEX_THREAD_LOCK(dbp->dbenv, sm->sm_mutexp);*/
+	__sm_pool_drain(sm, -1);
 	sm->n->close(sm->n, 0);
 	sm->meta->close(sm->meta, 0);
 	sm->primary->close(sm->primary, 0);
@@ -468,6 +662,7 @@ __sm_commit_txn(sm)
 	sm_t *sm;
 {
 	DBSQL_ASSERT(sm);
+	__sm_pool_drain(sm, -1);
 	if (sm->txn)
 		sm->txn->commit(sm->txn, 0);
 	sm->txn = 0;
@@ -488,12 +683,300 @@ __sm_abort_txn(sm)
 	sm_t *sm;
 {
 	DBSQL_ASSERT(sm);
+	__sm_pool_drain(sm, -1);
 	if (sm->txn)
 		sm->txn->abort(sm->txn);
 	sm->txn = 0;
 	return DBSQL_SUCCESS;
 }
 
+/*
+ * __sm_fetch --
+ *	Position the cursor as directed by 'op' and load the entry it lands
+ *	on into the cursor's own key and data buffers.  The buffers are
+ *	DB_DBT_REALLOC'ed so they only grow when an entry is larger than any
+ *	seen before on this cursor.  Returns the Berkeley DB error code.
+ *
+ * STATIC: static int __sm_fetch __P((sm_cursor_t *, u_int32_t));
+ */
+static int
+__sm_fetch(smc, op)
+	sm_cursor_t *smc;
+	u_int32_t op;
+{
+	int ret;
+
+	F_CLR(smc, SMC_ROW_VALID);
+	smc->gen++;
+	smc->key.flags = DB_DBT_REALLOC;
+	smc->data.flags = DB_DBT_REALLOC;
+	ret = smc->dbc->c_get(smc->dbc, &smc->key, &smc->data, op);
+	if (ret == 0)
+		F_SET(smc, SMC_ROW_VALID);
+	else if (ret == DB_LOCK_DEADLOCK)
+		smc->sm->stat.deadlocks++;
+	return ret;
+}
+
+/*
+ * __sm_flush_puts --
+ *	Write any entries batched up by __sm_insert() to the database.
+ *	Returns the Berkeley DB error code.
+ *
+ * STATIC: static int __sm_flush_puts __P((sm_cursor_t *));
+ */
+static int
+__sm_flush_puts(smc)
+	sm_cursor_t *smc;
+{
+	int ret = 0;
+#ifdef HAVE_SM_BULK_PUT
+	DBT data;
+
+	if (smc->nbput == 0)
+		return 0;
+	memset(&data, 0, sizeof(DBT));
+	ret = smc->db->put(smc->db, smc->txn, &smc->bput, &data,
+			   DB_MULTIPLE_KEY);
+	smc->nbput = 0;
+	DB_MULTIPLE_WRITE_INIT(smc->bputp, &smc->bput);
+#endif
+	return ret;
+}
+
+/*
+ * __sm_settle --
+ *	__sm_insert() does not position the cursor on the new entry, it
+ *	only remembers its key.  Write any batched entries and then move
+ *	the cursor onto the last inserted entry, loading it into the
+ *	cursor's key and data buffers.  This is done only when something
+ *	actually reads through the cursor after an insert.  Returns the
+ *	Berkeley DB error code.
+ *
+ * STATIC: static int __sm_settle __P((sm_cursor_t *));
+ */
+static int
+__sm_settle(smc)
+	sm_cursor_t *smc;
+{
+	int ret;
+
+	if ((ret = __sm_flush_puts(smc)) != 0)
+		return ret;
+	if (!F_ISSET(smc, SMC_SEEK_KEY))
+		return 0;
+	F_CLR(smc, SMC_SEEK_KEY);
+	return __sm_fetch(smc, DB_SET);
+}
+
+/*
+ * __sm_current --
+ *	Make sure the cursor's key and data buffers hold the entry the
+ *	cursor currently points to, reading it only when some operation
+ *	has invalidated them.  Returns the Berkeley DB error code.
+ *
+ * STATIC: static int __sm_current __P((sm_cursor_t *));
+ */
+static int
+__sm_current(smc)
+	sm_cursor_t *smc;
+{
+	if (F_ISSET(smc, SMC_SEEK_KEY))
+		return __sm_settle(smc);
+	if (F_ISSET(smc, SMC_ROW_VALID))
+		return 0;
+	return __sm_fetch(smc, DB_CURRENT);
+}
+
+/*
+ * __sm_bulk_fetch --
+ *	Fill the cursor's bulk buffer with as many entries as will fit,
+ *	starting at the one selected by 'op' (DB_FIRST or DB_NEXT).
+ *	Returns the Berkeley DB error code.
+ *
+ * STATIC: static int __sm_bulk_fetch __P((sm_cursor_t *, u_int32_t));
+ */
+static int
+__sm_bulk_fetch(smc, op)
+	sm_cursor_t *smc;
+	u_int32_t op;
+{
+	int ret;
+	DBT key;
+
+	memset(&key, 0, sizeof(DBT));
+	key.flags = DB_DBT_MALLOC;
+	smc->bulkp = 0;
+	ret = smc->dbc->c_get(smc->dbc, &key, &smc->bulk,
+			      op | DB_MULTIPLE_KEY);
+	if (key.data)
+		__dbsql_ufree(smc->sm->dbp, key.data);
+	if (ret == 0)
+		DB_MULTIPLE_INIT(smc->bulkp, &smc->bulk);
+	else if (ret == DB_LOCK_DEADLOCK)
+		smc->sm->stat.deadlocks++;
+	return ret;
+}
+
+/*
+ * __sm_bulk_step --
+ *	Point the cursor's key and data at the next entry held in the bulk
+ *	buffer.  Returns DB_NOTFOUND once the buffer is used up.
+ *
+ * STATIC: static int __sm_bulk_step __P((sm_cursor_t *));
+ */
+static int
+__sm_bulk_step(smc)
+	sm_cursor_t *smc;
+{
+	void *k, *d;
+	u_int32_t k_len, d_len;
+
+	F_CLR(smc, SMC_ROW_VALID);
+	smc->gen++;
+	if (smc->bulkp == 0)
+		return DB_NOTFOUND;
+	DB_MULTIPLE_KEY_NEXT(smc->bulkp, &smc->bulk, k, k_len, d, d_len);
+	if (smc->bulkp == 0)
+		return DB_NOTFOUND;
+	smc->key.data = k;
+	smc->key.size = k_len;
+	smc->data.data = d;
+	smc->data.size = d_len;
+	F_SET(smc, SMC_ROW_VALID);
+	return 0;
+}
+
+/*
+ * __sm_bulk_end --
+ *	Leave bulk scan mode.  A bulk read leaves the underlying DBC on the
+ *	last entry in the buffer rather than on the entry the cursor is
+ *	logically positioned on, so if 'reposition' is set the DBC is moved
+ *	back onto the current entry.  Otherwise the caller is about to move
+ *	the cursor to an absolute position and the current entry is simply
+ *	forgotten.  Returns the Berkeley DB error code.
+ *
+ * STATIC: static int __sm_bulk_end __P((sm_cursor_t *, int));
+ */
+static int
+__sm_bulk_end(smc, reposition)
+	sm_cursor_t *smc;
+	int reposition;
+{
+	void *k;
+
+	if (!F_ISSET(smc, SMC_BULK_SCAN))
+		return 0;
+	F_CLR(smc, SMC_BULK_SCAN);
+	smc->bulkp = 0;
+	k = 0;
+	if (reposition && F_ISSET(smc, SMC_ROW_VALID)) {
+		if (__dbsql_umalloc(smc->sm->dbp, smc->key.size, &k) == ENOMEM)
+			return ENOMEM;
+		memcpy(k, smc->key.data, smc->key.size);
+	}
+	F_CLR(smc, SMC_ROW_VALID);
+	smc->gen++;
+	smc->key.data = k;
+	smc->key.ulen = 0;
+	smc->data.data = 0;
+	smc->data.ulen = 0;
+	if (k == 0)
+		return 0;
+	return __sm_fetch(smc, DB_SET);
+}
+
+/*
+ * __sm_bulk_next --
+ *	Step a cursor in bulk scan mode to the next entry, refilling the
+ *	buffer once it is used up.  If the next entry is too large for the
+ *	buffer the cursor leaves bulk mode, is put back on the last entry
+ *	of the old buffer and goes on one entry at a time.  Returns the
+ *	Berkeley DB error code.
+ *
+ * STATIC: static int __sm_bulk_next __P((sm_cursor_t *));
+ */
+static int
+__sm_bulk_next(smc)
+	sm_cursor_t *smc;
+{
+	void *k;
+	u_int32_t k_len;
+	int ret;
+
+	if ((ret = __sm_bulk_step(smc)) != DB_NOTFOUND)
+		return ret;
+
+	/*
+	 * The key still points at the last entry of the buffer, which
+	 * the refill may overwrite.  Keep a copy to reposition on.
+	 */
+	k = 0;
+	k_len = smc->key.size;
+	if (smc->key.data != 0) {
+		if (__dbsql_umalloc(smc->sm->dbp, k_len, &k) == ENOMEM)
+			return ENOMEM;
+		memcpy(k, smc->key.data, k_len);
+	}
+	if ((ret = __sm_bulk_fetch(smc, DB_NEXT)) == 0)
+		ret = __sm_bulk_step(smc);
+	if (ret != DB_BUFFER_SMALL || k == 0) {
+		if (k)
+			__dbsql_ufree(smc->sm->dbp, k);
+		return ret;
+	}
+	__sm_bulk_end(smc, 0);
+	smc->key.data = k;
+	smc->key.size = k_len;
+	if ((ret = __sm_fetch(smc, DB_SET)) == 0)
+		ret = __sm_fetch(smc, DB_NEXT);
+	return ret;
+}
+
+/*
+ * __sm_bulk_begin --
+ *	Switch a read-only cursor into bulk scan mode and position it on
+ *	the first entry in the database.  While in this mode the entries
+ *	are read a buffer at a time and __sm_next() steps through them in
+ *	memory.  If bulk reads are not possible (for instance an entry is
+ *	too large to fit in the buffer) the cursor falls back to reading
+ *	one entry at a time.  Returns the Berkeley DB error code.
+ *
+ * STATIC: static int __sm_bulk_begin __P((sm_cursor_t *));
+ */
+static int
+__sm_bulk_begin(smc)
+	sm_cursor_t *smc;
+{
+	int ret;
+
+	if (smc->bulk.data == 0) {
+		if (__dbsql_malloc(smc->sm->dbp, SM_BULK_BUFSIZE,
+				   &smc->bulk.data) == ENOMEM)
+			return __sm_fetch(smc, DB_FIRST);
+		smc->bulk.ulen = SM_BULK_BUFSIZE;
+		smc->bulk.flags = DB_DBT_USERMEM;
+	}
+	if (!F_ISSET(smc, SMC_BULK_SCAN)) {
+		/* The key and data are about to point into the bulk buffer. */
+		if (smc->key.data)
+			__dbsql_ufree(smc->sm->dbp, smc->key.data);
+		if (smc->data.data)
+			__dbsql_ufree(smc->sm->dbp, smc->data.data);
+		F_SET(smc, SMC_BULK_SCAN);
+	}
+	switch (ret = __sm_bulk_fetch(smc, DB_FIRST)) {
+	case 0:
+		return __sm_bulk_step(smc);
+	case DB_NOTFOUND:
+		__sm_bulk_end(smc, 0);
+		return ret;
+	default:
+		__sm_bulk_end(smc, 0);
+		return __sm_fetch(smc, DB_FIRST);
+	}
+}
+
 /*
  * __sm_cursor --
  *	Create a new cursor for the btree index 'idb'.  If 'write' is set
@@ -502,60 +985,160 @@ __sm_abort_txn(sm)
  *	that a sequential scan using __sm_cursor_next will consistently
  *	read all values in the database.
  *
- * PUBLIC: int __sm_cursor __P((sm_t *, int, int, sm_cursor_t **));
+ *	Cursors closed earlier in the same transaction are kept in a
+ *	small pool and handed out again when one is asked for on the same
+ *	database in the same mode.  A reader that still has its DBC and
+ *	child transaction is handed out as is, only that counts as a pool
+ *	hit.  Opening a writer releases the pooled readers on its database.
+ *
+ *	If 'snap' is not NULL it is a snapshot from __sm_snapshot_begin()
+ *	and a read-only cursor reads in it instead of in a transaction of
+ *	its own.  Such a cursor takes no read locks, so a long SELECT never
+ *	blocks a writer.
+ *
+ * PUBLIC: int __sm_cursor __P((sm_t *, int, int, DB_TXN *,
+ * PUBLIC:                 sm_cursor_t **));
  */
 int
-__sm_cursor(sm, id, write, smcp)
+__sm_cursor(sm, id, write, snap, smcp)
 	sm_t *sm;
 	int id;
 	int write;
+	DB_TXN *snap;
 	sm_cursor_t **smcp;
 {
-	int rc;
 	sm_rec_t *smr;
-	sm_cursor_t *smc;
+	sm_cursor_t *smc, **pp;
 	DB_ENV *dbenv;
+	int mode;
 
 	DBSQL_ASSERT(sm != 0);
 	DBSQL_ASSERT(smcp != 0);
 
 	*smcp = 0;
 	dbenv = sm->dbp->dbenv;
+	mode = (write ? SMC_RW_CURSOR : SMC_RO_CURSOR);
 
 	smr = (sm_rec_t *)__hash_find(&sm->dbs, (const void *)0, id);
 	if (smr == 0)
 		return DBSQL_INTERNAL;
 
-	if (__dbsql_calloc(sm->dbp, 1, sizeof(sm_cursor_t), &smc) == ENOMEM)
-		return DBSQL_NOMEM;
-
-	smc->sm = sm;
+	if (write)
+		__sm_pool_release(sm, id);
+	for (pp = &sm->pool; (smc = *pp) != 0; pp = &smc->next) {
+		if (smc->id == id && F_ISSET(smc, mode) &&
+		    (smc->txn == 0 || (snap == 0 && smc->parent == sm->txn)))
+			break;
+	}
+	if (smc != 0) {
+		*pp = smc->next;
+		smc->next = 0;
+		sm->npool--;
+	} else {
+		if (__dbsql_calloc(sm->dbp, 1, sizeof(sm_cursor_t),
+				   &smc) == ENOMEM)
+			return DBSQL_NOMEM;
+		smc->sm = sm;
+		smc->id = id;
+		F_SET(smc, mode);
+	}
 	smc->db = smr->db;
-	smc->id = id;
-
+	if (smc->txn != 0) {
+		sm->stat.pool_hits++;
+		*smcp = smc;
+		return DBSQL_SUCCESS;
+	}
+	sm->stat.pool_misses++;
+
+	if (!write && snap != 0) {
+		F_SET(smc, SMC_SNAPSHOT);
+		smc->parent = 0;
+		if (smr->db->cursor(smr->db, snap, &smc->dbc, 0) != 0) {
+			smc->dbc = 0;
+			__sm_cursor_free(smc, 1);
+			return DBSQL_INTERNAL;
+		}
+		*smcp = smc;
+		return DBSQL_SUCCESS;
+	}
 	if (dbenv->txn_begin(dbenv, sm->txn, &smc->txn, 0) != 0) {
-		__dbsql_free(sm->dbp, smc);
+		smc->txn = 0;
+		__sm_cursor_free(smc, 0);
 		return DBSQL_INTERNAL;
 	}
-	if (write)
-		F_SET(smc, SMC_RW_CURSOR);
-	else
-		F_SET(smc, SMC_RO_CURSOR);
-
+	smc->parent = sm->txn;
 	if (smr->db->cursor(smr->db, smc->txn, &smc->dbc, 0) != 0) {
-		smc->txn->abort(smc->txn);
-		__dbsql_free(sm->dbp, smc);
+		smc->dbc = 0;
+		__sm_cursor_free(smc, 1);
 		return DBSQL_INTERNAL;
 	}
 	*smcp = smc;
 	return DBSQL_SUCCESS;
 }
 
+/*
+ * __sm_snapshot_begin --
+ *	Begin a DB_TXN_SNAPSHOT transaction for the cursors a read-only
+ *	statement opens on this database, so that the statement sees one
+ *	state of the database however many cursors it opens.  '*txnp' is
+ *	left NULL if the statement must lock as usual instead: inside of an
+ *	explicit transaction, on temporary databases and when Berkeley DB
+ *	has no multiversion support.
+ *
+ * PUBLIC: int __sm_snapshot_begin __P((sm_t *, DB_TXN **));
+ */
+int
+__sm_snapshot_begin(sm, txnp)
+	sm_t *sm;
+	DB_TXN **txnp;
+{
+	DB_ENV *dbenv;
+
+	DBSQL_ASSERT(sm != 0);
+
+	*txnp = 0;
+	if (sm->txn != 0 || SM_DB_MVCC(sm) == 0)
+		return DBSQL_SUCCESS;
+#ifdef SM_TXN_SNAPSHOT
+	dbenv = sm->dbp->dbenv;
+	if (dbenv->txn_begin(dbenv, 0, txnp, SM_TXN_SNAPSHOT) != 0) {
+		*txnp = 0;
+		return DBSQL_INTERNAL;
+	}
+	sm->stat.snapshots++;
+#else
+	COMPQUIET(dbenv, NULL);
+#endif
+	return DBSQL_SUCCESS;
+}
+
+/*
+ * __sm_snapshot_end --
+ *	Resolve a snapshot from __sm_snapshot_begin().  Every cursor that
+ *	reads in it must have been closed.
+ *
+ * PUBLIC: void __sm_snapshot_end __P((DB_TXN *));
+ */
+void
+__sm_snapshot_end(txn)
+	DB_TXN *txn;
+{
+	if (txn != 0)
+		txn->commit(txn, 0);
+}
+
 /*
  * __sm_close_cursor --
- *	If this is a read-only cursor, discard the sm_cursor_t->txn.  If
- *	not, it should have been NULL, check that.  Close the
- *	sm_cursor_t->dbc and free the sm_cursor_t.
+ *	Write out anything the cursor still holds back and return it to
+ *	the pool of the sm_t it belongs to, or free it if the pool is full.
+ *	A reader inside of a larger transaction keeps its DBC and child
+ *	transaction while it waits in the pool so that reusing it costs
+ *	nothing, these are released by __sm_pool_release() when a writer
+ *	opens on the same database and by __sm_commit_txn() or
+ *	__sm_abort_txn().  Any other cursor is released now: a writer so
+ *	that what it wrote is visible to the rest of the transaction, a
+ *	reader on its own so that it holds no locks between statements.
+ *	The bulk buffers are freed either way.
  *
  * PUBLIC: int __sm_close_cursor __P((sm_cursor_t *));
  */
@@ -563,19 +1146,143 @@ int
 __sm_close_cursor(smc)
 	sm_cursor_t *smc;
 {
-	int rc = DBSQL_SUCCESS;
+	int rc;
+	sm_t *sm;
 	DBSQL_ASSERT(smc != 0);
 
-	
-	if (smc->dbc->c_close(smc->dbc)  == DB_LOCK_DEADLOCK) {
-		smc->txn->abort(smc->txn);
-		rc = DBSQL_INTERNAL;
-	} else
-		smc->txn->commit(smc->txn, 0);
-	__dbsql_free(smc->sm->dbp, smc);
+	sm = smc->sm;
+	if (__sm_flush_puts(smc) != 0)
+		return __sm_cursor_free(smc, 1);
+	__sm_bulk_end(smc, 0);
+	F_CLR(smc, SMC_ROW_VALID | SMC_SEEK_KEY | SMC_BULK_PUT);
+	smc->gen++;
+
+	rc = DBSQL_SUCCESS;
+	if (F_ISSET(smc, SMC_RW_CURSOR) || smc->parent == 0) {
+		if ((rc = __sm_cursor_release(smc, 0)) != DBSQL_SUCCESS) {
+			__sm_cursor_free(smc, 0);
+			return rc;
+		}
+	}
+	if (sm->npool >= SM_POOL_MAX)
+		return __sm_cursor_free(smc, 0);
+	__sm_cursor_trim(smc);
+	smc->next = sm->pool;
+	sm->pool = smc;
+	sm->npool++;
+	return rc;
+}
+
+/*
+ * __sm_stat --
+ *	Copy the storage manager's counters into 'sp'.  The lock counters
+ *	come from the Berkeley DB environment and so cover every database
+ *	in it.
+ *
+ * PUBLIC: int __sm_stat __P((sm_t *, sm_stat_t *));
+ */
+int
+__sm_stat(sm, sp)
+	sm_t *sm;
+	sm_stat_t *sp;
+{
+	DB_ENV *dbenv;
+	DB_LOCK_STAT *lsp;
+
+	DBSQL_ASSERT(sm != 0);
+	DBSQL_ASSERT(sp != 0);
+
+	*sp = sm->stat;
+	dbenv = sm->dbp->dbenv;
+	if (dbenv->lock_stat(dbenv, &lsp, 0) == 0) {
+		sp->lock_waits = (u_int32_t)lsp->st_lock_wait;
+		sp->lock_deadlocks = (u_int32_t)lsp->st_ndeadlocks;
+		__dbsql_ufree(sm->dbp, lsp);
+	}
+	return DBSQL_SUCCESS;
+}
+
+/*
+ * __sm_estimate_entries --
+ *	Estimate the number of entries in the table or index 'id' without
+ *	reading it.  The key count Berkeley DB saves in the metadata page
+ *	is used when there is one, otherwise the estimate is made from the
+ *	size of the database.  Returns DBSQL_NOTFOUND if neither is known.
+ *
+ * PUBLIC: int __sm_estimate_entries __P((sm_t *, int, double *));
+ */
+int
+__sm_estimate_entries(sm, id, count)
+	sm_t *sm;
+	int id;
+	double *count;
+{
+	int rc;
+	sm_rec_t *smr;
+	DB_BTREE_STAT *sp;
+
+	DBSQL_ASSERT(sm != 0);
+	DBSQL_ASSERT(count != 0);
+
+	smr = (sm_rec_t *)__hash_find(&sm->dbs, (const void *)0, id);
+	if (smr == 0)
+		return DBSQL_NOTFOUND;
+	if (smr->db->stat(smr->db, sm->txn, &sp, DB_FAST_STAT) != 0)
+		return DBSQL_INTERNAL;
+	rc = DBSQL_SUCCESS;
+	if (sp->bt_nkeys > 0)
+		*count = sp->bt_nkeys;
+#ifdef HAVE_SM_PAGECNT
+	else if (sp->bt_pagecnt > 1)
+		*count = ((double)(sp->bt_pagecnt - 1) * sp->bt_pagesize) /
+			SM_EST_ENTRY_SIZE;
+#endif
+	else
+		rc = DBSQL_NOTFOUND;
+	__dbsql_ufree(sm->dbp, sp);
 	return rc;
 }
 
+/*
+ * __sm_estimate_range --
+ *	Estimate the fractions of the entries of the table or index 'id'
+ *	whose keys sort before and the same as the 'len' bytes at 'key'.
+ *	Berkeley DB works these out from the path a search for the key
+ *	takes, without reading the leaf pages.
+ *
+ * PUBLIC: int __sm_estimate_range __P((sm_t *, int, const void *, int,
+ * PUBLIC:                         double *, double *));
+ */
+int
+__sm_estimate_range(sm, id, key, len, less, equal)
+	sm_t *sm;
+	int id;
+	const void *key;
+	int len;
+	double *less;
+	double *equal;
+{
+	sm_rec_t *smr;
+	DBT k;
+	DB_KEY_RANGE kr;
+
+	DBSQL_ASSERT(sm != 0);
+
+	smr = (sm_rec_t *)__hash_find(&sm->dbs, (const void *)0, id);
+	if (smr == 0)
+		return DBSQL_NOTFOUND;
+	memset(&k, 0, sizeof(DBT));
+	k.data = (void *)key;
+	k.size = len;
+	if (smr->db->key_range(smr->db, sm->txn, &k, &kr, 0) != 0)
+		return DBSQL_INTERNAL;
+	if (less)
+		*less = kr.less;
+	if (equal)
+		*equal = kr.equal;
+	return DBSQL_SUCCESS;
+}
+
 /*
  * __sm_moveto --
  *	Move the cursor to a node near the key to be inserted. If the key
@@ -615,6 +1322,11 @@ __sm_moveto(smc, item, len, result)
 	DBSQL_ASSERT(result);
 
 	dbc = smc->dbc;
+	__sm_bulk_end(smc, 0);
+	F_CLR(smc, SMC_ROW_VALID | SMC_SEEK_KEY);
+	smc->gen++;
+	if (__sm_flush_puts(smc) != 0)
+		return DBSQL_INTERNAL;
 
 	memset(&key, 0, sizeof(DBT));
 	memset(&data, 0, sizeof(DBT));
@@ -679,17 +1391,18 @@ __sm_next(smc, result)
 	int *result;
 {
 	int rc = DBSQL_SUCCESS;
-	DBT key, data;
+	int ret;
 
 	DBSQL_ASSERT(smc);
 	DBSQL_ASSERT(result);
 
-	memset(&key, 0, sizeof(DBT));
-	memset(&data, 0, sizeof(DBT));
-	key.flags = DB_DBT_MALLOC;
-	data.flags = DB_DBT_MALLOC;
-
-	switch(smc->dbc->c_get(smc->dbc, &key, &data, DB_NEXT)) {
+	if (F_ISSET(smc, SMC_BULK_SCAN)) {
+		if ((ret = __sm_bulk_next(smc)) != 0)
+			__sm_bulk_end(smc, 0);
+	} else if ((ret = __sm_settle(smc)) == 0) {
+		ret = __sm_fetch(smc, DB_NEXT);
+	}
+	switch(ret) {
 	case 0:
 		*result = 0;
 		break;
@@ -697,14 +1410,11 @@ __sm_next(smc, result)
 		*result = 1;
 		break;
 	default:
+		*result = 1;
 		rc = DBSQL_INTERNAL; /* TODO */
 		break;
 	}
-	if (key.data)
-		__dbsql_ufree(smc->sm->dbp, key.data);
-	if (data.data)
-		__dbsql_ufree(smc->sm->dbp, data.data);
-	return DBSQL_SUCCESS;
+	return rc;
 }
 
 /*
@@ -722,17 +1432,13 @@ __sm_prev(smc, result)
 	int *result;
 {
 	int rc = DBSQL_SUCCESS;
-	DBT key, data;
 
 	DBSQL_ASSERT(smc);
 	DBSQL_ASSERT(result);
 
-	memset(&key, 0, sizeof(DBT));
-	memset(&data, 0, sizeof(DBT));
-	key.flags = DB_DBT_MALLOC;
-	data.flags = DB_DBT_MALLOC;
-
-	switch(smc->dbc->c_get(smc->dbc, &key, &data, DB_PREV)) {
+	if (__sm_bulk_end(smc, 1) != 0 || __sm_settle(smc) != 0)
+		return DBSQL_INTERNAL;
+	switch(__sm_fetch(smc, DB_PREV)) {
 	case 0:
 		*result = 0;
 		break;
@@ -743,10 +1449,6 @@ __sm_prev(smc, result)
 		rc = DBSQL_INTERNAL;
 		break;
 	}
-	if (key.data)
-		__dbsql_ufree(smc->sm->dbp, key.data);
-	if (data.data)
-		__dbsql_ufree(smc->sm->dbp, data.data);
 	return rc;
 }
 
@@ -766,19 +1468,13 @@ __sm_key_size(smc, size)
 	int *size;
 {
 	int rc = DBSQL_SUCCESS;
-	DBT key, data;
 
 	DBSQL_ASSERT(smc);
 	DBSQL_ASSERT(size);
 
-	memset(&key, 0, sizeof(DBT));
-	memset(&data, 0, sizeof(DBT));
-	key.flags = DB_DBT_MALLOC;
-	data.flags = DB_DBT_MALLOC;
-
-	switch(smc->dbc->c_get(smc->dbc, &key, &data, DB_CURRENT)) {
+	switch(__sm_current(smc)) {
 	case 0:
-		*size = key.size;
+		*size = smc->key.size;
 		break;
 	case DB_NOTFOUND:
 		*size = 0;
@@ -787,10 +1483,6 @@ __sm_key_size(smc, size)
 		rc = DBSQL_INTERNAL; /* TODO */
 		break;
 	}
-	if (key.data)
-		__dbsql_ufree(smc->sm->dbp, key.data);
-	if (data.data)
-		__dbsql_ufree(smc->sm->dbp, data.data);
 	return rc;
 }
 
@@ -810,19 +1502,13 @@ __sm_data_size(smc, size)
 	int *size;
 {
 	int rc = DBSQL_SUCCESS;
-	DBT key, data;
 
 	DBSQL_ASSERT(smc);
 	DBSQL_ASSERT(size);
 
-	memset(&key, 0, sizeof(DBT));
-	memset(&data, 0, sizeof(DBT));
-	key.flags = DB_DBT_MALLOC;
-	data.flags = DB_DBT_MALLOC;
-
-	switch(smc->dbc->c_get(smc->dbc, &key, &data, DB_CURRENT)) {
+	switch(__sm_current(smc)) {
 	case 0:
-		*size = data.size;
+		*size = smc->data.size;
 		break;
 	case DB_NOTFOUND:
 		*size = 0;
@@ -831,10 +1517,6 @@ __sm_data_size(smc, size)
 		rc = DBSQL_INTERNAL;
 		break;
 	}
-	if (key.data)
-		__dbsql_ufree(smc->sm->dbp, key.data);
-	if (data.data)
-		__dbsql_ufree(smc->sm->dbp, data.data);
 	return rc;
 }
 
@@ -865,34 +1547,25 @@ __sm_key_compare(smc, value, len, ignore, result)
 {
 	int rc = DBSQL_SUCCESS;
 	int nlen;
-	DBT key, data;
 
 	DBSQL_ASSERT(smc);
 	DBSQL_ASSERT(value);
 	DBSQL_ASSERT(ignore >= 0);
 
-	memset(&key, 0, sizeof(DBT));
-	memset(&data, 0, sizeof(DBT));
-	key.flags = DB_DBT_MALLOC;
-	data.flags = DB_DBT_MALLOC;
-
-	switch(smc->dbc->c_get(smc->dbc, &key, &data, DB_CURRENT)) {
+	switch(__sm_current(smc)) {
 	case 0:
-		nlen = key.size - ignore;
+		nlen = smc->key.size - ignore;
 		if (nlen < 0) {
 			*result = -1;
 		} else {
-			*result = __sm_cmp_values(key.data, nlen, value, len);
+			*result = __sm_cmp_values(smc->key.data, nlen,
+						  value, len);
 			break;
 		}
 	default:
 		rc = DBSQL_INTERNAL;
 		break;
 	}
-	if (key.data)
-		__dbsql_ufree(smc->sm->dbp, key.data);
-	if (data.data)
-		__dbsql_ufree(smc->sm->dbp, data.data);
 	return rc;
 }
 
@@ -911,34 +1584,27 @@ __sm_key(smc, offset, len, value)
 	const void *value;
 {
 	size_t amt = 0;
-	DBT key, data;
+	DBT *dbt;
 
 	DBSQL_ASSERT(smc);
 
-	memset(&key, 0, sizeof(DBT));
-	memset(&data, 0, sizeof(DBT));
-	key.flags = DB_DBT_MALLOC;
-	data.flags = DB_DBT_MALLOC;
-
-	switch(smc->dbc->c_get(smc->dbc, &key, &data, DB_CURRENT)) {
+	dbt = &smc->key;
+	switch(__sm_current(smc)) {
 	case 0:
-		if (!key.data || ((len + offset) <= key.size)) {
-			memcpy((void *)value, ((char*)key.data) + offset, len);
+		if (!dbt->data || ((len + offset) <= dbt->size)) {
+			memcpy((void *)value, ((char*)dbt->data) + offset,
+			       len);
 			amt = len;
 		} else {
-			memcpy((void *)value, ((char*)key.data) + offset,
-			       key.size - offset);
-			amt = key.size - offset;
+			memcpy((void *)value, ((char*)dbt->data) + offset,
+			       dbt->size - offset);
+			amt = dbt->size - offset;
 		}
 		break;
 	default:
 		amt = 0; /* TODO error */
 		break;
 	}
-	if (key.data)
-		__dbsql_ufree(smc->sm->dbp, key.data);
-	if (data.data)
-		__dbsql_ufree(smc->sm->dbp, data.data);
 	return amt;
 }
 
@@ -957,43 +1623,124 @@ __sm_data(smc, offset, len, value)
 	char *value;
 {
 	size_t amt = 0;
-	DBT key, data;
+	DBT *dbt;
 
 	DBSQL_ASSERT(smc);
 
-	memset(&key, 0, sizeof(DBT));
-	memset(&data, 0, sizeof(DBT));
-	key.flags = DB_DBT_MALLOC;
-	data.flags = DB_DBT_MALLOC;
-
-	switch(smc->dbc->c_get(smc->dbc, &key, &data, DB_CURRENT)) {
+	dbt = &smc->data;
+	switch(__sm_current(smc)) {
 	case 0:
-		if (!data.data || ((len + offset) <= data.size)) {
-			memcpy((void *)value, ((char*)data.data) + offset,len);
+		if (!dbt->data || ((len + offset) <= dbt->size)) {
+			memcpy((void *)value, ((char*)dbt->data) + offset,
+			       len);
 			amt = len;
 		} else {
-			memcpy((void *)value, ((char*)data.data) + offset,
-			       data.size - offset);
-			amt = data.size - offset;
+			memcpy((void *)value, ((char*)dbt->data) + offset,
+			       dbt->size - offset);
+			amt = dbt->size - offset;
 		}
 		break;
 	default:
 		amt = 0; /* TODO */
 		break;
 	}
-	if (key.data)
-		__dbsql_ufree(smc->sm->dbp, key.data);
-	if (data.data)
-		__dbsql_ufree(smc->sm->dbp, data.data);
 	return amt;
 }
 
+/*
+ * __sm_row_gen --
+ *	Return a number that changes whenever the entry the cursor points
+ *	to, or the buffers holding it, may have changed.  Callers use it to
+ *	tell whether what they derived from the current entry is stale.
+ *
+ * PUBLIC: u_int32_t __sm_row_gen __P((sm_cursor_t *));
+ */
+u_int32_t
+__sm_row_gen(smc)
+	sm_cursor_t *smc;
+{
+	DBSQL_ASSERT(smc);
+	return (smc->gen);
+}
+
+/*
+ * __sm_key_ptr --
+ *	Set *value to point at the key of the entry the cursor currently
+ *	points to and *size to its length, without copying it.  The memory
+ *	belongs to the cursor and is only valid until the cursor is next
+ *	moved, written through or closed.  If the cursor does not point
+ *	at an entry, *value is NULL and *size is 0.
+ *
+ * PUBLIC: int __sm_key_ptr __P((sm_cursor_t *, const char **, int *));
+ */
+int
+__sm_key_ptr(smc, value, size)
+	sm_cursor_t *smc;
+	const char **value;
+	int *size;
+{
+	DBSQL_ASSERT(smc);
+	DBSQL_ASSERT(value);
+	DBSQL_ASSERT(size);
+
+	switch(__sm_current(smc)) {
+	case 0:
+		*value = (const char *)smc->key.data;
+		*size = smc->key.size;
+		return DBSQL_SUCCESS;
+	case DB_NOTFOUND:
+		*value = 0;
+		*size = 0;
+		return DBSQL_SUCCESS;
+	default:
+		*value = 0;
+		*size = 0;
+		return DBSQL_INTERNAL;
+	}
+}
+
+/*
+ * __sm_data_ptr --
+ *	The data counterpart of __sm_key_ptr().
+ *
+ * PUBLIC: int __sm_data_ptr __P((sm_cursor_t *, const char **, int *));
+ */
+int
+__sm_data_ptr(smc, value, size)
+	sm_cursor_t *smc;
+	const char **value;
+	int *size;
+{
+	DBSQL_ASSERT(smc);
+	DBSQL_ASSERT(value);
+	DBSQL_ASSERT(size);
+
+	switch(__sm_current(smc)) {
+	case 0:
+		*value = (const char *)smc->data.data;
+		*size = smc->data.size;
+		return DBSQL_SUCCESS;
+	case DB_NOTFOUND:
+		*value = 0;
+		*size = 0;
+		return DBSQL_SUCCESS;
+	default:
+		*value = 0;
+		*size = 0;
+		return DBSQL_INTERNAL;
+	}
+}
+
 /*
  * __sm_first --
  *	Advance the cursor to the first entry in the database.  If
  *	successful then set *result=0 and return DBSQL_SUCCESS.
  *	If the database was empty, then set *result=1.
  *
+ *	Read-only cursors are put into bulk scan mode so that the
+ *	__sm_next() calls of the sequential scan that usually follows are
+ *	served from memory a page of entries at a time.
+ *
  * PUBLIC: int __sm_first __P((sm_cursor_t *, int *));
  */
 int
@@ -1002,17 +1749,19 @@ __sm_first(smc, result)
 	int *result;
 {
 	int rc = DBSQL_SUCCESS;
-	DBT key, data;
+	int ret;
 
 	DBSQL_ASSERT(smc);
 	DBSQL_ASSERT(result);
 
-	memset(&key, 0, sizeof(DBT));
-	memset(&data, 0, sizeof(DBT));
-	key.flags = DB_DBT_MALLOC;
-	data.flags = DB_DBT_MALLOC;
-
-	switch(smc->dbc->c_get(smc->dbc, &key, &data, DB_FIRST)) {
+	F_CLR(smc, SMC_SEEK_KEY);
+	if ((ret = __sm_flush_puts(smc)) != 0)
+		;
+	else if (F_ISSET(smc, SMC_RO_CURSOR))
+		ret = __sm_bulk_begin(smc);
+	else
+		ret = __sm_fetch(smc, DB_FIRST);
+	switch(ret) {
 	case 0:
 		*result = 0;
 		break;
@@ -1022,10 +1771,6 @@ __sm_first(smc, result)
 	default:
 		rc = DBSQL_INTERNAL; /* TODO: report error */
 	}
-	if (key.data)
-		__dbsql_ufree(smc->sm->dbp, key.data);
-	if (data.data)
-		__dbsql_ufree(smc->sm->dbp, data.data);
 	return rc;
 }
 
@@ -1043,17 +1788,15 @@ __sm_last(smc, result)
 	int *result;
 {
 	int rc = DBSQL_SUCCESS;
-	DBT key, data;
 
 	DBSQL_ASSERT(smc);
 	DBSQL_ASSERT(result);
 
-	memset(&key, 0, sizeof(DBT));
-	memset(&data, 0, sizeof(DBT));
-	key.flags = DB_DBT_MALLOC;
-	data.flags = DB_DBT_MALLOC;
-
-	switch(smc->dbc->c_get(smc->dbc, &key, &data, DB_LAST)) {
+	__sm_bulk_end(smc, 0);
+	F_CLR(smc, SMC_SEEK_KEY);
+	if (__sm_flush_puts(smc) != 0)
+		return DBSQL_INTERNAL;
+	switch(__sm_fetch(smc, DB_LAST)) {
 	case 0:
 		*result = 0;
 		break;
@@ -1063,10 +1806,6 @@ __sm_last(smc, result)
 	default:
 		rc = DBSQL_INTERNAL; /* TODO: report error */
 	}
-	if (key.data)
-		__dbsql_ufree(smc->sm->dbp, key.data);
-	if (data.data)
-		__dbsql_ufree(smc->sm->dbp, data.data);
 	return rc;
 }
 
@@ -1077,6 +1816,11 @@ __sm_last(smc, result)
  *	define what database the record should be inserted into.  The cursor
  *	is left pointing at the new record.
  *
+ *	The cursor is not actually moved onto the new record until
+ *	something reads through it, see __sm_settle().  If the cursor is
+ *	in bulk insert mode the record may not even be written to the
+ *	database until then.
+ *
  * PUBLIC: int __sm_insert __P((sm_cursor_t *, const void *, int,
  * PUBLIC:                 const void *, int));
  */
@@ -1088,13 +1832,35 @@ __sm_insert(smc, k, k_len, v, v_len)
 	const void *v;
 	int v_len;
 {
-	int rc = DBSQL_SUCCESS;
 	DBT key, data;
 
 	DBSQL_ASSERT(smc);
 	DBSQL_ASSERT(k);
 	DBSQL_ASSERT(k_len);
 
+	__sm_bulk_end(smc, 0);
+	F_CLR(smc, SMC_ROW_VALID | SMC_SEEK_KEY);
+	smc->gen++;
+
+#ifdef HAVE_SM_BULK_PUT
+	if (F_ISSET(smc, SMC_BULK_PUT)) {
+		DB_MULTIPLE_KEY_WRITE_NEXT(smc->bputp, &smc->bput,
+					   k, k_len, v, v_len);
+		if (smc->bputp == 0 && smc->nbput > 0) {
+			/* The buffer is full, write it out and try again. */
+			if (__sm_flush_puts(smc) != 0)
+				return DBSQL_INTERNAL;
+			DB_MULTIPLE_KEY_WRITE_NEXT(smc->bputp, &smc->bput,
+						   k, k_len, v, v_len);
+		}
+		if (smc->bputp != 0) {
+			smc->nbput++;
+			goto remember;
+		}
+		/* Too large to batch at all, write it on its own. */
+		DB_MULTIPLE_WRITE_INIT(smc->bputp, &smc->bput);
+	}
+#endif
 	memset(&key, 0, sizeof(DBT));
 	memset(&data, 0, sizeof(DBT));
 	key.flags = DB_DBT_USERMEM;
@@ -1106,15 +1872,72 @@ __sm_insert(smc, k, k_len, v, v_len)
 	data.data = (void *)v;
 
 	if (smc->db->put(smc->db, smc->txn, &key, &data, 0) != 0)
-		rc = DBSQL_INTERNAL;
-	else {
-		/* Position the cursor to the new entry. */
-		key.ulen = k_len;
-		data.ulen = v_len;
-		if (smc->dbc->c_get(smc->dbc, &key, &data, DB_SET) != 0)
-			rc = DBSQL_INTERNAL;
-	}
-	return rc;
+		return DBSQL_INTERNAL;
+
+#ifdef HAVE_SM_BULK_PUT
+remember:
+#endif
+	/* Remember where the cursor is to be positioned. */
+	if (__dbsql_urealloc(smc->sm->dbp, k_len, &smc->key.data) == ENOMEM)
+		return DBSQL_NOMEM;
+	memcpy(smc->key.data, k, k_len);
+	smc->key.size = k_len;
+	F_SET(smc, SMC_SEEK_KEY);
+	return DBSQL_SUCCESS;
+}
+
+/*
+ * __sm_bulk_insert --
+ *	Put the cursor into bulk insert mode.  From now on __sm_insert()
+ *	collects the new entries in a buffer and writes them a buffer at a
+ *	time with a DB_MULTIPLE_KEY put.  Any read or positioning through
+ *	this cursor, or closing it, writes out what has been collected
+ *	first, so the entries are always visible through this cursor.
+ *	They are not visible through other cursors on the same database
+ *	until then, which is why the code generator only asks for this
+ *	mode when it is streaming rows into a table that nothing else in
+ *	the statement reads.
+ *
+ *	Bulk insert mode is an optimization, if it cannot be enabled the
+ *	inserts are simply done one at a time.
+ *
+ * PUBLIC: int __sm_bulk_insert __P((sm_cursor_t *));
+ */
+int
+__sm_bulk_insert(smc)
+	sm_cursor_t *smc;
+{
+	DBSQL_ASSERT(smc);
+
+#ifdef HAVE_SM_BULK_PUT
+	if (F_ISSET(smc, SMC_BULK_PUT))
+		return DBSQL_SUCCESS;
+	if (__dbsql_malloc(smc->sm->dbp, SM_BULK_BUFSIZE,
+			   &smc->bput.data) == ENOMEM)
+		return DBSQL_SUCCESS;
+	smc->bput.ulen = SM_BULK_BUFSIZE;
+	smc->bput.flags = DB_DBT_USERMEM | DB_DBT_BULK;
+	smc->nbput = 0;
+	DB_MULTIPLE_WRITE_INIT(smc->bputp, &smc->bput);
+	F_SET(smc, SMC_BULK_PUT);
+#endif
+	return DBSQL_SUCCESS;
+}
+
+/*
+ * __sm_flush --
+ *	Write out any entries held back by bulk insert mode so that errors
+ *	are reported to the caller rather than lost when the cursor is
+ *	closed.
+ *
+ * PUBLIC: int __sm_flush __P((sm_cursor_t *));
+ */
+int
+__sm_flush(smc)
+	sm_cursor_t *smc;
+{
+	DBSQL_ASSERT(smc);
+	return (__sm_flush_puts(smc) == 0 ? DBSQL_SUCCESS : DBSQL_INTERNAL);
 }
 
 /*
@@ -1131,6 +1954,10 @@ __sm_delete(smc)
 
 	DBSQL_ASSERT(smc);
 
+	if (__sm_bulk_end(smc, 1) != 0 || __sm_settle(smc) != 0)
+		return DBSQL_INTERNAL;
+	F_CLR(smc, SMC_ROW_VALID);
+	smc->gen++;
 	switch(smc->dbc->c_del(smc->dbc, 0)) {
 	case 0:
 		break;
@@ -1162,6 +1989,7 @@ __sm_drop_table(sm, id)
 	if (smr == 0)
 		return DBSQL_INTERNAL;
 
+	__sm_pool_drain(sm, id);
 	rc = smr->db->close(smr->db, 0);
 	if (F_ISSET(sm, SM_INMEM_DB) == 0)
 		smr->db->remove(smr->db, smr->file, NULL, 0);
@@ -1194,6 +2022,7 @@ __sm_clear_table(sm, id)
 	smr = __hash_find(&sm->dbs, (const void *)0, id);
 	if (smr == 0)
 		return DBSQL_INTERNAL;
+	__sm_pool_drain(sm, id);
 	if ((rc = smr->db->truncate(smr->db, sm->txn, &count, 0)) != 0)
 		return rc;
 	return DBSQL_SUCCESS;
@@ -1251,7 +2080,7 @@ __sm_resource(sm, id, type, init)
 	F_SET(smr, type);
 	if ((rc = smr->db->open(smr->db, txn,
 				(F_ISSET(sm, SM_INMEM_DB) ? NULL : name),
-				NULL, DB_BTREE, flags, 0)) != 0)
+				NULL, DB_BTREE, SM_DB_MVCC(sm) | flags, 0)) != 0)
 			goto err;
 	txn->commit(txn, 0);
 	__hash_insert(&sm->dbs, (void *)0, n, smr);
@@ -1307,6 +2136,9 @@ __sm_create_index(sm, id)
 
 /*
  * __sm_set_format_version --
+ *	Stamp the format version 'ver' into a database.  A 'ver' of 0
+ *	removes the stamp, leaving the database as those made before it
+ *	was written.
  *
  * PUBLIC: int __sm_set_format_version __P((sm_t *, int, u_int32_t));
  */
@@ -1336,7 +2168,14 @@ __sm_set_format_version(sm, id, ver)
 
 	dbenv->txn_begin(dbenv, sm->txn, &txn, 0);
 
-	if ((rc = sm->meta->put(sm->meta, txn, &key, &data, 0)) != 0) {
+	if (ver == 0) {
+		rc = sm->meta->del(sm->meta, txn, &key, 0);
+		if (rc == DB_NOTFOUND)
+			rc = 0;
+	} else {
+		rc = sm->meta->put(sm->meta, txn, &key, &data, 0);
+	}
+	if (rc != 0) {
 		/* TODO: report error */
 		dbenv->err(dbenv, rc, "put/meta/ver");
 		rc = DBSQL_INTERNAL;
@@ -1494,3 +2333,132 @@ __sm_get_schema_sig(sm, sig)
 	txn->abort(txn);
 	return rc;
 }
+
+/*
+ * __sm_stat_key --
+ *	Fill in 'key' with the name under which the statistics of the
+ *	table or index 'name' are kept in the meta database.  The caller
+ *	must __dbsql_free() key->data.
+ *
+ * STATIC: static int __sm_stat_key __P((sm_t *, const char *, DBT *));
+ */
+static int
+__sm_stat_key(sm, name, key)
+	sm_t *sm;
+	const char *name;
+	DBT *key;
+{
+	char *k;
+	size_t len;
+
+	len = strlen(SM_STAT_PREFIX) + strlen(name);
+	if (__dbsql_malloc(sm->dbp, len + 1, &k) == ENOMEM)
+		return ENOMEM;
+	snprintf(k, len + 1, "%s%s", SM_STAT_PREFIX, name);
+	memset(key, 0, sizeof(DBT));
+	key->data = k;
+	key->size = len;
+	return 0;
+}
+
+/*
+ * __sm_set_stat --
+ *	Store the 'len' bytes at 'stat' as the statistics gathered by
+ *	ANALYZE for the table or index 'name'.  If 'stat' is NULL any
+ *	statistics stored for 'name' are removed.
+ *
+ * PUBLIC: int __sm_set_stat __P((sm_t *, const char *, const void *,
+ * PUBLIC:                   int));
+ */
+int
+__sm_set_stat(sm, name, stat, len)
+	sm_t *sm;
+	const char *name;
+	const void *stat;
+	int len;
+{
+	int rc;
+	DBT key, data;
+	DB_TXN *txn;
+	DB_ENV *dbenv;
+
+	DBSQL_ASSERT(sm != 0);
+
+	dbenv = sm->dbp->dbenv;
+	if (__sm_stat_key(sm, name, &key) == ENOMEM)
+		return DBSQL_NOMEM;
+
+	memset(&data, 0, sizeof(DBT));
+	data.data = (void *)stat;
+	data.size = len;
+
+	dbenv->txn_begin(dbenv, sm->txn, &txn, 0);
+
+	if (stat == 0)
+		rc = sm->meta->del(sm->meta, txn, &key, 0);
+	else
+		rc = sm->meta->put(sm->meta, txn, &key, &data, 0);
+	if (rc != 0 && rc != DB_NOTFOUND) {
+		dbenv->err(dbenv, rc, "put/meta/stat");
+		rc = DBSQL_INTERNAL;
+		txn->abort(txn);
+	} else {
+		rc = DBSQL_SUCCESS;
+		txn->commit(txn, 0);
+	}
+	__dbsql_free(sm->dbp, key.data);
+	return rc;
+}
+
+/*
+ * __sm_get_stat --
+ *	Fetch the statistics stored for the table or index 'name'.  On
+ *	success *stat points at memory the caller must release with
+ *	__dbsql_ufree() and *len is its size.  If there are no statistics
+ *	for 'name' *stat is NULL.
+ *
+ * PUBLIC: int __sm_get_stat __P((sm_t *, const char *, void *, int *));
+ */
+int
+__sm_get_stat(sm, name, stat, len)
+	sm_t *sm;
+	const char *name;
+	void *stat;
+	int *len;
+{
+	int rc;
+	DBT key, data;
+	DB_TXN *txn;
+	DB_ENV *dbenv;
+
+	DBSQL_ASSERT(sm != 0);
+
+	dbenv = sm->dbp->dbenv;
+	*(void **)stat = 0;
+	*len = 0;
+	if (__sm_stat_key(sm, name, &key) == ENOMEM)
+		return DBSQL_NOMEM;
+
+	memset(&data, 0, sizeof(DBT));
+	data.flags = DB_DBT_MALLOC;
+
+	dbenv->txn_begin(dbenv, sm->txn, &txn, 0);
+
+	rc = sm->meta->get(sm->meta, txn, &key, &data, 0);
+	if (rc == DB_NOTFOUND) {
+		rc = DBSQL_SUCCESS;
+	} else if (rc != 0) {
+		dbenv->err(dbenv, rc, "get/meta/stat");
+		rc = DBSQL_INTERNAL;
+	} else {
+		*(void **)stat = data.data;
+		*len = data.size;
+		rc = DBSQL_SUCCESS;
+	}
+	if (rc == DBSQL_SUCCESS)
+		txn->commit(txn, 0);
+	else
+		txn->abort(txn);
+	__dbsql_free(sm->dbp, key.data);
+	return rc;
+}
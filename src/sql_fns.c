@@ -742,31 +742,32 @@ __register_builtin_funcs(dbp)
 		char *name;
 		int num_arg;
 		int data_type;
+		int deterministic;
 		void (*func)(dbsql_func_t*,int,const char**);
 	} funcs[] = {
-		{ "min",       -1, DBSQL_ARGS,    __min_func    },
-		{ "min",        0, 0,              0          },
-		{ "max",       -1, DBSQL_ARGS,    __max_func    },
-		{ "max",        0, 0,              0          },
-		{ "length",     1, DBSQL_NUMERIC, __length_func },
-		{ "substr",     3, DBSQL_TEXT,    __substr_func },
-		{ "abs",        1, DBSQL_NUMERIC, __abs_func    },
-		{ "round",      1, DBSQL_NUMERIC, __round_func  },
-		{ "round",      2, DBSQL_NUMERIC, __round_func  },
-		{ "upper",      1, DBSQL_TEXT,    __upper_func  },
-		{ "lower",      1, DBSQL_TEXT,    __lower_func  },
-		{ "coalesce",  -1, DBSQL_ARGS,    __ifnull_func },
-		{ "coalesce",   0, 0,              0          },
-		{ "coalesce",   1, 0,              0          },
-		{ "ifnull",     2, DBSQL_ARGS,    __ifnull_func },
-		{ "random",    -1, DBSQL_NUMERIC, __random_func },
-		{ "like",       2, DBSQL_NUMERIC, __like_func   },
-		{ "glob",       2, DBSQL_NUMERIC, __glob_func   },
-		{ "nullif",     2, DBSQL_ARGS,    __nullif_func },
-		{ "dbsql_get_version",0,DBSQL_TEXT,  __version_func},
-		{ "quote",      1, DBSQL_ARGS,    __quote_func  },
+		{ "min",       -1, DBSQL_ARGS,    1, __min_func    },
+		{ "min",        0, 0,              0, 0          },
+		{ "max",       -1, DBSQL_ARGS,    1, __max_func    },
+		{ "max",        0, 0,              0, 0          },
+		{ "length",     1, DBSQL_NUMERIC, 1, __length_func },
+		{ "substr",     3, DBSQL_TEXT,    1, __substr_func },
+		{ "abs",        1, DBSQL_NUMERIC, 1, __abs_func    },
+		{ "round",      1, DBSQL_NUMERIC, 1, __round_func  },
+		{ "round",      2, DBSQL_NUMERIC, 1, __round_func  },
+		{ "upper",      1, DBSQL_TEXT,    1, __upper_func  },
+		{ "lower",      1, DBSQL_TEXT,    1, __lower_func  },
+		{ "coalesce",  -1, DBSQL_ARGS,    1, __ifnull_func },
+		{ "coalesce",   0, 0,              0, 0          },
+		{ "coalesce",   1, 0,              0, 0          },
+		{ "ifnull",     2, DBSQL_ARGS,    1, __ifnull_func },
+		{ "random",    -1, DBSQL_NUMERIC, 0, __random_func },
+		{ "like",       2, DBSQL_NUMERIC, 1, __like_func   },
+		{ "glob",       2, DBSQL_NUMERIC, 1, __glob_func   },
+		{ "nullif",     2, DBSQL_ARGS,    1, __nullif_func },
+		{ "dbsql_get_version",0,DBSQL_TEXT,  1, __version_func},
+		{ "quote",      1, DBSQL_ARGS,    1, __quote_func  },
 #ifdef DBSQL_SOUNDEX
-		{ "soundex",    1, DBSQL_TEXT,    __soundex_func},
+		{ "soundex",    1, DBSQL_TEXT,    1, __soundex_func},
 #endif
 	};
 	static struct {
@@ -793,6 +794,8 @@ __register_builtin_funcs(dbp)
 		if (funcs[i].func) {
 			dbp->func_return_type(dbp, funcs[i].name,
 					      funcs[i].data_type);
+			dbp->func_deterministic(dbp, funcs[i].name,
+						funcs[i].deterministic);
 		}
 	}
 
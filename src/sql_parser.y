@@ -135,7 +135,7 @@ id(A) ::= ID(X).         {A = X;}
 // This obviates the need for the "id" nonterminal.
 //
 %fallback ID
-  ABORT AFTER ASC ATTACH BEFORE BEGIN CASCADE CLUSTER CONFLICT
+  ABORT AFTER ANALYZE ASC ATTACH BEFORE BEGIN CASCADE CLUSTER CONFLICT
   COPY DATABASE DEFERRED DELIMITERS DESC DETACH EACH END EXPLAIN FAIL FOR
   GLOB IGNORE IMMEDIATE INITIALLY INSTEAD LIKE MATCH KEY
   OF OFFSET PRAGMA RAISE REPLACE RESTRICT ROW STATEMENT
@@ -562,7 +562,7 @@ expr(A) ::= FLOAT(X).        {A = __expr(TK_FLOAT, 0, 0, &X);}
 expr(A) ::= STRING(X).       {A = __expr(TK_STRING, 0, 0, &X);}
 expr(A) ::= VARIABLE(X).     {
   A = __expr(TK_VARIABLE, 0, 0, &X);
-  if( A ) A->iTable = ++pParse->nVar;
+  if( A ) __expr_assign_var(pParse, A);
 }
 expr(A) ::= ID(X) LP exprlist(Y) RP(E). {
   A = __expr_function(Y, &X);
@@ -781,6 +781,11 @@ cmd ::= COPY orconf(R) nm(X) dbnm(D) FROM nm(Y).
 cmd ::= VACUUM.                {__vacuum(pParse,0);}
 cmd ::= VACUUM nm(X).         {__vacuum(pParse,&X);}
 
+///////////////////////////// The ANALYZE command ////////////////////////////
+//
+cmd ::= ANALYZE.                {__analyze(pParse,0,0);}
+cmd ::= ANALYZE nm(X) dbnm(Y).  {__analyze(pParse,&X,&Y);}
+
 ///////////////////////////// The PRAGMA command /////////////////////////////
 //
 cmd ::= PRAGMA ids(X) EQ nm(Y).         {__pragma(pParse,&X,&Y,0);}
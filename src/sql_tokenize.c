@@ -55,6 +55,7 @@ static keyword_t sql_tokens_table[] = {
   { "ABORT",             TK_ABORT,        },
   { "AFTER",             TK_AFTER,        },
   { "ALL",               TK_ALL,          },
+  { "ANALYZE",           TK_ANALYZE,      },
   { "AND",               TK_AND,          },
   { "AS",                TK_AS,           },
   { "ASC",               TK_ASC,          },
@@ -435,6 +436,17 @@ __get_token(z, token_type)
 		*token_type = TK_VARIABLE;
 		return 1;
 		break;
+	case ':':
+		if ((z[1] & 0x80) == 0 && !id_char_p[z[1]]) {
+			break;
+		}
+		i = 2;
+		while((z[i] & 0x80)!=0 || id_char_p[z[i]]) {
+			i++;
+		}
+		*token_type = TK_VARIABLE;
+		return i;
+		break;
 	default:
 		if ((*z & 0x80) == 0 && !id_char_p[*z]) {
 			break;
@@ -555,6 +567,11 @@ __run_sql_parser(parser, sql, err_msgs)
 		__vdbe_delete(parser->pVdbe);
 		parser->pVdbe = 0;
 	}
+	if (parser->pConst) {
+		__expr_list_delete(parser->pConst);
+		parser->pConst = 0;
+	}
+	__expr_var_names_clear(parser);
 	if (parser->pNewTable) {
 		__vdbe_delete_table(parser->db, parser->pNewTable);
 		parser->pNewTable = 0;
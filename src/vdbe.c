@@ -176,40 +176,141 @@ __api_step(p, n, values, col_names)
 	return rc;
 }
 
+/*
+ * __agg_hash --
+ *	Hash an aggregator key.  The low bits pick the hash chain and the
+ *	high bits the spill partition (see __agg_part), so the hash must
+ *	mix well in both.
+ *
+ * STATIC: static u_int32_t __agg_hash __P((const char *, int));
+ */
+static u_int32_t
+__agg_hash(key, len)
+	const char *key;
+	int len;
+{
+	u_int32_t h;
+
+	h = 2166136261U;
+	while (len-- > 0) {
+		h ^= (u_int8_t)*key++;
+		h *= 16777619U;
+	}
+	return (h ^ (h >> 16));
+}
+
+/*
+ * __agg_find --
+ *	Find the aggregate element with the given key and hash.  The number
+ *	of elements compared along the way is added to '*probesp'.
+ *
+ * STATIC: static agg_elem_t *__agg_find __P((agg_t *, const char *, int,
+ * STATIC:                               u_int32_t, u_int32_t *));
+ */
+static agg_elem_t *
+__agg_find(p, key, len, h, probesp)
+	agg_t *p;
+	const char *key;
+	int len;
+	u_int32_t h;
+	u_int32_t *probesp;
+{
+	agg_elem_t *elem;
+
+	if (p->aHash == 0)
+		return 0;
+	for (elem = p->aHash[h & (p->nHash - 1)]; elem; elem = elem->pHash) {
+		(*probesp)++;
+		if (elem->hash == h && elem->nKey == len &&
+		    memcmp(elem->zKey, key, len) == 0)
+			return elem;
+	}
+	return 0;
+}
+
+/*
+ * __agg_grow --
+ *	Double the number of hash chains of an aggregator.
+ *	Return 0 on success and 1 if memory is exhausted.
+ *
+ * STATIC: static int __agg_grow __P((agg_t *));
+ */
+static int
+__agg_grow(p)
+	agg_t *p;
+{
+	agg_elem_t **ht, *elem;
+	int n, i;
+
+	n = (p->nHash == 0) ? 16 : p->nHash * 2;
+	if (__dbsql_calloc(NULL, n, sizeof(agg_elem_t *), &ht) == ENOMEM)
+		return 1;
+	for (elem = p->pFirst; elem; elem = elem->pNext) {
+		i = elem->hash & (n - 1);
+		elem->pHash = ht[i];
+		ht[i] = elem;
+	}
+	if (p->aHash)
+		__dbsql_free(NULL, p->aHash);
+	p->aHash = ht;
+	p->nHash = n;
+	return 0;
+}
+
 /*
  * __agg_insert --
  *	Insert a new aggregate element and make it the element that
  *	has focus.
  *	Return 0 on success and 1 if memory is exhausted.
  *
- * STATIC: static int __agg_insert __P((agg_t *, char *, int));
+ * STATIC: static int __agg_insert __P((agg_t *, char *, int, u_int32_t));
  */
 static int
-__agg_insert(p, key, len)
+__agg_insert(p, key, len, h)
 	agg_t *p;
 	char *key;
 	int len;
+	u_int32_t h;
 {
-	agg_elem_t *elem, *old;
-	int i;
+	agg_elem_t *elem;
+	int i, size;
 	mem_t *mem;
 
-	if (__dbsql_calloc(NULL, 1, sizeof(agg_elem_t) + len +
-			((p->nMem - 1) * sizeof(elem->aMem[0])),
-			&elem) == ENOMEM)
+	if (p->nElem >= p->nHash && __agg_grow(p))
 		return 1;
-	elem->zKey = (char*)&elem->aMem[p->nMem];
+	size = sizeof(agg_elem_t) + ((p->nMem - 1) * sizeof(elem->aMem[0]));
+	if (p->pFree) {
+		elem = p->pFree;
+		p->pFree = elem->pNext;
+	} else if (__vdbe_arena_alloc(&p->pArena, size, &elem) == ENOMEM) {
+		return 1;
+	}
+	if (len <= NBFS) {
+		elem->zKey = elem->zShort;
+	} else if (__dbsql_malloc(NULL, len, &elem->zKey) == ENOMEM) {
+		elem->pNext = p->pFree;
+		p->pFree = elem;
+		return 1;
+	} else {
+		size += len;
+	}
 	memcpy(elem->zKey, key, len);
 	elem->nKey = len;
-	old = __hash_insert(&p->hash, elem->zKey, elem->nKey, elem);
-	if (old != 0) {
-		DBSQL_ASSERT(old == elem);  /* Malloc failed on insert */
-		__dbsql_free(NULL, old);
-		return 0;
-	}
+	elem->hash = h;
 	for (i = 0, mem = elem->aMem; i < p->nMem; i++, mem++) {
 		mem->flags = MEM_Null;
 	}
+	i = h & (p->nHash - 1);
+	elem->pHash = p->aHash[i];
+	p->aHash[i] = elem;
+	elem->pNext = 0;
+	if (p->pLast)
+		p->pLast->pNext = elem;
+	else
+		p->pFirst = elem;
+	p->pLast = elem;
+	p->nElem++;
+	p->nUsed += size;
 	p->pCurrent = elem;
 	return 0;
 }
@@ -227,13 +328,9 @@ __agg_in_focus(p)
 	if (p->pCurrent) {
 		return p->pCurrent;
 	} else {
-		hash_ele_t *elem;
-		elem = __hash_first(&p->hash);
-		if (elem == 0) {
-			__agg_insert(p,"",1);
-			elem = __hash_first(&p->hash);
-		}
-		return elem ? __hash_data(elem) : 0;
+		if (p->pFirst == 0)
+			__agg_insert(p, "", 1, __agg_hash("", 1));
+		return p->pFirst;
 	}
 }
 
@@ -262,34 +359,6 @@ __entity_as_string(stack)
 		stack->z = stack->zShort;
 		stack->n = strlen(stack->zShort) + 1;
 		stack->flags = MEM_Str | MEM_Short;
-		return 0;
-	}
-}
-
-/*
- * __entity_to_string -- 
- *	Convert the given stack entity into a string that has been obtained
- *	from __dbsql_calloc().  This is different from __entity_as_string()
- *	above in that __entity_as_string() will use the NBFS bytes of static
- *	string space if the string will fit but this routine will always
- *	__dbsql_malloc new memory. Return non-zero if we run out of memory.
- *
- * STATIC: int __entity_to_string __P((mem_t *));
- */
-static int
-__entity_to_string(stack)
-	mem_t *stack;
-{
-	if ((stack->flags & MEM_Dyn) == 0) {
-		int fg = stack->flags;
-		char *z;
-		__entity_as_string(stack);
-		DBSQL_ASSERT((fg & MEM_Dyn) == 0);
-		if (__dbsql_calloc(NULL, 1, stack->n, &z) == ENOMEM)
-			return 1;
-		memcpy(z, stack->z, stack->n);
-		stack->z = z;
-		stack->flags |= MEM_Dyn;
 	}
 	return 0;
 }
@@ -324,6 +393,26 @@ __entity_ephem_to_dyn(stack)
 	return 0;
 }
 
+/*
+ * __entity_keep --
+ *	Make the string of a stack entity that is about to be stored in a
+ *	memory cell outlive the stack.  Besides ephemeral strings this
+ *	copies strings out of the string arena, which is emptied as soon as
+ *	the stack is.  Returns 1 if we run out of memory.
+ *
+ * STATIC: static int __entity_keep __P((mem_t * stack));
+ */
+static int
+__entity_keep(stack)
+	mem_t *stack;
+{
+	if ((stack->flags & MEM_Arena) != 0) {
+		stack->flags &= ~MEM_Arena;
+		stack->flags |= MEM_Ephem;
+	}
+	return __entity_ephem_to_dyn(stack);
+}
+
 /*
  * __entity_release_mem --
  *	Release the memory associated with the given stack level.  This
@@ -360,6 +449,152 @@ __pop_stack(stack, n)
 	*stack = tos;
 }
 
+/*
+ * __agg_part --
+ *	Return the spill partition of a key hash for an aggregator whose
+ *	keys have been partitioned 'level' times before.  Partitions are
+ *	taken from the top of the hash down so they stay independent of
+ *	the hash chains, which use the low bits.  Once every bit has been
+ *	used all the keys go to partition 0.
+ *
+ * STATIC: static int __agg_part __P((u_int32_t, int));
+ */
+static int
+__agg_part(h, level)
+	u_int32_t h;
+	int level;
+{
+	if ((level + 1) * AGG_PART_BITS > 32)
+		return 0;
+	return (int)((h << (level * AGG_PART_BITS)) >> (32 - AGG_PART_BITS));
+}
+
+/*
+ * __agg_spill --
+ *	Append the 'n' stack entries ending at 'top' to spill file 'fp'
+ *	as one row.  Strings are written as they are, other values in
+ *	their native form.
+ *
+ * STATIC: static int __agg_spill __P((FILE *, mem_t *, int));
+ */
+static int
+__agg_spill(fp, top, n)
+	FILE *fp;
+	mem_t *top;
+	int n;
+{
+	mem_t *mem;
+	char type;
+	void *val;
+	size_t len;
+
+	for (mem = &top[1 - n]; mem <= top; mem++) {
+		if (mem->flags & MEM_Null) {
+			type = 'n';
+			val = 0;
+			len = 0;
+		} else if (mem->flags & MEM_Str) {
+			type = 's';
+			val = mem->z;
+			len = mem->n;
+		} else if (mem->flags & MEM_Int) {
+			type = 'i';
+			val = &mem->i;
+			len = sizeof(mem->i);
+		} else {
+			type = 'r';
+			val = &mem->r;
+			len = sizeof(mem->r);
+		}
+		if (fwrite(&type, 1, 1, fp) != 1)
+			return DBSQL_IOERR;
+		if (type == 's' && fwrite(&mem->n, sizeof(mem->n), 1, fp) != 1)
+			return DBSQL_IOERR;
+		if (len > 0 && fwrite(val, 1, len, fp) != len)
+			return DBSQL_IOERR;
+	}
+	return 0;
+}
+
+/*
+ * __agg_replay --
+ *	Read a row written by __agg_spill into the 'n' stack entries that
+ *	follow 'top'.  '*eofp' is set if the file holds no more rows.
+ *
+ * STATIC: static int __agg_replay __P((FILE *, mem_t *, int, int *));
+ */
+static int
+__agg_replay(fp, top, n, eofp)
+	FILE *fp;
+	mem_t *top;
+	int n;
+	int *eofp;
+{
+	mem_t *mem;
+	char type;
+	int i, ret;
+
+	*eofp = 0;
+	ret = 0;
+	for (i = 0, mem = &top[1]; i < n; i++, mem++)
+		mem->flags = MEM_Null;
+	for (i = 0, mem = &top[1]; i < n; i++, mem++) {
+		if (fread(&type, 1, 1, fp) != 1) {
+			if (i == 0 && !ferror(fp)) {
+				*eofp = 1;
+				return 0;
+			}
+			ret = DBSQL_IOERR;
+			break;
+		}
+		switch (type) {
+		case 'n':
+			break;
+		case 'i':
+			if (fread(&mem->i, sizeof(mem->i), 1, fp) != 1)
+				ret = DBSQL_IOERR;
+			else
+				mem->flags = MEM_Int;
+			break;
+		case 'r':
+			if (fread(&mem->r, sizeof(mem->r), 1, fp) != 1)
+				ret = DBSQL_IOERR;
+			else
+				mem->flags = MEM_Real;
+			break;
+		case 's':
+			if (fread(&mem->n, sizeof(mem->n), 1, fp) != 1 ||
+			    mem->n <= 0) {
+				ret = DBSQL_IOERR;
+				break;
+			}
+			if (mem->n <= NBFS) {
+				mem->z = mem->zShort;
+				mem->flags = MEM_Str | MEM_Short;
+			} else if (__dbsql_malloc(NULL, mem->n,
+			    &mem->z) == ENOMEM) {
+				ret = ENOMEM;
+				break;
+			} else {
+				mem->flags = MEM_Str | MEM_Dyn;
+			}
+			if (fread(mem->z, 1, mem->n, fp) != (size_t)mem->n)
+				ret = DBSQL_IOERR;
+			break;
+		default:
+			ret = DBSQL_IOERR;
+			break;
+		}
+		if (ret != 0)
+			break;
+	}
+	if (ret != 0) {
+		for (i = 0, mem = &top[1]; i < n; i++, mem++)
+			__entity_release_mem(mem);
+	}
+	return ret;
+}
+
 /*
  * __entity_to_int --
  *	Convert the given stack entity into a integer if it isn't one
@@ -411,40 +646,1304 @@ __entity_to_real(stack)
 }
 
 /*
- * __sorted_merge --
- *	The parameters are pointers to the head of two sorted lists
- *	of sorter_t structures.  Merge these two lists together and return
- *	a single sorted list.  This routine forms the core of the merge-sort
- *	algorithm.  In the case of a tie, left sorts in front of right.
+ * __entity_is_whole --
+ *	Return true if the given stack entity is a number whose text form
+ *	is an exact integer, so that comparing it as a double gives the
+ *	same result as __str_numeric_cmp() would on its text.  Integers
+ *	read from typed records are such MEM_Real values.
+ *
+ * STATIC: static int __entity_is_whole __P((mem_t *));
+ */
+static int
+__entity_is_whole(stack)
+	mem_t *stack;
+{
+	if (stack->flags & MEM_Int)
+		return 1;
+	return ((stack->flags & (MEM_Real | MEM_Str)) == MEM_Real &&
+		stack->r > -1e15 && stack->r < 1e15 &&
+		stack->r == (double)(int64_t)stack->r);
+}
+
+/*
+ * __hjoin_key --
+ *	Turn the value at the top of the stack into a join hash table key
+ *	and return its length.  When keys compare as numbers, every value
+ *	that looks like a number becomes a double so that 5, 5.0 and '5'
+ *	all hash alike, as OP_Eq would find them equal.  Anything else is
+ *	keyed by its text.
+ *
+ * STATIC: static int __hjoin_key __P((hjoin_t *, mem_t *, double *,
+ * STATIC:                        char **));
+ */
+static int
+__hjoin_key(hj, pTos, rp, keyp)
+	hjoin_t *hj;
+	mem_t *pTos;
+	double *rp;
+	char **keyp;
+{
+	if (!hj->text) {
+		if (pTos->flags & MEM_Int) {
+			*rp = pTos->i;
+		} else if (pTos->flags & MEM_Real) {
+			*rp = pTos->r;
+		} else if (__str_is_numeric(pTos->z)) {
+			*rp = __dbsql_atof(pTos->z);
+		} else {
+			goto text;
+		}
+		if (*rp == 0)
+			*rp = 0;	/* -0.0 and 0.0 are equal */
+		*keyp = (char *)rp;
+		return sizeof(double);
+	}
+text:	__entity_as_string(pTos);
+	*keyp = pTos->z;
+	return pTos->n;
+}
+
+/*
+ * __hjoin_match --
+ *	Return the first element of the hash chain starting at 'elem' whose
+ *	key is 'key', or NULL.
+ *
+ * STATIC: static hjoin_elem_t *__hjoin_match __P((hjoin_elem_t *,
+ * STATIC:                                    const char *, int, u_int32_t));
+ */
+static hjoin_elem_t *
+__hjoin_match(elem, key, len, h)
+	hjoin_elem_t *elem;
+	const char *key;
+	int len;
+	u_int32_t h;
+{
+	for (; elem; elem = elem->pHash) {
+		if (elem->hash == h && elem->nKey == len &&
+		    memcmp(elem->zKey, key, len) == 0)
+			return elem;
+	}
+	return 0;
+}
+
+/*
+ * __hjoin_grow --
+ *	Double the number of hash chains of a join hash table.  Elements
+ *	keep their order within a chain.
+ *	Return 0 on success and 1 if memory is exhausted.
+ *
+ * STATIC: static int __hjoin_grow __P((hjoin_t *));
+ */
+static int
+__hjoin_grow(hj)
+	hjoin_t *hj;
+{
+	hjoin_elem_t **ht, *elem, *next, *rev;
+	int n, i;
+
+	n = (hj->nHash == 0) ? 256 : hj->nHash * 2;
+	if (__dbsql_calloc(NULL, n, sizeof(hjoin_elem_t *), &ht) == ENOMEM)
+		return 1;
+	for (i = 0; i < hj->nHash; i++) {
+		/* Reverse the chain so pushing it back restores the order. */
+		for (rev = 0, elem = hj->aHash[i]; elem; elem = next) {
+			next = elem->pHash;
+			elem->pHash = rev;
+			rev = elem;
+		}
+		for (elem = rev; elem; elem = next) {
+			next = elem->pHash;
+			elem->pHash = ht[elem->hash & (n - 1)];
+			ht[elem->hash & (n - 1)] = elem;
+		}
+	}
+	if (hj->aHash)
+		__dbsql_free(NULL, hj->aHash);
+	hj->aHash = ht;
+	hj->nHash = n;
+	return 0;
+}
+
+/*
+ * __record_varint_len --
+ *	Return the number of bytes __record_put_varint() uses for 'v'.
+ *
+ * STATIC: static int __record_varint_len __P((u_int32_t));
+ */
+static int
+__record_varint_len(v)
+	u_int32_t v;
+{
+	int n;
+
+	for (n = 1; (v >>= 7) != 0; n++)
+		;
+	return n;
+}
+
+/*
+ * __record_put_varint --
+ *	Write 'v' into 'p' as a variable length integer, see vdbe_int.h.
+ *	Return the number of bytes written.
+ *
+ * STATIC: static int __record_put_varint __P((unsigned char *, u_int32_t));
+ */
+static int
+__record_put_varint(p, v)
+	unsigned char *p;
+	u_int32_t v;
+{
+	int i, n;
+
+	n = __record_varint_len(v);
+	for (i = n - 1; i >= 0; i--) {
+		p[i] = (v & 0x7f) | (i == n - 1 ? 0 : 0x80);
+		v >>= 7;
+	}
+	return n;
+}
+
+/*
+ * __record_get_varint --
+ *	Read a variable length integer from 'p' into '*v'.  Return the
+ *	number of bytes read.
+ *
+ * STATIC: static int __record_get_varint __P((const unsigned char *,
+ * STATIC:                                u_int32_t *));
+ */
+static int
+__record_get_varint(p, v)
+	const unsigned char *p;
+	u_int32_t *v;
+{
+	u_int32_t x;
+	int i;
+
+	x = 0;
+	i = 0;
+	do {
+		x = (x << 7) | (p[i] & 0x7f);
+	} while ((p[i++] & 0x80) != 0 && i < 5);
+	*v = x;
+	return i;
+}
+
+/*
+ * __record_type_size --
+ *	Return the number of data bytes used by a field of type 'type'.
+ *
+ * STATIC: static int __record_type_size __P((u_int32_t));
+ */
+static int
+__record_type_size(type)
+	u_int32_t type;
+{
+	static const int sizes[] = { 0, 1, 2, 4, 8, 8 };
+
+	if (type >= REC_TEXT)
+		return (type - REC_TEXT);
+	return sizes[type];
+}
+
+/*
+ * __record_int_text --
+ *	Return true if the 'n' bytes at 'z' (null terminator included) are
+ *	exactly what "%d" produces for some integer, and store the integer
+ *	in '*v'.  Only such text can go into a typed record as an integer
+ *	without changing what is later read back.
+ *
+ * STATIC: static int __record_int_text __P((const char *, int, int *));
+ */
+static int
+__record_int_text(z, n, v)
+	const char *z;
+	int n;
+	int *v;
+{
+	int i;
+
+	i = (z[0] == '-');
+	if (n - 1 <= i || n - 1 > 11)
+		return 0;
+	if (z[i] == '0') {
+		*v = 0;
+		return (n == 2);
+	}
+	for (; i < n - 1; i++)
+		if (z[i] < '0' || z[i] > '9')
+			return 0;
+	return __dbsql_atoi(z, v);
+}
+
+/*
+ * __record_type --
+ *	Work out the type under which 'm' goes into a typed record.  If it
+ *	is an integer type the value is stored in '*v'.
+ *
+ *	Text is kept as text, unless it is the canonical spelling of an
+ *	integer, so that it reads back exactly as it was written.  Reals
+ *	holding an integral value are stored as integers, which reads
+ *	back as the same real.
+ *
+ * STATIC: static u_int32_t __record_type __P((mem_t *, int64_t *));
+ */
+static u_int32_t
+__record_type(m, v)
+	mem_t *m;
+	int64_t *v;
+{
+	int i;
+
+	if (m->flags & MEM_Null)
+		return REC_NULL;
+	if (m->flags & MEM_Str) {
+		if (!__record_int_text(m->z, m->n, &i))
+			return (REC_TEXT + m->n);
+		*v = i;
+	} else if (m->flags & MEM_Int) {
+		*v = m->i;
+	} else if (m->flags & MEM_Real) {
+		if (m->r != m->r ||
+		    m->r < -9007199254740992.0 || m->r > 9007199254740992.0 ||
+		    (double)(int64_t)m->r != m->r ||
+		    (m->r == 0.0 && 1.0 / m->r < 0.0))
+			return REC_REAL;
+		*v = (int64_t)m->r;
+	} else {
+		__entity_as_string(m);
+		return (REC_TEXT + m->n);
+	}
+	if (*v >= -128 && *v <= 127)
+		return REC_INT8;
+	if (*v >= -32768 && *v <= 32767)
+		return REC_INT16;
+	if (*v >= -2147483647 - 1 && *v <= 2147483647)
+		return REC_INT32;
+	return REC_INT64;
+}
+
+/*
+ * __record_make --
+ *	Build a typed record out of the 'nField' stack entries starting at
+ *	'pRec'.  The record is written into 'zTemp' if it fits in NBFS
+ *	bytes, otherwise into the string arena of 'p'.  Return ENOMEM
+ *	on failure.
+ *
+ * STATIC: static int __record_make __P((vdbe_t *, mem_t *, int, char *,
+ * STATIC:                          char **, int *));
+ */
+static int
+__record_make(p, pRec, nField, zTemp, pzRec, pnByte)
+	vdbe_t *p;
+	mem_t *pRec;
+	int nField;
+	char *zTemp;
+	char **pzRec;
+	int *pnByte;
+{
+	unsigned char *z;
+	u_int32_t type;
+	u_int64_t u;
+	int64_t v;
+	int i, j, k, d, nHdr, nData, nByte, size;
+
+	v = 0;
+	nHdr = 0;
+	nData = 0;
+	for (i = 0; i < nField; i++) {
+		type = __record_type(&pRec[i], &v);
+		nHdr += __record_varint_len(type);
+		nData += __record_type_size(type);
+	}
+	nByte = 1 + __record_varint_len(nHdr) + nHdr + nData;
+	if (nByte >= 256)
+		nByte += 2;
+	if (nByte <= NBFS) {
+		z = (unsigned char *)zTemp;
+	} else if (__vdbe_str_alloc(p, nByte, (char **)&z) == ENOMEM) {
+		return ENOMEM;
+	}
+	j = 0;
+	z[j++] = 0;
+	if (nByte >= 256) {
+		z[j++] = 0;
+		z[j++] = 2;
+	}
+	j += __record_put_varint(&z[j], nHdr);
+	d = j + nHdr;
+	for (i = 0; i < nField; i++, pRec++) {
+		type = __record_type(pRec, &v);
+		j += __record_put_varint(&z[j], type);
+		size = __record_type_size(type);
+		if (type >= REC_TEXT) {
+			memcpy(&z[d], pRec->z, size);
+		} else {
+			if (type == REC_REAL)
+				memcpy(&u, &pRec->r, sizeof(u));
+			else
+				u = (u_int64_t)v;
+			for (k = size - 1; k >= 0; k--) {
+				z[d + k] = (unsigned char)(u & 0xff);
+				u >>= 8;
+			}
+		}
+		d += size;
+	}
+	DBSQL_ASSERT(d == nByte);
+	*pzRec = (char *)z;
+	*pnByte = nByte;
+	return 0;
+}
+
+/*
+ * __record_field --
+ *	Decode the field of type 'type' whose data is at 'offset' in the
+ *	typed record 'zRec' of 'nRec' bytes into 'pMem'.  Text is not
+ *	copied, 'pMem' points into the record.
+ *
+ *	Integers are decoded as MEM_Real.  Numbers in a format version 1
+ *	record are text and so arithmetic on them is always done in floating
+ *	point; marking them MEM_Int would turn 10/20 into integer division.
+ *
+ * STATIC: static int __record_field __P((const char *, int, u_int32_t,
+ * STATIC:                           int, mem_t *));
+ */
+static int
+__record_field(zRec, nRec, type, offset, pMem)
+	const char *zRec;
+	int nRec;
+	u_int32_t type;
+	int offset;
+	mem_t *pMem;
+{
+	const unsigned char *z;
+	u_int64_t u;
+	int k, size;
+
+	size = __record_type_size(type);
+	if (offset + size > nRec)
+		return DBSQL_CORRUPT;
+	z = (const unsigned char *)zRec + offset;
+	switch (type) {
+	case REC_NULL:
+		pMem->flags = MEM_Null;
+		break;
+	case REC_REAL:
+		for (u = 0, k = 0; k < 8; k++)
+			u = (u << 8) | z[k];
+		memcpy(&pMem->r, &u, sizeof(u));
+		pMem->flags = MEM_Real;
+		break;
+	case REC_INT8: /* FALLTHROUGH */
+	case REC_INT16: /* FALLTHROUGH */
+	case REC_INT32: /* FALLTHROUGH */
+	case REC_INT64:
+		u = (z[0] & 0x80) ? ~(u_int64_t)0 : 0;
+		for (k = 0; k < size; k++)
+			u = (u << 8) | z[k];
+		pMem->r = (double)(int64_t)u;
+		pMem->flags = MEM_Real;
+		break;
+	default:
+		if (size == 0)
+			return DBSQL_CORRUPT;
+		pMem->n = size;
+		pMem->z = (char *)z;
+		pMem->flags = MEM_Str | MEM_Ephem;
+		break;
+	}
+	return DBSQL_SUCCESS;
+}
+
+/*
+ * __record_column --
+ *	Decode field 'col' of the typed record 'zRec' of 'nRec' bytes into
+ *	'pMem', walking the record header from the start.
+ *
+ * STATIC: static int __record_column __P((const char *, int, int,
+ * STATIC:                            mem_t *));
+ */
+static int
+__record_column(zRec, nRec, col, pMem)
+	const char *zRec;
+	int nRec;
+	int col;
+	mem_t *pMem;
+{
+	const unsigned char *z;
+	u_int32_t type, nHdr;
+	int i, h, end, offset;
+
+	z = (const unsigned char *)zRec;
+	h = (nRec < 256 ? 1 : 3);
+	h += __record_get_varint(&z[h], &nHdr);
+	end = h + nHdr;
+	if (end > nRec)
+		return DBSQL_CORRUPT;
+	offset = end;
+	for (i = 0; ; i++) {
+		if (h >= end)
+			return DBSQL_CORRUPT;
+		h += __record_get_varint(&z[h], &type);
+		if (i == col)
+			break;
+		offset += __record_type_size(type);
+	}
+	return __record_field(zRec, nRec, type, offset, pMem);
+}
+
+/*
+ * __record_cached_column --
+ *	Like __record_column() but for a record read through cursor 'pC'.
+ *	The header is decoded only as far as needed and what has been
+ *	decoded is kept in the cursor, so reading any column of the same
+ *	row again costs a single array lookup.
+ *
+ * STATIC: static int __record_cached_column __P((cursor_t *, const char *,
+ * STATIC:                                   int, int, mem_t *));
+ */
+static int
+__record_cached_column(pC, zRec, nRec, col, pMem)
+	cursor_t *pC;
+	const char *zRec;
+	int nRec;
+	int col;
+	mem_t *pMem;
+{
+	const unsigned char *z;
+	u_int32_t gen, type, nHdr;
+	int h, n;
+
+	z = (const unsigned char *)zRec;
+	gen = __sm_row_gen(pC->pCursor);
+	if (!pC->hdrValid || pC->rowGen != gen) {
+		h = (nRec < 256 ? 1 : 3);
+		h += __record_get_varint(&z[h], &nHdr);
+		if (h + (int)nHdr > nRec)
+			return DBSQL_CORRUPT;
+		pC->hdrPos = h;
+		pC->hdrEnd = h + nHdr;
+		pC->dataPos = pC->hdrEnd;
+		pC->nField = 0;
+		pC->rowGen = gen;
+		pC->hdrValid = 1;
+	}
+	while (pC->nField <= col) {
+		if (pC->hdrPos >= pC->hdrEnd) {
+			pC->hdrValid = 0;
+			return DBSQL_CORRUPT;
+		}
+		if (pC->nField >= pC->nFieldAlloc) {
+			n = (pC->nFieldAlloc ? 2 * pC->nFieldAlloc : 16);
+			if (__dbsql_realloc(NULL, n * sizeof(rec_field_t),
+					    &pC->aField) == ENOMEM) {
+				pC->hdrValid = 0;
+				return DBSQL_NOMEM;
+			}
+			pC->nFieldAlloc = n;
+		}
+		pC->hdrPos += __record_get_varint(&z[pC->hdrPos], &type);
+		pC->aField[pC->nField].type = type;
+		pC->aField[pC->nField].offset = pC->dataPos;
+		pC->dataPos += __record_type_size(type);
+		pC->nField++;
+	}
+	return __record_field(zRec, nRec, pC->aField[col].type,
+			      pC->aField[col].offset, pMem);
+}
+
+/*
+ * __alt_column --
+ *	Read column 'col' of the table cursor 'pC' from the key of the index
+ *	entry its deferred move came from, see OP_IdxMoveTo.  Returns 1 with
+ *	the value in 'pMem' when the index holds the column as NULL or text.
+ *	Returns 0 when the row has to be read instead.
+ *
+ *	A number is only kept in the key in its sortable form, which loses
+ *	the text it was written as ("7.0" and "007" give the same key as 7).
+ *	If 'numeric' is set only the value is wanted, and a number that
+ *	decodes to a whole number below 2^31 in size is pushed as a real,
+ *	as a typed record would give it.  Whole numbers that size are held
+ *	exactly.  A real that is too close to one to get a key of its own
+ *	reads as that whole number.
+ *
+ * STATIC: static int __alt_column __P((vdbe_t *, cursor_t *, int, int,
+ * STATIC:                         mem_t *));
+ */
+static int
+__alt_column(p, pC, col, numeric, pMem)
+	vdbe_t *p;
+	cursor_t *pC;
+	int col;
+	int numeric;
+	mem_t *pMem;
+{
+	const char *zMap, *zKey;
+	int c, field, j, nKey;
+	double r;
+
+	zMap = pC->zAltMap;
+	for (field = 0;; field++) {
+		for (c = 0; *zMap >= '0' && *zMap <= '9'; zMap++)
+			c = c * 10 + *zMap - '0';
+		if (c == col)
+			break;
+		if (*zMap++ != ',')
+			return 0;
+	}
+	if (__sm_key_ptr(p->aCsr[pC->iAltCsr].pCursor, &zKey,
+			 &nKey) != DBSQL_SUCCESS)
+		return 0;
+	nKey -= sizeof(u_int32_t);
+	for (j = 0; field > 0 && j < nKey; j++) {
+		if (zKey[j] == 0)
+			field--;
+	}
+	if (j >= nKey)
+		return 0;
+	switch (zKey[j]) {
+	case 'a':
+		pMem->flags = MEM_Null;
+		return 1;
+	case 'b':
+		if (!numeric || !__str_sortable_as_real(&zKey[j + 1], &r) ||
+		    r < -2147483648.0 || r > 2147483647.0 ||
+		    (double)(int)r != r)
+			break;
+		pMem->r = r;
+		pMem->flags = MEM_Real;
+		return 1;
+	case 'c':
+		pMem->z = (char *)&zKey[j + 1];
+		pMem->n = strlen(pMem->z) + 1;
+		pMem->flags = MEM_Str | MEM_Ephem;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * __vdbe_column --
+ *	Read column 'col' of the record that cursor 'i' points to into
+ *	'pTos', the entry just pushed onto the stack.  A negative 'i' names
+ *	a record on the stack, relative to 'pTos'.  The 'numeric' flag is
+ *	passed on to __alt_column.  This is the body of OP_Column, shared
+ *	with OP_ColumnCmp.
+ *
+ * STATIC: static int __vdbe_column __P((vdbe_t *, int, int, int, mem_t *));
+ */
+static int
+__vdbe_column(p, i, col, numeric, pTos)
+	vdbe_t *p;
+	int i;
+	int col;
+	int numeric;
+	mem_t *pTos;
+{
+	int amt, offset, end, payloadSize;
+	int rc = DBSQL_SUCCESS;
+	cursor_t *pC;
+	char *zRec;
+	sm_cursor_t *pCrsr;
+	int idxWidth;
+	unsigned char aHdr[10];
+
+	DBSQL_ASSERT(i < p->nCursor);
+	if (i < 0) {
+		DBSQL_ASSERT(&pTos[i] >= p->aStack);
+		DBSQL_ASSERT(pTos[i].flags & MEM_Str);
+		zRec = pTos[i].z;
+		payloadSize = pTos[i].n;
+	} else if ((pC = &p->aCsr[i])->pCursor != 0) {
+		if (pC->deferredMoveto && pC->zAltMap != 0 &&
+		    __alt_column(p, pC, col, numeric, pTos))
+			return DBSQL_SUCCESS;
+		__vdbe_cursor_moveto(pC);
+		zRec = 0;
+		pCrsr = pC->pCursor;
+		if (pC->nullRow) {
+			payloadSize = 0;
+		} else if (pC->keyAsData) {
+			rc = __sm_key_ptr(pCrsr, (const char **)&zRec,
+					  &payloadSize);
+		} else {
+			rc = __sm_data_ptr(pCrsr, (const char **)&zRec,
+					   &payloadSize);
+		}
+		if (rc != DBSQL_SUCCESS)
+			return rc;
+	} else if (pC->pseudoTable) {
+		payloadSize = pC->nData;
+		zRec = pC->pData;
+		DBSQL_ASSERT(payloadSize == 0 || zRec != 0);
+	} else {
+		payloadSize = 0;
+	}
+
+	/*
+	 * Figure out how many bytes in the column data and where the column
+	 * data begins.
+	 */
+	if (payloadSize == 0) {
+		pTos->flags = MEM_Null;
+		return DBSQL_SUCCESS;
+	} else if (REC_IS_TYPED(zRec, payloadSize)) {
+		if (i >= 0 && pC->pCursor != 0)
+			return __record_cached_column(pC, zRec, payloadSize,
+						      col, pTos);
+		return __record_column(zRec, payloadSize, col, pTos);
+	} else if (payloadSize < 256) {
+		idxWidth = 1;
+	} else if (payloadSize < 65536) {
+		idxWidth = 2;
+	} else {
+		idxWidth = 3;
+	}
+
+	/*
+	 * Figure out where the requested column is stored and how big it is.
+	 */
+	if (payloadSize < (idxWidth * (col + 1)))
+		return DBSQL_CORRUPT;
+	memcpy(aHdr, &zRec[idxWidth * col], idxWidth * 2);
+	offset = aHdr[0];
+	end = aHdr[idxWidth];
+	if (idxWidth > 1) {
+		offset |= aHdr[1] << 8;
+		end |= aHdr[idxWidth + 1] << 8;
+		if (idxWidth > 2) {
+			offset |= aHdr[2] << 16;
+			end |= aHdr[idxWidth + 2] << 16;
+		}
+	}
+	amt = end - offset;
+	if (amt < 0 || offset < 0 || end > payloadSize)
+		return DBSQL_CORRUPT;
+
+	/*
+	 * 'amt' and 'offset' now hold the offset to the start of data and the
+	 * amount of data.  Go get the data and put it on the stack.
+	 */
+	pTos->n = amt;
+	if (amt == 0) {
+		pTos->flags = MEM_Null;
+	} else {
+		pTos->flags = MEM_Str | MEM_Ephem;
+		pTos->z = &zRec[offset];
+	}
+	return DBSQL_SUCCESS;
+}
+
+/*
+ * __vdbe_compare --
+ *	Compare 'pNos' with 'pTos' the way comparison opcode 'op', one of
+ *	OP_Eq to OP_Ge or OP_StrEq to OP_StrGe, does.  Returns 1 if the
+ *	comparison holds, 0 if it does not and -1 if either side is NULL.
+ *
+ * STATIC: static int __vdbe_compare __P((int, mem_t *, mem_t *));
+ */
+static int
+__vdbe_compare(op, pNos, pTos)
+	int op;
+	mem_t *pNos;
+	mem_t *pTos;
+{
+	int c, v;
+	int ft, fn;
+
+	ft = pTos->flags;
+	fn = pNos->flags;
+	if ((ft | fn) & MEM_Null) {
+		return -1;
+	} else if (op >= OP_StrEq) {
+		__entity_as_string(pTos);
+		__entity_as_string(pNos);
+		c = strcmp(pNos->z, pTos->z);
+		op -= OP_StrEq - OP_Eq;
+	} else if ((ft & fn & MEM_Int) == MEM_Int) {
+		c = pNos->i - pTos->i;
+	} else if ((ft & MEM_Int) != 0 && (fn & MEM_Str) !=0
+		   && __dbsql_atoi(pNos->z,&v)) {
+		c = v - pTos->i;
+	} else if ((fn & MEM_Int) != 0 && (ft & MEM_Str) !=0 &&
+		   __dbsql_atoi(pTos->z,&v)) {
+		c = pNos->i - v;
+	} else if (__entity_is_whole(pTos) && __entity_is_whole(pNos)) {
+		double a, b;
+		a = (ft & MEM_Int) ? pTos->i : pTos->r;
+		b = (fn & MEM_Int) ? pNos->i : pNos->r;
+		c = (b < a) ? -1 : (b > a);
+	} else {
+		__entity_as_string(pTos);
+		__entity_as_string(pNos);
+		c = __str_numeric_cmp(pNos->z, pTos->z);
+	}
+	/* !!!
+	 * The code generator depends on the string comparison opcodes
+	 * being exactly 6 greater than the corresponding numeric ones.
+	 * !!!
+	 */
+	DBSQL_ASSERT(OP_StrEq - 6 == OP_Eq && OP_StrNe - 6 == OP_Ne &&
+		     OP_StrLt - 6 == OP_Lt && OP_StrLe - 6 == OP_Le &&
+		     OP_StrGt - 6 == OP_Gt && OP_StrGe - 6 == OP_Ge);
+	switch(op) {
+	case OP_Eq:    c = (c == 0);     break;
+	case OP_Ne:    c = (c != 0);     break;
+	case OP_Lt:    c = (c <  0);     break;
+	case OP_Le:    c = (c <= 0);     break;
+	case OP_Gt:    c = (c >  0);     break;
+	default:       c = (c >= 0);     break;
+	}
+	return c;
+}
+
+/*
+ * __sorted_merge --
+ *	The parameters are pointers to the head of two sorted lists
+ *	of sorter_t structures.  Merge these two lists together and return
+ *	a single sorted list.  This routine forms the core of the merge-sort
+ *	algorithm.  In the case of a tie, left sorts in front of right.
+ *
+ * STATIC: static sorter_t * __sorted_merge __P((sorter_t *, sorter_t *));
+ */
+static sorter_t *
+__sorted_merge(left, right)
+	sorter_t *left;
+	sorter_t *right;
+{
+	sorter_t head;
+	sorter_t *tail;
+	tail = &head;
+	tail->pNext = 0;
+	while(left && right) {
+		int c = __str_cmp(left->zKey, right->zKey);
+		if (c <= 0) {
+			tail->pNext = left;
+			left = left->pNext;
+		} else {
+			tail->pNext = right;
+			right = right->pNext;
+		}
+		tail = tail->pNext;
+	}
+	if (left) {
+		tail->pNext = left;
+	} else if (right) {
+		tail->pNext = right;
+	}
+	return head.pNext;
+}
+
+/*
+ * __sorter_sort --
+ *	Sort a list of sorter_t structures in place and return the head
+ *	of the sorted list.  The algorithm is a mergesort using NSORT
+ *	buckets of lists of increasing length.
+ *
+ * STATIC: static sorter_t *__sorter_sort __P((sorter_t *));
+ */
+static sorter_t *
+__sorter_sort(list)
+	sorter_t *list;
+{
+	int i;
+	sorter_t *elem;
+	sorter_t *buckets[NSORT];
+
+	for (i = 0; i < NSORT; i++) {
+		buckets[i] = 0;
+	}
+	while (list) {
+		elem = list;
+		list = elem->pNext;
+		elem->pNext = 0;
+		for (i = 0; i < NSORT - 1; i++) {
+			if (buckets[i] == 0) {
+				buckets[i] = elem;
+				break;
+			} else {
+				elem = __sorted_merge(buckets[i], elem);
+				buckets[i] = 0;
+			}
+		}
+		if (i >= NSORT - 1) {
+			buckets[NSORT - 1] =
+				__sorted_merge(buckets[NSORT - 1], elem);
+		}
+	}
+	elem = 0;
+	for (i = 0; i < NSORT; i++) {
+		elem = __sorted_merge(buckets[i], elem);
+	}
+	return elem;
+}
+
+/*
+ * __sorter_run_next --
+ *	Read the next element of a run written by __sorter_write_run into
+ *	run->head.  At the end of the run head.zKey is set to NULL.
+ *
+ * STATIC: static int __sorter_run_next __P((sort_run_t *));
+ */
+static int
+__sorter_run_next(run)
+	sort_run_t *run;
+{
+	int len[2];
+	int n;
+
+	if (fread(len, sizeof(len), 1, run->fp) != 1) {
+		if (ferror(run->fp))
+			return DBSQL_IOERR;
+		run->head.zKey = 0;
+		return 0;
+	}
+	n = len[0] + len[1];
+	if (n > run->nBuf) {
+		if (__dbsql_realloc(NULL, n, &run->zBuf) == ENOMEM)
+			return ENOMEM;
+		run->nBuf = n;
+	}
+	if (fread(run->zBuf, 1, n, run->fp) != (size_t)n)
+		return DBSQL_IOERR;
+	run->head.nKey = len[0];
+	run->head.zKey = run->zBuf;
+	run->head.nData = len[1];
+	run->head.pData = run->zBuf + len[0];
+	return 0;
+}
+
+/*
+ * __sorter_run_cmp --
+ *	Compare the heads of two runs.  Equal keys order the run written
+ *	last first, which is the order an in-memory sort gives them.
+ *
+ * STATIC: static int __sorter_run_cmp __P((sort_run_t *, sort_run_t *));
+ */
+static int
+__sorter_run_cmp(a, b)
+	sort_run_t *a;
+	sort_run_t *b;
+{
+	int c;
+
+	if ((c = __str_cmp(a->head.zKey, b->head.zKey)) != 0)
+		return c;
+	return (a > b) ? -1 : (a < b);
+}
+
+/*
+ * __sorter_run_down --
+ *	Move the run at aRunHeap[i] down the min-heap until neither of its
+ *	children has a smaller head.
+ *
+ * STATIC: static void __sorter_run_down __P((vdbe_t *, int));
+ */
+static void
+__sorter_run_down(p, i)
+	vdbe_t *p;
+	int i;
+{
+	sort_run_t **heap = p->aRunHeap;
+	sort_run_t *run = heap[i];
+	int child;
+
+	while ((child = 2 * i + 1) < p->nRunHeap) {
+		if (child + 1 < p->nRunHeap &&
+		    __sorter_run_cmp(heap[child + 1], heap[child]) < 0)
+			child++;
+		if (__sorter_run_cmp(heap[child], run) >= 0)
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = run;
+}
+
+/*
+ * __sorter_run_heap --
+ *	Position every run on its first element and make a min-heap of the
+ *	runs that have one.
+ *
+ * STATIC: static int __sorter_run_heap __P((vdbe_t *));
+ */
+static int
+__sorter_run_heap(p)
+	vdbe_t *p;
+{
+	int i, ret;
+
+	if (__dbsql_realloc(NULL, p->nRun * sizeof(sort_run_t *),
+			    &p->aRunHeap) == ENOMEM)
+		return ENOMEM;
+	p->nRunHeap = 0;
+	for (i = 0; i < p->nRun; i++) {
+		if (fflush(p->aRun[i].fp) != 0)
+			return DBSQL_IOERR;
+		rewind(p->aRun[i].fp);
+		if ((ret = __sorter_run_next(&p->aRun[i])) != 0)
+			return ret;
+		if (p->aRun[i].head.zKey != 0)
+			p->aRunHeap[p->nRunHeap++] = &p->aRun[i];
+	}
+	for (i = p->nRunHeap / 2 - 1; i >= 0; i--)
+		__sorter_run_down(p, i);
+	return 0;
+}
+
+/*
+ * __sorter_run_pop --
+ *	Step the run at the top of the heap to its next element and restore
+ *	the heap, dropping the run from it at its end.
+ *
+ * STATIC: static int __sorter_run_pop __P((vdbe_t *));
+ */
+static int
+__sorter_run_pop(p)
+	vdbe_t *p;
+{
+	int ret;
+
+	if ((ret = __sorter_run_next(p->aRunHeap[0])) != 0)
+		return ret;
+	if (p->aRunHeap[0]->head.zKey == 0)
+		p->aRunHeap[0] = p->aRunHeap[--p->nRunHeap];
+	if (p->nRunHeap > 0)
+		__sorter_run_down(p, 0);
+	return 0;
+}
+
+/*
+ * __sorter_write_elem --
+ *	Append one element to the run file 'fp'.  Return the number of
+ *	bytes written, or 0 on an I/O error.
+ *
+ * STATIC: static u_int64_t __sorter_write_elem __P((FILE *, sorter_t *));
+ */
+static u_int64_t
+__sorter_write_elem(fp, elem)
+	FILE *fp;
+	sorter_t *elem;
+{
+	int len[2];
+
+	len[0] = elem->nKey;
+	len[1] = elem->nData;
+	if (fwrite(len, sizeof(len), 1, fp) != 1 ||
+	    fwrite(elem->zKey, 1, elem->nKey, fp) != (size_t)elem->nKey ||
+	    fwrite(elem->pData, 1, elem->nData, fp) != (size_t)elem->nData)
+		return 0;
+	return sizeof(len) + elem->nKey + elem->nData;
+}
+
+/*
+ * __sorter_merge_runs --
+ *	Merge all of the runs into a single new run, so that a sort never
+ *	holds more than SORT_RUN_MAX temporary files open.  The merged run
+ *	takes the place of the first one and, being made of the oldest
+ *	elements, keeps their order among equal keys.
+ *
+ * STATIC: static int __sorter_merge_runs __P((vdbe_t *));
+ */
+static int
+__sorter_merge_runs(p)
+	vdbe_t *p;
+{
+	FILE *fp;
+	u_int64_t n, nbytes;
+	int i, ret;
+
+	if ((ret = __sorter_run_heap(p)) != 0)
+		return ret;
+	if ((fp = tmpfile()) == NULL)
+		return DBSQL_IOERR;
+	nbytes = 0;
+	while (p->nRunHeap > 0) {
+		if ((n = __sorter_write_elem(fp,
+		    &p->aRunHeap[0]->head)) == 0 ||
+		    (ret = __sorter_run_pop(p)) != 0) {
+			fclose(fp);
+			return (n == 0 ? DBSQL_IOERR : ret);
+		}
+		nbytes += n;
+	}
+	if (fflush(fp) != 0) {
+		fclose(fp);
+		return DBSQL_IOERR;
+	}
+	for (i = 0; i < p->nRun; i++) {
+		fclose(p->aRun[i].fp);
+		if (p->aRun[i].zBuf)
+			__dbsql_free(NULL, p->aRun[i].zBuf);
+	}
+	memset(&p->aRun[0], 0, sizeof(sort_run_t));
+	p->aRun[0].fp = fp;
+	p->nRun = 1;
+	p->db->sort_merges++;
+	p->db->sort_spill_bytes += nbytes;
+	return 0;
+}
+
+/*
+ * __sorter_write_run --
+ *	Write the sorted list of elements 'list' to a temporary file as a
+ *	new run.  Once there are SORT_RUN_MAX runs they are merged into one.
+ *
+ * STATIC: static int __sorter_write_run __P((vdbe_t *, sorter_t *));
+ */
+static int
+__sorter_write_run(p, list)
+	vdbe_t *p;
+	sorter_t *list;
+{
+	sort_run_t *run;
+	sorter_t *elem;
+	u_int64_t n, nbytes;
+
+	if (__dbsql_realloc(NULL, (p->nRun + 1) * sizeof(sort_run_t),
+			    &p->aRun) == ENOMEM)
+		return ENOMEM;
+	run = &p->aRun[p->nRun];
+	memset(run, 0, sizeof(sort_run_t));
+	if ((run->fp = tmpfile()) == NULL)
+		return DBSQL_IOERR;
+	p->nRun++;
+
+	nbytes = 0;
+	for (elem = list; elem; elem = elem->pNext) {
+		if ((n = __sorter_write_elem(run->fp, elem)) == 0)
+			return DBSQL_IOERR;
+		nbytes += n;
+	}
+	if (fflush(run->fp) != 0)
+		return DBSQL_IOERR;
+
+	p->db->sort_spills++;
+	p->db->sort_spill_bytes += nbytes;
+	if (p->nRun >= SORT_RUN_MAX)
+		return __sorter_merge_runs(p);
+	return 0;
+}
+
+/*
+ * __sorter_spill --
+ *	Sort the elements held in memory by the sorter and write them to
+ *	a temporary file as a new run.  The arena is then emptied, keeping
+ *	one block around for the elements that follow.
+ *
+ * STATIC: static int __sorter_spill __P((vdbe_t *));
+ */
+static int
+__sorter_spill(p)
+	vdbe_t *p;
+{
+	arena_block_t *blk;
+	int ret;
+
+	p->pSort = __sorter_sort(p->pSort);
+	if ((ret = __sorter_write_run(p, p->pSort)) != 0)
+		return ret;
+	p->pSort = 0;
+
+	while ((blk = p->pSortArena->pNext) != 0) {
+		p->pSortArena->pNext = blk->pNext;
+		__dbsql_free(NULL, blk);
+	}
+	p->pSortArena->nUsed = 0;
+	p->nSortMem = 0;
+	return 0;
+}
+
+/*
+ * __sorter_heap_cmp --
+ *	Compare two elements of a bounded sorter.  Equal keys order the
+ *	element that arrived last first, which is the order the mergesort
+ *	gives them.
+ *
+ * STATIC: static int __sorter_heap_cmp __P((sorter_t *, sorter_t *));
+ */
+static int
+__sorter_heap_cmp(a, b)
+	sorter_t *a;
+	sorter_t *b;
+{
+	int c;
+
+	if ((c = __str_cmp(a->zKey, b->zKey)) != 0)
+		return c;
+	if (a->iSeq == b->iSeq)
+		return 0;
+	return (a->iSeq > b->iSeq) ? -1 : 1;
+}
+
+/*
+ * __sorter_heap_down --
+ *	Move element 'i' of a bounded sorter's heap down until neither
+ *	of its children sorts after it.
+ *
+ * STATIC: static void __sorter_heap_down __P((vdbe_t *, int));
+ */
+static void
+__sorter_heap_down(p, i)
+	vdbe_t *p;
+	int i;
+{
+	sorter_t **heap = p->aHeap;
+	sorter_t *elem;
+	int child;
+
+	elem = heap[i];
+	while ((child = 2 * i + 1) < p->nHeap) {
+		if (child + 1 < p->nHeap &&
+		    __sorter_heap_cmp(heap[child + 1], heap[child]) > 0)
+			child++;
+		if (__sorter_heap_cmp(heap[child], elem) <= 0)
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = elem;
+}
+
+/*
+ * __sorter_heap_drain --
+ *	Empty the heap of a bounded sorter and return its elements as a
+ *	sorted list.
+ *
+ * STATIC: static sorter_t *__sorter_heap_drain __P((vdbe_t *));
+ */
+static sorter_t *
+__sorter_heap_drain(p)
+	vdbe_t *p;
+{
+	sorter_t *elem, *list;
+
+	/* Take the largest off the heap each time, building the list from
+	 * its tail. */
+	list = 0;
+	while (p->nHeap > 0) {
+		elem = p->aHeap[0];
+		p->aHeap[0] = p->aHeap[--p->nHeap];
+		if (p->nHeap > 0)
+			__sorter_heap_down(p, 0);
+		elem->pNext = list;
+		list = elem;
+	}
+	return list;
+}
+
+/*
+ * __sorter_heap_spill --
+ *	Write the elements of a bounded sorter that outgrew "PRAGMA
+ *	sort_memory" to a run and empty its heap.  If the heap was full the
+ *	largest key written is kept in zHeapMax: the run holds enough rows
+ *	that sort ahead of any larger key, so such keys can still be
+ *	rejected on arrival.
+ *
+ * STATIC: static int __sorter_heap_spill __P((vdbe_t *));
+ */
+static int
+__sorter_heap_spill(p)
+	vdbe_t *p;
+{
+	sorter_t *elem, *list;
+	char *zMax;
+	int ret;
+
+	elem = p->aHeap[0];
+	if (p->nHeap == p->nSortLimit) {
+		if (__dbsql_malloc(NULL, elem->nKey, &zMax) == ENOMEM)
+			return ENOMEM;
+		memcpy(zMax, elem->zKey, elem->nKey);
+		if (p->zHeapMax)
+			__dbsql_free(NULL, p->zHeapMax);
+		p->zHeapMax = zMax;
+	}
+
+	list = __sorter_heap_drain(p);
+	ret = __sorter_write_run(p, list);
+	while ((elem = list) != 0) {
+		list = elem->pNext;
+		__dbsql_free(NULL, elem);
+	}
+	p->nSortMem = 0;
+	return ret;
+}
+
+/*
+ * __sorter_heap_put --
+ *	Offer a key and its data to a sorter that keeps only the 'limit'
+ *	smallest keys.  The heap holds the largest kept element on top so
+ *	that most rows are rejected with a single comparison and without
+ *	being copied.  A heap that would grow past "PRAGMA sort_memory" is
+ *	spilled to a run first.
  *
- * STATIC: static sorter_t * __sorted_merge __P((sorter_t *, sorter_t *));
+ * STATIC: static int __sorter_heap_put __P((vdbe_t *, int, mem_t *,
+ * STATIC:                              mem_t *));
  */
-static sorter_t *
-__sorted_merge(left, right)
-	sorter_t *left;
-	sorter_t *right;
+static int
+__sorter_heap_put(p, limit, key, data)
+	vdbe_t *p;
+	int limit;
+	mem_t *key;
+	mem_t *data;
 {
-	sorter_t head;
-	sorter_t *tail;
-	tail = &head;
-	tail->pNext = 0;
-	while(left && right) {
-		int c = __str_cmp(left->zKey, right->zKey);
-		if (c <= 0) {
-			tail->pNext = left;
-			left = left->pNext;
-		} else {
-			tail->pNext = right;
-			right = right->pNext;
-		}
-		tail = tail->pNext;
+	sorter_t **heap;
+	sorter_t *elem;
+	u_int32_t size;
+	int i, parent, ret;
+
+	if (p->aHeap == 0) {
+		if (__dbsql_calloc(NULL, limit, sizeof(sorter_t *),
+				   &p->aHeap) == ENOMEM)
+			return ENOMEM;
+		p->nSortLimit = limit;
 	}
-	if (left) {
-		tail->pNext = left;
-	} else if (right) {
-		tail->pNext = right;
+	DBSQL_ASSERT(p->nSortLimit == limit);
+	heap = p->aHeap;
+
+	/*
+	 * A newer element sorts ahead of an older one with an equal key,
+	 * so only a strictly larger key than the top can be rejected.
+	 */
+	if (p->nHeap == limit && __str_cmp(key->z, heap[0]->zKey) > 0)
+		return 0;
+	if (p->zHeapMax != 0 && __str_cmp(key->z, p->zHeapMax) > 0)
+		return 0;
+
+	size = sizeof(sorter_t) + key->n + data->n;
+	if (p->db->sort_memory != 0 && p->nHeap > 0 &&
+	    (p->nSortMem + size) / 1024 >= p->db->sort_memory &&
+	    (ret = __sorter_heap_spill(p)) != 0)
+		return ret;
+	if (__dbsql_malloc(NULL, size, &elem) == ENOMEM)
+		return ENOMEM;
+	p->nSortMem += size;
+	elem->nKey = key->n;
+	elem->zKey = (char *)&elem[1];
+	memcpy(elem->zKey, key->z, key->n);
+	elem->nData = data->n;
+	elem->pData = elem->zKey + key->n;
+	memcpy(elem->pData, data->z, data->n);
+	elem->iSeq = p->iSortSeq++;
+	elem->pNext = 0;
+
+	if (p->nHeap == limit) {
+		p->nSortMem -= sizeof(sorter_t) + heap[0]->nKey +
+		    heap[0]->nData;
+		__dbsql_free(NULL, heap[0]);
+		heap[0] = elem;
+		__sorter_heap_down(p, 0);
+		return 0;
 	}
-	return head.pNext;
+	for (i = p->nHeap++; i > 0; i = parent) {
+		parent = (i - 1) / 2;
+		if (__sorter_heap_cmp(heap[parent], elem) >= 0)
+			break;
+		heap[i] = heap[parent];
+	}
+	heap[i] = elem;
+	return 0;
 }
 
 /*
@@ -507,6 +2006,168 @@ __expand_cursor_array_size(vm, num_cursors)
 	return 0;
 }
 
+/*
+ * __vdbe_open_temp --
+ *	Open cursor 'i' on a new transient table, an index if 'index' is
+ *	set, see OP_OpenTemp.
+ *
+ * STATIC: static int __vdbe_open_temp __P((vdbe_t *, int, int));
+ */
+static int
+__vdbe_open_temp(p, i, index)
+	vdbe_t *p;
+	int i;
+	int index;
+{
+	cursor_t *pCx;
+	int pgno, rc;
+
+	DBSQL_ASSERT(i >= 0);
+	if (__expand_cursor_array_size(p, i))
+		return DBSQL_NOMEM;
+	pCx = &p->aCsr[i];
+	__vdbe_cleanup_cursor(pCx);
+	memset(pCx, 0, sizeof(*pCx));
+	pCx->nullRow = 1;
+
+	rc = __sm_create(p->db, 0, 1,
+			 (F_ISSET(p->db, DBSQL_DurableTemp) == 0), &pCx->pBt);
+
+	if (rc == DBSQL_SUCCESS) {
+		rc = __sm_begin_txn(pCx->pBt);
+	}
+	if (rc == DBSQL_SUCCESS) {
+		if (index) {
+			rc = __sm_create_index(pCx->pBt, &pgno);
+			if (rc == DBSQL_SUCCESS) {
+				rc = __sm_cursor(pCx->pBt, pgno, 1, 0,
+						    &pCx->pCursor);
+			}
+		} else {
+			rc = __sm_cursor(pCx->pBt, 2, 1, 0, &pCx->pCursor);
+		}
+	}
+	return rc;
+}
+
+/*
+ * __hjoin_prefix --
+ *	Set the zProbe of a join hash table to the start of the entries its
+ *	transient index holds for the key 'key' of 'len' bytes and hash 'h':
+ *	the hash, the length and the key.  Room is left for a ROWID to follow.
+ *	Return 1 if memory is exhausted.
+ *
+ * STATIC: static int __hjoin_prefix __P((hjoin_t *, const char *, int,
+ * STATIC:                           u_int32_t));
+ */
+static int
+__hjoin_prefix(hj, key, len, h)
+	hjoin_t *hj;
+	const char *key;
+	int len;
+	u_int32_t h;
+{
+	u_int32_t n;
+
+	n = len;
+	if (hj->nProbeAlloc < 2 * sizeof(u_int32_t) + len + sizeof(int)) {
+		hj->nProbeAlloc = 2 * (2 * sizeof(u_int32_t) + len +
+				       sizeof(int));
+		if (__dbsql_realloc(NULL, hj->nProbeAlloc,
+				    &hj->zProbe) == ENOMEM) {
+			hj->nProbeAlloc = 0;
+			return 1;
+		}
+	}
+	memcpy(hj->zProbe, &h, sizeof(u_int32_t));
+	memcpy(&hj->zProbe[sizeof(u_int32_t)], &n, sizeof(u_int32_t));
+	memcpy(&hj->zProbe[2 * sizeof(u_int32_t)], key, len);
+	hj->nProbe = 2 * sizeof(u_int32_t) + len;
+	return 0;
+}
+
+/*
+ * __hjoin_spill_put --
+ *	Add ROWID 'recno' under the key 'key' of 'len' bytes and hash 'h' to
+ *	the transient index of a join hash table that spilled.
+ *
+ * STATIC: static int __hjoin_spill_put __P((vdbe_t *, hjoin_t *,
+ * STATIC:                              const char *, int, u_int32_t, int));
+ */
+static int
+__hjoin_spill_put(p, hj, key, len, h, recno)
+	vdbe_t *p;
+	hjoin_t *hj;
+	const char *key;
+	int len;
+	u_int32_t h;
+	int recno;
+{
+	int v;
+
+	if (__hjoin_prefix(hj, key, len, h))
+		return DBSQL_NOMEM;
+	v = INT_TO_KEY(recno);
+	memcpy(&hj->zProbe[hj->nProbe], &v, sizeof(int));
+	return __sm_insert(p->aCsr[hj->iSpill].pCursor, hj->zProbe,
+			   hj->nProbe + sizeof(int), "", 0);
+}
+
+/*
+ * __hjoin_spill --
+ *	Move the elements of a join hash table that outgrew its budget to a
+ *	transient index opened on cursor 'i' and empty it.  The rows still to
+ *	be added go to the index as well.
+ *
+ * STATIC: static int __hjoin_spill __P((vdbe_t *, hjoin_t *, int));
+ */
+static int
+__hjoin_spill(p, hj, i)
+	vdbe_t *p;
+	hjoin_t *hj;
+	int i;
+{
+	hjoin_elem_t *elem;
+	int j, rc;
+
+	if ((rc = __vdbe_open_temp(p, i, 1)) != DBSQL_SUCCESS)
+		return rc;
+	hj->iSpill = i;
+	for (j = 0; j < hj->nHash; j++) {
+		for (elem = hj->aHash[j]; elem; elem = elem->pHash) {
+			rc = __hjoin_spill_put(p, hj, elem->zKey, elem->nKey,
+					       elem->hash, elem->iRecno);
+			if (rc != DBSQL_SUCCESS)
+				return rc;
+		}
+	}
+	__vdbe_hjoin_clear(hj);
+	hj->overflow = 1;
+	return DBSQL_SUCCESS;
+}
+
+/*
+ * __hjoin_spill_match --
+ *	Return 1 if the transient index of a spilled join hash table is on
+ *	an entry of the key in its zProbe, and 0 if not.
+ *
+ * STATIC: static int __hjoin_spill_match __P((vdbe_t *, hjoin_t *));
+ */
+static int
+__hjoin_spill_match(p, hj)
+	vdbe_t *p;
+	hjoin_t *hj;
+{
+	const char *zKey;
+	int nKey;
+
+	if (__sm_key_ptr(p->aCsr[hj->iSpill].pCursor, &zKey,
+			 &nKey) != DBSQL_SUCCESS)
+		return 0;
+	return (nKey == hj->nProbe + sizeof(int) &&
+		memcmp(zKey, hj->zProbe, hj->nProbe) == 0);
+}
+
 /*
  * The CHECK_FOR_INTERRUPT macro defined here looks to see if the
  * DBSQL->interrupt() routine has been called.  If it has been, then
@@ -516,9 +2177,91 @@ __expand_cursor_array_size(vm, num_cursors)
  * implement a loop.  This test used to be on every single instruction,
  * but that meant we had more testing that we needed.  By only testing the
  * flag on jump instructions, we get a (small) speed improvement.
+ *
+ * The bottom of a loop is also where the string arena is emptied.  When
+ * the stack is empty no MEM_Arena string can be in use, so the strings
+ * made for one row are given back before the next row is started.
  */
 #define CHECK_FOR_INTERRUPT \
-   if( db->flags & DBSQL_Interrupt ) goto abort_due_to_interrupt;
+   if( db->flags & DBSQL_Interrupt ) goto abort_due_to_interrupt; \
+   if (pTos < p->aStack && p->nStrArena > 0) __vdbe_str_reset(p); \
+   CHECK_FOR_PROGRESS
+
+/*
+ * The CHECK_FOR_PROGRESS macro calls the progress callback if at least
+ * DBSQL->nProgressOps opcodes have run since it was last called.  If the
+ * callback returns non-zero the program is abandoned with DBSQL_ABORT.
+ * Opcodes are counted as they run but the count is only looked at where
+ * CHECK_FOR_INTERRUPT is, on the jumps that close loops, and by OP_Halt
+ * for programs that do not loop.
+ */
+#ifndef DBSQL_NO_PROGRESS
+#define CHECK_FOR_PROGRESS \
+   if (db->xProgress && nProgressOps >= db->nProgressOps) { \
+	   nProgressOps = 0; \
+	   if (db->xProgress(db->pProgressArg) != 0) \
+		   goto abort_due_to_progress; \
+   }
+#else
+#define CHECK_FOR_PROGRESS
+#endif
+
+/*
+ * With a compiler that can take the address of a label, __vdbe_exec()
+ * jumps to the code of each opcode through a table of those addresses
+ * instead of through the switch statement, which saves the range check
+ * and the extra jump that the switch costs on every opcode.  The switch
+ * is still there, and still used by other compilers, the code of each
+ * opcode simply has a label of its own as well.  VDBE_OPCODE_LABELS is
+ * generated into opcodes.h along with the opcode numbers.  Define
+ * DBSQL_NO_THREADED_DISPATCH to always use the switch.
+ */
+#if defined(__GNUC__) && defined(VDBE_OPCODE_LABELS) && \
+    !defined(DBSQL_NO_THREADED_DISPATCH)
+#define VDBE_THREADED
+#define OPCODE_LABEL(X) op_##X:
+#else
+#define OPCODE_LABEL(X)
+#endif
+
+/*
+ * OPCODE_START is done before every opcode: a test build may simulate an
+ * interrupt, and the opcode is counted for CHECK_FOR_PROGRESS.
+ */
+#ifdef CONFIG_TEST
+#define OPCODE_INTERRUPT \
+   if (dbsql_interrupt_count > 0 && --dbsql_interrupt_count == 0) \
+	   db->interrupt(db);
+#else
+#define OPCODE_INTERRUPT
+#endif
+#ifndef DBSQL_NO_PROGRESS
+#define OPCODE_START OPCODE_INTERRUPT nProgressOps++
+#else
+#define OPCODE_START OPCODE_INTERRUPT
+#endif
+
+/*
+ * NEXT_OPCODE ends the opcodes that run most often in place of "break".
+ * With threaded dispatch it starts the next opcode and jumps straight to
+ * its code, so each of those opcodes has an indirect jump of its own and
+ * the processor can learn which opcode tends to follow it.  The shared
+ * jump at the top of the loop is then only taken after the other
+ * opcodes.  An error, a trace, the end of the program, profiling and the
+ * checks a DIAGNOSTIC build makes after each opcode all go back through
+ * the loop.  NEXT_OPCODE must not be used inside a loop or a switch of
+ * its own.
+ */
+#if defined(VDBE_THREADED) && !defined(VDBE_PROFILE) && !defined(DIAGNOSTIC)
+#define NEXT_OPCODE \
+   if (rc != DBSQL_SUCCESS || p->trace != 0 || pc + 1 >= p->nOp) \
+	   break; \
+   pOp = &p->aOp[++pc]; \
+   OPCODE_START; \
+   goto *aOpcodeLabel[pOp->opcode]
+#else
+#define NEXT_OPCODE break
+#endif
 
 
 /*
@@ -574,6 +2317,9 @@ __vdbe_exec(p)
 	int nProgressOps = 0;      /* Opcodes executed since progress
 				      callback. */
 #endif
+#ifdef VDBE_THREADED
+	static void *aOpcodeLabel[] = { &&op_default, VDBE_OPCODE_LABELS };
+#endif
 
 	if (p->magic != VDBE_MAGIC_RUN)
 		return DBSQL_MISUSE;
@@ -608,39 +2354,16 @@ __vdbe_exec(p)
 #endif
 
 		/*
-		 * Check to see if we need to simulate an interrupt.  This
-		 * only happens if we have a special test build.
+		 * Simulate an interrupt in a test build and count the opcode
+		 * for the progress callback, see OPCODE_START.
 		 */
-#ifdef CONFIG_TEST
-		if (dbsql_interrupt_count > 0) {
-			dbsql_interrupt_count--;
-			if (dbsql_interrupt_count == 0) {
-				db->interrupt(db);
-			}
-		}
-#endif
+		OPCODE_START;
 
-#ifndef DBSQL_NO_PROGRESS
-		/*
-		 * Call the progress callback if it is configured and the
-		 * required number of VDBE ops have been executed (either
-		 * since this invocation of __vdbe_exec() or since last time
-		 * the progress callback was called).  If the progress
-		 * callback returns non-zero, exit the virtual machine with
-		 * a return code DBSQL_ABORT.
-		 */
-		if (db->xProgress) {
-			if (db->nProgressOps == nProgressOps) {
-				if (db->xProgress(db->pProgressArg) != 0) {
-					rc = DBSQL_ABORT;
-					continue;
-				}
-				nProgressOps = 0;
-			}
-			nProgressOps++;
-		}
+#ifdef VDBE_THREADED
+		DBSQL_ASSERT(pOp->opcode > 0 &&
+		       pOp->opcode < ARRAY_SIZE(aOpcodeLabel));
+		goto *aOpcodeLabel[pOp->opcode];
 #endif
-
 switch(pOp->opcode) {
 
 /*****************************************************************************
@@ -678,10 +2401,10 @@ switch(pOp->opcode) {
 ** the one at index P2 from the beginning of
 ** the program.
 */
-case OP_Goto: {
+case OP_Goto: OPCODE_LABEL(Goto) {
 	CHECK_FOR_INTERRUPT;
 	pc = pOp->p2 - 1;
-	break;
+	NEXT_OPCODE;
 }
 
 /* Opcode:  Gosub * P2 *
@@ -694,7 +2417,7 @@ case OP_Goto: {
 ** the return address stack will fill up and processing will abort
 ** with a fatal error.
 */
-case OP_Gosub: {
+case OP_Gosub: OPCODE_LABEL(Gosub) {
 	if (p->returnDepth >=
 	    (sizeof(p->returnStack) / sizeof(p->returnStack[0]))) {
 		__str_append(&p->zErrMsg, "return address stack overflow",
@@ -713,7 +2436,7 @@ case OP_Gosub: {
 ** OP_Gosub.  If an OP_Return has occurred for all OP_Gosubs, then
 ** processing aborts with a fatal error.
 */
-case OP_Return: {
+case OP_Return: OPCODE_LABEL(Return) {
 	if (p->returnDepth <= 0) {
 		__str_append(&p->zErrMsg, "return address stack underflow",
 			     (char*)0);
@@ -741,8 +2464,12 @@ case OP_Return: {
 ** There is an implied "Halt 0 0 0" instruction inserted at the very end of
 ** every program.  So a jump past the last instruction of the program
 ** is the same as executing Halt.
+**
+** The progress callback is called first if it is due, so that it also
+** gets a chance to abandon programs that have no loops.
 */
-case OP_Halt: {
+case OP_Halt: OPCODE_LABEL(Halt) {
+	CHECK_FOR_PROGRESS;
 	p->magic = VDBE_MAGIC_HALT;
 	p->pTos = pTos;
 	if (pOp->p1 != DBSQL_SUCCESS) {
@@ -763,7 +2490,7 @@ case OP_Halt: {
 ** The integer value P1 is pushed onto the stack.  If P3 is not zero
 ** then it is assumed to be a string representation of the same integer.
 */
-case OP_Integer: {
+case OP_Integer: OPCODE_LABEL(Integer) {
 	pTos++;
 	pTos->i = pOp->p1;
 	pTos->flags = MEM_Int;
@@ -772,7 +2499,7 @@ case OP_Integer: {
 		pTos->flags |= MEM_Str | MEM_Static;
 		pTos->n = strlen(pOp->p3) + 1;
 	}
-	break;
+	NEXT_OPCODE;
 }
 
 /* Opcode: String * * P3
@@ -780,7 +2507,7 @@ case OP_Integer: {
 ** The string value P3 is pushed onto the stack.  If P3==0 then a
 ** NULL is pushed onto the stack.
 */
-case OP_String: {
+case OP_String: OPCODE_LABEL(String) {
 	char *z = pOp->p3;
 	pTos++;
 	if( z==0 ){
@@ -790,7 +2517,7 @@ case OP_String: {
 		pTos->n = strlen(z) + 1;
 		pTos->flags = MEM_Str | MEM_Static;
 	}
-	break;
+	NEXT_OPCODE;
 }
 
 /* Opcode: Variable P1 * *
@@ -798,17 +2525,24 @@ case OP_String: {
 ** Push the value of variable P1 onto the stack.  A variable is
 ** an unknown in the original SQL string as handed to DBSQL->prepare().
 ** Any occurance of the '?' character in the original SQL is considered
-** a variable.  Variables in the SQL string are number from left to
+** a variable, as is a ':name', all the uses of which are the same
+** variable.  Variables in the SQL string are number from left to
 ** right beginning with 1.  The values of variables are set using the
-** dbsql_bind() API.
+** DBSQL->bind() family of calls, which keep integers and reals as such
+** so that they are pushed without going through text.
 */
-case OP_Variable: {
+case OP_Variable: OPCODE_LABEL(Variable) {
 	int j = pOp->p1 - 1;
 	pTos++;
-	if (j >= 0 && j < p->nVar && p->azVar[j] != 0) {
-		pTos->z = p->azVar[j];
-		pTos->n = p->anVar[j];
-		pTos->flags = MEM_Str | MEM_Static;
+	if (j >= 0 && j < p->nVar && p->aVar[j].flags != 0) {
+		memcpy(pTos, &p->aVar[j], (sizeof(*pTos) - NBFS));
+		if (pTos->flags & MEM_Short) {
+			memcpy(pTos->zShort, p->aVar[j].zShort, pTos->n);
+			pTos->z = pTos->zShort;
+		} else if (pTos->flags & MEM_Dyn) {
+			pTos->flags &= ~MEM_Dyn;
+			pTos->flags |= MEM_Static;
+		}
 	} else {
 		pTos->flags = MEM_Null;
 	}
@@ -819,11 +2553,11 @@ case OP_Variable: {
 **
 ** P1 elements are popped off of the top of stack and discarded.
 */
-case OP_Pop: {
+case OP_Pop: OPCODE_LABEL(Pop) {
 	DBSQL_ASSERT(pOp->p1 >= 0);
 	__pop_stack(&pTos, pOp->p1);
 	DBSQL_ASSERT(pTos >= &p->aStack[-1]);
-	break;
+	NEXT_OPCODE;
 }
 
 /* Opcode: Dup P1 P2 *
@@ -841,28 +2575,28 @@ case OP_Pop: {
 **
 ** Also see the Pull instruction.
 */
-case OP_Dup: {
+case OP_Dup: OPCODE_LABEL(Dup) {
 	mem_t *pFrom = &pTos[-pOp->p1];
 	DBSQL_ASSERT(pFrom <= pTos && pFrom >= p->aStack);
 	pTos++;
 	memcpy(pTos, pFrom, (sizeof(*pFrom) - NBFS));
 	if (pTos->flags & MEM_Str) {
-		if (pOp->p2 && (pTos->flags & (MEM_Dyn | MEM_Ephem))) {
-			pTos->flags &= ~MEM_Dyn;
+		if (pOp->p2 &&
+		    (pTos->flags & (MEM_Dyn | MEM_Ephem | MEM_Arena))) {
+			pTos->flags &= ~(MEM_Dyn | MEM_Arena);
 			pTos->flags |= MEM_Ephem;
 		} else if (pTos->flags & MEM_Short) {
 			memcpy(pTos->zShort, pFrom->zShort, pTos->n);
 			pTos->z = pTos->zShort;
 		} else if ((pTos->flags & MEM_Static) == 0) {
-			if (__dbsql_calloc(NULL, 1, pFrom->n,
-					   &pTos->z) == ENOMEM)
+			if (__vdbe_str_alloc(p, pFrom->n, &pTos->z) == ENOMEM)
 				goto no_mem;
 			memcpy(pTos->z, pFrom->z, pFrom->n);
-			pTos->flags &= ~(MEM_Static | MEM_Ephem | MEM_Short);
-			pTos->flags |= MEM_Dyn;
+			pTos->flags &= ~(MEM_Dyn | MEM_Ephem | MEM_Short);
+			pTos->flags |= MEM_Arena;
 		}
 	}
-	break;
+	NEXT_OPCODE;
 }
 
 /* Opcode: Pull P1 * *
@@ -875,7 +2609,7 @@ case OP_Dup: {
 **
 ** See also the Dup instruction.
 */
-case OP_Pull: {
+case OP_Pull: OPCODE_LABEL(Pull) {
 	mem_t *pFrom = &pTos[-pOp->p1];
 	int i;
 	mem_t ts;
@@ -902,7 +2636,7 @@ case OP_Pull: {
 		DBSQL_ASSERT(pTos->z == pTos[-pOp->p1].zShort);
 		pTos->z = pTos->zShort;
 	}
-	break;
+	NEXT_OPCODE;
 }
 
 /* Opcode: Push P1 * *
@@ -911,7 +2645,7 @@ case OP_Pull: {
 ** stack (P1==0 is the top of the stack) with the value
 ** of the top of the stack.  Then pop the top of the stack.
 */
-case OP_Push: {
+case OP_Push: OPCODE_LABEL(Push) {
 	mem_t *pTo = &pTos[-pOp->p1];
 
 	DBSQL_ASSERT(pTo >= p->aStack);
@@ -925,7 +2659,7 @@ case OP_Push: {
 		pTo->z = pTo->zShort;
 	}
 	pTos--;
-	break;
+	NEXT_OPCODE;
 }
 
 
@@ -934,7 +2668,7 @@ case OP_Push: {
 ** P3 becomes the P1-th column name (first is 0).  An array of pointers
 ** to all column names is passed as the 4th parameter to the callback.
 */
-case OP_ColumnName: {
+case OP_ColumnName: OPCODE_LABEL(ColumnName) {
 	DBSQL_ASSERT(pOp->p1 >= 0 && pOp->p1 < p->nOp);
 	p->azColName[pOp->p1] = pOp->p3;
 	p->nCallback = 0;
@@ -947,7 +2681,7 @@ case OP_ColumnName: {
 ** invoke the callback function using the newly formed array as the
 ** 3rd parameter.
 */
-case OP_Callback: {
+case OP_Callback: OPCODE_LABEL(Callback) {
 	int i;
 	char **azArgv = p->zArgv;
 	mem_t *pCol;
@@ -1000,7 +2734,7 @@ case OP_Callback: {
 ** This opcode is used to report the number and names of columns
 ** in cases where the result set is empty.
 */
-case OP_NullCallback: {
+case OP_NullCallback: OPCODE_LABEL(NullCallback) {
 	if (p->nCallback == 0 && p->xCallback != 0) {
 		if (__safety_off(db))
 			goto abort_due_to_misuse;
@@ -1024,10 +2758,9 @@ case OP_NullCallback: {
 ** any element of the stack is NULL, then the result is NULL.
 **
 ** If P3 is NULL, then use no separator.  When P1==1, this routine
-** makes a copy of the top stack element into memory obtained
-** from __dbsql_calloc().
+** makes a copy of the top stack element in the string arena.
 */
-case OP_Concat: {
+case OP_Concat: OPCODE_LABEL(Concat) {
 	char *zNew;
 	int nByte;
 	int nField;
@@ -1061,7 +2794,7 @@ case OP_Concat: {
 		pTos->flags = MEM_Null;
 		break;
 	}
-	if (__dbsql_calloc(NULL, 1, nByte, &zNew) == ENOMEM)
+	if (__vdbe_str_alloc(p, nByte, &zNew) == ENOMEM)
 		goto no_mem;
 	j = 0;
 	pTerm = &pTos[1 - nField];
@@ -1080,7 +2813,7 @@ case OP_Concat: {
 	}
 	pTos++;
 	pTos->n = nByte;
-	pTos->flags = MEM_Str | MEM_Dyn;
+	pTos->flags = MEM_Str | MEM_Arena;
 	pTos->z = zNew;
 	break;
 }
@@ -1131,11 +2864,11 @@ case OP_Concat: {
 ** function before the division.  Division by zero returns NULL.
 ** If either operand is NULL, the result is NULL.
 */
-case OP_Add:       /* FALLTHROUGH */
-case OP_Subtract:  /* FALLTHROUGH */
-case OP_Multiply:  /* FALLTHROUGH */
-case OP_Divide:    /* FALLTHROUGH */
-case OP_Remainder: {
+case OP_Add: OPCODE_LABEL(Add)       /* FALLTHROUGH */
+case OP_Subtract: OPCODE_LABEL(Subtract)  /* FALLTHROUGH */
+case OP_Multiply: OPCODE_LABEL(Multiply)  /* FALLTHROUGH */
+case OP_Divide: OPCODE_LABEL(Divide)    /* FALLTHROUGH */
+case OP_Remainder: OPCODE_LABEL(Remainder) {
 	mem_t *pNos = &pTos[-1];
 	DBSQL_ASSERT(pNos >= p->aStack);
 	if (((pTos->flags | pNos->flags) & MEM_Null) != 0) {
@@ -1196,7 +2929,7 @@ case OP_Remainder: {
 		pTos->r = b;
 		pTos->flags = MEM_Real;
 	}
-	break;
+	NEXT_OPCODE;
 
 divide_by_zero:
 	__entity_release_mem(pTos);
@@ -1214,7 +2947,7 @@ divide_by_zero:
 **
 ** See also: AggFunc
 */
-case OP_Function: {
+case OP_Function: OPCODE_LABEL(Function) {
 	int n, i;
 	mem_t *pArg;
 	char **azArgv;
@@ -1236,6 +2969,7 @@ case OP_Function: {
 	ctx.s.z = 0;
 	ctx.isError = 0;
 	ctx.isStep = 0;
+	ctx.pVm = p;
 	if (__safety_off(db))
 		goto abort_due_to_misuse;
 	(*ctx.pFunc->xFunc)(&ctx, n, (const char**)azArgv);
@@ -1283,10 +3017,10 @@ case OP_Function: {
 ** right by N bits where N is the second element on the stack.
 ** If either operand is NULL, the result is NULL.
 */
-case OP_BitAnd:    /* FALLTHROUGH */
-case OP_BitOr:     /* FALLTHROUGH */
-case OP_ShiftLeft: /* FALLTHROUGH */
-case OP_ShiftRight: {
+case OP_BitAnd: OPCODE_LABEL(BitAnd)    /* FALLTHROUGH */
+case OP_BitOr: OPCODE_LABEL(BitOr)     /* FALLTHROUGH */
+case OP_ShiftLeft: OPCODE_LABEL(ShiftLeft) /* FALLTHROUGH */
+case OP_ShiftRight: OPCODE_LABEL(ShiftRight) {
 	mem_t *pNos = &pTos[-1];
 	int a, b;
 
@@ -1323,7 +3057,7 @@ case OP_ShiftRight: {
 **
 ** To force the top of the stack to be an integer, just add 0.
 */
-case OP_AddImm: {
+case OP_AddImm: OPCODE_LABEL(AddImm) {
 	DBSQL_ASSERT(pTos >= p->aStack);
 	__entity_to_int(pTos);
 	pTos->i += pOp->p1;
@@ -1340,7 +3074,7 @@ case OP_AddImm: {
 ** current value if P1==0, or to the least integer that is strictly
 ** greater than its current value if P1==1.
 */
-case OP_ForceInt: {
+case OP_ForceInt: OPCODE_LABEL(ForceInt) {
 	int v;
 	DBSQL_ASSERT(pTos >= p->aStack);
 	if ((pTos->flags & (MEM_Int | MEM_Real)) == 0 &&
@@ -1377,7 +3111,7 @@ case OP_ForceInt: {
 ** P1 is 1, then the stack is popped.  In all other cases, the depth
 ** of the stack is unchanged.
 */
-case OP_MustBeInt: {
+case OP_MustBeInt: OPCODE_LABEL(MustBeInt) {
 	DBSQL_ASSERT(pTos >= p->aStack);
 	if (pTos->flags & MEM_Int) {
 		/* Do nothing */
@@ -1492,101 +3226,53 @@ mismatch:
 ** use OP_StrLe.
 **
 ** If P2 is zero, do not jump.  Instead, push an integer 1 onto the
-** stack if the jump would have been taken, or a 0 if not.  Push a
-** NULL if either operand was NULL.
-*/
-/* Opcode: Gt P1 P2 *
-**
-** Pop the top two elements from the stack.  If second element (the
-** next on stack) is greater than the first (the top of stack),
-** then jump to instruction P2. In other words, jump if NOS>TOS.
-**
-** If either operand is NULL (and thus if the result is unknown) then
-** take the jump if P1 is true.
-**
-** If both values are numeric, they are converted to doubles using atof()
-** and compared in that format.  Numeric values are always less than
-** non-numeric values.  If both operands are non-numeric, the strcmp() library
-** routine is used for the comparison.  For a pure text comparison
-** use OP_StrGt.
-**
-** If P2 is zero, do not jump.  Instead, push an integer 1 onto the
-** stack if the jump would have been taken, or a 0 if not.  Push a
-** NULL if either operand was NULL.
-*/
-/* Opcode: Ge P1 P2 *
-**
-** Pop the top two elements from the stack.  If second element (the next
-** on stack) is greater than or equal to the first (the top of stack),
-** then jump to instruction P2. In other words, jump if NOS>=TOS.
-**
-** If either operand is NULL (and thus if the result is unknown) then
-** take the jump if P1 is true.
-**
-** If both values are numeric, they are converted to doubles using atof()
-** and compared in that format.  Numeric values are always less than
-** non-numeric values.  If both operands are non-numeric, the strcmp() library
-** routine is used for the comparison.  For a pure text comparison
-** use OP_StrGe.
-**
-** If P2 is zero, do not jump.  Instead, push an integer 1 onto the
-** stack if the jump would have been taken, or a 0 if not.  Push a
-** NULL if either operand was NULL.
-*/
-case OP_Eq: /* FALLTHROUGH */
-case OP_Ne: /* FALLTHROUGH */
-case OP_Lt: /* FALLTHROUGH */
-case OP_Le: /* FALLTHROUGH */
-case OP_Gt: /* FALLTHROUGH */
-case OP_Ge: {
-	mem_t *pNos = &pTos[-1];
-	int c, v;
-	int ft, fn;
-	DBSQL_ASSERT(pNos >= p->aStack);
-	ft = pTos->flags;
-	fn = pNos->flags;
-	if ((ft | fn) & MEM_Null) {
-		__pop_stack(&pTos, 2);
-		if (pOp->p2) {
-			if (pOp->p1)
-				pc = pOp->p2-1;
-		} else {
-			pTos++;
-			pTos->flags = MEM_Null;
-		}
-		break;
-	} else if ((ft & fn & MEM_Int) == MEM_Int) {
-		c = pNos->i - pTos->i;
-	} else if ((ft & MEM_Int) != 0 && (fn & MEM_Str) !=0
-		   && __dbsql_atoi(pNos->z,&v)) {
-		c = v - pTos->i;
-	} else if ((fn & MEM_Int) != 0 && (ft & MEM_Str) !=0 &&
-		   __dbsql_atoi(pTos->z,&v)) {
-		c = pNos->i - v;
-	} else {
-		__entity_as_string(pTos);
-		__entity_as_string(pNos);
-		c = __str_numeric_cmp(pNos->z, pTos->z);
-	}
-	switch(pOp->opcode) {
-	case OP_Eq:    c = (c == 0);     break;
-	case OP_Ne:    c = (c != 0);     break;
-	case OP_Lt:    c = (c <  0);     break;
-	case OP_Le:    c = (c <= 0);     break;
-	case OP_Gt:    c = (c >  0);     break;
-	default:       c = (c >= 0);     break;
-	}
-	__pop_stack(&pTos, 2);
-	if (pOp->p2) {
-		if (c)
-			pc = pOp->p2 - 1;
-	} else {
-		pTos++;
-		pTos->i = c;
-		pTos->flags = MEM_Int;
-	}
-	break;
-}
+** stack if the jump would have been taken, or a 0 if not.  Push a
+** NULL if either operand was NULL.
+*/
+/* Opcode: Gt P1 P2 *
+**
+** Pop the top two elements from the stack.  If second element (the
+** next on stack) is greater than the first (the top of stack),
+** then jump to instruction P2. In other words, jump if NOS>TOS.
+**
+** If either operand is NULL (and thus if the result is unknown) then
+** take the jump if P1 is true.
+**
+** If both values are numeric, they are converted to doubles using atof()
+** and compared in that format.  Numeric values are always less than
+** non-numeric values.  If both operands are non-numeric, the strcmp() library
+** routine is used for the comparison.  For a pure text comparison
+** use OP_StrGt.
+**
+** If P2 is zero, do not jump.  Instead, push an integer 1 onto the
+** stack if the jump would have been taken, or a 0 if not.  Push a
+** NULL if either operand was NULL.
+*/
+/* Opcode: Ge P1 P2 *
+**
+** Pop the top two elements from the stack.  If second element (the next
+** on stack) is greater than or equal to the first (the top of stack),
+** then jump to instruction P2. In other words, jump if NOS>=TOS.
+**
+** If either operand is NULL (and thus if the result is unknown) then
+** take the jump if P1 is true.
+**
+** If both values are numeric, they are converted to doubles using atof()
+** and compared in that format.  Numeric values are always less than
+** non-numeric values.  If both operands are non-numeric, the strcmp() library
+** routine is used for the comparison.  For a pure text comparison
+** use OP_StrGe.
+**
+** If P2 is zero, do not jump.  Instead, push an integer 1 onto the
+** stack if the jump would have been taken, or a 0 if not.  Push a
+** NULL if either operand was NULL.
+*/
+case OP_Eq: OPCODE_LABEL(Eq) /* FALLTHROUGH */
+case OP_Ne: OPCODE_LABEL(Ne) /* FALLTHROUGH */
+case OP_Lt: OPCODE_LABEL(Lt) /* FALLTHROUGH */
+case OP_Le: OPCODE_LABEL(Le) /* FALLTHROUGH */
+case OP_Gt: OPCODE_LABEL(Gt) /* FALLTHROUGH */
+case OP_Ge: OPCODE_LABEL(Ge) /* FALLTHROUGH */
 
 /* !!!
 ** WARNING, INSERT NO CODE AT THIS POINT!
@@ -1698,73 +3384,30 @@ case OP_Ge: {
 ** stack if the jump would have been taken, or a 0 if not.  Push a
 ** NULL if either operand was NULL.
 */
-case OP_StrEq: /* FALLTHROUGH */
-case OP_StrNe: /* FALLTHROUGH */
-case OP_StrLt: /* FALLTHROUGH */
-case OP_StrLe: /* FALLTHROUGH */
-case OP_StrGt: /* FALLTHROUGH */
-case OP_StrGe: {
-	mem_t *pNos = &pTos[-1];
+case OP_StrEq: OPCODE_LABEL(StrEq) /* FALLTHROUGH */
+case OP_StrNe: OPCODE_LABEL(StrNe) /* FALLTHROUGH */
+case OP_StrLt: OPCODE_LABEL(StrLt) /* FALLTHROUGH */
+case OP_StrLe: OPCODE_LABEL(StrLe) /* FALLTHROUGH */
+case OP_StrGt: OPCODE_LABEL(StrGt) /* FALLTHROUGH */
+case OP_StrGe: OPCODE_LABEL(StrGe) {
 	int c;
-	DBSQL_ASSERT(pNos >= p->aStack);
-	if ((pNos->flags | pTos->flags) & MEM_Null) {
-		__pop_stack(&pTos, 2);
-		if (pOp->p2) {
-			if (pOp->p1)
-				pc = (pOp->p2 - 1);
-		} else {
-			pTos++;
-			pTos->flags = MEM_Null;
-		}
-		break;
-	} else {
-		__entity_as_string(pTos);
-		__entity_as_string(pNos);
-		c = strcmp(pNos->z, pTos->z);
-	}
-	/* !!!
-	 * The DBSQL_ASSERTs on each case of the following switch are there to verify
-	 * that string comparison opcodes are always exactly 6 greater than the
-	 * corresponding numeric comparison opcodes.  The code generator
-	 * depends on this fact.
-	 * !!!
-	 */
-	switch(pOp->opcode) {
-	case OP_StrEq:
-		c = (c == 0);
-		DBSQL_ASSERT(pOp->opcode-6 == OP_Eq);
-		break;
-	case OP_StrNe:
-		c = (c != 0);
-		DBSQL_ASSERT(pOp->opcode-6 == OP_Ne);
-		break;
-	case OP_StrLt:
-		c = (c < 0);
-		DBSQL_ASSERT(pOp->opcode-6 == OP_Lt);
-		break;
-	case OP_StrLe:
-		c = (c <= 0);
-		DBSQL_ASSERT(pOp->opcode-6 == OP_Le);
-		break;
-	case OP_StrGt:
-		c = (c > 0);
-		DBSQL_ASSERT(pOp->opcode-6 == OP_Gt);
-		break;
-	default:
-		c = (c >= 0);
-		DBSQL_ASSERT(pOp->opcode-6 == OP_Ge);
-		break;
-	}
+
+	DBSQL_ASSERT(&pTos[-1] >= p->aStack);
+	c = __vdbe_compare(pOp->opcode, &pTos[-1], pTos);
 	__pop_stack(&pTos, 2);
 	if (pOp->p2) {
-		if (c)
-			pc = (pOp->p2 - 1);
+		if (c > 0 || (c < 0 && pOp->p1))
+			pc = pOp->p2 - 1;
 	} else {
 		pTos++;
-		pTos->flags = MEM_Int;
-		pTos->i = c;
+		if (c < 0) {
+			pTos->flags = MEM_Null;
+		} else {
+			pTos->i = c;
+			pTos->flags = MEM_Int;
+		}
 	}
-	break;
+	NEXT_OPCODE;
 }
 
 /* Opcode: And * * *
@@ -1779,8 +3422,8 @@ case OP_StrGe: {
 ** two values and push the resulting boolean value back onto the
 ** stack.
 */
-case OP_And: /* FALLTHROUGH */
-case OP_Or: {
+case OP_And: OPCODE_LABEL(And) /* FALLTHROUGH */
+case OP_Or: OPCODE_LABEL(Or) {
 	mem_t *pNos = &pTos[-1];
 	int v1, v2;    /* 0==TRUE, 1==FALSE, 2==UNKNOWN or NULL */
 
@@ -1829,8 +3472,8 @@ case OP_Or: {
 ** with its absolute value. If the top of the stack is NULL
 ** its value is unchanged.
 */
-case OP_Negative: /* FALLTHROUGH */
-case OP_AbsValue: {
+case OP_Negative: OPCODE_LABEL(Negative) /* FALLTHROUGH */
+case OP_AbsValue: OPCODE_LABEL(AbsValue) {
 	DBSQL_ASSERT(pTos >= p->aStack);
 	if (pTos->flags & MEM_Real) {
 		__entity_release_mem(pTos);
@@ -1863,7 +3506,7 @@ case OP_AbsValue: {
 ** with its complement.  If the top of the stack is NULL its value
 ** is unchanged.
 */
-case OP_Not: {
+case OP_Not: OPCODE_LABEL(Not) {
 	DBSQL_ASSERT(pTos >= p->aStack);
 	if (pTos->flags & MEM_Null)
 		break;  /* Do nothing to NULLs */
@@ -1879,7 +3522,7 @@ case OP_Not: {
 ** with its ones-complement.  If the top of the stack is NULL its
 ** value is unchanged.
 */
-case OP_BitNot: {
+case OP_BitNot: OPCODE_LABEL(BitNot) {
 	DBSQL_ASSERT(pTos >= p->aStack);
 	if (pTos->flags & MEM_Null)
 		break;  /* Do nothing to NULLs */
@@ -1894,7 +3537,7 @@ case OP_BitNot: {
 ** Do nothing.  This instruction is often useful as a jump
 ** destination.
 */
-case OP_Noop: {
+case OP_Noop: OPCODE_LABEL(Noop) {
   break;
 }
 
@@ -1918,8 +3561,8 @@ case OP_Noop: {
 ** If the value popped of the stack is NULL, then take the jump if P1
 ** is true and fall through if P1 is false.
 */
-case OP_If: /* FALLTHROUGH */
-case OP_IfNot: {
+case OP_If: OPCODE_LABEL(If) /* FALLTHROUGH */
+case OP_IfNot: OPCODE_LABEL(IfNot) {
 	int c;
 	DBSQL_ASSERT(pTos >= p->aStack);
 	if (pTos->flags & MEM_Null) {
@@ -1934,7 +3577,7 @@ case OP_IfNot: {
 	pTos--;
 	if (c)
 		pc = pOp->p2-1;
-	break;
+	NEXT_OPCODE;
 }
 
 /* Opcode: IsNull P1 P2 *
@@ -1943,7 +3586,7 @@ case OP_IfNot: {
 ** to P2.  Pop the stack P1 times if P1>0.   If P1<0 leave the stack
 ** unchanged.
 */
-case OP_IsNull: {
+case OP_IsNull: OPCODE_LABEL(IsNull) {
 	int i, cnt;
 	mem_t *pTerm;
 	cnt = pOp->p1;
@@ -1959,7 +3602,7 @@ case OP_IsNull: {
 	}
 	if (pOp->p1 > 0)
 		__pop_stack(&pTos, cnt);
-	break;
+	NEXT_OPCODE;
 }
 
 /* Opcode: NotNull P1 P2 *
@@ -1968,7 +3611,7 @@ case OP_IsNull: {
 ** stack if P1 times if P1 is greater than zero.  If P1 is less than
 ** zero then leave the stack unchanged.
 */
-case OP_NotNull: {
+case OP_NotNull: OPCODE_LABEL(NotNull) {
 	int i, cnt;
 	cnt = pOp->p1;
 	if (cnt < 0)
@@ -1982,7 +3625,7 @@ case OP_NotNull: {
 		pc = pOp->p2 - 1;
 	if (pOp->p1 > 0)
 		__pop_stack(&pTos, cnt);
-	break;
+	NEXT_OPCODE;
 }
 
 /* Opcode: MakeRecord P1 P2 *
@@ -2005,8 +3648,19 @@ case OP_NotNull: {
 ** (Later:) The P2==1 option was intended to make NULLs distinct
 ** for the UNION operator.  But I have since discovered that NULLs
 ** are indistinct for UNION.  So this option is never used.
+**
+** When the database format version is 2 or more the record is typed,
+** numbers are stored in binary rather than as text.  See vdbe_int.h.
+*/
+/* Opcode: MakeTextRecord P1 P2 *
+**
+** Like MakeRecord except that the record always uses the format
+** version 1 layout with every field stored as text.  Values that
+** print the same then always make the same bytes, which matters when
+** the record is used as a key rather than as data.
 */
-case OP_MakeRecord: {
+case OP_MakeTextRecord: OPCODE_LABEL(MakeTextRecord) /* FALLTHROUGH */
+case OP_MakeRecord: OPCODE_LABEL(MakeRecord) {
 	char *zNewRecord;
 	int nByte;
 	int nField;
@@ -2040,6 +3694,12 @@ case OP_MakeRecord: {
 	nField = pOp->p1;
 	pRec = &pTos[1 - nField];
 	DBSQL_ASSERT(pRec >= p->aStack);
+	if (pOp->opcode == OP_MakeRecord && db->format_version >= 2) {
+		if (__record_make(p, pRec, nField, zTemp, &zNewRecord,
+				  &nByte) == ENOMEM)
+			goto no_mem;
+		goto make_record_done;
+	}
 	nByte = 0;
 	for (i = 0; i < nField; i++, pRec++) {
 		if (pRec->flags & MEM_Null) {
@@ -2062,7 +3722,7 @@ case OP_MakeRecord: {
 	if (nByte <= NBFS) {
 		zNewRecord = zTemp;
 	} else {
-		if (__dbsql_calloc(NULL, 1, nByte, &zNewRecord) == ENOMEM)
+		if (__vdbe_str_alloc(p, nByte, &zNewRecord) == ENOMEM)
 			goto no_mem;
 	}
 	j = 0;
@@ -2097,6 +3757,7 @@ case OP_MakeRecord: {
 			j += pRec->n;
 		}
 	}
+make_record_done:
 	__pop_stack(&pTos, nField);
 	pTos++;
 	pTos->n = nByte;
@@ -2108,7 +3769,7 @@ case OP_MakeRecord: {
 	} else {
 		DBSQL_ASSERT(zNewRecord != zTemp);
 		pTos->z = zNewRecord;
-		pTos->flags = MEM_Str | MEM_Dyn;
+		pTos->flags = MEM_Str | MEM_Arena;
 	}
 	break;
 }
@@ -2185,8 +3846,8 @@ case OP_MakeRecord: {
 **
 ** See also:  MakeKey, SortMakeKey
 */
-case OP_MakeIdxKey: /* FALLTHROUGH */
-case OP_MakeKey: {
+case OP_MakeIdxKey: OPCODE_LABEL(MakeIdxKey) /* FALLTHROUGH */
+case OP_MakeKey: OPCODE_LABEL(MakeKey) {
 	char *zNewKey;
 	int nByte;
 	int nField;
@@ -2236,7 +3897,7 @@ case OP_MakeKey: {
 	if (nByte <= NBFS) {
 		zNewKey = zTemp;
 	} else {
-		if (__dbsql_calloc(NULL, 1, nByte, &zNewKey) == ENOMEM)
+		if (__vdbe_str_alloc(p, nByte, &zNewKey) == ENOMEM)
 			goto no_mem;
 	}
 	j = 0;
@@ -2279,7 +3940,7 @@ case OP_MakeKey: {
 		pTos->flags = MEM_Str | MEM_Short;
 	} else {
 		pTos->z = zNewKey;
-		pTos->flags = MEM_Str | MEM_Dyn;
+		pTos->flags = MEM_Str | MEM_Arena;
 	}
 	break;
 }
@@ -2292,15 +3953,15 @@ case OP_MakeKey: {
 ** will move to the first entry greater than the key rather than to
 ** the key itself.
 */
-case OP_IncrKey: {
+case OP_IncrKey: OPCODE_LABEL(IncrKey) {
 	DBSQL_ASSERT(pTos >= p->aStack);
 	/*
 	 * The IncrKey opcode is only applied to keys generated by
 	 * MakeKey or MakeIdxKey and the results of those operands
-	 * are always dynamic strings or zShort[] strings.  So we
+	 * are always arena strings or zShort[] strings.  So we
 	 * are always free to modify the string in place.
 	 */
-	DBSQL_ASSERT(pTos->flags & (MEM_Dyn | MEM_Short));
+	DBSQL_ASSERT(pTos->flags & (MEM_Arena | MEM_Short));
 	pTos->z[pTos->n-1]++;
 	break;
 }
@@ -2318,7 +3979,7 @@ case OP_IncrKey: {
 ** database file has an index of 0 and the file used for temporary tables
 ** has an index of 1.
 */
-case OP_Checkpoint: {
+case OP_Checkpoint: OPCODE_LABEL(Checkpoint) {
 	int i = pOp->p1;
 	if (i >= 0 && i < db->nDb && db->aDb[i].pBt) {
 		rc = __sm_checkpoint(db->aDb[i].pBt);
@@ -2335,7 +3996,7 @@ case OP_Checkpoint: {
 ** does not support transactions (i.e. it is a DS or CDS environment) this
 ** will not actually begin a transaction.
 */
-case OP_Transaction: {
+case OP_Transaction: OPCODE_LABEL(Transaction) {
 	int i = pOp->p1;
 	DBSQL_ASSERT(i >= 0 && i < db->nDb);
 	if (db->aDb[i].inTrans) /* TODO: do we need this? */
@@ -2352,7 +4013,7 @@ case OP_Transaction: {
 ** transaction to actually take effect.  No additional modifications
 ** are allowed until another transaction is started.
 */
-case OP_Commit: {
+case OP_Commit: OPCODE_LABEL(Commit) {
 	int i = pOp->p1;
 	DBSQL_ASSERT(i >= 0 && i < db->nDb);
 	if (db->xCommitCallback != 0) {
@@ -2387,7 +4048,7 @@ case OP_Commit: {
 ** This instruction automatically closes all cursors and releases both
 ** the read and write locks on the indicated database.
 */
-case OP_Rollback: {
+case OP_Rollback: OPCODE_LABEL(Rollback) {
 	int i = pOp->p1;
 	DBSQL_ASSERT(i >= 0 && i < db->nDb);
 	DBSQL_ASSERT(db->aDb[i].inTrans); /* TODO: do we need this? */
@@ -2403,7 +4064,7 @@ case OP_Rollback: {
 ** Write the top of the stack into database P1 as its format_version.
 ** A transaction must be started before executing this opcode.
 */
-case OP_SetFormatVersion: {
+case OP_SetFormatVersion: OPCODE_LABEL(SetFormatVersion) {
 	DBSQL_ASSERT(pOp->p1 >= 0 && pOp->p1 < db->nDb);
 	DBSQL_ASSERT(db->aDb[pOp->p1].pBt != 0);
 	DBSQL_ASSERT(pTos >= p->aStack);
@@ -2420,7 +4081,7 @@ case OP_SetFormatVersion: {
 ** Every time something changes effecting the schema it is updated.
 ** This value needs to be stored. P1 is the database to effect.
 */
-case OP_SetSchemaSignature: {
+case OP_SetSchemaSignature: OPCODE_LABEL(SetSchemaSignature) {
 	DBSQL_ASSERT(pTos >= p->aStack);
 	__entity_to_int(pTos);
 	rc = __sm_set_schema_sig(db->aDb[pOp->p1].pBt, pTos->i);
@@ -2446,7 +4107,7 @@ case OP_SetSchemaSignature: {
 ** change in the post-check and pre-commit would spell trouble for
 ** everyone (and their data).
 */
-case OP_VerifySchemaSignature: {
+case OP_VerifySchemaSignature: OPCODE_LABEL(VerifySchemaSignature) {
 	int sig;
 	DBSQL_ASSERT(pOp->p1 >= 0 && pOp->p1 < db->nDb);
 	rc = __sm_get_schema_sig(db->aDb[pOp->p1].pBt, &sig);
@@ -2479,6 +4140,10 @@ case OP_VerifySchemaSignature: {
 ** to get a read lock but fails, the script terminates with an
 ** DBSQL_BUSY error code.
 **
+** Under "PRAGMA isolation = snapshot" a program that writes no database
+** takes no read lock.  Its cursors on a database all read in one
+** snapshot of it instead, which lasts until the program halts.
+**
 ** The P3 value is the name of the table or index being opened.
 ** The P3 value is not actually used by this opcode and may be
 ** omitted.  But the code generator usually inserts the index or
@@ -2502,14 +4167,15 @@ case OP_VerifySchemaSignature: {
 **
 ** See also OpenRead.
 */
-case OP_OpenRead: /* FALLTHROUGH */
-case OP_OpenWrite: {
+case OP_OpenRead: OPCODE_LABEL(OpenRead) /* FALLTHROUGH */
+case OP_OpenWrite: OPCODE_LABEL(OpenWrite) {
 	int busy = 0;
 	int i = pOp->p1;
 	int p2 = pOp->p2;
 	int wrFlag;
 	sm_t *pX;
 	int iDb;
+	DB_TXN *snap;
 
 	DBSQL_ASSERT(pTos >= p->aStack);
 	__entity_to_int(pTos);
@@ -2539,8 +4205,28 @@ case OP_OpenWrite: {
 	p->aCsr[i].nullRow = 1;
 	if (pX == 0)
 		break;
+	snap = 0;
+	if (!wrFlag && p->readOnly && (db->flags & DBSQL_SnapshotRead)) {
+		/*
+		 * All the cursors of a read-only program on one database
+		 * read in a single snapshot, taken when the first of them
+		 * is opened and ended when the program halts.
+		 */
+		if (iDb >= p->nSnap) {
+			if (__dbsql_realloc(NULL, db->nDb * sizeof(DB_TXN *),
+			    &p->aSnap) == ENOMEM)
+				goto no_mem;
+			memset(&p->aSnap[p->nSnap], 0,
+			       (db->nDb - p->nSnap) * sizeof(DB_TXN *));
+			p->nSnap = db->nDb;
+		}
+		if (p->aSnap[iDb] == 0 &&
+		    (rc = __sm_snapshot_begin(pX, &p->aSnap[iDb])) != 0)
+			goto abort_due_to_error;
+		snap = p->aSnap[iDb];
+	}
 	do {
-		rc = __sm_cursor(pX, p2, wrFlag, &p->aCsr[i].pCursor);
+		rc = __sm_cursor(pX, p2, wrFlag, snap, &p->aCsr[i].pCursor);
 		switch(rc) {
 		case DBSQL_BUSY: {
 			if (db->xBusyCallback == 0) {
@@ -2587,35 +4273,10 @@ case OP_OpenWrite: {
 ** whereas "Temporary" in the context of CREATE TABLE means for the duration
 ** of the connection to the database.  Same word; different meanings.
 */
-case OP_OpenTemp: {
-	int i = pOp->p1;
-	cursor_t *pCx;
-	DBSQL_ASSERT(i >= 0);
-	if (__expand_cursor_array_size(p, i))
+case OP_OpenTemp: OPCODE_LABEL(OpenTemp) {
+	rc = __vdbe_open_temp(p, pOp->p1, pOp->p2);
+	if (rc == DBSQL_NOMEM)
 		goto no_mem;
-	pCx = &p->aCsr[i];
-	__vdbe_cleanup_cursor(pCx);
-	memset(pCx, 0, sizeof(*pCx));
-	pCx->nullRow = 1;
-
-	rc = __sm_create(db, 0, 1,
-			 (F_ISSET(db, DBSQL_DurableTemp) == 0), &pCx->pBt);
-
-	if (rc == DBSQL_SUCCESS) {
-		rc = __sm_begin_txn(pCx->pBt);
-	}
-	if (rc == DBSQL_SUCCESS) {
-		if (pOp->p2) {
-			int pgno;
-			rc = __sm_create_index(pCx->pBt, &pgno);
-			if (rc == DBSQL_SUCCESS) {
-				rc = __sm_cursor(pCx->pBt, pgno, 1,
-						    &pCx->pCursor);
-			}
-		} else {
-			rc = __sm_cursor(pCx->pBt, 2, 1, &pCx->pCursor);
-		}
-	}
 	break;
 }
 
@@ -2629,7 +4290,7 @@ case OP_OpenTemp: {
 ** A pseudo-table created by this opcode is useful for holding the
 ** NEW or OLD tables in a trigger.
 */
-case OP_OpenPseudo: {
+case OP_OpenPseudo: OPCODE_LABEL(OpenPseudo) {
 	int i = pOp->p1;
 	cursor_t *pCx;
 	DBSQL_ASSERT(i >= 0);
@@ -2643,14 +4304,34 @@ case OP_OpenPseudo: {
 	break;
 }
 
+/* Opcode: BulkInsert P1 * *
+**
+** Tell the write cursor P1 that the program is about to stream a
+** large number of rows into it and that nothing else in the program
+** reads that table or index through a different cursor.  Inserts
+** through P1 are then batched and written a buffer at a time.  Any
+** read or positioning through P1 writes out the batch first.
+*/
+case OP_BulkInsert: OPCODE_LABEL(BulkInsert) {
+	int i = pOp->p1;
+	DBSQL_ASSERT(i >= 0 && i < p->nCursor);
+	if (p->aCsr[i].pCursor != 0) {
+		rc = __sm_bulk_insert(p->aCsr[i].pCursor);
+	}
+	break;
+}
+
 /* Opcode: Close P1 * *
 **
 ** Close a cursor previously opened as P1.  If P1 is not
 ** currently open, this instruction is a no-op.
 */
-case OP_Close: {
+case OP_Close: OPCODE_LABEL(Close) {
 	int i = pOp->p1;
 	if (i >= 0 && i < p->nCursor) {
+		if (p->aCsr[i].pCursor != 0 &&
+		    (rc = __sm_flush(p->aCsr[i].pCursor)) != DBSQL_SUCCESS)
+			goto abort_due_to_error;
 		__vdbe_cleanup_cursor(&p->aCsr[i]);
 	}
 	break;
@@ -2677,8 +4358,8 @@ case OP_Close: {
 **
 ** See also: MoveTo
 */
-case OP_MoveLt: /* FALLTHROUGH */
-case OP_MoveTo: {
+case OP_MoveLt: OPCODE_LABEL(MoveLt) /* FALLTHROUGH */
+case OP_MoveTo: OPCODE_LABEL(MoveTo) {
 	int i = pOp->p1;
 	cursor_t *pC;
 
@@ -2693,6 +4374,7 @@ case OP_MoveTo: {
 			if (pOp->p2 == 0 && pOp->opcode == OP_MoveTo) {
 				pC->movetoTarget = iKey;
 				pC->deferredMoveto = 1;
+				pC->zAltMap = 0;
 				__entity_release_mem(pTos);
 				pTos--;
 				break;
@@ -2740,6 +4422,118 @@ case OP_MoveTo: {
 	break;
 }
 
+/* Opcode: MergeTo P1 P2 *
+**
+** Pop the top of the stack and use its value as a key.  Reposition index
+** cursor P1 on the first entry whose key is not less than the key, and
+** jump to P2 if there is no such entry, like MoveTo does.
+**
+** The key is remembered.  If it is greater than the key of the previous
+** MergeTo and the cursor has only moved forward since then, every entry
+** before the cursor is less than the key.  The cursor is then stepped
+** forward to the key instead of searching the index for it.  If it is
+** the same key again, the loop has just read the entries that match it
+** and the cursor is stepped back over them.  Either way the index is
+** searched after MERGE_STEPS steps.  An inner loop fed keys in ascending
+** order by its outer loop thus reads its index in a single forward pass.
+*/
+case OP_MergeTo: OPCODE_LABEL(MergeTo) {
+	int i = pOp->p1;
+	cursor_t *pC;
+	sm_cursor_t *pCrsr;
+	int res, n, cmp, seek, steps;
+
+	DBSQL_ASSERT(pTos >= p->aStack);
+	DBSQL_ASSERT(i >= 0 && i < p->nCursor);
+	pC = &p->aCsr[i];
+	if ((pCrsr = pC->pCursor) != 0) {
+		__entity_as_string(pTos);
+		DBSQL_ASSERT(pC->deferredMoveto == 0);
+		seek = 1;
+		cmp = 0;
+		if (pC->zMerge != 0) {
+			n = (pTos->n < pC->nMerge) ? pTos->n : pC->nMerge;
+			if ((cmp = memcmp(pTos->z, pC->zMerge, n)) == 0)
+				cmp = pTos->n - pC->nMerge;
+			seek = (cmp < 0 || (cmp == 0 && pC->nullRow));
+		}
+		if (!seek && cmp > 0) {
+			/* Step forward from where the last key left off. */
+			for (steps = 0; !seek && !pC->nullRow; steps++) {
+				if (__sm_key_compare(pCrsr, pTos->z, pTos->n,
+						     4, &cmp) != DBSQL_SUCCESS ||
+				    steps == MERGE_STEPS) {
+					seek = 1;
+				} else if (cmp >= 0) {
+					break;
+				} else {
+					if ((rc = __sm_next(pCrsr, &res)) !=
+					    DBSQL_SUCCESS)
+						goto abort_due_to_error;
+					pC->nullRow = res;
+#ifdef CONFIG_TEST
+					dbsql_search_count++;
+#endif
+				}
+			}
+		} else if (!seek) {
+			/*
+			 * The same key again.  Step back over the entries
+			 * that match it to the last one that is less.
+			 */
+			for (steps = 0; !seek; steps++) {
+				if (steps == MERGE_STEPS) {
+					seek = 1;
+					break;
+				}
+				if ((rc = __sm_prev(pCrsr, &res)) !=
+				    DBSQL_SUCCESS)
+					goto abort_due_to_error;
+#ifdef CONFIG_TEST
+				dbsql_search_count++;
+#endif
+				if (res || __sm_key_compare(pCrsr, pTos->z,
+				    pTos->n, 4, &cmp) != DBSQL_SUCCESS)
+					seek = 1;
+				else if (cmp < 0)
+					break;
+			}
+			if (!seek) {
+				if ((rc = __sm_next(pCrsr, &res)) !=
+				    DBSQL_SUCCESS)
+					goto abort_due_to_error;
+				pC->nullRow = res;
+#ifdef CONFIG_TEST
+				dbsql_search_count++;
+#endif
+			}
+		}
+		if (seek) {
+			/* Search the index for the key. */
+			__sm_moveto(pCrsr, pTos->z, pTos->n, &res);
+			pC->nullRow = 0;
+			if (res < 0) {
+				__sm_next(pCrsr, &res);
+				pC->nullRow = (res != 0);
+			}
+#ifdef CONFIG_TEST
+			dbsql_search_count++;
+#endif
+		}
+		pC->recnoIsValid = 0;
+		if (pC->nMerge < pTos->n &&
+		    __dbsql_realloc(NULL, pTos->n, &pC->zMerge) == ENOMEM)
+			goto no_mem;
+		memcpy(pC->zMerge, pTos->z, pTos->n);
+		pC->nMerge = pTos->n;
+		if (pC->nullRow && pOp->p2 > 0)
+			pc = pOp->p2 - 1;
+	}
+	__entity_release_mem(pTos);
+	pTos--;
+	break;
+}
+
 /* Opcode: Distinct P1 P2 *
 **
 ** Use the top of the stack as a string key.  If a record with that key does
@@ -2773,9 +4567,9 @@ case OP_MoveTo: {
 **
 ** See also: Distinct, Found, MoveTo, NotExists, IsUnique
 */
-case OP_Distinct: /* FALLTHROUGH */
-case OP_NotFound: /* FALLTHROUGH */
-case OP_Found: {
+case OP_Distinct: OPCODE_LABEL(Distinct) /* FALLTHROUGH */
+case OP_NotFound: OPCODE_LABEL(NotFound) /* FALLTHROUGH */
+case OP_Found: OPCODE_LABEL(Found) {
 	int i = pOp->p1;
 	int alreadyExists = 0;
 	cursor_t *pC;
@@ -2822,7 +4616,7 @@ case OP_Found: {
 **
 ** See also: Distinct, NotFound, NotExists, Found
 */
-case OP_IsUnique: {
+case OP_IsUnique: OPCODE_LABEL(IsUnique) {
 	int i = pOp->p1;
 	mem_t *pNos = &pTos[-1];
 	sm_cursor_t *pCrsr;
@@ -2914,7 +4708,7 @@ case OP_IsUnique: {
 **
 ** See also: Distinct, Found, MoveTo, NotFound, IsUnique
 */
-case OP_NotExists: {
+case OP_NotExists: OPCODE_LABEL(NotExists) {
 	int i = pOp->p1;
 	sm_cursor_t *pCrsr;
 	DBSQL_ASSERT(pTos >= p->aStack);
@@ -2944,7 +4738,7 @@ case OP_NotExists: {
 ** table that cursor P1 points to.  The new record number is pushed
 ** onto the stack.
 */
-case OP_NewRecno: {
+case OP_NewRecno: OPCODE_LABEL(NewRecno) {
 	static struct drand48_data rand;
 	static int first_time = 1;
 	if (first_time) {
@@ -3073,8 +4867,8 @@ case OP_NewRecno: {
 **
 ** P1 may not be a pseudo-table opened using the OpenPseudo opcode.
 */
-case OP_PutIntKey: /* FALLTHROUGH */
-case OP_PutStrKey: {
+case OP_PutIntKey: OPCODE_LABEL(PutIntKey) /* FALLTHROUGH */
+case OP_PutStrKey: OPCODE_LABEL(PutStrKey) {
 	mem_t *pNos = &pTos[-1];
 	int i = pOp->p1;
 	cursor_t *pC;
@@ -3146,7 +4940,7 @@ case OP_PutStrKey: {
 **
 ** If P1 is a pseudo-table, then this instruction is a no-op.
 */
-case OP_Delete: {
+case OP_Delete: OPCODE_LABEL(Delete) {
 	int i = pOp->p1;
 	cursor_t *pC;
 	DBSQL_ASSERT(i >= 0 && i < p->nCursor);
@@ -3170,10 +4964,11 @@ case OP_Delete: {
 ** data off of the key rather than the data.  This is used for
 ** processing compound selects.
 */
-case OP_KeyAsData: {
+case OP_KeyAsData: OPCODE_LABEL(KeyAsData) {
 	int i = pOp->p1;
 	DBSQL_ASSERT(i >= 0 && i < p->nCursor);
 	p->aCsr[i].keyAsData = pOp->p2;
+	p->aCsr[i].hdrValid = 0;
 	break;
 }
 
@@ -3195,8 +4990,8 @@ case OP_KeyAsData: {
 ** If the cursor is not pointing to a valid row, a NULL is pushed
 ** onto the stack.
 */
-case OP_RowKey: /* FALLTHROUGH */
-case OP_RowData: {
+case OP_RowKey: OPCODE_LABEL(RowKey) /* FALLTHROUGH */
+case OP_RowData: OPCODE_LABEL(RowData) {
 	int i = pOp->p1;
 	cursor_t *pC;
 	int n;
@@ -3222,9 +5017,9 @@ case OP_RowData: {
 			pTos->flags = MEM_Str | MEM_Short;
 			pTos->z = pTos->zShort;
 		} else {
-			if (__dbsql_calloc(NULL, 1, n, &pTos->z) == ENOMEM)
+			if (__vdbe_str_alloc(p, n, &pTos->z) == ENOMEM)
 				goto no_mem;
-			pTos->flags = MEM_Str | MEM_Dyn;
+			pTos->flags = MEM_Str | MEM_Arena;
 		}
 		if (pC->keyAsData || pOp->opcode == OP_RowKey) {
 			__sm_key(pCrsr, 0, n, pTos->z);
@@ -3241,7 +5036,7 @@ case OP_RowData: {
 	break;
 }
 
-/* Opcode: Column P1 P2 *
+/* Opcode: Column P1 P2 P3
 **
 ** Interpret the data that cursor P1 points to as
 ** a structure built using the MakeRecord instruction.
@@ -3259,114 +5054,62 @@ case OP_RowData: {
 ** For P1==-2, the next on the stack is used.  And so forth.  The
 ** value pushed is always just a pointer into the record which is
 ** stored further down on the stack.  The column value is not copied.
+**
+** When P1 is a cursor the value pushed points into the row buffer
+** owned by that cursor, so it is likewise not copied.  It remains valid
+** until the cursor is next moved.
+**
+** Numbers in a typed record are pushed as MEM_Real values without
+** being converted to text.
+**
+** If the cursor was last positioned by IdxMoveTo and the index holds
+** the column as NULL or text, the value is read from the index key and
+** the table row is not read at all.  A P3 of "n" says that only the
+** numeric value of the column is used, as by arithmetic, and then a
+** whole number is read from the index key as well.  The key does not
+** keep the text of a number, so without P3 numbers come from the row.
 */
-case OP_Column: {
-	int amt, offset, end, payloadSize;
-	int i = pOp->p1;
-	int p2 = pOp->p2;
-	cursor_t *pC;
-	char *zRec;
-	sm_cursor_t *pCrsr;
-	int idxWidth;
-	unsigned char aHdr[10];
-
-	DBSQL_ASSERT(i < p->nCursor);
+case OP_Column: OPCODE_LABEL(Column) {
 	pTos++;
-	if (i < 0) {
-		DBSQL_ASSERT(&pTos[i] >= p->aStack);
-		DBSQL_ASSERT(pTos[i].flags & MEM_Str);
-		zRec = pTos[i].z;
-		payloadSize = pTos[i].n;
-	} else if ((pC = &p->aCsr[i])->pCursor != 0) {
-		__vdbe_cursor_moveto(pC);
-		zRec = 0;
-		pCrsr = pC->pCursor;
-		if (pC->nullRow) {
-			payloadSize = 0;
-		} else if (pC->keyAsData) {
-			__sm_key_size(pCrsr, &payloadSize);
-		} else {
-			__sm_data_size(pCrsr, &payloadSize);
-		}
-	} else if (pC->pseudoTable) {
-		payloadSize = pC->nData;
-		zRec = pC->pData;
-		DBSQL_ASSERT(payloadSize == 0 || zRec != 0);
-	} else {
-		payloadSize = 0;
-	}
-
-	/*
-	 * Figure out how many bytes in the column data and where the column
-	 * data begins.
-	 */
-	if (payloadSize == 0) {
-		pTos->flags = MEM_Null;
-		break;
-	} else if (payloadSize < 256) {
-		idxWidth = 1;
-	} else if (payloadSize < 65536) {
-		idxWidth = 2;
-	} else {
-		idxWidth = 3;
-	}
-
-	/*
-	 * Figure out where the requested column is stored and how big it is.
-	 */
-	if (payloadSize < (idxWidth * (p2 + 1))) {
-		rc = DBSQL_CORRUPT;
-		goto abort_due_to_error;
-	}
-	if (zRec) {
-		memcpy(aHdr, &zRec[idxWidth * p2], idxWidth * 2);
-	} else if (pC->keyAsData) {
-		__sm_key(pCrsr, idxWidth * p2, idxWidth * 2, (char*)aHdr);
-	} else {
-		__sm_data(pCrsr, idxWidth * p2, idxWidth * 2, (char*)aHdr);
-	}
-	offset = aHdr[0];
-	end = aHdr[idxWidth];
-	if (idxWidth > 1) {
-		offset |= aHdr[1] << 8;
-		end |= aHdr[idxWidth + 1] << 8;
-		if (idxWidth > 2) {
-			offset |= aHdr[2] << 16;
-			end |= aHdr[idxWidth + 2] << 16;
-		}
-	}
-	amt = end - offset;
-	if (amt < 0 || offset < 0 || end > payloadSize) {
-		rc = DBSQL_CORRUPT;
+	rc = __vdbe_column(p, pOp->p1, pOp->p2, pOp->p3 != 0, pTos);
+	if (rc != DBSQL_SUCCESS)
 		goto abort_due_to_error;
-	}
+	NEXT_OPCODE;
+}
 
-	/*
-	 * 'amt' and 'offset' now hold the offset to the start of data and the
-	 * amount of data.  Go get the data and put it on the stack.
-	 */
-	pTos->n = amt;
-	if (amt == 0) {
-		pTos->flags = MEM_Null;
-	} else if (zRec) {
-		pTos->flags = MEM_Str | MEM_Ephem;
-		pTos->z = &zRec[offset];
-	} else {
-		if (amt <= NBFS) {
-			pTos->flags = MEM_Str | MEM_Short;
-			pTos->z = pTos->zShort;
-		} else {
-			if (__dbsql_calloc(NULL, 1, amt, &pTos->z) == ENOMEM)
-				goto no_mem;
-			pTos->flags = MEM_Str | MEM_Dyn;
-		}
-		if (pC->keyAsData) {
-			__sm_key(pCrsr, offset, amt, pTos->z);
-		} else {
-			__sm_data(pCrsr, offset, amt, pTos->z);
-		}
-	}
-	break;
+/* Opcode: ColumnCmp P1 P2 P3
+**
+** Do "Column C1 A1", "Column C2 A2" and a comparison with P1 and P2 as
+** one instruction: push column A1 of cursor C1 and column A2 of cursor
+** C2, pop them and jump to P2 as the comparison would.  P3 is
+** "C1,A1,C2,A2,K", where K counts the comparison from Eq: 0 to 5 for Eq
+** to Ge and 6 to 11 for StrEq to StrGe.  The peephole pass stores the
+** five numbers after that text, so they are not parsed as the program
+** runs.
+**
+** The peephole pass makes this from the three instructions when they
+** compare two table columns and jump, as WHERE terms such as "a<b" or
+** "t1.x=t2.y" do, so the term takes one dispatch per row instead of
+** three.
+*/
+case OP_ColumnCmp: OPCODE_LABEL(ColumnCmp) {
+	column_cmp_t *cc = (column_cmp_t *)pOp->p3;
+	int c;
+
+	DBSQL_ASSERT(cc != 0 && cc->iCmp >= 0 && cc->iCmp <= OP_StrGe - OP_Eq);
+	pTos++;
+	rc = __vdbe_column(p, cc->iCsr1, cc->iCol1, 0, pTos);
+	if (rc != DBSQL_SUCCESS)
+		goto abort_due_to_error;
+	pTos++;
+	rc = __vdbe_column(p, cc->iCsr2, cc->iCol2, 0, pTos);
+	if (rc != DBSQL_SUCCESS)
+		goto abort_due_to_error;
+	c = __vdbe_compare(OP_Eq + cc->iCmp, &pTos[-1], pTos);
+	__pop_stack(&pTos, 2);
+	if (c > 0 || (c < 0 && pOp->p1))
+		pc = pOp->p2 - 1;
+	NEXT_OPCODE;
 }
 
 /* Opcode: Recno P1 * *
@@ -3376,14 +5119,15 @@ case OP_Column: {
 ** file P1.  The sequential scan should have been started using the
 ** Next opcode.
 */
-case OP_Recno: {
+case OP_Recno: OPCODE_LABEL(Recno) {
 	int i = pOp->p1;
 	cursor_t *pC;
 	int v;
 
 	DBSQL_ASSERT(i >= 0 && i < p->nCursor);
 	pC = &p->aCsr[i];
-	__vdbe_cursor_moveto(pC);
+	if (pC->zAltMap == 0 || !pC->deferredMoveto)
+		__vdbe_cursor_moveto(pC);
 	pTos++;
 	if (pC->recnoIsValid) {
 		v = pC->lastRecno;
@@ -3399,7 +5143,7 @@ case OP_Recno: {
 	}
 	pTos->i = v;
 	pTos->flags = MEM_Int;
-	break;
+	NEXT_OPCODE;
 }
 
 /* Opcode: FullKey P1 * *
@@ -3413,7 +5157,7 @@ case OP_Recno: {
 **
 ** This opcode may not be used on a pseudo-table.
 */
-case OP_FullKey: {
+case OP_FullKey: OPCODE_LABEL(FullKey) {
 	int i = pOp->p1;
 	sm_cursor_t *pCrsr;
 
@@ -3432,9 +5176,9 @@ case OP_FullKey: {
 			goto abort_due_to_error;
 		}
 		if (amt > NBFS) {
-			if (__dbsql_calloc(NULL, 1, amt, &z) == ENOMEM)
+			if (__vdbe_str_alloc(p, amt, &z) == ENOMEM)
 				goto no_mem;
-			pTos->flags = MEM_Str | MEM_Dyn;
+			pTos->flags = MEM_Str | MEM_Arena;
 		} else {
 			z = pTos->zShort;
 			pTos->flags = MEM_Str | MEM_Short;
@@ -3452,7 +5196,7 @@ case OP_FullKey: {
 ** that occur while the cursor is on the null row will always push
 ** a NULL onto the stack.
 */
-case OP_NullRow: {
+case OP_NullRow: OPCODE_LABEL(NullRow) {
 	int i = pOp->p1;
 
 	DBSQL_ASSERT(i >= 0 && i < p->nCursor);
@@ -3469,7 +5213,7 @@ case OP_NullRow: {
 ** If P2 is 0 or if the table or index is not empty, fall through
 ** to the following instruction.
 */
-case OP_Last: {
+case OP_Last: OPCODE_LABEL(Last) {
 	int i = pOp->p1;
 	cursor_t *pC;
 	sm_cursor_t *pCrsr;
@@ -3498,7 +5242,7 @@ case OP_Last: {
 ** If P2 is 0 or if the table or index is not empty, fall through
 ** to the following instruction.
 */
-case OP_Rewind: {
+case OP_Rewind: OPCODE_LABEL(Rewind) {
 	int i = pOp->p1;
 	cursor_t *pC;
 	sm_cursor_t *pCrsr;
@@ -3536,8 +5280,8 @@ case OP_Rewind: {
 ** to the following instruction.  But if the cursor backup was successful,
 ** jump immediately to P2.
 */
-case OP_Prev: /* FALLTHROUGH */
-case OP_Next: {
+case OP_Prev: OPCODE_LABEL(Prev) /* FALLTHROUGH */
+case OP_Next: OPCODE_LABEL(Next) {
 	cursor_t *pC;
 	sm_cursor_t *pCrsr;
 
@@ -3564,7 +5308,7 @@ case OP_Next: {
 		pC->nullRow = 1;
 	}
 	pC->recnoIsValid = 0;
-	break;
+	NEXT_OPCODE;
 }
 
 /* Opcode: IdxPut P1 P2 P3
@@ -3578,7 +5322,7 @@ case OP_Next: {
 ** is rolled back.  If P3 is not null, then it becomes part of the
 ** error message returned with the DBSQL_CONSTRAINT.
 */
-case OP_IdxPut: {
+case OP_IdxPut: OPCODE_LABEL(IdxPut) {
 	int i = pOp->p1;
 	sm_cursor_t *pCrsr;
 	DBSQL_ASSERT(pTos >= p->aStack);
@@ -3628,7 +5372,7 @@ case OP_IdxPut: {
 ** The top of the stack is an index key built using the MakeIdxKey opcode.
 ** This opcode removes that entry from the index.
 */
-case OP_IdxDelete: {
+case OP_IdxDelete: OPCODE_LABEL(IdxDelete) {
 	int i = pOp->p1;
 	sm_cursor_t *pCrsr;
 	DBSQL_ASSERT(pTos >= p->aStack);
@@ -3656,7 +5400,7 @@ case OP_IdxDelete: {
 **
 ** See also: Recno, MakeIdxKey.
 */
-case OP_IdxRecno: {
+case OP_IdxRecno: OPCODE_LABEL(IdxRecno) {
 	int i = pOp->p1;
 	sm_cursor_t *pCrsr;
 
@@ -3679,7 +5423,7 @@ case OP_IdxRecno: {
 	} else {
 		pTos->flags = MEM_Null;
 	}
-	break;
+	NEXT_OPCODE;
 }
 
 /* Opcode: IdxGT P1 P2 *
@@ -3707,9 +5451,9 @@ case OP_IdxRecno: {
 ** then jump to P2.  Otherwise fall through to the next instruction.
 ** In either case, the stack is popped once.
 */
-case OP_IdxLT: /* FALLTHROUGH */
-case OP_IdxGT: /* FALLTHROUGH */
-case OP_IdxGE: {
+case OP_IdxLT: OPCODE_LABEL(IdxLT) /* FALLTHROUGH */
+case OP_IdxGT: OPCODE_LABEL(IdxGT) /* FALLTHROUGH */
+case OP_IdxGE: OPCODE_LABEL(IdxGE) {
 	int i= pOp->p1;
 	sm_cursor_t *pCrsr;
 
@@ -3735,7 +5479,7 @@ case OP_IdxGE: {
 	}
 	__entity_release_mem(pTos);
 	pTos--;
-	break;
+	NEXT_OPCODE;
 }
 
 /* Opcode: IdxIsNull P1 P2 *
@@ -3747,7 +5491,7 @@ case OP_IdxGE: {
 **
 ** The index entry is always popped from the stack.
 */
-case OP_IdxIsNull: {
+case OP_IdxIsNull: OPCODE_LABEL(IdxIsNull) {
 	int i = pOp->p1;
 	int k, n;
 	const char *z;
@@ -3782,7 +5526,7 @@ case OP_IdxIsNull: {
 **
 ** See also: Clear
 */
-case OP_Destroy: {
+case OP_Destroy: OPCODE_LABEL(Destroy) {
 	rc = __sm_drop_table(db->aDb[pOp->p2].pBt, pOp->p1);
 	break;
 }
@@ -3799,7 +5543,7 @@ case OP_Destroy: {
 **
 ** See also: Destroy
 */
-case OP_Clear: {
+case OP_Clear: OPCODE_LABEL(Clear) {
 	rc = __sm_clear_table(db->aDb[pOp->p2].pBt, pOp->p1);
 	break;
 }
@@ -3829,8 +5573,8 @@ case OP_Clear: {
 **
 ** See documentation on OP_CreateTable for additional information.
 */
-case OP_CreateIndex: /* FALLTHROUGH */
-case OP_CreateTable: {
+case OP_CreateIndex: OPCODE_LABEL(CreateIndex) /* FALLTHROUGH */
+case OP_CreateTable: OPCODE_LABEL(CreateTable) {
 	int pgno;
 	DBSQL_ASSERT(pOp->p3 != 0 && pOp->p3type == P3_POINTER);
 	DBSQL_ASSERT(pOp->p2 >= 0 && pOp->p2 < db->nDb);
@@ -3857,7 +5601,7 @@ case OP_CreateTable: {
 ** Write the integer on the top of the stack
 ** into the temporary storage list.
 */
-case OP_ListWrite: {
+case OP_ListWrite: OPCODE_LABEL(ListWrite) {
 	keylist_t *pKeylist;
 	DBSQL_ASSERT(pTos >= p->aStack);
 	pKeylist = p->pList;
@@ -3884,7 +5628,7 @@ case OP_ListWrite: {
 ** Rewind the temporary buffer back to the beginning.  This is
 ** now a no-op.
 */
-case OP_ListRewind: {
+case OP_ListRewind: OPCODE_LABEL(ListRewind) {
 	/* This is now a no-op */
 	break;
 }
@@ -3895,7 +5639,7 @@ case OP_ListRewind: {
 ** and push it onto the stack.  If the storage buffer is empty,
 ** push nothing but instead jump to P2.
 */
-case OP_ListRead: {
+case OP_ListRead: OPCODE_LABEL(ListRead) {
 	keylist_t *pKeylist;
 	CHECK_FOR_INTERRUPT;
 	pKeylist = p->pList;
@@ -3920,7 +5664,7 @@ case OP_ListRead: {
 **
 ** Reset the temporary storage buffer so that it holds nothing.
 */
-case OP_ListReset: {
+case OP_ListReset: OPCODE_LABEL(ListReset) {
 	if (p->pList) {
 		__vdbe_keylist_free(p->pList);
 		p->pList = 0;
@@ -3933,7 +5677,7 @@ case OP_ListReset: {
 ** Save the current vdbe_t list such that it can be restored by a ListPop
 ** opcode. The list is empty after this is executed.
 */
-case OP_ListPush: {
+case OP_ListPush: OPCODE_LABEL(ListPush) {
 	p->keylistStackDepth++;
 	DBSQL_ASSERT(p->keylistStackDepth > 0);
 	if (__dbsql_realloc(NULL, sizeof(keylist_t *) * p->keylistStackDepth,
@@ -3949,7 +5693,7 @@ case OP_ListPush: {
 ** Restore the vdbe_t list to the state it was in when ListPush was last
 ** executed.
 */
-case OP_ListPop: {
+case OP_ListPop: OPCODE_LABEL(ListPop) {
 	DBSQL_ASSERT(p->keylistStackDepth > 0);
 	p->keylistStackDepth--;
 	__vdbe_keylist_free(p->pList);
@@ -3962,29 +5706,57 @@ case OP_ListPop: {
 	break;
 }
 
-/* Opcode: SortPut * * *
+/* Opcode: SortPut P1 * *
 **
 ** The TOS is the key and the NOS is the data.  Pop both from the stack
 ** and put them on the sorter.  The key and data should have been
 ** made using SortMakeKey and SortMakeRec, respectively.
+**
+** If P1 is greater than zero only the P1 elements with the smallest
+** keys will ever be read back, so the sorter keeps just those in a
+** heap and discards the rest as they arrive.  Either way the elements
+** held in memory are written to disk as a sorted run when they reach
+** the "PRAGMA sort_memory" budget.
 */
-case OP_SortPut: {
+case OP_SortPut: OPCODE_LABEL(SortPut) {
 	mem_t *pNos = &pTos[-1];
 	sorter_t *pSorter;
+	int n, ret;
 	DBSQL_ASSERT(pNos >= p->aStack);
-	if (__entity_to_string(pTos) || __entity_to_string(pNos))
-		goto no_mem;
-	if (__dbsql_calloc(NULL, 1, sizeof(sorter_t), &pSorter) == ENOMEM)
+	__entity_as_string(pTos);
+	__entity_as_string(pNos);
+	if (pOp->p1 > 0) {
+		if ((ret = __sorter_heap_put(p, pOp->p1, pTos, pNos)) != 0) {
+			if (ret == ENOMEM)
+				goto no_mem;
+			rc = ret;
+			goto abort_due_to_error;
+		}
+		__pop_stack(&pTos, 2);
+		break;
+	}
+	n = sizeof(sorter_t) + pTos->n + pNos->n;
+	if (db->sort_memory != 0 && p->pSort != 0 &&
+	    (p->nSortMem + n) / 1024 >= db->sort_memory) {
+		if ((ret = __sorter_spill(p)) != 0) {
+			if (ret == ENOMEM)
+				goto no_mem;
+			rc = ret;
+			goto abort_due_to_error;
+		}
+	}
+	if (__vdbe_arena_alloc(&p->pSortArena, n, &pSorter) == ENOMEM)
 		goto no_mem;
-	pSorter->pNext = p->pSort;
-	p->pSort = pSorter;
-	DBSQL_ASSERT(pTos->flags & MEM_Dyn);
+	p->nSortMem += n;
 	pSorter->nKey = pTos->n;
-	pSorter->zKey = pTos->z;
-	DBSQL_ASSERT(pNos->flags & MEM_Dyn);
+	pSorter->zKey = (char *)&pSorter[1];
+	memcpy(pSorter->zKey, pTos->z, pTos->n);
 	pSorter->nData = pNos->n;
-	pSorter->pData = pNos->z;
-	pTos -= 2;
+	pSorter->pData = pSorter->zKey + pTos->n;
+	memcpy(pSorter->pData, pNos->z, pNos->n);
+	pSorter->pNext = p->pSort;
+	p->pSort = pSorter;
+	__pop_stack(&pTos, 2);
 	break;
 }
 
@@ -3993,8 +5765,12 @@ case OP_SortPut: {
 ** The top P1 elements are the arguments to a callback.  Form these
 ** elements into a single data entry that can be stored on a sorter
 ** using SortPut and later fed to a callback using SortCallback.
+**
+** The entry is an array of P1+1 pointers followed by the text of each
+** element.  The sorter copies entries around, so until SortCallback
+** the pointers hold the offset of the text from the start of the entry.
 */
-case OP_SortMakeRec: {
+case OP_SortMakeRec: OPCODE_LABEL(SortMakeRec) {
 	char *z;
 	char **azArg;
 	int nByte;
@@ -4013,14 +5789,15 @@ case OP_SortMakeRec: {
 		}
 	}
 	nByte += sizeof(char*) * (nField + 1);
-	if (__dbsql_calloc(NULL, 1, nByte, &azArg) == ENOMEM)
+	if (__vdbe_str_alloc(p, nByte, (char **)&azArg) == ENOMEM)
 		goto no_mem;
+	azArg[nField] = 0;
 	z = (char*)&azArg[nField + 1];
 	for (pRec = &pTos[1 - nField], i = 0; i < nField; i++, pRec++) {
 		if (pRec->flags & MEM_Null) {
 			azArg[i] = 0;
 		} else {
-			azArg[i] = z;
+			azArg[i] = (char *)(size_t)(z - (char *)azArg);
 			memcpy(z, pRec->z, pRec->n);
 			z += pRec->n;
 		}
@@ -4029,7 +5806,7 @@ case OP_SortMakeRec: {
 	pTos++;
 	pTos->n = nByte;
 	pTos->z = (char*)azArg;
-	pTos->flags = MEM_Str | MEM_Dyn;
+	pTos->flags = MEM_Str | MEM_Arena;
 	break;
 }
 
@@ -4048,7 +5825,7 @@ case OP_SortMakeRec: {
 **
 ** See also the MakeKey and MakeIdxKey opcodes.
 */
-case OP_SortMakeKey: {
+case OP_SortMakeKey: OPCODE_LABEL(SortMakeKey) {
 	char *zNewKey;
 	int nByte;
 	int nField;
@@ -4066,7 +5843,7 @@ case OP_SortMakeKey: {
 			nByte += pRec->n+2;
 		}
 	}
-	if (__dbsql_calloc(NULL, 1, nByte, &zNewKey) == ENOMEM)
+	if (__vdbe_str_alloc(p, nByte, &zNewKey) == ENOMEM)
 		goto no_mem;
 	j = 0;
 	k = 0;
@@ -4082,51 +5859,37 @@ case OP_SortMakeKey: {
 			zNewKey[j++] = 0;
 		}
 	}
-	zNewKey[j] = 0;
 	DBSQL_ASSERT(j < nByte);
+	memset(&zNewKey[j], 0, nByte - j);
 	__pop_stack(&pTos, nField);
 	pTos++;
 	pTos->n = nByte;
-	pTos->flags = MEM_Str | MEM_Dyn;
+	pTos->flags = MEM_Str | MEM_Arena;
 	pTos->z = zNewKey;
 	break;
 }
 
 /* Opcode: Sort * * *
 **
-** Sort all elements on the sorter.  The algorithm is a
-** mergesort.
-*/
-case OP_Sort: {
-	int i;
-	sorter_t *pElem;
-	sorter_t *apSorter[NSORT];
-	for(i = 0; i < NSORT; i++) {
-		apSorter[i] = 0;
-	}
-	while(p->pSort) {
-		pElem = p->pSort;
-		p->pSort = pElem->pNext;
-		pElem->pNext = 0;
-		for (i = 0; i < NSORT-1; i++) {
-			if (apSorter[i] == 0) {
-				apSorter[i] = pElem;
-				break;
-			} else {
-				pElem = __sorted_merge(apSorter[i], pElem);
-				apSorter[i] = 0;
-			}
-		}
-		if (i >= NSORT - 1) {
-			apSorter[NSORT - 1] =
-				__sorted_merge(apSorter[NSORT - 1],pElem);
-		}
-	}
-	pElem = 0;
-	for(i=0; i < NSORT; i++) {
-		pElem = __sorted_merge(apSorter[i], pElem);
+** Sort all elements on the sorter.  The elements still in memory are
+** sorted with a mergesort.  If earlier elements were written to
+** temporary files as sorted runs, position each run on its first
+** element and make a heap of them so that SortNext can merge them.  A
+** bounded sorter (see SortPut) empties its heap into a sorted list
+** instead of sorting.
+*/
+case OP_Sort: OPCODE_LABEL(Sort) {
+	int ret;
+	if (p->aHeap)
+		p->pSort = __sorter_heap_drain(p);
+	else
+		p->pSort = __sorter_sort(p->pSort);
+	if (p->nRun > 0 && (ret = __sorter_run_heap(p)) != 0) {
+		if (ret == ENOMEM)
+			goto no_mem;
+		rc = ret;
+		goto abort_due_to_error;
 	}
-	p->pSort = pElem;
 	break;
 }
 
@@ -4136,20 +5899,44 @@ case OP_Sort: {
 ** stack, then remove the element from the sorter.  If the sorter
 ** is empty, push nothing on the stack and instead jump immediately
 ** to instruction P2.
+**
+** When the sorter has runs on disk the topmost element is the smaller
+** of the head of the list in memory and the head of the run at the top
+** of the heap of runs.  Equal keys are taken from the most recently
+** written source first, which is the order an in-memory sort would
+** have given them.
 */
-case OP_SortNext: {
+case OP_SortNext: OPCODE_LABEL(SortNext) {
 	sorter_t *pSorter = p->pSort;
+	sort_run_t *pRun = 0;
+	char *z;
+	int ret;
 	CHECK_FOR_INTERRUPT;
-	if (pSorter != 0) {
-		p->pSort = pSorter->pNext;
-		pTos++;
-		pTos->z = pSorter->pData;
-		pTos->n = pSorter->nData;
-		pTos->flags = MEM_Str | MEM_Dyn;
-		__dbsql_free(NULL, pSorter->zKey);
-		__dbsql_free(NULL, pSorter);
-	} else {
+	if (p->nRunHeap > 0 && (pSorter == 0 ||
+	    __str_cmp(p->aRunHeap[0]->head.zKey, pSorter->zKey) < 0)) {
+		pRun = p->aRunHeap[0];
+		pSorter = &pRun->head;
+	}
+	if (pSorter == 0) {
 		pc = pOp->p2 - 1;
+		break;
+	}
+	if (__vdbe_str_alloc(p, pSorter->nData, &z) == ENOMEM)
+		goto no_mem;
+	memcpy(z, pSorter->pData, pSorter->nData);
+	pTos++;
+	pTos->z = z;
+	pTos->n = pSorter->nData;
+	pTos->flags = MEM_Str | MEM_Arena;
+	if (pRun == 0) {
+		p->pSort = pSorter->pNext;
+		if (p->aHeap)
+			__dbsql_free(NULL, pSorter);
+	} else if ((ret = __sorter_run_pop(p)) != 0) {
+		if (ret == ENOMEM)
+			goto no_mem;
+		rc = ret;
+		goto abort_due_to_error;
 	}
 	break;
 }
@@ -4161,9 +5948,16 @@ case OP_SortNext: {
 ** instruction.  Pop this record from the stack and invoke the
 ** callback on it.
 */
-case OP_SortCallback: {
+case OP_SortCallback: OPCODE_LABEL(SortCallback) {
+	char **azArg;
+	int i;
 	DBSQL_ASSERT(pTos >= p->aStack);
 	DBSQL_ASSERT(pTos->flags & MEM_Str);
+	azArg = (char **)pTos->z;
+	for (i = 0; i < pOp->p1; i++) {
+		if (azArg[i])
+			azArg[i] = pTos->z + (size_t)azArg[i];
+	}
 	if (p->xCallback == 0) {
 		p->pc = pc + 1;
 		p->azResColumn = (char**)pTos->z;
@@ -4191,7 +5985,7 @@ case OP_SortCallback: {
 **
 ** Remove any elements that remain on the sorter.
 */
-case OP_SortReset: {
+case OP_SortReset: OPCODE_LABEL(SortReset) {
 	__vdbe_sorter_reset(p);
 	break;
 }
@@ -4201,7 +5995,7 @@ case OP_SortReset: {
 ** Open the file named by P3 for reading using the FileRead opcode.
 ** If P3 is "stdin" then open standard input for reading.
 */
-case OP_FileOpen: {
+case OP_FileOpen: OPCODE_LABEL(FileOpen) {
 	DBSQL_ASSERT(pOp->p3 != 0);
 	if (p->pFile) {
 		if (p->pFile != stdin)
@@ -4234,7 +6028,7 @@ case OP_FileOpen: {
 ** "\N" is a null field.  The backslash \ character can be used be used
 ** to escape newlines or the delimiter.
 */
-case OP_FileRead: {
+case OP_FileRead: OPCODE_LABEL(FileRead) {
 	int n, eol, nField, i, c, nDelim;
 	char *zDelim, *z;
 	CHECK_FOR_INTERRUPT;
@@ -4356,7 +6150,7 @@ fileread_jump:
 ** Push onto the stack the P1-th column of the most recently read line
 ** from the input file.
 */
-case OP_FileColumn: {
+case OP_FileColumn: OPCODE_LABEL(FileColumn) {
 	int i = pOp->p1;
 	char *z;
 	DBSQL_ASSERT(i >= 0 && i < p->nField);
@@ -4386,7 +6180,7 @@ case OP_FileColumn: {
 ** stack is popped once if P2 is 1.  If P2 is zero, then
 ** the original data remains on the stack.
 */
-case OP_MemStore: {
+case OP_MemStore: OPCODE_LABEL(MemStore) {
 	int i = pOp->p1;
 	mem_t *pMem;
 	DBSQL_ASSERT(pTos >= p->aStack);
@@ -4411,7 +6205,7 @@ case OP_MemStore: {
 			       sizeof(p->aMem[0]) * (p->nMem - nOld));
 		}
 	}
-	if (__entity_ephem_to_dyn(pTos) == 1)
+	if (__entity_keep(pTos) == 1)
 		goto no_mem;
 	pMem = &p->aMem[i];
 	__entity_release_mem(pMem);
@@ -4431,7 +6225,7 @@ case OP_MemStore: {
 		__entity_release_mem(pTos);
 		pTos--;
 	}
-	break;
+	NEXT_OPCODE;
 }
 
 /* Opcode: MemLoad P1 * *
@@ -4443,7 +6237,7 @@ case OP_MemStore: {
 ** location is subsequently changed (using OP_MemStore) then the
 ** value pushed onto the stack will change too.
 */
-case OP_MemLoad: {
+case OP_MemLoad: OPCODE_LABEL(MemLoad) {
 	int i = pOp->p1;
 	DBSQL_ASSERT(i >= 0 && i < p->nMem);
 	pTos++;
@@ -4452,7 +6246,7 @@ case OP_MemLoad: {
 		pTos->flags |= MEM_Ephem;
 		pTos->flags &= ~(MEM_Dyn | MEM_Static | MEM_Short);
 	}
-	break;
+	NEXT_OPCODE;
 }
 
 /* Opcode: MemIncr P1 P2 *
@@ -4464,7 +6258,7 @@ case OP_MemLoad: {
 ** This instruction throws an error if the memory cell is not initially
 ** an integer.
 */
-case OP_MemIncr: {
+case OP_MemIncr: OPCODE_LABEL(MemIncr) {
 	int i = pOp->p1;
 	mem_t *pMem;
 	DBSQL_ASSERT(i >= 0 && i < p->nMem);
@@ -4474,7 +6268,7 @@ case OP_MemIncr: {
 	if (pOp->p2 > 0 && pMem->i > 0) {
 		pc = pOp->p2 - 1;
 	}
-	break;
+	NEXT_OPCODE;
 }
 
 /* Opcode: AggReset * P2 *
@@ -4482,7 +6276,7 @@ case OP_MemIncr: {
 ** Reset the aggregator so that it no longer contains any data.
 ** Future aggregator elements will contain P2 values each.
 */
-case OP_AggReset: {
+case OP_AggReset: OPCODE_LABEL(AggReset) {
 	__vdbe_agg_reset(&p->agg);
 	p->agg.nMem = pOp->p2;
 	if (__dbsql_calloc(NULL, p->agg.nMem, sizeof(p->agg.apFunc[0]),
@@ -4497,7 +6291,7 @@ case OP_AggReset: {
 ** The aggregate will operate out of aggregate column P2.
 ** P3 is a pointer to the func_def_t structure for the function.
 */
-case OP_AggInit: {
+case OP_AggInit: OPCODE_LABEL(AggInit) {
 	int i = pOp->p2;
 	DBSQL_ASSERT(i >= 0 && i < p->agg.nMem);
 	p->agg.apFunc[i] = (func_def_t*)pOp->p3;
@@ -4515,7 +6309,7 @@ case OP_AggInit: {
 ** Ideally, this index would be another parameter, but there are
 ** no free parameters left.  The integer is popped from the stack.
 */
-case OP_AggFunc: {
+case OP_AggFunc: OPCODE_LABEL(AggFunc) {
 	int n = pOp->p2;
 	int i;
 	mem_t *pMem, *pRec;
@@ -4543,6 +6337,7 @@ case OP_AggFunc: {
 	ctx.cnt = ++pMem->i;
 	ctx.isError = 0;
 	ctx.isStep = 1;
+	ctx.pVm = 0;
 	(ctx.pFunc->xStep)(&ctx, n, (const char**)azArgv);
 	pMem->z = ctx.pAgg;
 	pMem->flags = MEM_AggCtx;
@@ -4553,7 +6348,7 @@ case OP_AggFunc: {
 	break;
 }
 
-/* Opcode: AggFocus * P2 *
+/* Opcode: AggFocus P1 P2 *
 **
 ** Pop the top of the stack and use that as an aggregator key.  If
 ** an aggregator with that same key already exists, then make the
@@ -4561,39 +6356,87 @@ case OP_AggFunc: {
 ** with the given key exists, create one and make it current but
 ** do not jump.
 **
+** If P1 is not zero the aggregator may run over its memory budget.  The
+** key must then be on top of P1-1 more values which, together with the
+** key, make up everything the aggregator needs of the row.  Once no
+** more aggregators fit, a key without one has those P1 entries written
+** to a spill file and popped, no aggregator is made current and the
+** jump is to P2, where an AggSkip must follow.  The spilled rows are
+** fed back by AggRescan and AggReplay.
+**
 ** The order of aggregator opcodes is important.  The order is:
 ** AggReset AggFocus AggNext.  In other words, you must execute
 ** AggReset first, then zero or more AggFocus operations, then
 ** zero or more AggNext operations.  You must not execute an AggFocus
 ** in between an AggNext and an AggReset.
 */
-case OP_AggFocus: {
+case OP_AggFocus: OPCODE_LABEL(AggFocus) {
 	agg_elem_t *pElem;
 	char *zKey;
-	int nKey;
+	int nKey, i;
+	u_int32_t h, probes;
 
 	DBSQL_ASSERT(pTos >= p->aStack);
 	__entity_as_string(pTos);
 	zKey = pTos->z;
 	nKey = pTos->n;
-	pElem = __hash_find(&p->agg.hash, zKey, nKey);
+	h = __agg_hash(zKey, nKey);
+	p->agg.skip = 0;
+	probes = 0;
+	pElem = __agg_find(&p->agg, zKey, nKey, h, &probes);
+	db->agg_lookups++;
+	db->agg_probes += probes;
 	if (pElem) {
 		p->agg.pCurrent = pElem;
 		pc = pOp->p2 - 1;
-	} else {
-		__agg_insert(&p->agg, zKey, nKey);
+		goto agg_focus_done;
+	}
+	if (pOp->p1 && !p->agg.full && db->agg_memory != 0 &&
+	    p->agg.nElem > 0 && p->agg.nUsed / 1024 >= db->agg_memory)
+		p->agg.full = 1;
+	if (pOp->p1 && p->agg.full) {
+		DBSQL_ASSERT(&pTos[1 - pOp->p1] >= p->aStack);
+		i = __agg_part(h, p->agg.level);
+		if (p->agg.apOut[i] == 0 &&
+		    (p->agg.apOut[i] = tmpfile()) == NULL) {
+			rc = DBSQL_IOERR;
+			goto abort_due_to_error;
+		}
+		if ((rc = __agg_spill(p->agg.apOut[i], pTos, pOp->p1)) != 0)
+			goto abort_due_to_error;
+		db->agg_spills++;
+		p->agg.skip = 1;
+		p->agg.pCurrent = 0;
+		__pop_stack(&pTos, pOp->p1);
+		pc = pOp->p2 - 1;
+		break;
 	}
+	if (__agg_insert(&p->agg, zKey, nKey, h))
+		goto no_mem;
+	db->agg_groups++;
+agg_focus_done:
 	__entity_release_mem(pTos);
 	pTos--;
 	break;
 }
 
+/* Opcode: AggSkip * P2 *
+**
+** Jump to P2 if the most recent AggFocus spilled the row it was given
+** for a later pass.
+*/
+case OP_AggSkip: OPCODE_LABEL(AggSkip) {
+	if (p->agg.skip)
+		pc = pOp->p2 - 1;
+	break;
+}
+
 /* Opcode: AggSet * P2 *
 **
 ** Move the top of the stack into the P2-th field of the current
 ** aggregate.  String values are duplicated into new memory.
 */
-case OP_AggSet: {
+case OP_AggSet: OPCODE_LABEL(AggSet) {
 	agg_elem_t *pFocus = __agg_in_focus(&p->agg);
 	mem_t *pMem;
 	int i = pOp->p2;
@@ -4601,7 +6444,7 @@ case OP_AggSet: {
 	if (pFocus == 0)
 		goto no_mem;
 	DBSQL_ASSERT(i >= 0 && i < p->agg.nMem);
-	if (__entity_ephem_to_dyn(pTos) == 1)
+	if (__entity_keep(pTos) == 1)
 		goto no_mem;
 	pMem = &pFocus->aMem[i];
 	__entity_release_mem(pMem);
@@ -4622,7 +6465,7 @@ case OP_AggSet: {
 ** of the current aggregate.  Strings are not duplicated so
 ** string values will be ephemeral.
 */
-case OP_AggGet: {
+case OP_AggGet: OPCODE_LABEL(AggGet) {
 	agg_elem_t *pFocus = __agg_in_focus(&p->agg);
 	mem_t *pMem;
 	int i = pOp->p2;
@@ -4651,12 +6494,12 @@ case OP_AggGet: {
 ** zero or more AggNext operations.  You must not execute an AggFocus
 ** in between an AggNext and an AggReset.
 */
-case OP_AggNext: {
+case OP_AggNext: OPCODE_LABEL(AggNext) {
 	CHECK_FOR_INTERRUPT;
 	if (p->agg.pSearch == 0) {
-		p->agg.pSearch = __hash_first(&p->agg.hash);
+		p->agg.pSearch = p->agg.pFirst;
 	} else {
-		p->agg.pSearch = __hash_next(p->agg.pSearch);
+		p->agg.pSearch = p->agg.pSearch->pNext;
 	}
 	if (p->agg.pSearch == 0) {
 		pc = pOp->p2 - 1;
@@ -4664,7 +6507,7 @@ case OP_AggNext: {
 		int i;
 		dbsql_func_t ctx;
 		mem_t *aMem;
-		p->agg.pCurrent = __hash_data(p->agg.pSearch);
+		p->agg.pCurrent = p->agg.pSearch;
 		aMem = p->agg.pCurrent->aMem;
 		for(i = 0; i < p->agg.nMem; i++){
 			int freeCtx;
@@ -4678,6 +6521,7 @@ case OP_AggNext: {
 			freeCtx = aMem[i].z && aMem[i].z!=aMem[i].zShort;
 			ctx.cnt = aMem[i].i;
 			ctx.isStep = 0;
+			ctx.pVm = 0;
 			ctx.pFunc = p->agg.apFunc[i];
 			(*p->agg.apFunc[i]->xFinalize)(&ctx);
 			if (freeCtx) {
@@ -4692,13 +6536,283 @@ case OP_AggNext: {
 	break;
 }
 
+/* Opcode: AggRescan * P2 *
+**
+** If AggFocus spilled rows, discard the aggregates that AggNext has
+** just visited and make the next partition of the spilled rows the one
+** AggReplay reads.  Otherwise jump to P2.
+*/
+case OP_AggRescan: OPCODE_LABEL(AggRescan) {
+	agg_part_t *pPart;
+	int i;
+
+	for (i = 0; i < AGG_PART_FANOUT; i++) {
+		if (p->agg.apOut[i] == 0)
+			continue;
+		if (__dbsql_realloc(NULL,
+		    (p->agg.nPart + 1) * sizeof(agg_part_t),
+		    &p->agg.aPart) == ENOMEM)
+			goto no_mem;
+		pPart = &p->agg.aPart[p->agg.nPart++];
+		pPart->fp = p->agg.apOut[i];
+		pPart->level = p->agg.level + 1;
+		p->agg.apOut[i] = 0;
+		if (fflush(pPart->fp) != 0) {
+			rc = DBSQL_IOERR;
+			goto abort_due_to_error;
+		}
+		rewind(pPart->fp);
+	}
+	if (p->agg.nPart == 0) {
+		pc = pOp->p2 - 1;
+		break;
+	}
+	__vdbe_agg_clear(&p->agg);
+	p->agg.nPart--;
+	p->agg.pIn = p->agg.aPart[p->agg.nPart].fp;
+	p->agg.level = p->agg.aPart[p->agg.nPart].level;
+	db->agg_passes++;
+	break;
+}
+
+/* Opcode: AggReplay P1 P2 *
+**
+** Push the P1 values of the next row of the partition AggRescan made
+** current, as AggFocus spilled them.  At the end of the partition
+** jump to P2 instead.
+*/
+case OP_AggReplay: OPCODE_LABEL(AggReplay) {
+	int eof;
+
+	CHECK_FOR_INTERRUPT;
+	DBSQL_ASSERT(p->agg.pIn != 0);
+	if ((rc = __agg_replay(p->agg.pIn, pTos, pOp->p1, &eof)) != 0) {
+		if (rc == ENOMEM)
+			goto no_mem;
+		goto abort_due_to_error;
+	}
+	if (eof) {
+		fclose(p->agg.pIn);
+		p->agg.pIn = 0;
+		pc = pOp->p2 - 1;
+	} else {
+		pTos += pOp->p1;
+	}
+	break;
+}
+
+/* Opcode: HashReset P1 P2 P3
+**
+** Empty join hash table P1, creating it if it does not exist yet, and
+** bind it to cursor P2, the inner table of a hash join.  Keys compare
+** as text if P3 is not NULL and as numbers otherwise.
+*/
+case OP_HashReset: OPCODE_LABEL(HashReset) {
+	int i = pOp->p1;
+	hjoin_t *hj;
+	DBSQL_ASSERT(i >= 0);
+	if (p->nHJoin <= i) {
+		if (__dbsql_realloc(NULL, (i + 1) * sizeof(p->aHJoin[0]),
+				 &p->aHJoin) == ENOMEM)
+			goto no_mem;
+		memset(&p->aHJoin[p->nHJoin], 0,
+		       (i + 1 - p->nHJoin) * sizeof(p->aHJoin[0]));
+		p->nHJoin = i + 1;
+	}
+	hj = &p->aHJoin[i];
+	if (hj->overflow)
+		__vdbe_cleanup_cursor(&p->aCsr[hj->iSpill]);
+	__vdbe_hjoin_clear(hj);
+	hj->iCsr = pOp->p2;
+	hj->text = (pOp->p3 != 0);
+	hj->overflow = 0;
+	db->hash_builds++;
+	break;
+}
+
+/* Opcode: HashPut P1 P2 *
+**
+** Pop a ROWID and then a key off of the stack and add them to join hash
+** table P1.  Rows must be added in descending ROWID order, so that rows
+** with the same key are found in ascending order.  A NULL key is never
+** equal to anything and is not added.
+**
+** If the table grows past the "PRAGMA hash_memory" budget it spills: its
+** rows, and the ones added after them, go to a transient index opened on
+** cursor P2.
+*/
+case OP_HashPut: OPCODE_LABEL(HashPut) {
+	hjoin_t *hj;
+	hjoin_elem_t *elem;
+	double r;
+	char *key;
+	int len, size;
+	u_int32_t h;
+
+	DBSQL_ASSERT(pOp->p1 >= 0 && pOp->p1 < p->nHJoin);
+	DBSQL_ASSERT(&pTos[-1] >= p->aStack);
+	hj = &p->aHJoin[pOp->p1];
+	if ((pTos[-1].flags & MEM_Null) != 0) {
+		__pop_stack(&pTos, 2);
+		break;
+	}
+	len = __hjoin_key(hj, &pTos[-1], &r, &key);
+	h = __agg_hash(key, len);
+	__entity_to_int(pTos);
+	if (hj->overflow) {
+		rc = __hjoin_spill_put(p, hj, key, len, h, pTos->i);
+		__pop_stack(&pTos, 2);
+		if (rc == DBSQL_NOMEM)
+			goto no_mem;
+		break;
+	}
+	if (hj->nElem >= hj->nHash && __hjoin_grow(hj))
+		goto no_mem;
+	size = sizeof(hjoin_elem_t) + len;
+	if (__vdbe_arena_alloc(&hj->pArena, size, &elem) == ENOMEM)
+		goto no_mem;
+	elem->iRecno = pTos->i;
+	elem->hash = h;
+	elem->nKey = len;
+	memcpy(elem->zKey, key, len);
+	elem->pHash = hj->aHash[h & (hj->nHash - 1)];
+	hj->aHash[h & (hj->nHash - 1)] = elem;
+	hj->nElem++;
+	hj->nUsed += size;
+	__pop_stack(&pTos, 2);
+	if (db->hash_memory != 0 && hj->nUsed / 1024 >= db->hash_memory) {
+		db->hash_spills++;
+		rc = __hjoin_spill(p, hj, pOp->p2);
+		if (rc == DBSQL_NOMEM)
+			goto no_mem;
+	}
+	break;
+}
+
+/* Opcode: HashFirst P1 P2 *
+**
+** Pop a key off of the stack and position join hash table P1 on the
+** first of its rows with that key.  Jump to P2 if there is no such row.
+**
+** If the table spilled, seek its transient index to the entries of the
+** key instead.
+*/
+case OP_HashFirst: OPCODE_LABEL(HashFirst) {
+	hjoin_t *hj;
+	sm_cursor_t *pCrsr;
+	double r;
+	char *key;
+	int len, res;
+	u_int32_t h;
+
+	DBSQL_ASSERT(pOp->p1 >= 0 && pOp->p1 < p->nHJoin);
+	DBSQL_ASSERT(pTos >= p->aStack);
+	hj = &p->aHJoin[pOp->p1];
+	hj->pMatch = 0;
+	res = 1;
+	if ((pTos->flags & MEM_Null) == 0 && (hj->overflow || hj->nHash > 0)) {
+		len = __hjoin_key(hj, pTos, &r, &key);
+		h = __agg_hash(key, len);
+		if (!hj->overflow) {
+			hj->pMatch = __hjoin_match(
+				hj->aHash[h & (hj->nHash - 1)], key, len, h);
+			res = (hj->pMatch == 0);
+		} else if (__hjoin_prefix(hj, key, len, h)) {
+			goto no_mem;
+		} else {
+			pCrsr = p->aCsr[hj->iSpill].pCursor;
+			rc = __sm_moveto(pCrsr, hj->zProbe, hj->nProbe, &res);
+			if (rc == DBSQL_SUCCESS && res < 0)
+				rc = __sm_next(pCrsr, &res);
+			if (rc != DBSQL_SUCCESS)
+				goto abort_due_to_error;
+#ifdef CONFIG_TEST
+			dbsql_search_count++;
+#endif
+			res = !__hjoin_spill_match(p, hj);
+		}
+	}
+	if (res)
+		pc = pOp->p2 - 1;
+	__entity_release_mem(pTos);
+	pTos--;
+	break;
+}
+
+/* Opcode: HashMove P1 * *
+**
+** Move the cursor of join hash table P1 to the row the table is
+** positioned on.  The move is deferred until the row is needed.
+*/
+case OP_HashMove: OPCODE_LABEL(HashMove) {
+	hjoin_t *hj;
+	cursor_t *pC;
+	const char *zKey;
+	int nKey, v;
+
+	DBSQL_ASSERT(pOp->p1 >= 0 && pOp->p1 < p->nHJoin);
+	hj = &p->aHJoin[pOp->p1];
+	pC = &p->aCsr[hj->iCsr];
+	if (pC->pCursor == 0)
+		break;
+	if (hj->overflow) {
+		rc = __sm_key_ptr(p->aCsr[hj->iSpill].pCursor, &zKey, &nKey);
+		if (rc != DBSQL_SUCCESS)
+			goto abort_due_to_error;
+		DBSQL_ASSERT(nKey == hj->nProbe + sizeof(int));
+		memcpy(&v, &zKey[hj->nProbe], sizeof(int));
+	} else {
+		DBSQL_ASSERT(hj->pMatch != 0);
+		v = INT_TO_KEY(hj->pMatch->iRecno);
+	}
+	pC->nullRow = 0;
+	pC->movetoTarget = v;
+	pC->deferredMoveto = 1;
+	pC->zAltMap = 0;
+	break;
+}
+
+/* Opcode: HashNext P1 P2 *
+**
+** Advance join hash table P1 to its next row with the same key and jump
+** to P2.  If there are no more such rows fall through.
+*/
+case OP_HashNext: OPCODE_LABEL(HashNext) {
+	hjoin_t *hj;
+	hjoin_elem_t *elem;
+	int res;
+
+	CHECK_FOR_INTERRUPT;
+	DBSQL_ASSERT(pOp->p1 >= 0 && pOp->p1 < p->nHJoin);
+	hj = &p->aHJoin[pOp->p1];
+	if (hj->overflow) {
+		rc = __sm_next(p->aCsr[hj->iSpill].pCursor, &res);
+		if (rc != DBSQL_SUCCESS)
+			goto abort_due_to_error;
+		if (res == 0 && __hjoin_spill_match(p, hj)) {
+			pc = pOp->p2 - 1;
+#ifdef CONFIG_TEST
+			dbsql_search_count++;
+#endif
+		}
+		break;
+	}
+	elem = hj->pMatch;
+	if (elem != 0)
+		hj->pMatch = __hjoin_match(elem->pHash, elem->zKey,
+					   elem->nKey, elem->hash);
+	if (hj->pMatch != 0)
+		pc = pOp->p2 - 1;
+	break;
+}
+
 /* Opcode: SetInsert P1 * P3
 **
 ** If Set P1 does not exist then create it.  Then insert value
 ** P3 into that set.  If P3 is NULL, then insert the top of the
 ** stack into the set.
 */
-case OP_SetInsert: {
+case OP_SetInsert: OPCODE_LABEL(SetInsert) {
 	int i = pOp->p1;
 	if (p->nSet <= i) {
 		int k;
@@ -4728,7 +6842,7 @@ case OP_SetInsert: {
 ** contents of set P1.  If the element popped exists in set P1,
 ** then jump to P2.  Otherwise fall through.
 */
-case OP_SetFound: {
+case OP_SetFound: OPCODE_LABEL(SetFound) {
 	int i = pOp->p1;
 	DBSQL_ASSERT(pTos >= p->aStack);
 	__entity_as_string(pTos);
@@ -4747,7 +6861,7 @@ case OP_SetFound: {
 ** contents of set P1.  If the element popped does not exists in
 ** set P1, then jump to P2.  Otherwise fall through.
 */
-case OP_SetNotFound: {
+case OP_SetNotFound: OPCODE_LABEL(SetNotFound) {
 	int i = pOp->p1;
 	DBSQL_ASSERT(pTos>=p->aStack);
 	__entity_as_string(pTos);
@@ -4772,8 +6886,8 @@ case OP_SetNotFound: {
 ** are no more elements in the set, do not do the push and fall through.
 ** Otherwise, jump to P2 after pushing the next set element.
 */
-case OP_SetFirst:  /* FALLTHROUGH */
-case OP_SetNext: {
+case OP_SetFirst: OPCODE_LABEL(SetFirst)  /* FALLTHROUGH */
+case OP_SetNext: OPCODE_LABEL(SetNext) {
 	set_t *pSet;
 	CHECK_FOR_INTERRUPT;
 	if (pOp->p1 < 0 || pOp->p1 >= p->nSet) {
@@ -4810,7 +6924,7 @@ case OP_SetNext: {
 ** machines to be created and run.  It may not be called from within
 ** a transaction.
 */
-case OP_Vacuum: {
+case OP_Vacuum: OPCODE_LABEL(Vacuum) {
 	if (__safety_off(db))
 		goto abort_due_to_misuse;
 	rc = __execute_vacuum(&p->zErrMsg, db);
@@ -4819,9 +6933,138 @@ case OP_Vacuum: {
 	break;
 }
 
+/* Opcode: Analyze P1 P2 P3
+**
+** Read every entry of cursor P1 and store statistics about the table or
+** index named P3 for the query planner.  P2 is the number of columns of
+** the index, 0 if P1 is open on a table.  See __execute_analyze().
+*/
+case OP_Analyze: OPCODE_LABEL(Analyze) {
+	cursor_t *pC;
+
+	DBSQL_ASSERT(pOp->p1 >= 0 && pOp->p1 < p->nCursor);
+	pC = &p->aCsr[pOp->p1];
+	if (pC->pCursor == 0)
+		break;
+	if (__safety_off(db))
+		goto abort_due_to_misuse;
+	rc = __execute_analyze(&p->zErrMsg, db, pC->pCursor, pOp->p2,
+			       pOp->p3);
+	if (__safety_on(db))
+		goto abort_due_to_misuse;
+	if (rc == DBSQL_NOMEM)
+		goto no_mem;
+	break;
+}
+
+/* Opcode: DropStat P1 * P3
+**
+** Remove the statistics that Analyze stored for the table or index
+** named P3 of database P1, which is being dropped.
+*/
+case OP_DropStat: OPCODE_LABEL(DropStat) {
+	DBSQL_ASSERT(pOp->p1 >= 0 && pOp->p1 < db->nDb);
+	rc = __sm_set_stat(db->aDb[pOp->p1].pBt, pOp->p3, NULL, 0);
+	if (rc == DBSQL_NOMEM)
+		goto no_mem;
+	break;
+}
+
+/* Opcode: IdxMoveTo P1 P2 P3
+**
+** Move table cursor P1 to the row that the current entry of index cursor
+** P2 points to.  Like MoveTo with a P2 of 0 the move is deferred until a
+** column of the row is needed.  P3 lists, separated by commas, the table
+** column held in each field of the index key.  Column reads those from
+** the key while the move is still deferred and Recno needs no move at
+** all.  The table row is only read when a column is needed that the key
+** cannot give back: one the index does not hold, or a number other than
+** as the operand of arithmetic or of a comparison with a literal.
+**
+** See also: IdxRecno, MoveTo.
+*/
+case OP_IdxMoveTo: OPCODE_LABEL(IdxMoveTo) {
+	cursor_t *pC;
+	sm_cursor_t *pCrsr;
+	int v, sz;
+
+	DBSQL_ASSERT(pOp->p1 >= 0 && pOp->p1 < p->nCursor);
+	DBSQL_ASSERT(pOp->p2 >= 0 && pOp->p2 < p->nCursor);
+	pC = &p->aCsr[pOp->p1];
+	if ((pCrsr = p->aCsr[pOp->p2].pCursor) == 0 || pC->pCursor == 0)
+		break;
+	DBSQL_ASSERT(p->aCsr[pOp->p2].deferredMoveto == 0);
+	__sm_key_size(pCrsr, &sz);
+	if (sz < sizeof(u_int32_t)) {
+		pC->nullRow = 1;
+		break;
+	}
+	__sm_key(pCrsr, sz - sizeof(u_int32_t), sizeof(u_int32_t),
+		 (char*)&v);
+	pC->movetoTarget = v;
+	pC->deferredMoveto = 1;
+	pC->lastRecno = KEY_TO_INT(v);
+	pC->recnoIsValid = 1;
+	pC->nullRow = 0;
+	pC->iAltCsr = pOp->p2;
+	pC->zAltMap = pOp->p3;
+	break;
+}
+
+/* Opcode: IdxPrefix P1 P2 *
+**
+** The top of the stack holds a key made by MakeKey.  Replace it with
+** the first P2 fields of the key of the entry that index cursor P1
+** points to followed by that key.  This completes the keys of a
+** skip-scan, which leave out the fields that the index entry supplies.
+**
+** See also: MakeKey, IdxGE.
+*/
+case OP_IdxPrefix: OPCODE_LABEL(IdxPrefix) {
+	int i = pOp->p1;
+	sm_cursor_t *pCrsr;
+	const char *zKey;
+	char *zNew;
+	int nKey, j, k;
+
+	DBSQL_ASSERT(i >= 0 && i < p->nCursor);
+	DBSQL_ASSERT(pTos >= p->aStack);
+	__entity_as_string(pTos);
+	if ((pCrsr = p->aCsr[i].pCursor) == 0 ||
+	    __sm_key_ptr(pCrsr, &zKey, &nKey) != DBSQL_SUCCESS) {
+		__entity_release_mem(pTos);
+		pTos->flags = MEM_Null;
+		break;
+	}
+	nKey -= sizeof(u_int32_t);
+	for (j = 0, k = pOp->p2; k > 0 && j < nKey; j++) {
+		if (zKey[j] == 0)
+			k--;
+	}
+	if (j + pTos->n <= NBFS) {
+		zNew = zBuf;
+	} else if (__vdbe_str_alloc(p, j + pTos->n, &zNew) == ENOMEM) {
+		goto no_mem;
+	}
+	memcpy(zNew, zKey, j);
+	memcpy(&zNew[j], pTos->z, pTos->n);
+	j += pTos->n;
+	__entity_release_mem(pTos);
+	pTos->n = j;
+	if (zNew == zBuf) {
+		memcpy(pTos->zShort, zBuf, j);
+		pTos->z = pTos->zShort;
+		pTos->flags = MEM_Str | MEM_Short;
+	} else {
+		pTos->z = zNew;
+		pTos->flags = MEM_Str | MEM_Arena;
+	}
+	break;
+}
+
 /* Any other opcode is illegal...
 */
-default: {
+default: OPCODE_LABEL(default) {
 	snprintf(zBuf, sizeof(zBuf), "%d", pOp->opcode);
 	__str_append(&p->zErrMsg, "unknown opcode ", zBuf, (char*)0);
 	rc = DBSQL_INTERNAL;
@@ -4859,8 +7102,8 @@ default: {
     if (pTos >= p->aStack) {
 	    DBSQL_ASSERT(pTos->flags != 0);  /* Must define some type */
 	    if (pTos->flags & MEM_Str) {
-		    int x = pTos->flags &
-			    (MEM_Static | MEM_Dyn | MEM_Ephem | MEM_Short);
+		    int x = pTos->flags & (MEM_Static | MEM_Dyn |
+			    MEM_Ephem | MEM_Short | MEM_Arena);
 		    DBSQL_ASSERT(x != 0);            /* Strings must define
 							a string subtype. */
 		    DBSQL_ASSERT((x & (x-1)) == 0);  /* Only one string subtype
@@ -4879,8 +7122,8 @@ default: {
 		    /*
 		     * Cannot define a string subtype for non-string objects.
 		     */
-		    DBSQL_ASSERT((pTos->flags &
-			 (MEM_Static | MEM_Dyn | MEM_Ephem | MEM_Short)) == 0);
+		    DBSQL_ASSERT((pTos->flags & (MEM_Static | MEM_Dyn |
+			 MEM_Ephem | MEM_Short | MEM_Arena)) == 0);
 	    }
 	    /* MEM_Null excludes all other types. */
 	    DBSQL_ASSERT(pTos->flags == MEM_Null
@@ -4920,6 +7163,8 @@ default: {
 				    zBuf[1] = 'e';
 				    DBSQL_ASSERT((pTos[i].flags &
 					    (MEM_Static | MEM_Dyn)) == 0);
+			    } else if (pTos[i].flags & MEM_Arena) {
+				    zBuf[1] = 'a';
 			    } else {
 				    zBuf[1] = 's';
 			    }
@@ -4990,6 +7235,16 @@ abort_due_to_error:
 	}
 	goto vdbe_halt;
 
+	/*
+	 * Jump to here if the progress callback asks for the program to be
+	 * abandoned.
+	 */
+#ifndef DBSQL_NO_PROGRESS
+abort_due_to_progress:
+	rc = DBSQL_ABORT;
+	goto vdbe_halt;
+#endif
+
 	/*
 	 * Jump to here if the dbsql_interrupt() API sets the interrupt
 	 * flag.
@@ -534,6 +534,17 @@ dbsql_set_result_string(p, result, n)
 			p->s.zShort[n] = 0;
 			p->s.flags = MEM_Str | MEM_Short;
 			p->s.z = p->s.zShort;
+		} else if (p->pVm) {
+			if (__vdbe_str_alloc(p->pVm, n + 1,
+					     &p->s.z) == ENOMEM) {
+				p->s.flags = MEM_Null;
+				p->s.z = 0;
+				p->s.n = 0;
+				return 0;
+			}
+			memcpy(p->s.z, result, n);
+			p->s.z[n] = 0;
+			p->s.flags = MEM_Str | MEM_Arena;
 		} else {
 			if (__dbsql_calloc(NULL, 1, n + 1, &p->s.z) != ENOMEM) {
 				memcpy(p->s.z, result, n);
@@ -828,6 +839,290 @@ __vdbe_list(vm)
 	return vm->rc == DBSQL_SUCCESS ? DBSQL_DONE : DBSQL_ERROR;
 }
 
+/*
+ * __vdbe_jump_p --
+ *	Return true if P2 of the given opcode is the address of another
+ *	instruction.
+ *
+ * STATIC: static int __vdbe_jump_p __P((int));
+ */
+static int
+__vdbe_jump_p(opcode)
+	int opcode;
+{
+	switch (opcode) {
+	case OP_Goto:        case OP_Gosub:      case OP_ForceInt:
+	case OP_MustBeInt:   case OP_Eq:         case OP_Ne:
+	case OP_Lt:          case OP_Le:         case OP_Gt:
+	case OP_Ge:          case OP_StrEq:      case OP_StrNe:
+	case OP_StrLt:       case OP_StrLe:      case OP_StrGt:
+	case OP_StrGe:       case OP_If:         case OP_IfNot:
+	case OP_IsNull:      case OP_NotNull:    case OP_MakeIdxKey:
+	case OP_MoveLt:      case OP_MoveTo:     case OP_MergeTo:
+	case OP_Distinct:    case OP_NotFound:   case OP_Found:
+	case OP_IsUnique:    case OP_NotExists:  case OP_Last:
+	case OP_Rewind:      case OP_Prev:       case OP_Next:
+	case OP_IdxLT:       case OP_IdxGT:      case OP_IdxGE:
+	case OP_IdxIsNull:   case OP_ListRead:   case OP_SortNext:
+	case OP_FileRead:    case OP_MemIncr:    case OP_AggFocus:
+	case OP_AggSkip:     case OP_AggNext:    case OP_AggRescan:
+	case OP_HashFirst:   case OP_HashNext:
+	case OP_SetFound:    case OP_SetNotFound: case OP_SetFirst:
+	case OP_SetNext:     case OP_AggReplay:  case OP_ColumnCmp:
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * __vdbe_make_noop --
+ *	Turn an instruction into an OP_Noop, releasing its P3.
+ *
+ * STATIC: static void __vdbe_make_noop __P((vdbe_op_t *));
+ */
+static void
+__vdbe_make_noop(op)
+	vdbe_op_t *op;
+{
+	if (op->p3type == P3_DYNAMIC)
+		__dbsql_free(NULL, op->p3);
+	op->opcode = OP_Noop;
+	op->p1 = 0;
+	op->p2 = 0;
+	op->p3 = 0;
+	op->p3type = P3_NOTUSED;
+}
+
+/*
+ * __vdbe_optimize --
+ *	A peephole pass over a finished program.  The code generators
+ *	favor simple emitters over tight code, so a program typically has
+ *	jumps to jumps, jumps to the very next instruction, an OP_Dup whose
+ *	copy is popped straight away and instructions that nothing can
+ *	reach.  This pass:
+ *
+ *	  - points every jump that lands on an OP_Goto at that OP_Goto's
+ *	    destination,
+ *	  - folds a few short sequences into one instruction: a conditional
+ *	    jump over an OP_Goto becomes the inverted jump, adjacent OP_Pops
+ *	    are merged, OP_Dup followed by OP_Pop cancels out, a second
+ *	    OP_Column of the same cursor and column becomes an OP_Dup of the
+ *	    first and two OP_Columns compared by a conditional jump become
+ *	    one OP_ColumnCmp,
+ *	  - drops OP_Noop, jumps to the next instruction and unreachable
+ *	    code, then renumbers the jump destinations.
+ *
+ *	A sequence is only folded when no jump lands inside it.  When
+ *	memory is short the program is simply left as it is.
+ *
+ * STATIC: static void __vdbe_optimize __P((vdbe_t *));
+ */
+static void
+__vdbe_optimize(vm)
+	vdbe_t *vm;
+{
+	vdbe_op_t *op, *next, *cmp;
+	column_cmp_t *cc;
+	int *map, *work;
+	int i, j, t, hops, n;
+
+	n = vm->nOp;
+	if (__dbsql_calloc(NULL, 2 * (n + 1), sizeof(int), &map) == ENOMEM)
+		return;
+	work = &map[n + 1];
+
+	/*
+	 * Thread jumps through chains of OP_Goto.  A P2 of zero is left
+	 * alone; several opcodes read it as "do not jump".
+	 */
+	for (i = 0; i < n; i++) {
+		op = &vm->aOp[i];
+		if (!__vdbe_jump_p(op->opcode) || op->p2 <= 0 || op->p2 >= n)
+			continue;
+		for (t = op->p2, hops = 0; hops < n; hops++) {
+			if (vm->aOp[t].opcode == OP_Noop && t + 1 < n) {
+				t++;
+			} else if (vm->aOp[t].opcode == OP_Goto &&
+			    vm->aOp[t].p2 > 0 && vm->aOp[t].p2 < n &&
+			    vm->aOp[t].p2 != t) {
+				t = vm->aOp[t].p2;
+			} else {
+				break;
+			}
+		}
+		if (vm->aOp[t].opcode == OP_Goto)
+			continue;
+		op->p2 = t;
+	}
+
+	/*
+	 * Note every instruction that control can arrive at other than by
+	 * falling into it: the entry point, jump destinations and the
+	 * return point of each OP_Gosub.
+	 */
+	map[0] = 1;
+	for (i = 0; i < n; i++) {
+		op = &vm->aOp[i];
+		if (__vdbe_jump_p(op->opcode) && op->p2 >= 0 && op->p2 < n)
+			map[op->p2] = 1;
+		if (op->opcode == OP_Gosub && i + 1 < n)
+			map[i + 1] = 1;
+	}
+
+	/*
+	 * Fold short sequences.
+	 */
+	for (i = 0; i + 1 < n; i++) {
+		op = &vm->aOp[i];
+		next = &vm->aOp[i + 1];
+		if (map[i + 1])
+			continue;
+		switch (op->opcode) {
+		case OP_If:
+		case OP_IfNot:
+			/*
+			 * "If P1 i+2; Goto X" becomes "IfNot !P1 X", and the
+			 * other way around.
+			 */
+			if (next->opcode == OP_Goto && op->p2 == i + 2) {
+				op->opcode = (op->opcode == OP_If ?
+				    OP_IfNot : OP_If);
+				op->p1 = !op->p1;
+				op->p2 = next->p2;
+				__vdbe_make_noop(next);
+			}
+			break;
+		case OP_Dup:
+			/*
+			 * Dup followed by "Pop N" is the same as "Pop N-1".
+			 */
+			if (next->opcode == OP_Pop && next->p1 > 0) {
+				next->p1--;
+				__vdbe_make_noop(op);
+			}
+			break;
+		case OP_Pop:
+			if (next->opcode == OP_Pop) {
+				next->p1 += op->p1;
+				__vdbe_make_noop(op);
+			}
+			break;
+		case OP_Column:
+			/*
+			 * A negative P1 names a stack entry relative to the
+			 * top, so it means something else the second time.
+			 * A first read that only needs the numeric value
+			 * (P3) may not give the text of a number.
+			 */
+			if (next->opcode == OP_Column && op->p1 >= 0 &&
+			    next->p1 == op->p1 && next->p2 == op->p2 &&
+			    (op->p3 == 0 || next->p3 != 0)) {
+				__vdbe_make_noop(next);
+				next->opcode = OP_Dup;
+				break;
+			}
+			/*
+			 * "Column C1 A1; Column C2 A2; Lt P1 P2" becomes
+			 * "ColumnCmp P1 P2 'C1,A1,C2,A2,2'", its P3 a
+			 * column_cmp_t.  Only jumps are folded, a
+			 * comparison with a P2 of zero pushes its result.
+			 */
+			if (next->opcode != OP_Column || i + 2 >= n ||
+			    map[i + 2] || op->p1 < 0 || next->p1 < 0 ||
+			    op->p3 != 0 || next->p3 != 0)
+				break;
+			cmp = &vm->aOp[i + 2];
+			if (cmp->opcode < OP_Eq || cmp->opcode > OP_StrGe ||
+			    cmp->p2 <= 0)
+				break;
+			if (__dbsql_calloc(NULL, 1, sizeof(column_cmp_t),
+			    &cc) == ENOMEM)
+				break;
+			cc->iCsr1 = op->p1;
+			cc->iCol1 = op->p2;
+			cc->iCsr2 = next->p1;
+			cc->iCol2 = next->p2;
+			cc->iCmp = cmp->opcode - OP_Eq;
+			sprintf(cc->zText, "%d,%d,%d,%d,%d", cc->iCsr1,
+			    cc->iCol1, cc->iCsr2, cc->iCol2, cc->iCmp);
+			op->opcode = OP_ColumnCmp;
+			op->p1 = cmp->p1;
+			op->p2 = cmp->p2;
+			op->p3 = (char *)cc;
+			op->p3type = P3_DYNAMIC;
+			__vdbe_make_noop(next);
+			__vdbe_make_noop(cmp);
+			break;
+		}
+		if (op->opcode == OP_Pop && op->p1 == 0)
+			__vdbe_make_noop(op);
+	}
+	op = &vm->aOp[n - 1];
+	if (op->opcode == OP_Pop && op->p1 == 0)
+		__vdbe_make_noop(op);
+
+	/*
+	 * Drop the instructions that cannot be reached from the entry
+	 * point.  Control leaves an instruction by falling through unless
+	 * it is an OP_Goto, OP_Halt or OP_Return, and by its P2 if that
+	 * is a jump.
+	 */
+	memset(map, 0, (n + 1) * sizeof(int));
+	map[0] = 1;
+	work[0] = 0;
+	j = 1;
+	while (j > 0) {
+		i = work[--j];
+		op = &vm->aOp[i];
+		if (op->opcode != OP_Goto && op->opcode != OP_Halt &&
+		    op->opcode != OP_Return && i + 1 < n && !map[i + 1]) {
+			map[i + 1] = 1;
+			work[j++] = i + 1;
+		}
+		if (__vdbe_jump_p(op->opcode) && op->p2 >= 0 &&
+		    op->p2 < n && !map[op->p2]) {
+			map[op->p2] = 1;
+			work[j++] = op->p2;
+		}
+	}
+	for (i = 0; i < n; i++) {
+		if (!map[i])
+			__vdbe_make_noop(&vm->aOp[i]);
+	}
+
+	/*
+	 * An OP_Goto whose destination is reached by falling through the
+	 * OP_Noops that follow it does nothing.
+	 */
+	for (i = 0; i < n; i++) {
+		op = &vm->aOp[i];
+		if (op->opcode != OP_Goto || op->p2 <= i)
+			continue;
+		for (j = i + 1; j < op->p2 && vm->aOp[j].opcode == OP_Noop;)
+			j++;
+		if (j == op->p2)
+			__vdbe_make_noop(op);
+	}
+
+	/*
+	 * Squeeze out the OP_Noops.  map[i] becomes the new address of the
+	 * first instruction kept at or after i.
+	 */
+	for (i = 0, j = 0; i < n; i++) {
+		map[i] = j;
+		if (vm->aOp[i].opcode != OP_Noop)
+			vm->aOp[j++] = vm->aOp[i];
+	}
+	map[n] = j;
+	vm->nOp = j;
+	for (i = 0; i < vm->nOp; i++) {
+		op = &vm->aOp[i];
+		if (__vdbe_jump_p(op->opcode) && op->p2 >= 0 && op->p2 <= n)
+			op->p2 = map[op->p2];
+	}
+	__dbsql_free(NULL, map);
+}
+
 /*
  * __vdbe_make_ready --
  *	Prepare a virtual machine for execution.  This involves things such
@@ -875,30 +1170,46 @@ __vdbe_make_ready(vm, num_var, callback, callback_arg, explain_p)
 
 	/*
 	 * No instruction ever pushes more than a single element onto the
-	 * stack.  And the stack never grows on successive executions of the
-	 * same loop.  So the total number of instructions is an upper bound
-	 * on the maximum stack depth required.
+	 * stack, except OP_AggReplay which pushes back values that as many
+	 * instructions of the scan loop computed.  And the stack never grows
+	 * on successive executions of the same loop.  So the total number of
+	 * instructions is an upper bound on the maximum stack depth required.
 	 *
 	 * Allocation all the stack space we will ever need.
+	 *
+	 * The program is optimized here too, the first time it is made
+	 * ready, unless "PRAGMA peephole = OFF" asks to see it as it was
+	 * generated.  The stack is sized from the unoptimized program as
+	 * the bound above is only argued for that one.
 	 */
 	if (vm->aStack == 0) {
 		vm->nVar = num_var;
 		DBSQL_ASSERT(num_var >= 0);
 		n = explain_p ? 10 : vm->nOp;
+		if ((vm->db->flags & DBSQL_NoPeephole) == 0)
+			__vdbe_optimize(vm);
 		__dbsql_calloc(NULL, 1,
-			 /* aStack and zArgv */
+			 /* aStack, zArgv and azColName */
 			 (n * (sizeof(vm->aStack[0]) + (2 * sizeof(char*))) +
-			 /* azVar, anVar, abVar */
-			 (vm->nVar * (sizeof(char*)) + sizeof(int) + 1)),
+			 /* aVar */
+			 (vm->nVar * sizeof(vm->aVar[0]))),
 			 &vm->aStack);
-			vm->zArgv = (char**)&vm->aStack[n];
+			vm->aVar = &vm->aStack[n];
+			vm->zArgv = (char**)&vm->aVar[vm->nVar];
 			vm->azColName = (char**)&vm->zArgv[n];
-			vm->azVar = (char**)&vm->azColName[n];
-			vm->anVar = (int*)&vm->azVar[vm->nVar];
-			vm->abVar = (u_int8_t*)&vm->anVar[vm->nVar];
 	}
 
-	__hash_init(&vm->agg.hash, DBSQL_HASH_BINARY, 0);
+	/*
+	 * A program that neither starts a transaction nor opens a cursor
+	 * for writing may read in snapshots (see OP_OpenRead).
+	 */
+	vm->readOnly = 1;
+	for (n = 0; n < vm->nOp; n++) {
+		if (vm->aOp[n].opcode == OP_Transaction ||
+		    vm->aOp[n].opcode == OP_OpenWrite)
+			vm->readOnly = 0;
+	}
+
 	vm->agg.pSearch = 0;
 #ifdef MEMORY_DEBUG
 	if (__os_file_exists("vdbe_trace")){
@@ -929,9 +1240,109 @@ __vdbe_make_ready(vm, num_var, callback, callback_arg, explain_p)
 }
 
 
+/*
+ * __vdbe_arena_alloc --
+ *	Allocate 'n' bytes out of the arena whose newest block is at
+ *	'*arenap'.  The memory is released only when the whole arena is
+ *	freed with __vdbe_arena_free().
+ *
+ * PUBLIC: int __vdbe_arena_alloc __P((arena_block_t **, int, void *));
+ */
+int
+__vdbe_arena_alloc(arenap, n, storep)
+	arena_block_t **arenap;
+	int n;
+	void *storep;
+{
+	arena_block_t *blk;
+	int nalloc;
+
+	n = (n + 7) & ~7;
+	blk = *arenap;
+	if (blk == 0 || blk->nUsed + n > blk->nAlloc) {
+		nalloc = (n > ARENA_BLOCK) ? n : ARENA_BLOCK;
+		if (__dbsql_malloc(NULL, sizeof(arena_block_t) + nalloc,
+				   &blk) == ENOMEM)
+			return ENOMEM;
+		blk->zBuf = (char *)&blk[1];
+		blk->nUsed = 0;
+		blk->nAlloc = nalloc;
+		blk->pNext = *arenap;
+		*arenap = blk;
+	}
+	*(void **)storep = &blk->zBuf[blk->nUsed];
+	blk->nUsed += n;
+	return 0;
+}
+
+/*
+ * __vdbe_arena_free --
+ *	Release every block of an arena.
+ *
+ * PUBLIC: void __vdbe_arena_free __P((arena_block_t **));
+ */
+void
+__vdbe_arena_free(arenap)
+	arena_block_t **arenap;
+{
+	arena_block_t *blk;
+
+	while ((blk = *arenap) != 0) {
+		*arenap = blk->pNext;
+		__dbsql_free(NULL, blk);
+	}
+}
+
+/*
+ * __vdbe_str_alloc --
+ *	Allocate 'n' bytes for a string value out of the string arena of
+ *	the VDBE given.  The caller marks the value MEM_Arena and never
+ *	frees it.
+ *
+ * PUBLIC: int __vdbe_str_alloc __P((vdbe_t *, int, char **));
+ */
+int
+__vdbe_str_alloc(vm, n, zp)
+	vdbe_t *vm;
+	int n;
+	char **zp;
+{
+	if (__vdbe_arena_alloc(&vm->pStrArena, n, zp) == ENOMEM)
+		return ENOMEM;
+	vm->nStrArena += n;
+	if (vm->nStrArena > vm->nStrArenaHigh)
+		vm->nStrArenaHigh = vm->nStrArena;
+	return 0;
+}
+
+/*
+ * __vdbe_str_reset --
+ *	Empty the string arena of the VDBE given, keeping its newest block
+ *	for the strings that come next.  Only safe when no value on the
+ *	stack is a MEM_Arena string.
+ *
+ * PUBLIC: void __vdbe_str_reset __P((vdbe_t *));
+ */
+void
+__vdbe_str_reset(vm)
+	vdbe_t *vm;
+{
+	arena_block_t *blk;
+
+	if (vm->pStrArena == 0)
+		return;
+	while ((blk = vm->pStrArena->pNext) != 0) {
+		vm->pStrArena->pNext = blk->pNext;
+		__dbsql_free(NULL, blk);
+	}
+	vm->pStrArena->nUsed = 0;
+	vm->nStrArena = 0;
+}
+
 /*
  * __vdbe_sorter_reset --
- *	Remove any elements that remain on the sorter for the VDBE given.
+ *	Remove any elements that remain on the sorter for the VDBE given
+ *	and close the temporary files holding its runs.
  *
  * PUBLIC: void __vdbe_sorter_reset __P((vdbe_t *));
  */
@@ -939,18 +1350,52 @@ void
 __vdbe_sorter_reset(vm)
 	vdbe_t *vm;
 {
-	while(vm->pSort) {
-		sorter_t *s = vm->pSort;
-		vm->pSort = s->pNext;
-		__dbsql_free(NULL, s->zKey);
-		__dbsql_free(NULL, s->pData);
-		__dbsql_free(NULL, s);
-	}
+	sorter_t *elem;
+	int i;
+
+	if (vm->aHeap) {
+		/* A bounded sorter allocates each of its elements. */
+		for (i = 0; i < vm->nHeap; i++) {
+			__dbsql_free(NULL, vm->aHeap[i]);
+		}
+		while ((elem = vm->pSort) != 0) {
+			vm->pSort = elem->pNext;
+			__dbsql_free(NULL, elem);
+		}
+		__dbsql_free(NULL, vm->aHeap);
+		vm->aHeap = 0;
+	}
+	if (vm->zHeapMax) {
+		__dbsql_free(NULL, vm->zHeapMax);
+		vm->zHeapMax = 0;
+	}
+	vm->nHeap = 0;
+	vm->nSortLimit = 0;
+	vm->iSortSeq = 0;
+	vm->pSort = 0;
+	__vdbe_arena_free(&vm->pSortArena);
+	vm->nSortMem = 0;
+	for (i = 0; i < vm->nRun; i++) {
+		if (vm->aRun[i].fp)
+			fclose(vm->aRun[i].fp);
+		if (vm->aRun[i].zBuf)
+			__dbsql_free(NULL, vm->aRun[i].zBuf);
+	}
+	if (vm->aRun) {
+		__dbsql_free(NULL, vm->aRun);
+		vm->aRun = 0;
+	}
+	vm->nRun = 0;
+	if (vm->aRunHeap) {
+		__dbsql_free(NULL, vm->aRunHeap);
+		vm->aRunHeap = 0;
+	}
+	vm->nRunHeap = 0;
 }
 
 /*
- * __vdbe_agg_reset --
- *	Reset an Agg structure.  Delete all its contents. 
+ * __agg_elem_release --
+ *	Free the values held by an aggregate element and its key.
  *
  *	For installable aggregate functions, if the step function has been
  *	called, make sure the finalizer function has also been called.  The
@@ -958,45 +1403,143 @@ __vdbe_sorter_reset(vm)
  *	private context.  If the finalizer has not been called yet, call it
  *	now.
  *
- * PUBLIC: void __vdbe_agg_reset __P((agg_t *));
+ * STATIC: static void __agg_elem_release __P((agg_t *, agg_elem_t *));
  */
-void
-__vdbe_agg_reset(agg)
+static void
+__agg_elem_release(agg, elem)
 	agg_t *agg;
+	agg_elem_t *elem;
 {
 	int i;
-	hash_ele_t *p;
-	for (p = __hash_first(&agg->hash); p; p = __hash_next(p)) {
-		agg_elem_t *elem = __hash_data(p);
-		DBSQL_ASSERT(agg->apFunc != 0);
-		for (i = 0; i < agg->nMem; i++) {
-			mem_t *mem = &elem->aMem[i];
-			if (agg->apFunc[i] && (mem->flags & MEM_AggCtx) != 0) {
-				dbsql_func_t ctx;
-				ctx.pFunc = agg->apFunc[i];
-				ctx.s.flags = MEM_Null;
-				ctx.pAgg = mem->z;
-				ctx.cnt = mem->i;
-				ctx.isStep = 0;
-				ctx.isError = 0;
-				(*agg->apFunc[i]->xFinalize)(&ctx);
-				if (mem->z != 0 && mem->z != mem->zShort) {
-					__dbsql_free(NULL, mem->z);
-				}
-			} else if (mem->flags & MEM_Dyn) {
+
+	DBSQL_ASSERT(agg->apFunc != 0);
+	for (i = 0; i < agg->nMem; i++) {
+		mem_t *mem = &elem->aMem[i];
+		if (agg->apFunc[i] && (mem->flags & MEM_AggCtx) != 0) {
+			dbsql_func_t ctx;
+			ctx.pFunc = agg->apFunc[i];
+			ctx.s.flags = MEM_Null;
+			ctx.pAgg = mem->z;
+			ctx.cnt = mem->i;
+			ctx.isStep = 0;
+			ctx.pVm = 0;
+			ctx.isError = 0;
+			(*agg->apFunc[i]->xFinalize)(&ctx);
+			if (mem->z != 0 && mem->z != mem->zShort) {
 				__dbsql_free(NULL, mem->z);
 			}
+		} else if (mem->flags & MEM_Dyn) {
+			__dbsql_free(NULL, mem->z);
 		}
-		__dbsql_free(NULL, elem);
+		mem->flags = MEM_Null;
+	}
+	agg->nUsed -= sizeof(agg_elem_t) +
+		((agg->nMem - 1) * sizeof(elem->aMem[0]));
+	if (elem->zKey != elem->zShort) {
+		agg->nUsed -= elem->nKey;
+		__dbsql_free(NULL, elem->zKey);
 	}
-	__hash_clear(&agg->hash);
-	__dbsql_free(NULL, agg->apFunc);
-	agg->apFunc = 0;
+	elem->zKey = 0;
+}
+
+/*
+ * __vdbe_agg_clear --
+ *	Delete all the elements of an Agg structure.  The functions and the
+ *	partitions still to be aggregated are kept.
+ *
+ * PUBLIC: void __vdbe_agg_clear __P((agg_t *));
+ */
+void
+__vdbe_agg_clear(agg)
+	agg_t *agg;
+{
+	agg_elem_t *elem;
+
+	for (elem = agg->pFirst; elem; elem = elem->pNext) {
+		__agg_elem_release(agg, elem);
+	}
+	if (agg->aHash) {
+		__dbsql_free(NULL, agg->aHash);
+		agg->aHash = 0;
+	}
+	agg->nHash = 0;
+	__vdbe_arena_free(&agg->pArena);
+	agg->pFirst = 0;
+	agg->pLast = 0;
+	agg->pFree = 0;
+	agg->nElem = 0;
+	agg->nUsed = 0;
 	agg->pCurrent = 0;
 	agg->pSearch = 0;
+	agg->full = 0;
+	agg->skip = 0;
+}
+
+/*
+ * __vdbe_agg_reset --
+ *	Reset an Agg structure.  Delete all its contents. 
+ *
+ * PUBLIC: void __vdbe_agg_reset __P((agg_t *));
+ */
+void
+__vdbe_agg_reset(agg)
+	agg_t *agg;
+{
+	int i;
+
+	__vdbe_agg_clear(agg);
+	if (agg->apFunc) {
+		__dbsql_free(NULL, agg->apFunc);
+		agg->apFunc = 0;
+	}
+	for (i = 0; i < AGG_PART_FANOUT; i++) {
+		if (agg->apOut[i]) {
+			fclose(agg->apOut[i]);
+			agg->apOut[i] = 0;
+		}
+	}
+	if (agg->pIn) {
+		fclose(agg->pIn);
+		agg->pIn = 0;
+	}
+	for (i = 0; i < agg->nPart; i++) {
+		fclose(agg->aPart[i].fp);
+	}
+	if (agg->aPart) {
+		__dbsql_free(NULL, agg->aPart);
+		agg->aPart = 0;
+	}
+	agg->nPart = 0;
+	agg->level = 0;
 	agg->nMem = 0;
 }
 
+/*
+ * __vdbe_hjoin_clear --
+ *	Delete all the elements of a join hash table.
+ *
+ * PUBLIC: void __vdbe_hjoin_clear __P((hjoin_t *));
+ */
+void
+__vdbe_hjoin_clear(hj)
+	hjoin_t *hj;
+{
+	if (hj->aHash) {
+		__dbsql_free(NULL, hj->aHash);
+		hj->aHash = 0;
+	}
+	hj->nHash = 0;
+	__vdbe_arena_free(&hj->pArena);
+	hj->nElem = 0;
+	hj->nUsed = 0;
+	hj->pMatch = 0;
+	if (hj->zProbe) {
+		__dbsql_free(NULL, hj->zProbe);
+		hj->zProbe = 0;
+	}
+	hj->nProbe = hj->nProbeAlloc = 0;
+}
+
 /*
  * __vdbe_keylist_free --
  *	Delete a keylist
@@ -1032,12 +1575,14 @@ __vdbe_cleanup_cursor(cx)
 		__sm_close_db(cx->pBt);
 	}
 	__dbsql_free(NULL, cx->pData);
+	__dbsql_free(NULL, cx->aField);
+	__dbsql_free(NULL, cx->zMerge);
 	memset(cx, 0, sizeof(cursor_t));
 }
 
 /*
  * __close_all_cursors --
- *	Close all cursors
+ *	Close all cursors, then end the snapshots they read in.
  *
  * STATIC: static void __close_all_cursors __P((vdbe_t *));
  */
@@ -1052,6 +1597,12 @@ __close_all_cursors(vm)
 	__dbsql_free(NULL, vm->aCsr);
 	vm->aCsr = 0;
 	vm->nCursor = 0;
+	for (i = 0; i < vm->nSnap; i++) {
+		__sm_snapshot_end(vm->aSnap[i]);
+	}
+	__dbsql_free(NULL, vm->aSnap);
+	vm->aSnap = 0;
+	vm->nSnap = 0;
 }
 
 /*
@@ -1095,6 +1646,11 @@ __cleanup(vm)
 		vm->pList = 0;
 	}
 	__vdbe_sorter_reset(vm);
+	if (vm->nStrArenaHigh > vm->db->arena_high)
+		vm->db->arena_high = vm->nStrArenaHigh;
+	__vdbe_arena_free(&vm->pStrArena);
+	vm->nStrArena = 0;
+	vm->nStrArenaHigh = 0;
 	if (vm->pFile) {
 		if (vm->pFile != stdin)
 			fclose(vm->pFile);
@@ -1119,6 +1675,12 @@ __cleanup(vm)
 	__dbsql_free(NULL, vm->aSet);
 	vm->aSet = 0;
 	vm->nSet = 0;
+	for (i = 0; i < vm->nHJoin; i++) {
+		__vdbe_hjoin_clear(&vm->aHJoin[i]);
+	}
+	__dbsql_free(NULL, vm->aHJoin);
+	vm->aHJoin = 0;
+	vm->nHJoin = 0;
 	if (vm->keylistStack) {
 		int ii;
 		for(ii = 0; ii < vm->keylistStackDepth; ii++) {
@@ -1237,53 +1799,279 @@ __vdbe_finalize(vm, err_msgs)
 }
 
 /*
- * __api_bind --
- *	Set the values of all variables.  Variable $1 in the original SQL will
- *	be the string azValue[0].  $2 will have the value azValue[1].  And
- *	so forth.  If a value is out of range (for example $3 when nValue==2)
- *	then its value will be NULL.
- *	This routine overrides any prior call.
+ * __vdbe_set_var_names --
+ *	Hand the names of the ':name' variables of the program over to the
+ *	VDBE, which frees them.  Entry i of 'azName' names variable i+1 or
+ *	is 0 for a '?'.  'azName' may be 0 when no variable is named.
  *
- * PUBLIC: int __api_bind __P((dbsql_stmt_t *, int, const char *, int,
- * PUBLIC:                int));
+ * PUBLIC: void __vdbe_set_var_names __P((vdbe_t *, char **));
  */
-int
-__api_bind(p, i, val, len, copy)
+void
+__vdbe_set_var_names(vm, azName)
+	vdbe_t *vm;
+	char **azName;
+{
+	DBSQL_ASSERT(vm->azVarName == 0);
+	vm->azVarName = azName;
+}
+
+/*
+ * __bind_var --
+ *	Find the variable that a bind call sets and release its old value.
+ *	Variable $1 in the original SQL is 'i' == 1.  Returns a DBSQL_ error
+ *	code when the statement is running or 'i' is out of range.
+ *
+ * STATIC: static int __bind_var __P((dbsql_stmt_t *, int, mem_t **));
+ */
+static int
+__bind_var(p, i, memp)
 	dbsql_stmt_t *p;
 	int i;
-	const char *val;
-	int len;
-	int copy;
+	mem_t **memp;
 {
 	vdbe_t *vm = (vdbe_t*)p;
+	mem_t *mem;
+
 	if (vm->magic != VDBE_MAGIC_RUN || vm->pc != 0) {
 		return DBSQL_MISUSE;
 	}
 	if (i < 1 || i > vm->nVar) {
 		return DBSQL_RANGE;
 	}
-	i--;
-	if (vm->abVar[i]) {
-		__dbsql_free(NULL, vm->azVar[i]);
+	mem = &vm->aVar[i - 1];
+	if (mem->flags & MEM_Dyn) {
+		__dbsql_free(NULL, mem->z);
 	}
-	if (val == 0) {
-		copy = 0;
-		len = 0;
+	mem->flags = MEM_Null;
+	mem->z = 0;
+	mem->n = 0;
+	*memp = mem;
+	return DBSQL_SUCCESS;
+}
+
+/*
+ * __bind_str --
+ *	Make 'mem' the 'n' bytes at 'val' followed by a nul.  Short values
+ *	are kept in mem_t.zShort, others are copied unless 'copy' is 0, in
+ *	which case 'val' must be nul terminated and outlive the binding.
+ *
+ * STATIC: static int __bind_str __P((mem_t *, const char *, int, int));
+ */
+static int
+__bind_str(mem, val, n, copy)
+	mem_t *mem;
+	const char *val;
+	int n;
+	int copy;
+{
+	if (n < NBFS) {
+		memcpy(mem->zShort, val, n);
+		mem->zShort[n] = 0;
+		mem->z = mem->zShort;
+		mem->flags = MEM_Str | MEM_Short;
+	} else if (copy) {
+		if (__dbsql_malloc(NULL, n + 1, &mem->z) == ENOMEM) {
+			mem->flags = MEM_Null;
+			return DBSQL_NOMEM;
+		}
+		memcpy(mem->z, val, n);
+		mem->z[n] = 0;
+		mem->flags = MEM_Str | MEM_Dyn;
+	} else {
+		mem->z = (char *)val;
+		mem->flags = MEM_Str | MEM_Static;
 	}
-	if (len < 0) {
+	mem->n = n + 1;
+	return DBSQL_SUCCESS;
+}
+
+/*
+ * __api_bind --
+ *	Set the value of variable 'i' to the 'len' bytes at 'val', where
+ *	'len' counts the nul terminator or is negative to have strlen()
+ *	find it.  Variable $1 in the original SQL is 'i' == 1.  A NULL
+ *	'val' binds the SQL NULL.  The value is copied when 'copy' is
+ *	non-zero, otherwise it must outlive the binding.
+ *	This routine overrides any prior call.
+ *
+ * PUBLIC: int __api_bind __P((dbsql_stmt_t *, int, const char *, int,
+ * PUBLIC:                int));
+ */
+int
+__api_bind(p, i, val, len, copy)
+	dbsql_stmt_t *p;
+	int i;
+	const char *val;
+	int len;
+	int copy;
+{
+	mem_t *mem;
+	int rc;
+
+	if ((rc = __bind_var(p, i, &mem)) != DBSQL_SUCCESS)
+		return rc;
+	if (val == 0)
+		return DBSQL_SUCCESS;
+	if (len < 0)
 		len = strlen(val) + 1;
-	}
-	if (copy) {
-		if (__dbsql_calloc(NULL, 1, len, &vm->azVar[i]) != ENOMEM)
-			memcpy(vm->azVar[i], val, len);
+	if (len == 0)
+		len = 1;
+	return __bind_str(mem, val, len - 1, copy);
+}
+
+/*
+ * __api_bind_int64 --
+ *	Bind an integer to variable 'i' without going through text.  Values
+ *	that do not fit the VDBE's integers are bound as their decimal
+ *	text, which the VDBE compares and sorts as a number.
+ *
+ * PUBLIC: int __api_bind_int64 __P((dbsql_stmt_t *, int, int64_t));
+ */
+int
+__api_bind_int64(p, i, val)
+	dbsql_stmt_t *p;
+	int i;
+	int64_t val;
+{
+	mem_t *mem;
+	int rc;
+
+	if ((rc = __bind_var(p, i, &mem)) != DBSQL_SUCCESS)
+		return rc;
+	if ((int64_t)(int)val == val) {
+		mem->i = (int)val;
+		mem->flags = MEM_Int;
 	} else {
-		vm->azVar[i] = (char*)val;
+		snprintf(mem->zShort, sizeof(mem->zShort), "%lld",
+			 (long long)val);
+		mem->z = mem->zShort;
+		mem->n = strlen(mem->zShort) + 1;
+		mem->flags = MEM_Str | MEM_Short;
 	}
-	vm->abVar[i] = copy;
-	vm->anVar[i] = len;
 	return DBSQL_SUCCESS;
 }
 
+/*
+ * __api_bind_double --
+ *	Bind a floating point value to variable 'i'.
+ *
+ * PUBLIC: int __api_bind_double __P((dbsql_stmt_t *, int, double));
+ */
+int
+__api_bind_double(p, i, val)
+	dbsql_stmt_t *p;
+	int i;
+	double val;
+{
+	mem_t *mem;
+	int rc;
+
+	if ((rc = __bind_var(p, i, &mem)) != DBSQL_SUCCESS)
+		return rc;
+	mem->r = val;
+	mem->flags = MEM_Real;
+	return DBSQL_SUCCESS;
+}
+
+/*
+ * __api_bind_text --
+ *	Bind the 'len' characters at 'val' to variable 'i'; a negative 'len'
+ *	has strlen() find them.  Unlike DBSQL->bind() 'len' does not count
+ *	a nul terminator.  With 'copy' zero 'val' must be nul terminated and
+ *	outlive the binding.
+ *
+ * PUBLIC: int __api_bind_text __P((dbsql_stmt_t *, int, const char *, int,
+ * PUBLIC:                     int));
+ */
+int
+__api_bind_text(p, i, val, len, copy)
+	dbsql_stmt_t *p;
+	int i;
+	const char *val;
+	int len;
+	int copy;
+{
+	mem_t *mem;
+	int rc;
+
+	if ((rc = __bind_var(p, i, &mem)) != DBSQL_SUCCESS)
+		return rc;
+	if (val == 0)
+		return DBSQL_SUCCESS;
+	if (len < 0)
+		len = strlen(val);
+	return __bind_str(mem, val, len, copy);
+}
+
+/*
+ * __api_bind_blob --
+ *	Bind the 'len' bytes at 'val' to variable 'i'.  The VDBE has no
+ *	binary type so the bytes are always copied and given a nul
+ *	terminator; they become a string whose length counts every byte.
+ *
+ * PUBLIC: int __api_bind_blob __P((dbsql_stmt_t *, int, const void *,
+ * PUBLIC:                     int));
+ */
+int
+__api_bind_blob(p, i, val, len)
+	dbsql_stmt_t *p;
+	int i;
+	const void *val;
+	int len;
+{
+	mem_t *mem;
+	int rc;
+
+	if ((rc = __bind_var(p, i, &mem)) != DBSQL_SUCCESS)
+		return rc;
+	if (val == 0 || len < 0)
+		return DBSQL_SUCCESS;
+	return __bind_str(mem, (const char *)val, len, 1);
+}
+
+/*
+ * __api_bind_null --
+ *	Bind the SQL NULL to variable 'i'.
+ *
+ * PUBLIC: int __api_bind_null __P((dbsql_stmt_t *, int));
+ */
+int
+__api_bind_null(p, i)
+	dbsql_stmt_t *p;
+	int i;
+{
+	mem_t *mem;
+
+	return __bind_var(p, i, &mem);
+}
+
+/*
+ * __api_bind_parameter_index --
+ *	Return the number of the variable called 'name', ":abc" for
+ *	instance, for use with the bind calls.  Return 0 if the statement
+ *	has no variable of that name.  The names were collected when the
+ *	statement was prepared so this does not look at the SQL.
+ *
+ * PUBLIC: int __api_bind_parameter_index __P((dbsql_stmt_t *,
+ * PUBLIC:                               const char *));
+ */
+int
+__api_bind_parameter_index(p, name)
+	dbsql_stmt_t *p;
+	const char *name;
+{
+	vdbe_t *vm = (vdbe_t*)p;
+	int i;
+
+	if (vm->azVarName == 0 || name == 0)
+		return 0;
+	for (i = 0; i < vm->nVar; i++) {
+		if (vm->azVarName[i] && strcmp(vm->azVarName[i], name) == 0)
+			return i + 1;
+	}
+	return 0;
+}
+
 
 /*
  * __vdbe_delete --
@@ -1319,9 +2107,13 @@ __vdbe_delete(vm)
 		}
 	}
 	for(i = 0; i < vm->nVar; i++) {
-		if (vm->abVar[i])
-			__dbsql_free(NULL, vm->azVar[i]);
+		if (vm->aVar[i].flags & MEM_Dyn)
+			__dbsql_free(NULL, vm->aVar[i].z);
+		if (vm->azVarName && vm->azVarName[i])
+			__dbsql_free(NULL, vm->azVarName[i]);
 	}
+	if (vm->azVarName)
+		__dbsql_free(NULL, vm->azVarName);
 	__dbsql_free(NULL, vm->aOp);
 	__dbsql_free(NULL, vm->aLabel);
 	__dbsql_free(NULL, vm->aStack);
@@ -403,6 +403,89 @@ t__last_rowid(_dbctx, interp, argc, argv)
 	return DBSQL_SUCCESS;
 }
 
+/*
+ * t__format_version --
+ *	TCL usage:  dbsql_format_version DB ?VERSION?
+ *
+ *	Returns the format version rows of the main database are written
+ *	in.  With VERSION, stamp that version into the main database
+ *	instead; 0 removes the stamp, as in databases made before it was
+ *	written.  The stamp is read when the database is next opened.
+ */
+static int
+t__format_version(_dbctx, interp, argc, argv)
+	void *_dbctx;
+	Tcl_Interp *interp;
+	int argc;
+	char **argv;
+{
+	DBSQL *dbp;
+	char buf[30];
+
+	COMPQUIET(_dbctx, NULL);
+
+	if (argc != 2 && argc != 3) {
+		Tcl_AppendResult(interp, "wrong # args: should be \"",
+				 argv[0], " DB ?VERSION?\"", 0);
+		return TCL_ERROR;
+	}
+	if (get_dbsql_from_ptr(interp, argv[1], &dbp))
+		return TCL_ERROR;
+	if (argc == 3) {
+		if (__sm_set_format_version(dbp->aDb[0].pBt, 0,
+		    (u_int32_t)atoi(argv[2])) != DBSQL_SUCCESS) {
+			Tcl_AppendResult(interp, "cannot set format version", 0);
+			return TCL_ERROR;
+		}
+		return TCL_OK;
+	}
+	sprintf(buf, "%lu", (unsigned long)dbp->format_version);
+	Tcl_AppendResult(interp, buf, 0);
+	return TCL_OK;
+}
+
+/*
+ * t__stat --
+ *	TCL usage:  dbsql_stat DB NAME
+ *
+ *	Returns the counts ANALYZE stored in the main database for the
+ *	table or index NAME, or an empty string if it stored none.
+ */
+static int
+t__stat(_dbctx, interp, argc, argv)
+	void *_dbctx;
+	Tcl_Interp *interp;
+	int argc;
+	char **argv;
+{
+	DBSQL *dbp;
+	char *stat;
+	int len, n;
+
+	COMPQUIET(_dbctx, NULL);
+
+	if (argc != 3) {
+		Tcl_AppendResult(interp, "wrong # args: should be \"",
+				 argv[0], " DB NAME\"", 0);
+		return TCL_ERROR;
+	}
+	if (get_dbsql_from_ptr(interp, argv[1], &dbp))
+		return TCL_ERROR;
+	if (__sm_get_stat(dbp->aDb[0].pBt, argv[2], &stat, &len) !=
+	    DBSQL_SUCCESS) {
+		Tcl_AppendResult(interp, "cannot read statistics", 0);
+		return TCL_ERROR;
+	}
+	if (stat) {
+		/* The counts end at a 0x00 for an index, else at 'len'. */
+		for (n = 0; n < len && stat[n]; n++)
+			;
+		Tcl_SetObjResult(interp, Tcl_NewStringObj(stat, n));
+		__dbsql_ufree(dbp, stat);
+	}
+	return TCL_OK;
+}
+
 /*
  * t__test_close --
  *	TCL usage:  dbsql_close DB
@@ -1190,7 +1273,8 @@ static char *dbsql_static_bind_value = 0;
  *	ignored and the value is set to NULL.  If FLAGS=="static" then
  *	the value is set to the value of a static variable named
  *	"dbsql_static_bind_value".  If FLAGS=="normal" then a copy
- *	of the VALUE is made.
+ *	of the VALUE is made.  FLAGS of "int64", "double", "text" or
+ *	"blob" bind VALUE with the typed bind call of that name.
  */
 static int
 t__dbsql_bind(_dbctx, interp, argc, argv)
@@ -1203,13 +1287,15 @@ t__dbsql_bind(_dbctx, interp, argc, argv)
 	dbsql_stmt_t *vm;
 	int rc;
 	int idx;
+	double r;
 	char buf[50];
 
 	COMPQUIET(_dbctx, NULL);
 
 	if (argc != 5) {
 		Tcl_AppendResult(interp, "wrong # args: should be \"", argv[0],
-				 " VM IDX VALUE (null|static|normal)\"", 0);
+				 " VM IDX VALUE (null|static|normal|int64|"
+				 "double|text|blob)\"", 0);
 		return TCL_ERROR;
 	}
 	if (get_dbsql_from_ptr(interp, argv[1], &dbp))
@@ -1224,9 +1310,22 @@ t__dbsql_bind(_dbctx, interp, argc, argv)
 		rc = dbp->bind(vm, idx, dbsql_static_bind_value, -1, 0);
 	} else if (strcmp(argv[4], "normal") == 0) {
 		rc = dbp->bind(vm, idx, argv[3], -1, 1);
+	} else if (strcmp(argv[4], "int64") == 0) {
+		rc = dbp->bind_int64(vm, idx,
+				     (int64_t)strtoll(argv[3], 0, 10));
+	} else if (strcmp(argv[4], "double") == 0) {
+		if (Tcl_GetDouble(interp, argv[3], &r))
+			return TCL_ERROR;
+		rc = dbp->bind_double(vm, idx, r);
+	} else if (strcmp(argv[4], "text") == 0) {
+		rc = dbp->bind_text(vm, idx, argv[3], -1, 1);
+	} else if (strcmp(argv[4], "blob") == 0) {
+		rc = dbp->bind_blob(vm, idx, argv[3], strlen(argv[3]));
 	} else {
 		Tcl_AppendResult(interp, "4th argument should be "
-				 "\"null\" or \"static\" or \"normal\"", 0);
+				 "\"null\" or \"static\" or \"normal\" or "
+				 "\"int64\" or \"double\" or \"text\" or "
+				 "\"blob\"", 0);
 		return TCL_ERROR;
 	}
 	if (rc) {
@@ -1237,6 +1336,40 @@ t__dbsql_bind(_dbctx, interp, argc, argv)
 	return TCL_OK;
 }
 
+/*
+ * t__dbsql_bind_index --
+ *	TCL usage:  dbsql_bind_index  VM  NAME
+ *
+ *	Return the number of the variable called NAME, ":abc" for instance,
+ *	or 0 if the statement has no such variable.
+ */
+static int
+t__dbsql_bind_index(_dbctx, interp, argc, argv)
+	void *_dbctx;
+	Tcl_Interp *interp;
+	int argc;
+	char **argv;
+{
+	DBSQL *dbp;
+	dbsql_stmt_t *vm;
+	char buf[50];
+
+	COMPQUIET(_dbctx, NULL);
+
+	if (argc != 3) {
+		Tcl_AppendResult(interp, "wrong # args: should be \"", argv[0],
+				 " VM NAME\"", 0);
+		return TCL_ERROR;
+	}
+	if (get_dbsql_from_ptr(interp, argv[1], &dbp))
+		return TCL_ERROR;
+	if (get_sqlvm_from_ptr(interp, argv[1], &vm))
+		return TCL_ERROR;
+	sprintf(buf, "%d", dbp->bind_parameter_index(vm, argv[2]));
+	Tcl_AppendResult(interp, buf, 0);
+	return TCL_OK;
+}
+
 /*
  * t__dbsql_breakpoint --
  *	TCL usage:    breakpoint
@@ -1288,6 +1421,8 @@ TODO
 #endif
      { "dbsql_env_create",              (Tcl_CmdProc*)t__dbsql_env_create  },
      { "dbsql_last_inserted_rowid",     (Tcl_CmdProc*)t__last_rowid        },
+     { "dbsql_format_version",          (Tcl_CmdProc*)t__format_version    },
+     { "dbsql_stat",                    (Tcl_CmdProc*)t__stat              },
      { "dbsql_exec_printf",             (Tcl_CmdProc*)t__exec_printf       },
      { "dbsql_get_table_printf",        (Tcl_CmdProc*)t__get_table_printf  },
      { "dbsql_close",                   (Tcl_CmdProc*)t__test_close        },
@@ -1304,6 +1439,7 @@ TODO
      { "dbsql_step",                    (Tcl_CmdProc*)t__dbsql_step        },
      { "dbsql_close_sqlvm",             (Tcl_CmdProc*)t__dbsql_finalize    },
      { "dbsql_bind",                    (Tcl_CmdProc*)t__dbsql_bind        },
+     { "dbsql_bind_index",              (Tcl_CmdProc*)t__dbsql_bind_index  },
      { "dbsql_reset_sqlvm",             (Tcl_CmdProc*)t__dbsql_reset       },
      { "breakpoint",                    (Tcl_CmdProc*)t__dbsql_breakpoint  },
   };